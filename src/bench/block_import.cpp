@@ -0,0 +1,166 @@
+// Copyright (c) 2018 The CashCore Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "chainparams.h"
+#include "consensus/merkle.h"
+#include "consensus/validation.h"
+#include "key.h"
+#include "main.h"
+#include "pubkey.h"
+#include "streams.h"
+#include "txdb.h"
+#include "util.h"
+#include "versionbits.h"
+
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/thread.hpp>
+
+// A regtest chain of proof-of-stake blocks is written to a block file and
+// reindexed from it, as -reindex does. Reindexing only accepts the blocks
+// (connecting them is left to ActivateBestChain afterwards), so their stake
+// kernels need not be valid, only their context-free checks pass.
+static const int IMPORT_BLOCKS = 1000;
+static const int IMPORT_BLOCK_TXS = 50;
+
+static CBlock MakeStakeBlock(const uint256& hashPrev, int nHeight, uint32_t nTime, unsigned int nBits, const CKey& key)
+{
+    CBlock block;
+    block.nVersion = VERSIONBITS_TOP_BITS;
+    block.hashPrevBlock = hashPrev;
+    block.nTime = nTime;
+    block.nBits = nBits;
+
+    CMutableTransaction coinbase;
+    coinbase.nTime = block.nTime;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].scriptSig = CScript() << nHeight << OP_0;
+    coinbase.vout.resize(1);
+    coinbase.vout[0].SetEmpty();
+    block.vtx.push_back(coinbase);
+
+    CMutableTransaction coinstake;
+    coinstake.nTime = block.nTime;
+    coinstake.vin.push_back(CTxIn(COutPoint(GetRandHash(), 0)));
+    coinstake.vout.resize(2);
+    coinstake.vout[0].SetEmpty();
+    coinstake.vout[1] = CTxOut(1000 * COIN, CScript() << ToByteVector(key.GetPubKey()) << OP_CHECKSIG);
+    block.vtx.push_back(coinstake);
+
+    for (int i = 0; i < IMPORT_BLOCK_TXS; i++) {
+        CMutableTransaction tx;
+        tx.nTime = block.nTime;
+        tx.vin.push_back(CTxIn(COutPoint(GetRandHash(), i % 4)));
+        tx.vin[0].scriptSig = CScript() << std::vector<unsigned char>(72, 1) << ToByteVector(key.GetPubKey());
+        tx.vout.push_back(CTxOut(COIN, CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, 2) << OP_EQUALVERIFY << OP_CHECKSIG));
+        block.vtx.push_back(tx);
+    }
+
+    block.hashMerkleRoot = BlockMerkleRoot(block);
+    key.Sign(block.GetHash(), block.vchBlockSig);
+    return block;
+}
+
+class ImportChain
+{
+public:
+    //! Block signatures are verified by CheckBlock
+    ECCVerifyHandle verifyHandle;
+    boost::filesystem::path path;
+    boost::thread_group threadGroup;
+
+    ImportChain(int nThreads)
+    {
+        SelectParams(CBaseChainParams::REGTEST);
+        ClearDatadirCache();
+        path = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+        boost::filesystem::create_directories(path);
+        mapArgs["-datadir"] = path.string();
+        mapArgs["-txindex"] = "0";
+        Reset();
+
+        nScriptCheckThreads = nThreads;
+        for (int i = 0; i < nScriptCheckThreads - 1; i++)
+            threadGroup.create_thread(&ThreadBlockImportCheck);
+
+        // Write the chain to a block file of its own
+        CKey key;
+        key.MakeNewKey(true);
+        const CBlockIndex* pindexGenesis = chainActive.Genesis();
+        uint256 hashPrev = pindexGenesis->GetBlockHash();
+        uint32_t nTime = pindexGenesis->nTime;
+        CAutoFile file(OpenBlockFile(CDiskBlockPos(1, 0)), SER_DISK, CLIENT_VERSION);
+        for (int nHeight = 1; nHeight <= IMPORT_BLOCKS; nHeight++) {
+            nTime = (nTime + 64) & ~Params().GetConsensus().nStakeTimestampMask;
+            CBlock block = MakeStakeBlock(hashPrev, nHeight, nTime, pindexGenesis->nBits, key);
+            file << FLATDATA(Params().MessageStart()) << (unsigned int)::GetSerializeSize(block, SER_DISK, CLIENT_VERSION) << block;
+            hashPrev = block.GetHash();
+        }
+    }
+
+    ~ImportChain()
+    {
+        threadGroup.interrupt_all();
+        threadGroup.join_all();
+        UnloadBlockIndex();
+        delete pcoinsTip;
+        pcoinsTip = NULL;
+        delete pcoinsdbview;
+        pcoinsdbview = NULL;
+        delete pblocktree;
+        pblocktree = NULL;
+        boost::filesystem::remove_all(path);
+        mapArgs.erase("-datadir");
+        mapArgs.erase("-txindex");
+        ClearDatadirCache();
+    }
+
+    //! Start over from an index of the genesis block only
+    void Reset()
+    {
+        UnloadBlockIndex();
+        delete pcoinsTip;
+        delete pcoinsdbview;
+        delete pblocktree;
+        pblocktree = new CBlockTreeDB(1 << 20, true);
+        pcoinsdbview = new CCoinsViewDB(1 << 23, true);
+        pcoinsTip = new CCoinsViewCache(pcoinsdbview);
+        InitBlockIndex(Params());
+        CValidationState state;
+        bool fActivated = ActivateBestChain(state, Params());
+        assert(fActivated);
+    }
+
+    void Reindex()
+    {
+        CDiskBlockPos pos(1, 0);
+        bool fLoaded = LoadExternalBlockFile(Params(), OpenBlockFile(pos, true), &pos);
+        assert(fLoaded);
+        assert(pindexBestHeader->nHeight == IMPORT_BLOCKS);
+    }
+};
+
+static void Reindex(benchmark::State& state, int nThreads)
+{
+    ImportChain chain(nThreads);
+    while (state.KeepRunning()) {
+        chain.Reindex();
+        chain.Reset();
+    }
+}
+
+static void ReindexBlocks(benchmark::State& state)
+{
+    Reindex(state, 0);
+}
+
+static void ReindexBlocksParallel(benchmark::State& state)
+{
+    Reindex(state, 4);
+}
+
+BENCHMARK(ReindexBlocks);
+BENCHMARK(ReindexBlocksParallel);
@@ -0,0 +1,136 @@
+// Copyright (c) 2018 The CashCore Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "blockencodings.h"
+#include "chainparams.h"
+#include "consensus/merkle.h"
+#include "consensus/validation.h"
+#include "key.h"
+#include "main.h"
+#include "pubkey.h"
+#include "random.h"
+#include "streams.h"
+#include "txmempool.h"
+
+#include <vector>
+
+// A proof-of-stake block of BLOCK_TXS mempool transactions is received as a
+// compact block by a node whose mempool holds them among others, or as a
+// full block. Both end with the block's context-free checks, so the time
+// saved by a compact block is what is left of receiving the full one.
+static const unsigned int BLOCK_TXS = 1000;
+
+class ReconstructionSetup
+{
+public:
+    //! Block signatures are verified by CheckBlock
+    ECCVerifyHandle verifyHandle;
+    CTxMemPool pool;
+    CBlock block;
+
+    ReconstructionSetup(unsigned int nMempoolTxs) : pool(CFeeRate(0))
+    {
+        SelectParams(CBaseChainParams::REGTEST);
+        assert(nMempoolTxs >= BLOCK_TXS);
+
+        CKey key;
+        key.MakeNewKey(true);
+        CScript scriptPubKey = CScript() << ToByteVector(key.GetPubKey()) << OP_CHECKSIG;
+
+        block.nVersion = 7;
+        block.hashPrevBlock = GetRandHash();
+        block.nBits = 0x207fffff;
+
+        CMutableTransaction coinbase;
+        coinbase.vin.resize(1);
+        coinbase.vin[0].scriptSig = CScript() << 1 << OP_0;
+        coinbase.vout.resize(1);
+        coinbase.vout[0].SetEmpty();
+        block.vtx.push_back(coinbase);
+
+        CMutableTransaction coinstake;
+        coinstake.vin.push_back(CTxIn(COutPoint(GetRandHash(), 0)));
+        coinstake.vout.resize(2);
+        coinstake.vout[0].SetEmpty();
+        coinstake.vout[1] = CTxOut(1000 * COIN, scriptPubKey);
+        block.vtx.push_back(coinstake);
+
+        // Pay-to-pubkey-hash transactions of typical size, the first ones
+        // of which are mined
+        LockPoints lp;
+        for (unsigned int i = 0; i < nMempoolTxs; i++) {
+            CMutableTransaction mtx;
+            mtx.vin.push_back(CTxIn(COutPoint(GetRandHash(), 0)));
+            mtx.vin[0].scriptSig = CScript() << std::vector<unsigned char>(72, 1) << ToByteVector(key.GetPubKey());
+            mtx.vout.resize(2);
+            for (unsigned int j = 0; j < mtx.vout.size(); j++)
+                mtx.vout[j] = CTxOut(COIN, CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, j) << OP_EQUALVERIFY << OP_CHECKSIG);
+            CTransaction tx(mtx);
+            pool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(tx, 0, 0, 0.0, 1, true, tx.GetValueOut(), false, 4, lp));
+            if (i < BLOCK_TXS)
+                block.vtx.push_back(tx);
+        }
+
+        block.hashMerkleRoot = BlockMerkleRoot(block);
+        key.Sign(block.GetHash(), block.vchBlockSig);
+    }
+};
+
+static void ReconstructBlock(benchmark::State& state, unsigned int nMempoolTxs)
+{
+    ReconstructionSetup setup(nMempoolTxs);
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << CBlockHeaderAndShortTxIDs(setup.block);
+
+    std::vector<CTransaction> vtx_missing;
+    while (state.KeepRunning()) {
+        CDataStream streamRecv(stream);
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        streamRecv >> cmpctblock;
+        PartiallyDownloadedBlock partialBlock(&setup.pool);
+        ReadStatus status = partialBlock.InitData(cmpctblock);
+        assert(status == READ_STATUS_OK);
+        CBlock block;
+        status = partialBlock.FillBlock(block, vtx_missing);
+        assert(status == READ_STATUS_OK);
+    }
+}
+
+static void ReconstructBlockMempool1k(benchmark::State& state)
+{
+    ReconstructBlock(state, 1000);
+}
+
+static void ReconstructBlockMempool10k(benchmark::State& state)
+{
+    ReconstructBlock(state, 10000);
+}
+
+static void ReconstructBlockMempool50k(benchmark::State& state)
+{
+    ReconstructBlock(state, 50000);
+}
+
+// The same block, deserialized from a full block message
+static void ReceiveFullBlock(benchmark::State& state)
+{
+    ReconstructionSetup setup(BLOCK_TXS);
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << setup.block;
+
+    while (state.KeepRunning()) {
+        CDataStream streamRecv(stream);
+        CBlock block;
+        streamRecv >> block;
+        CValidationState validationState;
+        bool fChecked = CheckBlock(block, validationState, Params().GetConsensus());
+        assert(fChecked);
+    }
+}
+
+BENCHMARK(ReconstructBlockMempool1k);
+BENCHMARK(ReconstructBlockMempool10k);
+BENCHMARK(ReconstructBlockMempool50k);
+BENCHMARK(ReceiveFullBlock);
@@ -10,6 +10,7 @@
 #include "uint256.h"
 #include "utiltime.h"
 #include "crypto/ripemd160.h"
+#include "crypto/scrypt.h"
 #include "crypto/sha1.h"
 #include "crypto/sha256.h"
 #include "crypto/sha512.h"
@@ -69,6 +70,30 @@ static void SipHash_32b(benchmark::State& state)
     }
 }
 
+/* Number of 80-byte headers hashed per scrypt iteration */
+static const size_t SCRYPT_BATCH = 64;
+
+static void Scrypt_Headers(benchmark::State& state)
+{
+    std::vector<char> in(80 * SCRYPT_BATCH, 0), out(32 * SCRYPT_BATCH);
+    for (size_t i = 0; i < SCRYPT_BATCH; i++)
+        in[80 * i] = i;
+    while (state.KeepRunning()) {
+        for (size_t i = 0; i < SCRYPT_BATCH; i++)
+            scrypt_1024_1_1_256(&in[80 * i], &out[32 * i]);
+    }
+}
+
+static void Scrypt_Headers_Multi(benchmark::State& state)
+{
+    std::vector<char> in(80 * SCRYPT_BATCH, 0), out(32 * SCRYPT_BATCH);
+    for (size_t i = 0; i < SCRYPT_BATCH; i++)
+        in[80 * i] = i;
+    scrypt_detect_multi();
+    while (state.KeepRunning())
+        scrypt_1024_1_1_256_multi(&in[0], &out[0], SCRYPT_BATCH);
+}
+
 BENCHMARK(RIPEMD160);
 BENCHMARK(SHA1);
 BENCHMARK(SHA256);
@@ -76,3 +101,6 @@ BENCHMARK(SHA512);
 
 BENCHMARK(SHA256_32b);
 BENCHMARK(SipHash_32b);
+
+BENCHMARK(Scrypt_Headers);
+BENCHMARK(Scrypt_Headers_Multi);
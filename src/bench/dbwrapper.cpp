@@ -0,0 +1,136 @@
+// Copyright (c) 2018 The CashCore Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "crypto/common.h"
+#include "dbwrapper.h"
+#include "random.h"
+#include "txdb.h"
+#include "uint256.h"
+
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/scoped_ptr.hpp>
+
+// Key patterns of the databases: txindex and coins records are keyed by
+// txids, so reads and writes are spread uniformly over the keyspace, while
+// scans (gettxoutsetinfo, the UTXO set upgrade) iterate it in order.
+static const char DB_TXINDEX = 't';
+static const unsigned int BATCH_TXS = 1000;
+static const unsigned int PREFILL_TXS = 200000;
+
+class BenchDB
+{
+public:
+    boost::filesystem::path path;
+    boost::scoped_ptr<CDBWrapper> db;
+    std::vector<uint256> vTxids;
+
+    BenchDB(const CDBOptions& dbopts, unsigned int nPrefill)
+    {
+        path = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+        db.reset(new CDBWrapper(path, 8 << 20, false, true, false, dbopts));
+        FastRandomContext rng(true);
+        CDBBatch batch(*db);
+        for (unsigned int i = 0; i < nPrefill; i++) {
+            vTxids.push_back(Txid(rng));
+            batch.Write(std::make_pair(DB_TXINDEX, vTxids.back()), Pos(i));
+            if (batch.SizeEstimate() > (1 << 20)) {
+                db->WriteBatch(batch);
+                batch.Clear();
+            }
+        }
+        db->WriteBatch(batch, true);
+    }
+
+    ~BenchDB()
+    {
+        db.reset();
+        boost::filesystem::remove_all(path);
+    }
+
+    static uint256 Txid(FastRandomContext& rng)
+    {
+        uint256 txid;
+        for (unsigned int i = 0; i < 8; i++)
+            WriteLE32(txid.begin() + 4 * i, rng.rand32());
+        return txid;
+    }
+
+    static CDiskTxPos Pos(unsigned int n)
+    {
+        return CDiskTxPos(CDiskBlockPos(n / 50000, (n % 50000) * 400), 81 + n % 4000);
+    }
+};
+
+// Connecting a block with -txindex: one batch of fresh txids
+static void DBWriteTxIndex(benchmark::State& state)
+{
+    BenchDB bench(CDBOptions(), 0);
+    FastRandomContext rng(true);
+    unsigned int n = 0;
+    while (state.KeepRunning()) {
+        CDBBatch batch(*bench.db);
+        for (unsigned int i = 0; i < BATCH_TXS; i++)
+            batch.Write(std::make_pair(DB_TXINDEX, BenchDB::Txid(rng)), BenchDB::Pos(n++));
+        bench.db->WriteBatch(batch);
+    }
+}
+
+static void DBReadRandom(benchmark::State& state, const CDBOptions& dbopts)
+{
+    BenchDB bench(dbopts, PREFILL_TXS);
+    FastRandomContext rng(true);
+    CDiskTxPos pos;
+    while (state.KeepRunning()) {
+        bool fFound = bench.db->Read(std::make_pair(DB_TXINDEX, bench.vTxids[rng.rand32() % bench.vTxids.size()]), pos);
+        assert(fFound);
+    }
+}
+
+// getrawtransaction, or the coins of a block's inputs
+static void DBReadTxIndex(benchmark::State& state)
+{
+    DBReadRandom(state, CDBOptions(DB_PROFILE_DEFAULT));
+}
+
+static void DBReadTxIndexHDD(benchmark::State& state)
+{
+    DBReadRandom(state, CDBOptions(DB_PROFILE_HDD));
+}
+
+// Lookups of outputs that do not exist yet, answered by the bloom filters
+static void DBReadMissing(benchmark::State& state)
+{
+    BenchDB bench(CDBOptions(), PREFILL_TXS);
+    // Not the deterministic sequence the database was filled with
+    FastRandomContext rng;
+    while (state.KeepRunning()) {
+        bool fFound = bench.db->Exists(std::make_pair(DB_TXINDEX, BenchDB::Txid(rng)));
+        assert(!fFound);
+    }
+}
+
+// A full scan of the keyspace
+static void DBIterate(benchmark::State& state)
+{
+    BenchDB bench(CDBOptions(), PREFILL_TXS);
+    boost::scoped_ptr<CDBIterator> it(bench.db->NewIterator());
+    it->Seek(std::make_pair(DB_TXINDEX, uint256()));
+    CDiskTxPos pos;
+    while (state.KeepRunning()) {
+        if (!it->Valid())
+            it->Seek(std::make_pair(DB_TXINDEX, uint256()));
+        bool fRead = it->GetValue(pos);
+        assert(fRead);
+        it->Next();
+    }
+}
+
+BENCHMARK(DBWriteTxIndex);
+BENCHMARK(DBReadTxIndex);
+BENCHMARK(DBReadTxIndexHDD);
+BENCHMARK(DBReadMissing);
+BENCHMARK(DBIterate);
@@ -0,0 +1,108 @@
+// Copyright (c) 2018 The CashCore Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "netbase.h"
+#include "socketevents.h"
+
+#include <iostream>
+
+#ifndef WIN32
+
+// Idle loopback peers per run; kept under FD_SETSIZE so select() can take part
+static const int SOCKET_EVENTS_PEERS = 400;
+
+/** Connected loopback TCP pairs: vPeers are the "remote" ends, vLocal ours */
+static bool MakeLoopbackPeers(int nPeers, std::vector<SOCKET>& vLocal, std::vector<SOCKET>& vPeers)
+{
+    SOCKET hListen = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (hListen == INVALID_SOCKET ||
+        bind(hListen, (struct sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR ||
+        listen(hListen, SOMAXCONN) == SOCKET_ERROR ||
+        getsockname(hListen, (struct sockaddr*)&addr, &len) == SOCKET_ERROR) {
+        CloseSocket(hListen);
+        return false;
+    }
+
+    for (int i = 0; i < nPeers; i++) {
+        SOCKET hPeer = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (hPeer == INVALID_SOCKET || connect(hPeer, (struct sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR) {
+            CloseSocket(hPeer);
+            break;
+        }
+        SOCKET hLocal = accept(hListen, NULL, NULL);
+        if (hLocal == INVALID_SOCKET || !SetSocketNonBlocking(hLocal, true)) {
+            CloseSocket(hPeer);
+            break;
+        }
+        vPeers.push_back(hPeer);
+        vLocal.push_back(hLocal);
+    }
+    CloseSocket(hListen);
+    return (int)vLocal.size() == nPeers;
+}
+
+/**
+ * Many registered peers of which only one has data: the case of a seed node
+ * with hundreds of mostly quiet inbound connections.
+ */
+static void SocketEventsLoopback(benchmark::State& state, SocketEventsMode mode)
+{
+    std::vector<SOCKET> vLocal, vPeers;
+    CSocketEvents* pEvents = CreateSocketEvents(mode);
+    if (!pEvents || !MakeLoopbackPeers(SOCKET_EVENTS_PEERS, vLocal, vPeers)) {
+        std::cerr << "SocketEvents: " << GetSocketEventsModeName(mode) << " unavailable\n";
+    } else {
+        for (size_t i = 0; i < vLocal.size(); i++)
+            pEvents->Set(vLocal[i], SOCKET_EVENT_RECV);
+
+        std::vector<std::pair<SOCKET, int> > vReady;
+        size_t nPeer = 0;
+        char c = 0;
+        while (state.KeepRunning()) {
+            nPeer = (nPeer + 1) % vPeers.size();
+            if (send(vPeers[nPeer], &c, 1, MSG_NOSIGNAL) != 1)
+                break;
+            do {
+                pEvents->Wait(1000, vReady);
+            } while (vReady.empty());
+            for (size_t i = 0; i < vReady.size(); i++)
+                while (recv(vReady[i].first, &c, 1, MSG_DONTWAIT) == 1) {}
+        }
+    }
+
+    for (size_t i = 0; i < vLocal.size(); i++) {
+        if (pEvents)
+            pEvents->Remove(vLocal[i]);
+        CloseSocket(vLocal[i]);
+        CloseSocket(vPeers[i]);
+    }
+    delete pEvents;
+}
+
+static void SocketEventsSelect(benchmark::State& state)
+{
+    SocketEventsLoopback(state, SOCKETEVENTS_SELECT);
+}
+
+static void SocketEventsPoll(benchmark::State& state)
+{
+    SocketEventsLoopback(state, SOCKETEVENTS_POLL);
+}
+
+static void SocketEventsEpoll(benchmark::State& state)
+{
+    SocketEventsLoopback(state, SOCKETEVENTS_EPOLL);
+}
+
+BENCHMARK(SocketEventsSelect);
+BENCHMARK(SocketEventsPoll);
+BENCHMARK(SocketEventsEpoll);
+
+#endif // WIN32
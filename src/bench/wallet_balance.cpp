@@ -0,0 +1,92 @@
+// Copyright (c) 2018 The CashCore Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "chain.h"
+#include "chainparams.h"
+#include "key.h"
+#include "main.h"
+#include "random.h"
+#include "txmempool.h"
+#include "wallet/wallet.h"
+
+// A wallet with a long history: each of its confirmed transactions spends
+// the output of the one before, so only the last one is left unspent.
+static const unsigned int HISTORY_TXS = 10000;
+
+class WalletHistorySetup
+{
+public:
+    uint256 hashGenesis;
+    CBlockIndex genesis;
+    CWallet wallet;
+
+    WalletHistorySetup()
+    {
+        SelectParams(CBaseChainParams::REGTEST);
+        hashGenesis = Params().GenesisBlock().GetHash();
+        genesis = CBlockIndex(Params().GenesisBlock());
+        genesis.phashBlock = &hashGenesis;
+
+        LOCK2(cs_main, wallet.cs_wallet);
+        mapBlockIndex[hashGenesis] = &genesis;
+        chainActive.SetTip(&genesis);
+
+        CKey key;
+        key.MakeNewKey(true);
+        wallet.AddKeyPubKey(key, key.GetPubKey());
+        CScript scriptPubKey = CScript() << ToByteVector(key.GetPubKey()) << OP_CHECKSIG;
+
+        COutPoint prevout(GetRandHash(), 0);
+        for (unsigned int i = 0; i < HISTORY_TXS; i++) {
+            CMutableTransaction tx;
+            tx.vin.push_back(CTxIn(prevout));
+            tx.vout.push_back(CTxOut(COIN, scriptPubKey));
+            CWalletTx wtx(&wallet, tx);
+            wtx.hashBlock = hashGenesis;
+            wtx.nIndex = 0;
+            wallet.AddToWallet(wtx, true, NULL);
+            prevout = COutPoint(wtx.GetHash(), 0);
+        }
+    }
+
+    ~WalletHistorySetup()
+    {
+        LOCK(cs_main);
+        chainActive.SetTip(NULL);
+        mapBlockIndex.erase(hashGenesis);
+    }
+};
+
+// Balances recomputed, as after every block or mempool change
+static void WalletBalance(benchmark::State& state)
+{
+    WalletHistorySetup setup;
+    while (state.KeepRunning()) {
+        mempool.AddTransactionsUpdated(1);
+        assert(setup.wallet.GetBalance() == COIN);
+    }
+}
+
+// Balances asked for again, as by the staker and getstakinginfo
+static void WalletBalanceCached(benchmark::State& state)
+{
+    WalletHistorySetup setup;
+    while (state.KeepRunning())
+        assert(setup.wallet.GetBalance() == COIN);
+}
+
+static void WalletAvailableCoins(benchmark::State& state)
+{
+    WalletHistorySetup setup;
+    std::vector<COutput> vCoins;
+    while (state.KeepRunning()) {
+        setup.wallet.AvailableCoins(vCoins);
+        assert(vCoins.size() == 1);
+    }
+}
+
+BENCHMARK(WalletBalance);
+BENCHMARK(WalletBalanceCached);
+BENCHMARK(WalletAvailableCoins);
@@ -0,0 +1,113 @@
+// Copyright (c) 2018 The CashCore Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "chainparams.h"
+#include "fs.h"
+#include "key.h"
+#include "random.h"
+#include "util.h"
+#include "utiltime.h"
+#include "wallet/db.h"
+#include "wallet/wallet.h"
+#include "wallet/walletdb.h"
+
+static const unsigned int LOAD_WALLET_TXS = 5000;
+
+/** A wallet file of the given backend in a scratch data directory */
+class WalletFileSetup
+{
+public:
+    fs::path pathTemp;
+    std::string strWalletFile;
+    CScript scriptPubKey;
+
+    explicit WalletFileSetup(const std::string& strBackend) : strWalletFile("wallet.dat")
+    {
+        SelectParams(CBaseChainParams::REGTEST);
+        pathTemp = fs::temp_directory_path() / strprintf("bench_wallet_%lu_%i", (unsigned long)GetTime(), (int)GetRand(100000));
+        fs::create_directories(pathTemp);
+        mapArgs["-datadir"] = pathTemp.string();
+        mapArgs["-walletbackend"] = strBackend;
+        ClearDatadirCache();
+
+        CWallet wallet(strWalletFile);
+        bool fFirstRun;
+        wallet.LoadWallet(fFirstRun);
+        CKey key;
+        key.MakeNewKey(true);
+        wallet.AddKeyPubKey(key, key.GetPubKey());
+        scriptPubKey = CScript() << ToByteVector(key.GetPubKey()) << OP_CHECKSIG;
+    }
+
+    ~WalletFileSetup()
+    {
+        bitdb.Flush(true);
+        bitdb.Reset();
+        mapArgs.erase("-datadir");
+        mapArgs.erase("-walletbackend");
+        ClearDatadirCache();
+        fs::remove_all(pathTemp);
+    }
+
+    CWalletTx NewWalletTx(CWallet& wallet) const
+    {
+        CMutableTransaction tx;
+        tx.vin.push_back(CTxIn(COutPoint(GetRandHash(), 0)));
+        tx.vout.push_back(CTxOut(COIN, scriptPubKey));
+        return CWalletTx(&wallet, tx);
+    }
+};
+
+// Start up with a wallet holding a few thousand transactions
+static void WalletLoad(benchmark::State& state, const std::string& strBackend)
+{
+    WalletFileSetup setup(strBackend);
+    {
+        CWallet wallet(setup.strWalletFile);
+        bool fFirstRun;
+        wallet.LoadWallet(fFirstRun);
+        CWalletDB walletdb(setup.strWalletFile, "r+", false);
+        LOCK(wallet.cs_wallet);
+        for (unsigned int i = 0; i < LOAD_WALLET_TXS; i++)
+            wallet.AddToWallet(setup.NewWalletTx(wallet), false, &walletdb);
+    }
+
+    while (state.KeepRunning()) {
+        // Close everything so the file is read from scratch, as on startup
+        bitdb.Flush(true);
+        bitdb.Reset();
+
+        CWallet wallet(setup.strWalletFile);
+        bool fFirstRun;
+        wallet.LoadWallet(fFirstRun);
+        assert(wallet.mapWallet.size() == LOAD_WALLET_TXS);
+    }
+}
+
+// Transactions added one at a time, as while staking or syncing blocks
+static void WalletAddToWallet(benchmark::State& state, const std::string& strBackend)
+{
+    WalletFileSetup setup(strBackend);
+    CWallet wallet(setup.strWalletFile);
+    bool fFirstRun;
+    wallet.LoadWallet(fFirstRun);
+
+    while (state.KeepRunning()) {
+        CWalletTx wtx = setup.NewWalletTx(wallet);
+        LOCK(wallet.cs_wallet);
+        CWalletDB walletdb(setup.strWalletFile, "r+", false);
+        wallet.AddToWallet(wtx, false, &walletdb);
+    }
+}
+
+static void WalletLoadBDB(benchmark::State& state) { WalletLoad(state, WALLET_BACKEND_BDB); }
+static void WalletLoadLog(benchmark::State& state) { WalletLoad(state, WALLET_BACKEND_LOG); }
+static void WalletAddToWalletBDB(benchmark::State& state) { WalletAddToWallet(state, WALLET_BACKEND_BDB); }
+static void WalletAddToWalletLog(benchmark::State& state) { WalletAddToWallet(state, WALLET_BACKEND_LOG); }
+
+BENCHMARK(WalletLoadBDB);
+BENCHMARK(WalletLoadLog);
+BENCHMARK(WalletAddToWalletBDB);
+BENCHMARK(WalletAddToWalletLog);
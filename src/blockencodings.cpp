@@ -19,13 +19,18 @@
 
 CBlockHeaderAndShortTxIDs::CBlockHeaderAndShortTxIDs(const CBlock& block) :
         nonce(GetRand(std::numeric_limits<uint64_t>::max())),
-        shorttxids(block.vtx.size() - 1), prefilledtxn(1), header(block) {
+        header(block), vchBlockSig(block.vchBlockSig) {
     FillShortTxIDSelector();
     //TODO: Use our mempool prior to block acceptance to predictively fill more than just the coinbase
-    prefilledtxn[0] = {0, block.vtx[0]};
-    for (size_t i = 1; i < block.vtx.size(); i++) {
+    // The coinstake never is in a mempool, it is prefilled right after the coinbase
+    size_t nPrefilled = block.IsProofOfStake() ? 2 : 1;
+    prefilledtxn.resize(nPrefilled);
+    shorttxids.resize(block.vtx.size() - nPrefilled);
+    for (size_t i = 0; i < nPrefilled; i++)
+        prefilledtxn[i] = {0, block.vtx[i]};
+    for (size_t i = nPrefilled; i < block.vtx.size(); i++) {
         const CTransaction& tx = block.vtx[i];
-        shorttxids[i - 1] = GetShortID(tx.GetHash());
+        shorttxids[i - nPrefilled] = GetShortID(tx.GetHash());
     }
 }
 
@@ -45,6 +50,13 @@ uint64_t CBlockHeaderAndShortTxIDs::GetShortID(const uint256& txhash) const {
     return SipHashUint256(shorttxidk0, shorttxidk1, txhash) & 0xffffffffffffL;
 }
 
+const CTransaction* CBlockHeaderAndShortTxIDs::GetCoinStake() const {
+    // Prefilled indexes are differentially encoded, so the second transaction has offset 0
+    if (prefilledtxn.size() < 2 || prefilledtxn[0].index != 0 || prefilledtxn[1].index != 0 || !prefilledtxn[1].tx.IsCoinStake())
+        return NULL;
+    return &prefilledtxn[1].tx;
+}
+
 
 
 ReadStatus PartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& cmpctblock) {
@@ -53,8 +65,14 @@ ReadStatus PartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& c
     if (cmpctblock.shorttxids.size() + cmpctblock.prefilledtxn.size() > MAX_BLOCK_SIZE / MIN_TRANSACTION_SIZE)
         return READ_STATUS_INVALID;
 
+    // Proof-of-stake blocks must come with their coinstake and its signature,
+    // so a peer cannot make us fetch transactions for a block nobody staked
+    if (!CheckBlockSignature(cmpctblock.header, cmpctblock.vchBlockSig, cmpctblock.GetCoinStake()))
+        return READ_STATUS_INVALID;
+
     assert(header.IsNull() && txn_available.empty());
     header = cmpctblock.header;
+    vchBlockSig = cmpctblock.vchBlockSig;
     txn_available.resize(cmpctblock.BlockTxCount());
 
     int32_t lastprefilledindex = -1;
@@ -145,6 +163,7 @@ bool PartiallyDownloadedBlock::IsTxAvailable(size_t index) const {
 ReadStatus PartiallyDownloadedBlock::FillBlock(CBlock& block, const std::vector<CTransaction>& vtx_missing) const {
     assert(!header.IsNull());
     block = header;
+    block.vchBlockSig = vchBlockSig;
     block.vtx.resize(txn_available.size());
 
     size_t tx_missing_offset = 0;
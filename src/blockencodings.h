@@ -144,6 +144,10 @@ protected:
 
 public:
     CBlockHeader header;
+    // Proof-of-stake blocks are signed by the key of their coinstake, which
+    // is always prefilled, so the signature can be checked before the rest
+    // of the block is reconstructed
+    std::vector<unsigned char> vchBlockSig;
 
     // Dummy for deserialization
     CBlockHeaderAndShortTxIDs() {}
@@ -154,11 +158,15 @@ public:
 
     size_t BlockTxCount() const { return shorttxids.size() + prefilledtxn.size(); }
 
+    //! The prefilled coinstake of a proof-of-stake block, NULL for proof-of-work blocks
+    const CTransaction* GetCoinStake() const;
+
     ADD_SERIALIZE_METHODS;
 
     template <typename Stream, typename Operation>
     inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
         READWRITE(header);
+        READWRITE(vchBlockSig);
         READWRITE(nonce);
 
         uint64_t shorttxids_size = (uint64_t)shorttxids.size();
@@ -198,6 +206,7 @@ protected:
     CTxMemPool* pool;
 public:
     CBlockHeader header;
+    std::vector<unsigned char> vchBlockSig;
     PartiallyDownloadedBlock(CTxMemPool* poolIn) : pool(poolIn) {}
 
     ReadStatus InitData(const CBlockHeaderAndShortTxIDs& cmpctblock);
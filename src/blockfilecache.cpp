@@ -0,0 +1,93 @@
+// Copyright (c) 2018 The CashCore Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilecache.h"
+
+#include "util.h"
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+CMappedFile::~CMappedFile()
+{
+#ifndef WIN32
+    munmap((void*)pdata, nSize);
+#endif
+}
+
+std::shared_ptr<const CMappedFile> CMappedFile::Open(const boost::filesystem::path& path)
+{
+    std::shared_ptr<const CMappedFile> ret;
+#ifndef WIN32
+    int fd = open(path.string().c_str(), O_RDONLY);
+    if (fd == -1)
+        return ret;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (p != MAP_FAILED)
+            ret.reset(new CMappedFile((const unsigned char*)p, st.st_size));
+        else
+            LogPrintf("Unable to map file %s\n", path.string());
+    }
+    // The mapping keeps its own reference to the file
+    close(fd);
+#endif
+    return ret;
+}
+
+void CBlockFileCache::SetMaxFiles(size_t nMaxFilesIn)
+{
+    LOCK(cs);
+    nMaxFiles = nMaxFilesIn;
+    while (listFiles.size() > nMaxFiles)
+        listFiles.pop_back();
+}
+
+std::shared_ptr<const CMappedFile> CBlockFileCache::Get(int nFile, const boost::filesystem::path& path, size_t nMinSize)
+{
+    LOCK(cs);
+    std::shared_ptr<const CMappedFile> file;
+    if (nMaxFiles == 0)
+        return file;
+    for (std::list<std::pair<int, std::shared_ptr<const CMappedFile> > >::iterator it = listFiles.begin(); it != listFiles.end(); ++it) {
+        if (it->first != nFile)
+            continue;
+        file = it->second;
+        listFiles.erase(it);
+        break;
+    }
+    // Block files grow while blocks are appended; map the current size
+    if (!file || file->size() < nMinSize)
+        file = CMappedFile::Open(path);
+    if (!file)
+        return file;
+    listFiles.push_front(std::make_pair(nFile, file));
+    while (listFiles.size() > nMaxFiles)
+        listFiles.pop_back();
+    if (file->size() < nMinSize)
+        file.reset();
+    return file;
+}
+
+void CBlockFileCache::Invalidate(int nFile)
+{
+    LOCK(cs);
+    for (std::list<std::pair<int, std::shared_ptr<const CMappedFile> > >::iterator it = listFiles.begin(); it != listFiles.end(); ++it) {
+        if (it->first == nFile) {
+            listFiles.erase(it);
+            return;
+        }
+    }
+}
+
+void CBlockFileCache::Clear()
+{
+    LOCK(cs);
+    listFiles.clear();
+}
@@ -0,0 +1,73 @@
+// Copyright (c) 2018 The CashCore Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKFILECACHE_H
+#define BITCOIN_BLOCKFILECACHE_H
+
+#include "sync.h"
+
+#include <list>
+#include <memory>
+#include <utility>
+
+#include <boost/filesystem/path.hpp>
+
+/** A read-only memory mapping of a whole file, as large as the file was when mapped */
+class CMappedFile
+{
+private:
+    const unsigned char* pdata;
+    size_t nSize;
+
+    CMappedFile(const unsigned char* pdataIn, size_t nSizeIn) : pdata(pdataIn), nSize(nSizeIn) {}
+    CMappedFile(const CMappedFile&);
+    CMappedFile& operator=(const CMappedFile&);
+
+public:
+    ~CMappedFile();
+
+    //! Map path read-only. Returns NULL if it is empty, cannot be mapped or mapping is not supported.
+    static std::shared_ptr<const CMappedFile> Open(const boost::filesystem::path& path);
+
+    const unsigned char* data() const { return pdata; }
+    size_t size() const { return nSize; }
+};
+
+/**
+ * Keeps the most recently read block files mapped read-only, so blocks can be
+ * deserialized from, or sent to peers straight out of, the page cache without
+ * opening, seeking and reading the file for every block.
+ *
+ * At most nMaxFiles files are mapped; the least recently used mapping is
+ * dropped first. Mappings are handed out as shared pointers, so one that is
+ * dropped stays valid for readers that still use it.
+ */
+class CBlockFileCache
+{
+private:
+    mutable CCriticalSection cs;
+    size_t nMaxFiles;
+    //! Mapped files by block file number, most recently used first
+    std::list<std::pair<int, std::shared_ptr<const CMappedFile> > > listFiles;
+
+public:
+    explicit CBlockFileCache(size_t nMaxFilesIn = 0) : nMaxFiles(nMaxFilesIn) {}
+
+    //! Change the number of mapped files, 0 disables the cache
+    void SetMaxFiles(size_t nMaxFilesIn);
+
+    /**
+     * Return a mapping of block file nFile at path that covers at least its
+     * first nMinSize bytes. The file is mapped again if it has grown since.
+     * Returns NULL if the cache is disabled or the file is not that large.
+     */
+    std::shared_ptr<const CMappedFile> Get(int nFile, const boost::filesystem::path& path, size_t nMinSize);
+
+    //! Drop the mapping of a block file, before it is deleted
+    void Invalidate(int nFile);
+
+    void Clear();
+};
+
+#endif // BITCOIN_BLOCKFILECACHE_H
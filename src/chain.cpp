@@ -112,10 +112,30 @@ void CBlockIndex::BuildSkip()
         pskip = pprev->GetAncestor(GetSkipHeight(nHeight));
 }
 
+void CBlockIndex::BuildLastBlockIndex()
+{
+    if (!pprev) {
+        pprevPoW = NULL;
+        pprevPoS = NULL;
+        fPrevTypeFinal = true;
+        return;
+    }
+    pprevPoW = pprev->IsProofOfStake() ? pprev->pprevPoW : pprev;
+    pprevPoS = pprev->IsProofOfStake() ? pprev : pprev->pprevPoS;
+    fPrevTypeFinal = pprev->fPrevTypeFinal && pprev->IsProofTypeFinal();
+}
+
 const CBlockIndex* GetLastBlockIndex(const CBlockIndex* pindex, bool fProofOfStake)
 {
-    while (pindex && pindex->pprev && (pindex->IsProofOfStake() != fProofOfStake))
+    while (pindex && pindex->pprev && (pindex->IsProofOfStake() != fProofOfStake)) {
+        // Once every predecessor has a final type the cached pointer is exact.
+        // Entries with no predecessor of the requested type end at genesis.
+        if (pindex->fPrevTypeFinal) {
+            const CBlockIndex* pindexLast = fProofOfStake ? pindex->pprevPoS : pindex->pprevPoW;
+            return pindexLast ? pindexLast : pindex->GetAncestor(0);
+        }
         pindex = pindex->pprev;
+    }
     return pindex;
 }
 
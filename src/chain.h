@@ -148,6 +148,7 @@ enum BlockStatus: uint32_t {
     BLOCK_PROOF_OF_STAKE     =   128, //! is proof-of-stake block
     BLOCK_STAKE_ENTROPY      =   256,
     BLOCK_STAKE_MODIFIER     =   512,
+    BLOCK_HAVE_POW_HASH      =  1024, //!< hashPoW is known and stored in the block index
 
 };
 
@@ -168,6 +169,13 @@ public:
     //! pointer to the index of some further predecessor of this block
     CBlockIndex* pskip;
 
+    //! (memory only) nearest proof-of-work and proof-of-stake predecessors of this block
+    CBlockIndex* pprevPoW;
+    CBlockIndex* pprevPoS;
+
+    //! (memory only) whether pprevPoW/pprevPoS are exact, i.e. the type of every predecessor is final
+    bool fPrevTypeFinal;
+
     //! height of the entry in the chain. The genesis block has height 0
     int nHeight;
 
@@ -198,6 +206,9 @@ public:
     //! hash modifier of proof-of-stake
     uint256 nStakeModifier;
 
+    //! scrypt proof-of-work hash of the header, valid if BLOCK_HAVE_POW_HASH is set
+    uint256 hashPoW;
+
     //! block header
     int nVersion;
     uint256 hashMerkleRoot;
@@ -213,6 +224,9 @@ public:
         phashBlock = NULL;
         pprev = NULL;
         pskip = NULL;
+        pprevPoW = NULL;
+        pprevPoS = NULL;
+        fPrevTypeFinal = false;
         nHeight = 0;
         nFile = 0;
         nDataPos = 0;
@@ -222,6 +236,7 @@ public:
         nChainTx = 0;
         nStatus = 0;
         nStakeModifier = uint256();
+        hashPoW = uint256();
         nSequenceId = 0;
 
         nVersion       = 0;
@@ -285,9 +300,17 @@ public:
 
     uint256 GetBlockPoWHash() const
     {
+        if (nStatus & BLOCK_HAVE_POW_HASH)
+            return hashPoW;
         return GetBlockHeader().GetPoWHash();
     }
 
+    void SetBlockPoWHash(const uint256& hash)
+    {
+        hashPoW = hash;
+        nStatus |= BLOCK_HAVE_POW_HASH;
+    }
+
     int64_t GetBlockTime() const
     {
         return (int64_t)nTime;
@@ -332,6 +355,13 @@ public:
         nStatus |= BLOCK_PROOF_OF_STAKE;
     }
 
+    //! Whether IsProofOfStake() can no longer change. Before the block data
+    //! is received, a header in the PoW era may still turn out to be PoS.
+    bool IsProofTypeFinal() const
+    {
+        return nTx > 0 || pprev == NULL || nHeight > Params().GetConsensus().nLastPOWBlock;
+    }
+
     std::string ToString() const
     {
         return strprintf("CBlockIndex(pprev=%p, nHeight=%d, merkle=%s, hashBlock=%s)",
@@ -366,6 +396,9 @@ public:
     //! Build the skiplist pointer for this entry.
     void BuildSkip();
 
+    //! Build the pprevPoW/pprevPoS pointers for this entry from those of pprev.
+    void BuildLastBlockIndex();
+
     //! Efficiently find an ancestor of this block.
     CBlockIndex* GetAncestor(int height);
     const CBlockIndex* GetAncestor(int height) const;
@@ -409,6 +442,8 @@ public:
             READWRITE(VARINT(nDataPos));
         if (nStatus & BLOCK_HAVE_UNDO)
             READWRITE(VARINT(nUndoPos));
+        if (nStatus & BLOCK_HAVE_POW_HASH)
+            READWRITE(hashPoW);
 
         // block header
         READWRITE(this->nVersion);
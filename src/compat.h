@@ -94,8 +94,17 @@ typedef u_int SOCKET;
 size_t strnlen( const char *start, size_t max_len);
 #endif // HAVE_DECL_STRNLEN
 
+// poll() and epoll have no FD_SETSIZE limit. WSAPoll is broken on Windows and
+// poll() on macOS misbehaves on some descriptor types, so those keep select().
+#if defined(__linux__)
+#define USE_POLL
+#define USE_EPOLL
+#elif !defined(WIN32) && !defined(__APPLE__)
+#define USE_POLL
+#endif
+
 bool static inline IsSelectableSocket(SOCKET s) {
-#ifdef WIN32
+#if defined(WIN32) || defined(USE_POLL)
     return true;
 #else
     return (s < FD_SETSIZE);
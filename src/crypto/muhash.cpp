@@ -0,0 +1,169 @@
+// Copyright (c) 2018 The CashCore Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "crypto/muhash.h"
+
+#include "crypto/sha256.h"
+#include "crypto/sha512.h"
+
+#include <string.h>
+
+namespace {
+
+/** 2^3072 - MAX_PRIME_DIFF is the largest 3072-bit prime */
+const Num3072::limb_t MAX_PRIME_DIFF = 1103717;
+
+}
+
+Num3072::Num3072(const unsigned char (&data)[BYTE_SIZE])
+{
+    for (int i = 0; i < LIMBS; ++i) {
+        limbs[i] = 0;
+        for (int j = LIMB_SIZE / 8 - 1; j >= 0; --j)
+            limbs[i] = (limbs[i] << 8) | data[i * (LIMB_SIZE / 8) + j];
+    }
+    if (IsOverflow())
+        FullReduce();
+}
+
+void Num3072::SetToOne()
+{
+    limbs[0] = 1;
+    for (int i = 1; i < LIMBS; ++i)
+        limbs[i] = 0;
+}
+
+bool Num3072::IsOverflow() const
+{
+    if (limbs[0] < (limb_t)0 - MAX_PRIME_DIFF)
+        return false;
+    for (int i = 1; i < LIMBS; ++i) {
+        if (limbs[i] != (limb_t)-1)
+            return false;
+    }
+    return true;
+}
+
+void Num3072::FullReduce()
+{
+    // Subtracting the prime is adding MAX_PRIME_DIFF modulo 2^3072
+    limb_t carry = MAX_PRIME_DIFF;
+    for (int i = 0; i < LIMBS && carry; ++i) {
+        limbs[i] += carry;
+        carry = limbs[i] < carry;
+    }
+}
+
+void Num3072::Multiply(const Num3072& a)
+{
+    // Schoolbook multiplication into a double-width product (a may alias this)
+    limb_t t[2 * LIMBS];
+    memset(t, 0, sizeof(t));
+    for (int i = 0; i < LIMBS; ++i) {
+        limb_t carry = 0;
+        for (int j = 0; j < LIMBS; ++j) {
+            double_limb_t v = (double_limb_t)limbs[i] * a.limbs[j] + t[i + j] + carry;
+            t[i + j] = (limb_t)v;
+            carry = (limb_t)(v >> LIMB_SIZE);
+        }
+        t[i + LIMBS] = carry;
+    }
+
+    // Fold the upper half into the lower one, as 2^3072 = MAX_PRIME_DIFF (mod p)
+    double_limb_t v = 0;
+    for (int i = 0; i < LIMBS; ++i) {
+        v += (double_limb_t)t[i + LIMBS] * MAX_PRIME_DIFF + t[i];
+        limbs[i] = (limb_t)v;
+        v >>= LIMB_SIZE;
+    }
+    // What is left above 2^3072 is small; fold it until nothing is
+    while (v) {
+        v *= MAX_PRIME_DIFF;
+        for (int i = 0; i < LIMBS && v; ++i) {
+            v += limbs[i];
+            limbs[i] = (limb_t)v;
+            v >>= LIMB_SIZE;
+        }
+    }
+    if (IsOverflow())
+        FullReduce();
+}
+
+Num3072 Num3072::GetInverse() const
+{
+    // Fermat's little theorem: a^(p-2) is the inverse of a modulo p
+    limb_t exponent[LIMBS];
+    exponent[0] = (limb_t)0 - (MAX_PRIME_DIFF + 2);
+    for (int i = 1; i < LIMBS; ++i)
+        exponent[i] = (limb_t)-1;
+
+    Num3072 ret;
+    for (int i = LIMBS - 1; i >= 0; --i) {
+        for (int b = LIMB_SIZE - 1; b >= 0; --b) {
+            ret.Multiply(ret);
+            if ((exponent[i] >> b) & 1)
+                ret.Multiply(*this);
+        }
+    }
+    return ret;
+}
+
+void Num3072::Divide(const Num3072& a)
+{
+    Multiply(a.GetInverse());
+}
+
+void Num3072::ToBytes(unsigned char (&out)[BYTE_SIZE]) const
+{
+    for (int i = 0; i < LIMBS; ++i) {
+        for (int j = 0; j < LIMB_SIZE / 8; ++j)
+            out[i * (LIMB_SIZE / 8) + j] = (unsigned char)(limbs[i] >> (8 * j));
+    }
+}
+
+Num3072 MuHash3072::ToNum3072(const unsigned char* data, size_t len)
+{
+    unsigned char seed[CSHA256::OUTPUT_SIZE];
+    CSHA256().Write(data, len).Finalize(seed);
+    unsigned char tmp[Num3072::BYTE_SIZE];
+    for (unsigned char i = 0; i < Num3072::BYTE_SIZE / CSHA512::OUTPUT_SIZE; ++i)
+        CSHA512().Write(seed, sizeof(seed)).Write(&i, 1).Finalize(tmp + i * CSHA512::OUTPUT_SIZE);
+    return Num3072(tmp);
+}
+
+MuHash3072& MuHash3072::Insert(const unsigned char* data, size_t len)
+{
+    numerator.Multiply(ToNum3072(data, len));
+    return *this;
+}
+
+MuHash3072& MuHash3072::Remove(const unsigned char* data, size_t len)
+{
+    denominator.Multiply(ToNum3072(data, len));
+    return *this;
+}
+
+MuHash3072& MuHash3072::operator*=(const MuHash3072& mul)
+{
+    numerator.Multiply(mul.numerator);
+    denominator.Multiply(mul.denominator);
+    return *this;
+}
+
+MuHash3072& MuHash3072::operator/=(const MuHash3072& div)
+{
+    numerator.Multiply(div.denominator);
+    denominator.Multiply(div.numerator);
+    return *this;
+}
+
+void MuHash3072::Finalize(uint256& out)
+{
+    numerator.Divide(denominator);
+    denominator.SetToOne();
+
+    unsigned char data[Num3072::BYTE_SIZE];
+    numerator.ToBytes(data);
+    CSHA256().Write(data, sizeof(data)).Finalize(out.begin());
+}
@@ -0,0 +1,65 @@
+// Copyright (c) 2018 The CashCore Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// This is a translation unit compiled with -mavx2. It is only called into
+// after scrypt_detect_multi() has confirmed AVX2 support at runtime.
+
+#ifdef ENABLE_AVX2
+
+#include <stdint.h>
+#include <immintrin.h>
+
+#include "crypto/scrypt-multi.h"
+
+namespace {
+
+struct Lanes4
+{
+    typedef __m128i V;
+    static const int N = 4;
+    static const int LOG2_N = 2;
+
+    static inline V Load(const uint32_t *p) { return _mm_loadu_si128((const __m128i *)p); }
+    static inline void Store(uint32_t *p, V v) { _mm_storeu_si128((__m128i *)p, v); }
+    static inline V Set1(uint32_t x) { return _mm_set1_epi32(x); }
+    static inline V Lanes() { return _mm_setr_epi32(0, 1, 2, 3); }
+    static inline V Add(V a, V b) { return _mm_add_epi32(a, b); }
+    static inline V Xor(V a, V b) { return _mm_xor_si128(a, b); }
+    static inline V And(V a, V b) { return _mm_and_si128(a, b); }
+    template <int n> static inline V Shl(V a) { return _mm_slli_epi32(a, n); }
+    template <int n> static inline V Rotl(V a) { return _mm_or_si128(_mm_slli_epi32(a, n), _mm_srli_epi32(a, 32 - n)); }
+    static inline V Gather(const int *base, V idx) { return _mm_i32gather_epi32(base, idx, 4); }
+};
+
+struct Lanes8
+{
+    typedef __m256i V;
+    static const int N = 8;
+    static const int LOG2_N = 3;
+
+    static inline V Load(const uint32_t *p) { return _mm256_loadu_si256((const __m256i *)p); }
+    static inline void Store(uint32_t *p, V v) { _mm256_storeu_si256((__m256i *)p, v); }
+    static inline V Set1(uint32_t x) { return _mm256_set1_epi32(x); }
+    static inline V Lanes() { return _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7); }
+    static inline V Add(V a, V b) { return _mm256_add_epi32(a, b); }
+    static inline V Xor(V a, V b) { return _mm256_xor_si256(a, b); }
+    static inline V And(V a, V b) { return _mm256_and_si256(a, b); }
+    template <int n> static inline V Shl(V a) { return _mm256_slli_epi32(a, n); }
+    template <int n> static inline V Rotl(V a) { return _mm256_or_si256(_mm256_slli_epi32(a, n), _mm256_srli_epi32(a, 32 - n)); }
+    static inline V Gather(const int *base, V idx) { return _mm256_i32gather_epi32(base, idx, 4); }
+};
+
+} // namespace
+
+void scrypt_core_avx2_4way(uint32_t *X, char *scratchpad)
+{
+    scrypt_core_multi<Lanes4>(X, scratchpad);
+}
+
+void scrypt_core_avx2_8way(uint32_t *X, char *scratchpad)
+{
+    scrypt_core_multi<Lanes8>(X, scratchpad);
+}
+
+#endif
@@ -0,0 +1,42 @@
+// Copyright (c) 2018 The CashCore Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// This is a translation unit compiled with -mavx512f. It is only called into
+// after scrypt_detect_multi() has confirmed AVX-512F support at runtime.
+
+#ifdef ENABLE_AVX512F
+
+#include <stdint.h>
+#include <immintrin.h>
+
+#include "crypto/scrypt-multi.h"
+
+namespace {
+
+struct Lanes16
+{
+    typedef __m512i V;
+    static const int N = 16;
+    static const int LOG2_N = 4;
+
+    static inline V Load(const uint32_t *p) { return _mm512_loadu_si512((const void *)p); }
+    static inline void Store(uint32_t *p, V v) { _mm512_storeu_si512((void *)p, v); }
+    static inline V Set1(uint32_t x) { return _mm512_set1_epi32(x); }
+    static inline V Lanes() { return _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15); }
+    static inline V Add(V a, V b) { return _mm512_add_epi32(a, b); }
+    static inline V Xor(V a, V b) { return _mm512_xor_si512(a, b); }
+    static inline V And(V a, V b) { return _mm512_and_si512(a, b); }
+    template <int n> static inline V Shl(V a) { return _mm512_slli_epi32(a, n); }
+    template <int n> static inline V Rotl(V a) { return _mm512_rol_epi32(a, n); }
+    static inline V Gather(const int *base, V idx) { return _mm512_i32gather_epi32(idx, base, 4); }
+};
+
+} // namespace
+
+void scrypt_core_avx512_16way(uint32_t *X, char *scratchpad)
+{
+    scrypt_core_multi<Lanes16>(X, scratchpad);
+}
+
+#endif
@@ -0,0 +1,132 @@
+// Copyright (c) 2018 The CashCore Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Lane-sliced scrypt(1024,1,1) core shared by the SIMD back-ends. This header
+// is only included by the translation units that are compiled with the
+// matching instruction set flags.
+//
+// Word k of lane l lives at X[k * N + l], so a single vector holds the same
+// Salsa20/8 word of N independent hashes and the rounds need no shuffles. The
+// scratchpad uses the same layout, and the data-dependent reads in the second
+// loop become one gather per word.
+
+#ifndef BITCOIN_CRYPTO_SCRYPT_MULTI_H
+#define BITCOIN_CRYPTO_SCRYPT_MULTI_H
+
+#include <stdint.h>
+
+namespace {
+
+template <typename T>
+inline void xor_salsa8_multi(typename T::V B[16], const typename T::V Bx[16])
+{
+    typedef typename T::V V;
+    V x00, x01, x02, x03, x04, x05, x06, x07, x08, x09, x10, x11, x12, x13, x14, x15;
+
+    x00 = (B[ 0] = T::Xor(B[ 0], Bx[ 0]));
+    x01 = (B[ 1] = T::Xor(B[ 1], Bx[ 1]));
+    x02 = (B[ 2] = T::Xor(B[ 2], Bx[ 2]));
+    x03 = (B[ 3] = T::Xor(B[ 3], Bx[ 3]));
+    x04 = (B[ 4] = T::Xor(B[ 4], Bx[ 4]));
+    x05 = (B[ 5] = T::Xor(B[ 5], Bx[ 5]));
+    x06 = (B[ 6] = T::Xor(B[ 6], Bx[ 6]));
+    x07 = (B[ 7] = T::Xor(B[ 7], Bx[ 7]));
+    x08 = (B[ 8] = T::Xor(B[ 8], Bx[ 8]));
+    x09 = (B[ 9] = T::Xor(B[ 9], Bx[ 9]));
+    x10 = (B[10] = T::Xor(B[10], Bx[10]));
+    x11 = (B[11] = T::Xor(B[11], Bx[11]));
+    x12 = (B[12] = T::Xor(B[12], Bx[12]));
+    x13 = (B[13] = T::Xor(B[13], Bx[13]));
+    x14 = (B[14] = T::Xor(B[14], Bx[14]));
+    x15 = (B[15] = T::Xor(B[15], Bx[15]));
+
+#define QR(a, b, c, n) a = T::Xor(a, T::template Rotl<n>(T::Add(b, c)))
+    for (int i = 0; i < 8; i += 2) {
+        /* Operate on columns. */
+        QR(x04, x00, x12,  7);  QR(x09, x05, x01,  7);
+        QR(x14, x10, x06,  7);  QR(x03, x15, x11,  7);
+
+        QR(x08, x04, x00,  9);  QR(x13, x09, x05,  9);
+        QR(x02, x14, x10,  9);  QR(x07, x03, x15,  9);
+
+        QR(x12, x08, x04, 13);  QR(x01, x13, x09, 13);
+        QR(x06, x02, x14, 13);  QR(x11, x07, x03, 13);
+
+        QR(x00, x12, x08, 18);  QR(x05, x01, x13, 18);
+        QR(x10, x06, x02, 18);  QR(x15, x11, x07, 18);
+
+        /* Operate on rows. */
+        QR(x01, x00, x03,  7);  QR(x06, x05, x04,  7);
+        QR(x11, x10, x09,  7);  QR(x12, x15, x14,  7);
+
+        QR(x02, x01, x00,  9);  QR(x07, x06, x05,  9);
+        QR(x08, x11, x10,  9);  QR(x13, x12, x15,  9);
+
+        QR(x03, x02, x01, 13);  QR(x04, x07, x06, 13);
+        QR(x09, x08, x11, 13);  QR(x14, x13, x12, 13);
+
+        QR(x00, x03, x02, 18);  QR(x05, x04, x07, 18);
+        QR(x10, x09, x08, 18);  QR(x15, x14, x13, 18);
+    }
+#undef QR
+
+    B[ 0] = T::Add(B[ 0], x00);
+    B[ 1] = T::Add(B[ 1], x01);
+    B[ 2] = T::Add(B[ 2], x02);
+    B[ 3] = T::Add(B[ 3], x03);
+    B[ 4] = T::Add(B[ 4], x04);
+    B[ 5] = T::Add(B[ 5], x05);
+    B[ 6] = T::Add(B[ 6], x06);
+    B[ 7] = T::Add(B[ 7], x07);
+    B[ 8] = T::Add(B[ 8], x08);
+    B[ 9] = T::Add(B[ 9], x09);
+    B[10] = T::Add(B[10], x10);
+    B[11] = T::Add(B[11], x11);
+    B[12] = T::Add(B[12], x12);
+    B[13] = T::Add(B[13], x13);
+    B[14] = T::Add(B[14], x14);
+    B[15] = T::Add(B[15], x15);
+}
+
+/**
+ * Run the scrypt ROMix step on T::N lane-sliced states in place. The
+ * scratchpad must hold at least 131072 * T::N + 63 bytes.
+ */
+template <typename T>
+void scrypt_core_multi(uint32_t *X, char *scratchpad)
+{
+    typedef typename T::V V;
+    V x[32];
+    V *V_ = (V *)(((uintptr_t)(scratchpad) + 63) & ~ (uintptr_t)(63));
+    const int *pV = (const int *)V_;
+
+    for (int k = 0; k < 32; k++)
+        x[k] = T::Load(&X[k * T::N]);
+
+    for (int i = 0; i < 1024; i++) {
+        for (int k = 0; k < 32; k++)
+            V_[i * 32 + k] = x[k];
+        xor_salsa8_multi<T>(&x[0], &x[16]);
+        xor_salsa8_multi<T>(&x[16], &x[0]);
+    }
+
+    // Element (j, k, lane) is at (j * 32 + k) * N + lane; the per-word
+    // offset k * N is folded into the gather base.
+    const V lanes = T::Lanes();
+    const V mask = T::Set1(1023);
+    for (int i = 0; i < 1024; i++) {
+        V idx = T::Add(T::template Shl<T::LOG2_N + 5>(T::And(x[16], mask)), lanes);
+        for (int k = 0; k < 32; k++)
+            x[k] = T::Xor(x[k], T::Gather(pV + k * T::N, idx));
+        xor_salsa8_multi<T>(&x[0], &x[16]);
+        xor_salsa8_multi<T>(&x[16], &x[0]);
+    }
+
+    for (int k = 0; k < 32; k++)
+        T::Store(&X[k * T::N], x[k]);
+}
+
+} // namespace
+
+#endif // BITCOIN_CRYPTO_SCRYPT_MULTI_H
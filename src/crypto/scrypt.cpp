@@ -34,6 +34,20 @@
 #include <string.h>
 #include <openssl/sha.h>
 
+#if defined(ENABLE_AVX2) || defined(ENABLE_AVX512F)
+#if defined(__x86_64__) || defined(__amd64__) || defined(__i386__)
+#define HAVE_SCRYPT_MULTI_CPUID 1
+#endif
+#endif
+
+#if defined(ENABLE_AVX2)
+void scrypt_core_avx2_4way(uint32_t *X, char *scratchpad);
+void scrypt_core_avx2_8way(uint32_t *X, char *scratchpad);
+#endif
+#if defined(ENABLE_AVX512F)
+void scrypt_core_avx512_16way(uint32_t *X, char *scratchpad);
+#endif
+
 #if defined(USE_SSE2) && !defined(USE_SSE2_ALWAYS)
 #ifdef _MSC_VER
 // MSVC 64bit is unable to use inline asm
@@ -327,3 +341,125 @@ void scrypt_1024_1_1_256(const char *input, char *output)
 	char scratchpad[SCRYPT_SCRATCHPAD_SIZE];
     scrypt_1024_1_1_256_sp(input, output, scratchpad);
 }
+
+typedef void (*scrypt_core_multi_fn)(uint32_t *X, char *scratchpad);
+
+struct scrypt_multi_core {
+	unsigned int ways;
+	scrypt_core_multi_fn core;
+};
+
+/* Selected multi-lane cores, widest first. Empty until scrypt_detect_multi() runs. */
+static scrypt_multi_core scrypt_multi_cores[3];
+static unsigned int scrypt_multi_core_count = 0;
+
+/*
+ * Hash ways consecutive headers with a lane-sliced core. PBKDF2 stays scalar
+ * per lane; only ROMix, which is nearly all of the work, runs vectorized.
+ */
+static void scrypt_1024_1_1_256_sp_lanes(const char *input, char *output,
+    char *scratchpad, const scrypt_multi_core &mc)
+{
+	uint8_t B[128];
+	uint32_t X[32 * SCRYPT_MULTI_MAX_WAYS];
+	unsigned int lane, k;
+
+	for (lane = 0; lane < mc.ways; lane++) {
+		PBKDF2_SHA256((const uint8_t *)&input[80 * lane], 80,
+		    (const uint8_t *)&input[80 * lane], 80, 1, B, 128);
+		for (k = 0; k < 32; k++)
+			X[k * mc.ways + lane] = le32dec(&B[4 * k]);
+	}
+
+	mc.core(X, scratchpad);
+
+	for (lane = 0; lane < mc.ways; lane++) {
+		for (k = 0; k < 32; k++)
+			le32enc(&B[4 * k], X[k * mc.ways + lane]);
+		PBKDF2_SHA256((const uint8_t *)&input[80 * lane], 80, B, 128, 1,
+		    (uint8_t *)&output[32 * lane], 32);
+	}
+}
+
+void scrypt_1024_1_1_256_multi(const char *input, char *output, size_t count)
+{
+	size_t i = 0;
+	char *scratchpad = NULL;
+
+	if (scrypt_multi_core_count > 0 && count >= scrypt_multi_cores[scrypt_multi_core_count - 1].ways)
+		scratchpad = (char *)malloc(SCRYPT_MULTI_SCRATCHPAD_SIZE);
+
+	if (scratchpad) {
+		for (unsigned int c = 0; c < scrypt_multi_core_count; c++) {
+			const scrypt_multi_core &mc = scrypt_multi_cores[c];
+			for (; count - i >= mc.ways; i += mc.ways)
+				scrypt_1024_1_1_256_sp_lanes(&input[80 * i], &output[32 * i], scratchpad, mc);
+		}
+		free(scratchpad);
+	}
+
+	for (; i < count; i++)
+		scrypt_1024_1_1_256(&input[80 * i], &output[32 * i]);
+}
+
+#if defined(HAVE_SCRYPT_MULTI_CPUID)
+static inline void scrypt_cpuid(uint32_t leaf, uint32_t subleaf, uint32_t &a, uint32_t &b, uint32_t &c, uint32_t &d)
+{
+    __asm__ ("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "0"(leaf), "2"(subleaf));
+}
+
+static inline uint64_t scrypt_xgetbv()
+{
+    uint32_t a, d;
+    __asm__ ("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+    return a | ((uint64_t)d << 32);
+}
+#endif
+
+std::string scrypt_detect_multi()
+{
+    std::string ret = "generic";
+    scrypt_multi_core_count = 0;
+
+#if defined(HAVE_SCRYPT_MULTI_CPUID)
+    uint32_t eax, ebx, ecx, edx;
+    scrypt_cpuid(0, 0, eax, ebx, ecx, edx);
+    if (eax < 7)
+        return ret;
+    scrypt_cpuid(1, 0, eax, ebx, ecx, edx);
+    // The OS must save the YMM (and for AVX-512, opmask and ZMM) state.
+    const bool have_xsave = ((ecx >> 27) & 1) && ((ecx >> 28) & 1);
+    const uint64_t xcr0 = have_xsave ? scrypt_xgetbv() : 0;
+    scrypt_cpuid(7, 0, eax, ebx, ecx, edx);
+    const bool have_avx2 = (xcr0 & 0x6) == 0x6 && ((ebx >> 5) & 1);
+    const bool have_avx512 = (xcr0 & 0xe6) == 0xe6 && ((ebx >> 16) & 1);
+
+    ret.clear();
+#if defined(ENABLE_AVX512F)
+    if (have_avx512) {
+        scrypt_multi_cores[scrypt_multi_core_count].ways = 16;
+        scrypt_multi_cores[scrypt_multi_core_count++].core = &scrypt_core_avx512_16way;
+        ret += "avx512(16way)";
+    }
+#endif
+#if defined(ENABLE_AVX2)
+    if (have_avx2) {
+        scrypt_multi_cores[scrypt_multi_core_count].ways = 8;
+        scrypt_multi_cores[scrypt_multi_core_count++].core = &scrypt_core_avx2_8way;
+        scrypt_multi_cores[scrypt_multi_core_count].ways = 4;
+        scrypt_multi_cores[scrypt_multi_core_count++].core = &scrypt_core_avx2_4way;
+        ret += ret.empty() ? "" : ",";
+        ret += "avx2(8way,4way)";
+    }
+#endif
+    if (ret.empty())
+        ret = "generic";
+#endif
+
+    return ret;
+}
+
+unsigned int scrypt_multi_ways()
+{
+    return scrypt_multi_core_count > 0 ? scrypt_multi_cores[0].ways : 1;
+}
@@ -2,12 +2,31 @@
 #define SCRYPT_H
 #include <stdlib.h>
 #include <stdint.h>
+#include <string>
 
 static const int SCRYPT_SCRATCHPAD_SIZE = 131072 + 63;
 
+/** Widest SIMD batch hashed by one call into a multi-lane scrypt core. */
+static const unsigned int SCRYPT_MULTI_MAX_WAYS = 16;
+static const int SCRYPT_MULTI_SCRATCHPAD_SIZE = 131072 * SCRYPT_MULTI_MAX_WAYS + 63;
+
 void scrypt_1024_1_1_256(const char *input, char *output);
 void scrypt_1024_1_1_256_sp_generic(const char *input, char *output, char *scratchpad);
 
+/**
+ * Hash count consecutive 80-byte inputs into count consecutive 32-byte
+ * outputs. Groups of 16/8/4 inputs are hashed together by the AVX-512 or AVX2
+ * cores selected by scrypt_detect_multi(); the rest go through the single
+ * hash path, so results are identical to calling scrypt_1024_1_1_256 on each.
+ */
+void scrypt_1024_1_1_256_multi(const char *input, char *output, size_t count);
+
+/** Select the multi-lane scrypt cores supported by this CPU and describe them. */
+std::string scrypt_detect_multi();
+
+/** Number of inputs hashed together by the widest selected core (1 if none). */
+unsigned int scrypt_multi_ways();
+
 #if defined(USE_SSE2)
 #if defined(_M_X64) || defined(__x86_64__) || defined(_M_AMD64) || (defined(MAC_OSX) && defined(__i386__))
 #define USE_SSE2_ALWAYS 1
@@ -15,14 +15,53 @@
 #include <memenv.h>
 #include <stdint.h>
 
-static leveldb::Options GetOptions(size_t nCacheSize)
+#include <algorithm>
+
+bool ParseDBProfile(const std::string& strProfile, DBProfile& profileRet)
+{
+    if (strProfile == "default")
+        profileRet = DB_PROFILE_DEFAULT;
+    else if (strProfile == "ssd")
+        profileRet = DB_PROFILE_SSD;
+    else if (strProfile == "hdd")
+        profileRet = DB_PROFILE_HDD;
+    else if (strProfile == "lowmem")
+        profileRet = DB_PROFILE_LOWMEM;
+    else
+        return false;
+    return true;
+}
+
+CDBOptions::CDBOptions(DBProfile profile)
+{
+    *this = CDBOptions();
+    switch (profile) {
+    case DB_PROFILE_DEFAULT:
+        break;
+    case DB_PROFILE_SSD:
+        nMaxOpenFiles = 1000;
+        break;
+    case DB_PROFILE_HDD:
+        nMaxOpenFiles = 1000;
+        nBlockSize = 64 << 10;
+        nWriteBufferPercent = 35;
+        break;
+    case DB_PROFILE_LOWMEM:
+        nBlockSize = 16 << 10;
+        break;
+    }
+}
+
+static leveldb::Options GetOptions(size_t nCacheSize, const CDBOptions& dbopts)
 {
     leveldb::Options options;
-    options.block_cache = leveldb::NewLRUCache(nCacheSize / 2);
-    options.write_buffer_size = nCacheSize / 4; // up to two write buffers may be held in memory simultaneously
-    options.filter_policy = leveldb::NewBloomFilterPolicy(10);
-    options.compression = leveldb::kNoCompression;
-    options.max_open_files = 64;
+    options.write_buffer_size = nCacheSize / 100 * std::min(std::max(dbopts.nWriteBufferPercent, 0), 50);
+    // up to two write buffers may be held in memory simultaneously, the block cache gets the rest
+    options.block_cache = leveldb::NewLRUCache(nCacheSize - 2 * options.write_buffer_size);
+    options.block_size = dbopts.nBlockSize;
+    options.filter_policy = dbopts.nBloomBits > 0 ? leveldb::NewBloomFilterPolicy(dbopts.nBloomBits) : NULL;
+    options.compression = dbopts.fCompression ? leveldb::kSnappyCompression : leveldb::kNoCompression;
+    options.max_open_files = dbopts.nMaxOpenFiles;
     if (leveldb::kMajorVersion > 1 || (leveldb::kMajorVersion == 1 && leveldb::kMinorVersion >= 16)) {
         // LevelDB versions before 1.16 consider short writes to be corruption. Only trigger error
         // on corruption in later versions.
@@ -31,14 +70,14 @@ static leveldb::Options GetOptions(size_t nCacheSize)
     return options;
 }
 
-CDBWrapper::CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe, bool obfuscate)
+CDBWrapper::CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe, bool obfuscate, const CDBOptions& dbopts)
 {
     penv = NULL;
     readoptions.verify_checksums = true;
     iteroptions.verify_checksums = true;
     iteroptions.fill_cache = false;
     syncoptions.sync = true;
-    options = GetOptions(nCacheSize);
+    options = GetOptions(nCacheSize, dbopts);
     options.create_if_missing = true;
     if (fMemory) {
         penv = leveldb::NewMemEnv(leveldb::Env::Default());
@@ -49,7 +88,7 @@ CDBWrapper::CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, b
             leveldb::Status result = leveldb::DestroyDB(path.string(), options);
             dbwrapper_private::HandleError(result);
         }
-        TryCreateDirectory(path);
+        boost::filesystem::create_directories(path);
         LogPrintf("Opening LevelDB in %s\n", path.string());
     }
     leveldb::Status status = leveldb::DB::Open(options, path.string(), &pdb);
@@ -50,11 +50,22 @@ private:
     const CDBWrapper &parent;
     leveldb::WriteBatch batch;
 
+    //! approximate serialized size of the queued changes
+    size_t size_estimate;
+
 public:
     /**
      * @param[in] parent    CDBWrapper that this batch is to be submitted to
      */
-    CDBBatch(const CDBWrapper &parent) : parent(parent) { };
+    CDBBatch(const CDBWrapper &parent) : parent(parent), size_estimate(0) { };
+
+    void Clear()
+    {
+        batch.Clear();
+        size_estimate = 0;
+    }
+
+    size_t SizeEstimate() const { return size_estimate; }
 
     template <typename K, typename V>
     void Write(const K& key, const V& value)
@@ -71,6 +82,13 @@ public:
         leveldb::Slice slValue(&ssValue[0], ssValue.size());
 
         batch.Put(slKey, slValue);
+        // LevelDB serializes writes as:
+        // - byte: header
+        // - varint: key length (1 byte up to 127B, 2 bytes up to 16383B, ...)
+        // - byte[]: key
+        // - varint: value length
+        // - byte[]: value
+        size_estimate += 3 + (slKey.size() > 127) + slKey.size() + (slValue.size() > 127) + slValue.size();
     }
 
     template <typename K>
@@ -82,6 +100,7 @@ public:
         leveldb::Slice slKey(&ssKey[0], ssKey.size());
 
         batch.Delete(slKey);
+        size_estimate += 2 + (slKey.size() > 127) + slKey.size();
     }
 };
 
@@ -148,6 +167,39 @@ public:
 
 };
 
+/** LevelDB tuning profiles, selected with -dbprofile */
+enum DBProfile
+{
+    DB_PROFILE_DEFAULT,
+    //! Many open files: random reads are cheap, reopening tables is not
+    DB_PROFILE_SSD,
+    //! Many open files, large blocks and write buffers: fewer seeks and compactions
+    DB_PROFILE_HDD,
+    //! Few open files and large blocks: less index and filter data held per table
+    DB_PROFILE_LOWMEM,
+};
+
+//! Parse a -dbprofile name. Returns false if it is unknown.
+bool ParseDBProfile(const std::string& strProfile, DBProfile& profileRet);
+
+/** LevelDB tuning of a CDBWrapper apart from the size of its cache */
+struct CDBOptions
+{
+    //! Number of table files kept open, each holds its index and filter blocks in memory
+    int nMaxOpenFiles;
+    //! Approximate uncompressed size of the blocks tables are read in (bytes)
+    size_t nBlockSize;
+    //! Share of the cache for each of the up to two write buffers (percent), the rest is block cache
+    int nWriteBufferPercent;
+    //! Bits per key of the bloom filter, 0 for none
+    int nBloomBits;
+    //! Compress blocks with Snappy. Ignored by LevelDB if it was built without it.
+    bool fCompression;
+
+    CDBOptions() : nMaxOpenFiles(64), nBlockSize(4096), nWriteBufferPercent(25), nBloomBits(10), fCompression(false) {}
+    explicit CDBOptions(DBProfile profile);
+};
+
 class CDBWrapper
 {
     friend const std::vector<unsigned char>& dbwrapper_private::GetObfuscateKey(const CDBWrapper &w);
@@ -192,8 +244,9 @@ public:
      * @param[in] fWipe         If true, remove all existing data.
      * @param[in] obfuscate     If true, store data obfuscated via simple XOR. If false, XOR
      *                          with a zero'd byte array.
+     * @param[in] dbopts        LevelDB tuning, see CDBOptions.
      */
-    CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false, bool obfuscate = false);
+    CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false, bool obfuscate = false, const CDBOptions& dbopts = CDBOptions());
     ~CDBWrapper();
 
     template <typename K, typename V>
@@ -280,6 +333,18 @@ public:
      * Return true if the database managed by this class contains no entries.
      */
     bool IsEmpty();
+
+    //! Compact the key range [key_begin, key_end], e.g. after rewriting it
+    template<typename K>
+    void CompactRange(const K& key_begin, const K& key_end) const
+    {
+        CDataStream ssKey1(SER_DISK, CLIENT_VERSION), ssKey2(SER_DISK, CLIENT_VERSION);
+        ssKey1 << key_begin;
+        ssKey2 << key_end;
+        leveldb::Slice slKey1(&ssKey1[0], ssKey1.size());
+        leveldb::Slice slKey2(&ssKey2[0], ssKey2.size());
+        pdb->CompactRange(&slKey1, &slKey2);
+    }
 };
 
 #endif // BITCOIN_DBWRAPPER_H
@@ -11,12 +11,14 @@
 
 #include "addrman.h"
 #include "amount.h"
+#include "blockfilecache.h"
 #include "chain.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "compat/sanity.h"
 #include "config.h"
 #include "consensus/validation.h"
+#include "crypto/scrypt.h"
 #include "httpserver.h"
 #include "httprpc.h"
 #include "key.h"
@@ -25,6 +27,7 @@
 #include "netbase.h"
 #include "net.h"
 #include "policy/policy.h"
+#include "pos.h"
 #include "rpc/server.h"
 #include "rpc/register.h"
 #include "script/standard.h"
@@ -145,9 +148,9 @@ class CCoinsViewErrorCatcher : public CCoinsViewBacked
 {
 public:
     CCoinsViewErrorCatcher(CCoinsView* view) : CCoinsViewBacked(view) {}
-    bool GetCoins(const uint256 &txid, CCoins &coins) const {
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const {
         try {
-            return CCoinsViewBacked::GetCoins(txid, coins);
+            return CCoinsViewBacked::GetCoin(outpoint, coin);
         } catch(const std::runtime_error& e) {
             uiInterface.ThreadSafeMessageBox(_("Error reading from database, shutting down."), "", CClientUIInterface::MSG_ERROR);
             LogPrintf("Error reading from database: %s\n", e.what());
@@ -161,7 +164,6 @@ public:
     // Writes do not need similar protection, as failure to write is handled by the caller.
 };
 
-static CCoinsViewDB *pcoinsdbview = NULL;
 static CCoinsViewErrorCatcher *pcoinscatcher = NULL;
 static boost::scoped_ptr<ECCVerifyHandle> globalVerifyHandle;
 
@@ -226,6 +228,8 @@ void Shutdown()
         pcoinsdbview = NULL;
         delete pblocktree;
         pblocktree = NULL;
+        delete ptxindexdb;
+        ptxindexdb = NULL;
     }
 #ifdef ENABLE_WALLET
     if (pwalletMain)
@@ -307,11 +311,14 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-?", _("Print this help message and exit"));
     strUsage += HelpMessageOpt("-version", _("Print version and exit"));
     strUsage += HelpMessageOpt("-alertnotify=<cmd>", _("Execute command when a relevant alert is received or we see a really long fork (%s in cmd is replaced by message)"));
+    strUsage += HelpMessageOpt("-asyncflush", strprintf(_("Write the UTXO cache to disk on a background thread while validation continues (default: %u)"), DEFAULT_ASYNC_FLUSH));
+    strUsage += HelpMessageOpt("-blockfilecache=<n>", strprintf(_("Keep up to <n> block files mapped into memory to read blocks from (default: %u)"), DEFAULT_BLOCK_FILE_CACHE));
     strUsage += HelpMessageOpt("-blocknotify=<cmd>", _("Execute command when the best block changes (%s in cmd is replaced by block hash)"));
     if (showDebug)
         strUsage += HelpMessageOpt("-blocksonly", strprintf(_("Whether to operate in a blocks only mode (default: %u)"), DEFAULT_BLOCKSONLY));
     strUsage += HelpMessageOpt("-checkblocks=<n>", strprintf(_("How many blocks to check at startup (default: %u, 0 = all)"), DEFAULT_CHECKBLOCKS));
     strUsage += HelpMessageOpt("-checklevel=<n>", strprintf(_("How thorough the block verification of -checkblocks is (0-4, default: %u)"), DEFAULT_CHECKLEVEL));
+    strUsage += HelpMessageOpt("-verifypowindex", strprintf(_("Recompute and verify the proof-of-work hash of every block index entry at startup, using the script verification threads (default: %u)"), DEFAULT_VERIFY_POW_INDEX));
     strUsage += HelpMessageOpt("-conf=<file>", strprintf(_("Specify configuration file (default: %s)"), BITCOIN_CONF_FILENAME));
     if (mode == HMM_BITCOIND)
     {
@@ -320,13 +327,17 @@ std::string HelpMessage(HelpMessageMode mode)
 #endif
     }
     strUsage += HelpMessageOpt("-datadir=<dir>", _("Specify data directory"));
+    if (showDebug)
+        strUsage += HelpMessageOpt("-dbbatchsize", strprintf("Maximum database write batch size in bytes (default: %u)", nDefaultDbBatchSize));
     strUsage += HelpMessageOpt("-dbcache=<n>", strprintf(_("Set database cache size in megabytes (%d to %d, default: %d)"), nMinDbCache, nMaxDbCache, nDefaultDbCache));
+    strUsage += HelpMessageOpt("-dbprofile=<profile>", strprintf(_("Tune the databases for the storage they are on: ssd, hdd, lowmem or default (default: %s)"), DEFAULT_DB_PROFILE));
     if (showDebug)
         strUsage += HelpMessageOpt("-feefilter", strprintf("Tell other nodes to filter invs to us by our mempool min fee (default: %u)", DEFAULT_FEEFILTER));
     strUsage += HelpMessageOpt("-loadblock=<file>", _("Imports blocks from external blk000??.dat file on startup"));
     strUsage += HelpMessageOpt("-maxorphantx=<n>", strprintf(_("Keep at most <n> unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS));
     strUsage += HelpMessageOpt("-maxmempool=<n>", strprintf(_("Keep the transaction memory pool below <n> megabytes (default: %u)"), DEFAULT_MAX_MEMPOOL_SIZE));
     strUsage += HelpMessageOpt("-mempoolexpiry=<n>", strprintf(_("Do not keep transactions in the mempool longer than <n> hours (default: %u)"), DEFAULT_MEMPOOL_EXPIRY));
+    strUsage += HelpMessageOpt("-mempoolbatch=<n>", strprintf(_("Add up to <n> relayed transactions to the mempool together, verifying their scripts on the -par threads (default: %u, 1 = one at a time)"), DEFAULT_MEMPOOL_BATCH_SIZE));
     strUsage += HelpMessageOpt("-par=<n>", strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"),
         -GetNumCores(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS));
 #ifndef WIN32
@@ -341,6 +352,8 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-sysperms", _("Create new files with system default permissions, instead of umask 077 (only effective with disabled wallet functionality)"));
 #endif
     strUsage += HelpMessageOpt("-txindex", strprintf(_("Maintain a full transaction index, used by the getrawtransaction rpc call (default: %u)"), DEFAULT_TXINDEX));
+    strUsage += HelpMessageOpt("-txindexcompression", strprintf(_("Compress the transaction index database, if built with Snappy support (default: %u)"), DEFAULT_TXINDEX_COMPRESSION));
+    strUsage += HelpMessageOpt("-utxostats", strprintf(_("Maintain UTXO set statistics for every block, used by the gettxoutsetinfo rpc call (default: %u)"), DEFAULT_UTXOSTATS));
 
     strUsage += HelpMessageGroup(_("Connection options:"));
     strUsage += HelpMessageOpt("-addnode=<ip>", _("Add a node to connect to and attempt to keep the connection open"));
@@ -359,6 +372,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-maxreceivebuffer=<n>", strprintf(_("Maximum per-connection receive buffer, <n>*1000 bytes (default: %u)"), DEFAULT_MAXRECEIVEBUFFER));
     strUsage += HelpMessageOpt("-maxsendbuffer=<n>", strprintf(_("Maximum per-connection send buffer, <n>*1000 bytes (default: %u)"), DEFAULT_MAXSENDBUFFER));
     strUsage += HelpMessageOpt("-maxtimeadjustment", strprintf(_("Maximum allowed median peer time offset adjustment. Local perspective of time may be influenced by peers forward or backward by this amount. (default: %u seconds)"), DEFAULT_MAX_TIME_ADJUSTMENT));
+    strUsage += HelpMessageOpt("-msghandlerthreads=<n>", strprintf(_("Number of threads processing peer messages, peers are divided among them (1 to %d, default: %d)"), MAX_MESSAGE_HANDLER_THREADS, DEFAULT_MESSAGE_HANDLER_THREADS));
     strUsage += HelpMessageOpt("-onion=<ip:port>", strprintf(_("Use separate SOCKS5 proxy to reach peers via Tor hidden services (default: %s)"), "-proxy"));
     strUsage += HelpMessageOpt("-onlynet=<net>", _("Only connect to nodes in network <net> (ipv4, ipv6 or onion)"));
     strUsage += HelpMessageOpt("-permitbaremultisig", strprintf(_("Relay non-P2SH multisig (default: %u)"), DEFAULT_PERMIT_BAREMULTISIG));
@@ -367,6 +381,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-proxy=<ip:port>", _("Connect through SOCKS5 proxy"));
     strUsage += HelpMessageOpt("-proxyrandomize", strprintf(_("Randomize credentials for every proxy connection. This enables Tor stream isolation (default: %u)"), DEFAULT_PROXYRANDOMIZE));
     strUsage += HelpMessageOpt("-seednode=<ip>", _("Connect to a node to retrieve peer addresses, and disconnect"));
+    strUsage += HelpMessageOpt("-socketevents=<mode>", strprintf(_("Wait for peer sockets using <mode>, one of: %s (default: %s)"), GetSupportedSocketEventsModes(), GetSocketEventsModeName(DEFAULT_SOCKETEVENTS)));
     strUsage += HelpMessageOpt("-timeout=<n>", strprintf(_("Specify connection timeout in milliseconds (minimum: 1, default: %d)"), DEFAULT_CONNECT_TIMEOUT));
     strUsage += HelpMessageOpt("-torcontrol=<ip>:<port>", strprintf(_("Tor control port to use if onion listening enabled (default: %s)"), DEFAULT_TOR_CONTROL));
     strUsage += HelpMessageOpt("-torpassword=<pass>", _("Tor control port password (default: empty)"));
@@ -403,6 +418,7 @@ std::string HelpMessage(HelpMessageMode mode)
     {
         strUsage += HelpMessageOpt("-checkblockindex", strprintf("Do a full consistency check for mapBlockIndex, setBlockIndexCandidates, chainActive and mapBlocksUnlinked occasionally. Also sets -checkmempool (default: %u)", Params(CBaseChainParams::MAIN).DefaultConsistencyChecks()));
         strUsage += HelpMessageOpt("-checkmempool=<n>", strprintf("Run checks every <n> transactions (default: %u)", Params(CBaseChainParams::MAIN).DefaultConsistencyChecks()));
+        strUsage += HelpMessageOpt("-dbcrashratio", "Randomly crash while writing data at a given rate (0-100)");
         strUsage += HelpMessageOpt("-disablesafemode", strprintf("Disable safemode, override a real safe mode event (default: %u)", DEFAULT_DISABLE_SAFEMODE));
         strUsage += HelpMessageOpt("-testsafemode", strprintf("Force safe mode (default: %u)", DEFAULT_TESTSAFEMODE));
         strUsage += HelpMessageOpt("-dropmessagestest=<n>", "Randomly drop 1 of every <n> network messages");
@@ -482,6 +498,8 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageGroup(_("Staking options:"));
     strUsage += HelpMessageOpt("-staking=<n>", strprintf(_("Enable staking functionality (0-1, default: %u)"), 1));
     strUsage += HelpMessageOpt("-reservebalance=<amount>", _("Keep the specified amount of coins available for spending at all times (default: 0)"));
+    strUsage += HelpMessageOpt("-stakethreads=<n>", strprintf(_("Set the number of stake kernel search threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"),
+        -GetNumCores(), MAX_STAKE_THREADS, DEFAULT_STAKE_THREADS));
 #endif
 
     return strUsage;
@@ -877,8 +895,15 @@ bool AppInit2(Config& config, boost::thread_group& threadGroup, CScheduler& sche
     int nUserMaxConnections = GetArg("-maxconnections", DEFAULT_MAX_PEER_CONNECTIONS);
     nMaxConnections = std::max(nUserMaxConnections, 0);
 
+    std::string strSocketEvents = GetArg("-socketevents", GetSocketEventsModeName(DEFAULT_SOCKETEVENTS));
+    if (!ParseSocketEventsMode(strSocketEvents, nSocketEventsMode))
+        return InitError(strprintf(_("Unsupported -socketevents=%s (available: %s)"), strSocketEvents, GetSupportedSocketEventsModes()));
+
+    nMessageHandlerThreads = std::max(1, std::min((int)GetArg("-msghandlerthreads", DEFAULT_MESSAGE_HANDLER_THREADS), MAX_MESSAGE_HANDLER_THREADS));
+
     // Trim requested connection counts, to fit into system limitations
-    nMaxConnections = std::max(std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS)), 0);
+    if (nSocketEventsMode == SOCKETEVENTS_SELECT)
+        nMaxConnections = std::max(std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS)), 0);
     int nFD = RaiseFileDescriptorLimit(nMaxConnections + MIN_CORE_FILEDESCRIPTORS);
     if (nFD < MIN_CORE_FILEDESCRIPTORS)
         return InitError(_("Not enough file descriptors available."));
@@ -938,6 +963,18 @@ bool AppInit2(Config& config, boost::thread_group& threadGroup, CScheduler& sche
         nScriptCheckThreads = 0;
     else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
         nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
+    nMempoolBatchSize = std::max((int64_t)1, GetArg("-mempoolbatch", DEFAULT_MEMPOOL_BATCH_SIZE));
+
+#ifdef ENABLE_WALLET
+    // -stakethreads=0 means autodetect, but nStakeKernelThreads==0 means no concurrency
+    nStakeKernelThreads = GetArg("-stakethreads", DEFAULT_STAKE_THREADS);
+    if (nStakeKernelThreads <= 0)
+        nStakeKernelThreads += GetNumCores();
+    if (nStakeKernelThreads <= 1)
+        nStakeKernelThreads = 0;
+    else if (nStakeKernelThreads > MAX_STAKE_THREADS)
+        nStakeKernelThreads = MAX_STAKE_THREADS;
+#endif
 
     fServer = GetBoolArg("-server", false);
 
@@ -992,6 +1029,7 @@ bool AppInit2(Config& config, boost::thread_group& threadGroup, CScheduler& sche
 #endif // ENABLE_WALLET
 
     fIsBareMultisigStd = GetBoolArg("-permitbaremultisig", DEFAULT_PERMIT_BAREMULTISIG);
+    fUTXOStats = GetBoolArg("-utxostats", DEFAULT_UTXOSTATS);
     fAcceptDatacarrier = GetBoolArg("-datacarrier", DEFAULT_ACCEPT_DATACARRIER);
     nMaxDatacarrierBytes = GetArg("-datacarriersize", nMaxDatacarrierBytes);
 
@@ -1084,8 +1122,11 @@ bool AppInit2(Config& config, boost::thread_group& threadGroup, CScheduler& sche
 
     LogPrintf("Using %u threads for script verification\n", nScriptCheckThreads);
     if (nScriptCheckThreads) {
-        for (int i=0; i<nScriptCheckThreads-1; i++)
+        for (int i=0; i<nScriptCheckThreads-1; i++) {
             threadGroup.create_thread(&ThreadScriptCheck);
+            threadGroup.create_thread(&ThreadHeaderPoWCheck);
+            threadGroup.create_thread(&ThreadBlockImportCheck);
+        }
     }
 
     // Start the lightweight task scheduler thread
@@ -1109,6 +1150,7 @@ bool AppInit2(Config& config, boost::thread_group& threadGroup, CScheduler& sche
 #if defined(USE_SSE2)
     scrypt_detect_sse2();
 #endif
+    LogPrintf("Using scrypt multi-lane implementation: %s\n", scrypt_detect_multi());
 
     // ********************************************************* Step 5: verify wallet database integrity
 #ifdef ENABLE_WALLET
@@ -1294,19 +1336,39 @@ bool AppInit2(Config& config, boost::thread_group& threadGroup, CScheduler& sche
         }
     }
 
+    blockFileCache.SetMaxFiles(std::max(GetArg("-blockfilecache", DEFAULT_BLOCK_FILE_CACHE), (int64_t)0));
+
+    // database tuning
+    DBProfile dbprofile;
+    if (!ParseDBProfile(GetArg("-dbprofile", DEFAULT_DB_PROFILE), dbprofile))
+        return InitError(strprintf(_("Unknown database profile '%s'"), GetArg("-dbprofile", DEFAULT_DB_PROFILE)));
+    CDBOptions dbopts(dbprofile);
+    // The txindex is written once and read rarely: give more of its cache to
+    // write buffers, which means fewer and larger compactions
+    CDBOptions txindexopts(dbprofile);
+    txindexopts.nWriteBufferPercent = std::max(txindexopts.nWriteBufferPercent, 40);
+    txindexopts.fCompression = GetBoolArg("-txindexcompression", DEFAULT_TXINDEX_COMPRESSION);
+#ifndef HAVE_SNAPPY
+    if (txindexopts.fCompression && GetBoolArg("-txindex", DEFAULT_TXINDEX))
+        LogPrintf("Not compressing the transaction index, LevelDB was built without Snappy\n");
+#endif
+
     // cache size calculations
     int64_t nTotalCache = (GetArg("-dbcache", nDefaultDbCache) << 20);
     nTotalCache = std::max(nTotalCache, nMinDbCache << 20); // total cache cannot be less than nMinDbCache
     nTotalCache = std::min(nTotalCache, nMaxDbCache << 20); // total cache cannot be greater than nMaxDbcache
-    int64_t nBlockTreeDBCache = nTotalCache / 8;
-    nBlockTreeDBCache = std::min(nBlockTreeDBCache, (GetBoolArg("-txindex", DEFAULT_TXINDEX) ? nMaxBlockDBAndTxIndexCache : nMaxBlockDBCache) << 20);
+    int64_t nBlockTreeDBCache = std::min(nTotalCache / 8, nMaxBlockDBCache << 20);
     nTotalCache -= nBlockTreeDBCache;
+    int64_t nTxIndexCache = std::min(nTotalCache / 8, GetBoolArg("-txindex", DEFAULT_TXINDEX) ? nMaxTxIndexCache << 20 : 0);
+    nTotalCache -= nTxIndexCache;
     int64_t nCoinDBCache = std::min(nTotalCache / 2, (nTotalCache / 4) + (1 << 23)); // use 25%-50% of the remainder for disk cache
     nCoinDBCache = std::min(nCoinDBCache, nMaxCoinsDBCache << 20); // cap total coins db cache
     nTotalCache -= nCoinDBCache;
     nCoinCacheUsage = nTotalCache; // the rest goes to in-memory cache
     LogPrintf("Cache configuration:\n");
     LogPrintf("* Using %.1fMiB for block index database\n", nBlockTreeDBCache * (1.0 / 1024 / 1024));
+    if (nTxIndexCache > 0)
+        LogPrintf("* Using %.1fMiB for transaction index database\n", nTxIndexCache * (1.0 / 1024 / 1024));
     LogPrintf("* Using %.1fMiB for chain state database\n", nCoinDBCache * (1.0 / 1024 / 1024));
     LogPrintf("* Using %.1fMiB for in-memory UTXO set\n", nCoinCacheUsage * (1.0 / 1024 / 1024));
 
@@ -1325,12 +1387,28 @@ bool AppInit2(Config& config, boost::thread_group& threadGroup, CScheduler& sche
                 delete pcoinsdbview;
                 delete pcoinscatcher;
                 delete pblocktree;
+                delete ptxindexdb;
+                ptxindexdb = NULL;
 
-                pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex);
-                pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex || fReindexChainState);
+                pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex, dbopts);
+                if (GetBoolArg("-txindex", DEFAULT_TXINDEX))
+                    ptxindexdb = new CTxIndexDB(nTxIndexCache, false, fReindex, txindexopts);
+                pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex || fReindexChainState, dbopts);
                 pcoinscatcher = new CCoinsViewErrorCatcher(pcoinsdbview);
                 pcoinsTip = new CCoinsViewCache(pcoinscatcher);
 
+                // If necessary, upgrade from the older per-transaction format.
+                if (!pcoinsdbview->Upgrade()) {
+                    strLoadError = _("Error upgrading chainstate database");
+                    break;
+                }
+
+                // Older versions kept the txindex in the block tree database
+                if (ptxindexdb && !ptxindexdb->MigrateData(*pblocktree)) {
+                    strLoadError = _("Error moving transaction index database");
+                    break;
+                }
+
                 if (fReindex) {
                     pblocktree->WriteReindexing(true);
                     //If we're reindexing in prune mode, wipe away unusable block files and all undo data files
@@ -1354,10 +1432,23 @@ bool AppInit2(Config& config, boost::thread_group& threadGroup, CScheduler& sche
                     break;
                 }
 
-                // Check for changed -txindex state
+                // Check for changed -txindex state. A newly enabled index is
+                // built in the background, as are the records of older versions
+                // that lack the block hash.
                 if (fTxIndex != GetBoolArg("-txindex", DEFAULT_TXINDEX)) {
-                    strLoadError = _("You need to rebuild the database using -reindex-chainstate to change -txindex");
-                    break;
+                    fTxIndex = !fTxIndex;
+                    pblocktree->WriteFlag("txindex", fTxIndex);
+                    LogPrintf("Transaction index %s\n", fTxIndex ? "enabled, building it in the background" : "disabled");
+                    if (fTxIndex && !ptxindexdb->WriteBuildPosition(uint256())) {
+                        strLoadError = _("Error writing transaction index database");
+                        break;
+                    }
+                } else if (fTxIndex) {
+                    uint256 hashBuilt;
+                    if (!ptxindexdb->ReadBuildPosition(hashBuilt) && ptxindexdb->HaveLegacyRecords() && !ptxindexdb->WriteBuildPosition(uint256())) {
+                        strLoadError = _("Error writing transaction index database");
+                        break;
+                    }
                 }
 
                 // Check for changed -prune state.  What we are concerned about is a user who has pruned blocks
@@ -1436,6 +1527,16 @@ bool AppInit2(Config& config, boost::thread_group& threadGroup, CScheduler& sche
     }
     LogPrintf(" block index %15dms\n", GetTimeMillis() - nStart);
 
+    // The chainstate is consistent now, later flushes may go to the background
+    if (GetBoolArg("-asyncflush", DEFAULT_ASYNC_FLUSH))
+        pcoinsdbview->StartBackgroundWriter();
+
+    if (!InitUTXOStats(chainparams)) {
+        if (ShutdownRequested())
+            return false;
+        return InitError(_("Error computing UTXO set statistics"));
+    }
+
     boost::filesystem::path est_path = GetDataDir() / FEE_ESTIMATES_FILENAME;
     CAutoFile est_filein(fopen(est_path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
     // Allowed to fail as this file IS missing on first startup.
@@ -1528,12 +1629,20 @@ bool AppInit2(Config& config, boost::thread_group& threadGroup, CScheduler& sche
 
     StartNode(threadGroup, scheduler);
 
+    // Build the transaction index, if a build is in progress
+    if (fTxIndex)
+        threadGroup.create_thread(&ThreadBuildTxIndex);
+
 #ifdef ENABLE_WALLET
     // Mine proof-of-stake blocks in the background
     if (!GetBoolArg("-staking", true))
         LogPrintf("Staking disabled\n");
-    else if (pwalletMain)
+    else if (pwalletMain) {
+        LogPrintf("Using %u threads for stake kernel search\n", nStakeKernelThreads);
+        for (int i=0; i<nStakeKernelThreads-1; i++)
+            threadGroup.create_thread(&ThreadStakeKernelCheck);
         threadGroup.create_thread(boost::bind(&ThreadStakeMiner, pwalletMain, chainparams));
+    }
 
     // ********************************************************* Step 12: finished
 #endif
@@ -11,16 +11,15 @@
 
 #include "addrman.h"
 #include "arith_uint256.h"
-/*
-// Disable BIP152
+#include "blockfilecache.h"
 #include "blockencodings.h"
-*/
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
 #include "consensus/consensus.h"
 #include "consensus/merkle.h"
 #include "consensus/validation.h"
+#include "crypto/scrypt.h"
 #include "hash.h"
 #include "init.h"
 #include "key.h"
@@ -83,9 +82,11 @@ int64_t nTimeBestReceived = 0;
 CWaitableCriticalSection csBestBlock;
 CConditionVariable cvBlockChange;
 int nScriptCheckThreads = 0;
+unsigned int nMempoolBatchSize = DEFAULT_MEMPOOL_BATCH_SIZE;
 bool fImporting = false;
 bool fReindex = false;
 bool fTxIndex = false;
+bool fUTXOStats = DEFAULT_UTXOSTATS;
 bool fHavePruned = false;
 bool fPruneMode = false;
 bool fIsBareMultisigStd = DEFAULT_PERMIT_BAREMULTISIG;
@@ -221,23 +222,26 @@ namespace {
     boost::scoped_ptr<CRollingBloomFilter> recentRejects;
     uint256 hashRecentRejectsChainTip;
 
+    /**
+     * Relayed transactions waiting to be added to the memory pool as one
+     * batch, and the peers they came from, which are referenced until the
+     * batch is processed. Protected by cs_main.
+     */
+    std::vector<CTransaction> vTxBatch;
+    std::vector<CNode*> vTxBatchFrom;
+    std::set<uint256> setTxBatch;
+
     /** Blocks that are in flight, and that are in the queue to be downloaded. Protected by cs_main. */
     struct QueuedBlock {
         uint256 hash;
         CBlockIndex* pindex;                                     //!< Optional.
         bool fValidatedHeaders;                                  //!< Whether this block has validated headers at the time of request.
-        /*
-        // Disable BIP152
         std::unique_ptr<PartiallyDownloadedBlock> partialBlock;  //!< Optional, used for CMPCTBLOCK downloads
-        */
     };
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> > mapBlocksInFlight;
 
     /** Stack of nodes which we have set to announce using compact blocks */
-    /*
-    // Disable BIP152
     list<NodeId> lNodesAnnouncingHeaderAndIDs;
-    */
 
     /** Number of preferable block download peers. */
     int nPreferredDownload = 0;
@@ -396,13 +400,10 @@ struct CNodeState {
     bool fPreferredDownload;
     //! Whether this peer wants invs or headers (when possible) for block announcements.
     bool fPreferHeaders;
-    /*
-    // Disable BIP152
     //! Whether this peer wants invs or cmpctblocks (when possible) for block announcements.
     bool fPreferHeaderAndIDs;
     //! Whether this peer will send us cmpctblocks if we request them
     bool fProvidesHeaderAndIDs;
-    */
     CNodeHeaders headers;
 
     CNodeState() {
@@ -421,11 +422,8 @@ struct CNodeState {
         nBlocksInFlightValidHeaders = 0;
         fPreferredDownload = false;
         fPreferHeaders = false;
-        /*
-        // Disable BIP152
         fPreferHeaderAndIDs = false;
         fProvidesHeaderAndIDs = false;
-        */
     }
 };
 
@@ -534,13 +532,8 @@ bool MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Pa
     // Make sure it's not listed somewhere already.
     MarkBlockAsReceived(hash);
 
-    /*
-    // Disable BIP152
     list<QueuedBlock>::iterator it = state->vBlocksInFlight.insert(state->vBlocksInFlight.end(),
             {hash, pindex, pindex != NULL, std::unique_ptr<PartiallyDownloadedBlock>(pit ? new PartiallyDownloadedBlock(&mempool) : NULL)});
-    */
-    list<QueuedBlock>::iterator it = state->vBlocksInFlight.insert(state->vBlocksInFlight.end(),
-            {hash, pindex, pindex != NULL});
     state->nBlocksInFlight++;
     state->nBlocksInFlightValidHeaders += it->fValidatedHeaders;
     if (state->nBlocksInFlight == 1) {
@@ -591,8 +584,6 @@ void UpdateBlockAvailability(NodeId nodeid, const uint256 &hash) {
     }
 }
 
-/*
-// Disable BIP152
 void MaybeSetPeerAsAnnouncingHeaderAndIDs(const CNodeState* nodestate, CNode* pfrom) {
     if (nodestate->fProvidesHeaderAndIDs) {
         for (std::list<NodeId>::iterator it = lNodesAnnouncingHeaderAndIDs.begin(); it != lNodesAnnouncingHeaderAndIDs.end(); it++) {
@@ -618,7 +609,6 @@ void MaybeSetPeerAsAnnouncingHeaderAndIDs(const CNodeState* nodestate, CNode* pf
         lNodesAnnouncingHeaderAndIDs.push_back(pfrom->GetId());
     }
 }
-*/
 
 // Requires cs_main
 bool CanDirectFetch(const Consensus::Params &consensusParams)
@@ -626,6 +616,23 @@ bool CanDirectFetch(const Consensus::Params &consensusParams)
     return chainActive.Tip()->GetBlockTime() > GetAdjustedTime() - consensusParams.nTargetSpacing * 20;
 }
 
+// Requires cs_main
+// Check the prefilled coinstake of a compact block before its transactions
+// are fetched, like AcceptBlock does when its kernel input is known. The
+// merkle root is only checked once the block is reconstructed, so failing
+// this does not make the block invalid.
+bool CheckCompactBlockStake(const CBlockHeaderAndShortTxIDs& cmpctblock, const CBlockIndex* pindex, const Consensus::Params& consensusParams)
+{
+    const CTransaction* ptxCoinStake = cmpctblock.GetCoinStake();
+    if (!ptxCoinStake || !consensusParams.IsProtocolV3(cmpctblock.header.GetBlockTime()))
+        return true;
+    CStakeInput stakeInput;
+    if (!GetStakeInput(pindex->pprev, ptxCoinStake->vin[0].prevout, *pcoinsTip, stakeInput))
+        return true;
+    CValidationState state;
+    return CheckProofOfStake(pindex->pprev, *ptxCoinStake, cmpctblock.header.nBits, stakeInput, state);
+}
+
 // Requires cs_main
 bool PeerHasHeader(CNodeState *state, CBlockIndex *pindex)
 {
@@ -760,6 +767,7 @@ void RegisterNodeSignals(CNodeSignals& nodeSignals)
 {
     nodeSignals.GetHeight.connect(&GetHeight);
     nodeSignals.ProcessMessages.connect(&ProcessMessages);
+    nodeSignals.FinishProcessMessages.connect(&FinishProcessMessages);
     nodeSignals.SendMessages.connect(&SendMessages);
     nodeSignals.InitializeNode.connect(&InitializeNode);
     nodeSignals.FinalizeNode.connect(&FinalizeNode);
@@ -769,6 +777,7 @@ void UnregisterNodeSignals(CNodeSignals& nodeSignals)
 {
     nodeSignals.GetHeight.disconnect(&GetHeight);
     nodeSignals.ProcessMessages.disconnect(&ProcessMessages);
+    nodeSignals.FinishProcessMessages.disconnect(&FinishProcessMessages);
     nodeSignals.SendMessages.disconnect(&SendMessages);
     nodeSignals.InitializeNode.disconnect(&InitializeNode);
     nodeSignals.FinalizeNode.disconnect(&FinalizeNode);
@@ -793,7 +802,10 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 }
 
 CCoinsViewCache *pcoinsTip = NULL;
+CCoinsViewDB *pcoinsdbview = NULL;
 CBlockTreeDB *pblocktree = NULL;
+CTxIndexDB *ptxindexdb = NULL;
+CBlockFileCache blockFileCache;
 
 //////////////////////////////////////////////////////////////////////////////
 //
@@ -1077,15 +1089,15 @@ bool CheckSequenceLocks(const CTransaction &tx, int flags, LockPoints* lp, bool
         prevheights.resize(tx.vin.size());
         for (size_t txinIndex = 0; txinIndex < tx.vin.size(); txinIndex++) {
             const CTxIn& txin = tx.vin[txinIndex];
-            CCoins coins;
-            if (!viewMemPool.GetCoins(txin.prevout.hash, coins)) {
+            Coin coin;
+            if (!viewMemPool.GetCoin(txin.prevout, coin)) {
                 return error("%s: Missing input", __func__);
             }
-            if (coins.nHeight == MEMPOOL_HEIGHT) {
+            if (coin.nHeight == MEMPOOL_HEIGHT) {
                 // Assume all mempool transaction confirm in the next block
                 prevheights[txinIndex] = tip->nHeight + 1;
             } else {
-                prevheights[txinIndex] = coins.nHeight;
+                prevheights[txinIndex] = coin.nHeight;
             }
         }
         lockPair = CalculateSequenceLocks(tx, flags, &prevheights, index);
@@ -1140,7 +1152,7 @@ unsigned int GetP2SHSigOpCount(const CTransaction& tx, const CCoinsViewCache& in
     unsigned int nSigOps = 0;
     for (unsigned int i = 0; i < tx.vin.size(); i++)
     {
-        const CTxOut &prevout = inputs.GetOutputFor(tx.vin[i]);
+        const CTxOut &prevout = inputs.AccessCoin(tx.vin[i].prevout).out;
         if (prevout.scriptPubKey.IsPayToScriptHash())
             nSigOps += prevout.scriptPubKey.GetSigOpCount(tx.vin[i].scriptSig);
     }
@@ -1217,9 +1229,9 @@ void LimitMempoolSize(CTxMemPool& pool, size_t limit, unsigned long age) {
     if (expired != 0)
         LogPrint("mempool", "Expired %i transactions from the memory pool\n", expired);
 
-    std::vector<uint256> vNoSpendsRemaining;
+    std::vector<COutPoint> vNoSpendsRemaining;
     pool.TrimToSize(limit, &vNoSpendsRemaining);
-    BOOST_FOREACH(const uint256& removed, vNoSpendsRemaining)
+    BOOST_FOREACH(const COutPoint& removed, vNoSpendsRemaining)
         pcoinsTip->Uncache(removed);
 }
 
@@ -1232,10 +1244,41 @@ std::string FormatStateMessage(const CValidationState &state)
         state.GetRejectCode());
 }
 
-bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree,
-                              bool* pfMissingInputs, bool fOverrideMempoolLimit, const CAmount& nAbsurdFee,
-                              std::vector<uint256>& vHashTxnToUncache)
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+
+namespace {
+
+/** State carried from the policy checks of a memory pool candidate to its admission */
+struct CMempoolCandidate
+{
+    const CTransaction& tx;
+    CCoinsView dummy;
+    //! The candidate's inputs, detached from the chainstate and the pool
+    CCoinsViewCache view;
+    std::unique_ptr<CTxMemPoolEntry> pentry;
+    std::unique_ptr<PrecomputedTransactionData> ptxdata;
+    CTxMemPool::setEntries setAncestors;
+    CTxMemPool::setEntries allConflicting;
+    CAmount nModifiedFees;
+    CAmount nConflictingFees;
+    size_t nConflictingSize;
+    //! Deferred script checks, used when admitting a batch
+    std::vector<CScriptCheck> vChecks;
+    std::vector<COutPoint> vCoinsToUncache;
+
+    CMempoolCandidate(const CTransaction& txIn) : tx(txIn), view(&dummy), nModifiedFees(0), nConflictingFees(0), nConflictingSize(0) {}
+};
+
+} // anon namespace
+
+/**
+ * Run every check of AcceptToMemoryPool except the script checks, filling in
+ * candidate for CommitMempoolCandidate.
+ */
+static bool PreCheckMempoolCandidate(CTxMemPool& pool, CValidationState& state, CMempoolCandidate& candidate, bool fLimitFree,
+                                     bool* pfMissingInputs, const CAmount& nAbsurdFee, std::vector<COutPoint>& vCoinsToUncache)
 {
+    const CTransaction& tx = candidate.tx;
     const uint256 hash = tx.GetHash();
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
@@ -1307,8 +1350,8 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
     }
 
     {
-        CCoinsView dummy;
-        CCoinsViewCache view(&dummy);
+        CCoinsView& dummy = candidate.dummy;
+        CCoinsViewCache& view = candidate.view;
 
         CAmount nValueIn = 0;
         LockPoints lp;
@@ -1318,30 +1361,34 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
         view.SetBackend(viewMemPool);
 
         // do we already have it?
-        bool fHadTxInCache = pcoinsTip->HaveCoinsInCache(hash);
-        if (view.HaveCoins(hash)) {
-            if (!fHadTxInCache)
-                vHashTxnToUncache.push_back(hash);
-            return state.Invalid(false, REJECT_ALREADY_KNOWN, "txn-already-known");
+        for (size_t out = 0; out < tx.vout.size(); out++) {
+            COutPoint outpoint(hash, out);
+            bool fHadCoinInCache = pcoinsTip->HaveCoinInCache(outpoint);
+            if (view.HaveCoin(outpoint)) {
+                if (!fHadCoinInCache)
+                    vCoinsToUncache.push_back(outpoint);
+                return state.Invalid(false, REJECT_ALREADY_KNOWN, "txn-already-known");
+            }
         }
 
         // do all inputs exist?
-        // Note that this does not check for the presence of actual outputs (see the next check for that),
-        // and only helps with filling in pfMissingInputs (to determine missing vs spent).
         BOOST_FOREACH(const CTxIn txin, tx.vin) {
-            if (!pcoinsTip->HaveCoinsInCache(txin.prevout.hash))
-                vHashTxnToUncache.push_back(txin.prevout.hash);
-            if (!view.HaveCoins(txin.prevout.hash)) {
+            if (!pcoinsTip->HaveCoinInCache(txin.prevout))
+                vCoinsToUncache.push_back(txin.prevout);
+            if (!view.HaveCoin(txin.prevout)) {
+                // Are inputs missing because we already have the tx?
+                for (size_t out = 0; out < tx.vout.size(); out++) {
+                    // Optimistically just do efficient check of cache for outputs
+                    if (pcoinsTip->HaveCoinInCache(COutPoint(hash, out)))
+                        return state.Invalid(false, REJECT_DUPLICATE, "txn-already-known");
+                }
+                // Otherwise assume this might be an orphan tx for which we just haven't seen parents yet
                 if (pfMissingInputs)
                     *pfMissingInputs = true;
                 return false; // fMissingInputs and !state.IsInvalid() is used to detect this condition, don't set state.Invalid()
             }
         }
 
-        // are the actual inputs available?
-        if (!view.HaveInputs(tx))
-            return state.Invalid(false, REJECT_DUPLICATE, "bad-txns-inputs-spent");
-
         // Bring the best block into scope
         view.GetBestBlock();
 
@@ -1368,7 +1415,8 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
         CAmount nValueOut = tx.GetValueOut();
         CAmount nFees = nValueIn-nValueOut;
         // nModifiedFees includes any fee deltas from PrioritiseTransaction
-        CAmount nModifiedFees = nFees;
+        CAmount& nModifiedFees = candidate.nModifiedFees;
+        nModifiedFees = nFees;
         double nPriorityDummy = 0;
         pool.ApplyDeltas(hash, nPriorityDummy, nModifiedFees);
 
@@ -1379,14 +1427,15 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
         // during reorgs to ensure COINBASE_MATURITY is still met.
         bool fSpendsCoinbase = false;
         BOOST_FOREACH(const CTxIn &txin, tx.vin) {
-            const CCoins *coins = view.AccessCoins(txin.prevout.hash);
-            if (coins->IsCoinBase()) {
+            const Coin &coin = view.AccessCoin(txin.prevout);
+            if (coin.IsCoinBase()) {
                 fSpendsCoinbase = true;
                 break;
             }
         }
 
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height(), pool.HasNoInputsOf(tx), inChainInputValue, fSpendsCoinbase, nSigOpsCount, lp);
+        candidate.pentry.reset(new CTxMemPoolEntry(tx, nFees, GetTime(), dPriority, chainActive.Height(), pool.HasNoInputsOf(tx), inChainInputValue, fSpendsCoinbase, nSigOpsCount, lp));
+        const CTxMemPoolEntry& entry = *candidate.pentry;
         unsigned int nSize = entry.GetTxSize();
 
         // Check that the transaction doesn't have an excessive number of
@@ -1435,7 +1484,7 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
                 strprintf("%d > %d", nFees, nAbsurdFee));
 
         // Calculate in-mempool ancestors, up to a limit.
-        CTxMemPool::setEntries setAncestors;
+        CTxMemPool::setEntries& setAncestors = candidate.setAncestors;
         size_t nLimitAncestors = GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT);
         size_t nLimitAncestorSize = GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT)*1000;
         size_t nLimitDescendants = GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT);
@@ -1464,10 +1513,10 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
 
         // Check if it's economically rational to mine this transaction rather
         // than the ones it replaces.
-        CAmount nConflictingFees = 0;
-        size_t nConflictingSize = 0;
+        CAmount& nConflictingFees = candidate.nConflictingFees;
+        size_t& nConflictingSize = candidate.nConflictingSize;
         uint64_t nConflictingCount = 0;
-        CTxMemPool::setEntries allConflicting;
+        CTxMemPool::setEntries& allConflicting = candidate.allConflicting;
 
         // If we don't hold the lock allConflicting might be incomplete; the
         // subsequent RemoveStaged() and addUnchecked() calls don't guarantee
@@ -1587,48 +1636,76 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
                               FormatMoney(::minRelayTxFee.GetFee(nSize))));
             }
         }
+    }
 
-        // Check against previous transactions
-        // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-        PrecomputedTransactionData txdata(tx);
-        if (!CheckInputs(tx, state, view, true, STANDARD_SCRIPT_VERIFY_FLAGS, true, txdata))
-            return false; // state filled in by CheckInputs
+    return true;
+}
 
-        // Check again against just the consensus-critical mandatory script
-        // verification flags, in case of bugs in the standard flags that cause
-        // transactions to pass as valid when they're actually invalid. For
-        // instance the STRICTENC flag was incorrectly allowing certain
-        // CHECKSIG NOT scripts to pass, even though they were invalid.
-        //
-        // There is a similar check in CreateNewBlock() to prevent creating
-        // invalid blocks, however allowing such transactions into the mempool
-        // can be exploited as a DoS attack.
-        if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, txdata))
-        {
-            return error("%s: BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s, %s",
-                __func__, hash.ToString(), FormatStateMessage(state));
-        }
+/**
+ * Run the script checks of a candidate that passed PreCheckMempoolCandidate,
+ * unless fScriptsChecked says they already passed, and add it to the pool.
+ */
+static bool CommitMempoolCandidate(CTxMemPool& pool, CValidationState& state, CMempoolCandidate& candidate, bool fScriptsChecked)
+{
+    const CTransaction& tx = candidate.tx;
+    const uint256 hash = tx.GetHash();
+    const CCoinsViewCache& view = candidate.view;
+    unsigned int nSize = candidate.pentry->GetTxSize();
+
+    // Check against previous transactions
+    // This is done last to help prevent CPU exhaustion denial-of-service attacks.
+    if (!candidate.ptxdata)
+        candidate.ptxdata.reset(new PrecomputedTransactionData(tx));
+    PrecomputedTransactionData& txdata = *candidate.ptxdata;
+    if (!fScriptsChecked && !CheckInputs(tx, state, view, true, STANDARD_SCRIPT_VERIFY_FLAGS, true, txdata))
+        return false; // state filled in by CheckInputs
+
+    // Check again against just the consensus-critical mandatory script
+    // verification flags, in case of bugs in the standard flags that cause
+    // transactions to pass as valid when they're actually invalid. For
+    // instance the STRICTENC flag was incorrectly allowing certain
+    // CHECKSIG NOT scripts to pass, even though they were invalid.
+    //
+    // There is a similar check in CreateNewBlock() to prevent creating
+    // invalid blocks, however allowing such transactions into the mempool
+    // can be exploited as a DoS attack.
+    if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, txdata))
+    {
+        return error("%s: BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s, %s",
+            __func__, hash.ToString(), FormatStateMessage(state));
+    }
 
-        // Remove conflicting transactions from the mempool
-        BOOST_FOREACH(const CTxMemPool::txiter it, allConflicting)
-        {
-            LogPrint("mempool", "replacing tx %s with %s for %s BTC additional fees, %d delta bytes\n",
-                    it->GetTx().GetHash().ToString(),
-                    hash.ToString(),
-                    FormatMoney(nModifiedFees - nConflictingFees),
-                    (int)nSize - (int)nConflictingSize);
-        }
-        pool.RemoveStaged(allConflicting, false);
+    // Remove conflicting transactions from the mempool
+    BOOST_FOREACH(const CTxMemPool::txiter it, candidate.allConflicting)
+    {
+        LogPrint("mempool", "replacing tx %s with %s for %s BTC additional fees, %d delta bytes\n",
+                it->GetTx().GetHash().ToString(),
+                hash.ToString(),
+                FormatMoney(candidate.nModifiedFees - candidate.nConflictingFees),
+                (int)nSize - (int)candidate.nConflictingSize);
+    }
+    pool.RemoveStaged(candidate.allConflicting, false);
 
-        // Store transaction in memory
-        pool.addUnchecked(hash, entry, setAncestors, !IsInitialBlockDownload());
+    // Store transaction in memory
+    pool.addUnchecked(hash, *candidate.pentry, candidate.setAncestors, !IsInitialBlockDownload());
+    return true;
+}
 
-        // trim mempool and check if tx was trimmed
-        if (!fOverrideMempoolLimit) {
-            LimitMempoolSize(pool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
-            if (!pool.exists(hash))
-                return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool full");
-        }
+bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree,
+                              bool* pfMissingInputs, bool fOverrideMempoolLimit, const CAmount& nAbsurdFee,
+                              std::vector<COutPoint>& vCoinsToUncache)
+{
+    CMempoolCandidate candidate(tx);
+    if (!PreCheckMempoolCandidate(pool, state, candidate, fLimitFree, pfMissingInputs, nAbsurdFee, vCoinsToUncache))
+        return false;
+    if (!CommitMempoolCandidate(pool, state, candidate, false))
+        return false;
+
+    // trim mempool and check if tx was trimmed
+    if (!fOverrideMempoolLimit) {
+        LimitMempoolSize(pool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+        if (!pool.exists(tx.GetHash()))
+            return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool full");
     }
 
     SyncWithWallets(tx, NULL, NULL);
@@ -1639,15 +1716,149 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
                         bool* pfMissingInputs, bool fOverrideMempoolLimit, const CAmount nAbsurdFee)
 {
-    std::vector<uint256> vHashTxToUncache;
-    bool res = AcceptToMemoryPoolWorker(pool, state, tx, fLimitFree, pfMissingInputs, fOverrideMempoolLimit, nAbsurdFee, vHashTxToUncache);
+    std::vector<COutPoint> vCoinsToUncache;
+    bool res = AcceptToMemoryPoolWorker(pool, state, tx, fLimitFree, pfMissingInputs, fOverrideMempoolLimit, nAbsurdFee, vCoinsToUncache);
     if (!res) {
-        BOOST_FOREACH(const uint256& hashTx, vHashTxToUncache)
-            pcoinsTip->Uncache(hashTx);
+        BOOST_FOREACH(const COutPoint& outpoint, vCoinsToUncache)
+            pcoinsTip->Uncache(outpoint);
     }
     return res;
 }
 
+/**
+ * Verify the scripts of a group of independent candidates together and add
+ * those that pass to the pool in order. vpos maps each candidate to its slot
+ * in the result vectors.
+ */
+static void CommitMempoolCandidates(CTxMemPool& pool, std::vector<std::unique_ptr<CMempoolCandidate> >& vCandidates, const std::vector<size_t>& vpos,
+                                    std::vector<CValidationState>& vState, std::vector<bool>& vfAccepted)
+{
+    // Without script check threads the scripts were already checked inline.
+    // Otherwise one failing check fails the whole queue run, in which case
+    // every candidate is checked again on its own to find out which one it
+    // was and why; signatures that did verify are in the signature cache.
+    bool fScriptsChecked = true;
+    if (nScriptCheckThreads) {
+        CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+        for (size_t i = 0; i < vCandidates.size(); i++)
+            control.Add(vCandidates[i]->vChecks);
+        fScriptsChecked = control.Wait();
+    }
+
+    std::vector<size_t> vAdded;
+    for (size_t i = 0; i < vCandidates.size(); i++) {
+        if (CommitMempoolCandidate(pool, vState[vpos[i]], *vCandidates[i], fScriptsChecked))
+            vAdded.push_back(i);
+        else
+            BOOST_FOREACH(const COutPoint& outpoint, vCandidates[i]->vCoinsToUncache)
+                pcoinsTip->Uncache(outpoint);
+    }
+
+    // Trim once for the whole group rather than after every transaction
+    if (!vAdded.empty())
+        LimitMempoolSize(pool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+    BOOST_FOREACH(size_t i, vAdded) {
+        const CTransaction& tx = vCandidates[i]->tx;
+        if (!pool.exists(tx.GetHash())) {
+            vState[vpos[i]].DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool full");
+            BOOST_FOREACH(const COutPoint& outpoint, vCandidates[i]->vCoinsToUncache)
+                pcoinsTip->Uncache(outpoint);
+            continue;
+        }
+        vfAccepted[vpos[i]] = true;
+        SyncWithWallets(tx, NULL, NULL);
+    }
+}
+
+void AcceptToMemoryPoolBatch(CTxMemPool& pool, const std::vector<CTransaction>& vtx, bool fLimitFree,
+                             std::vector<CValidationState>& vState, std::vector<bool>& vfAccepted, std::vector<bool>& vfMissingInputs)
+{
+    AssertLockHeld(cs_main);
+    vState.assign(vtx.size(), CValidationState());
+    vfAccepted.assign(vtx.size(), false);
+    vfMissingInputs.assign(vtx.size(), false);
+
+    // Candidates whose scripts have not been checked yet. The policy checks
+    // of a transaction only see the pool as it is, so one spending or
+    // double-spending an output of a pending candidate waits for the group
+    // to be committed first.
+    std::vector<std::unique_ptr<CMempoolCandidate> > vCandidates;
+    std::vector<size_t> vpos;
+    std::set<uint256> setPendingTx;
+    std::set<COutPoint> setPendingSpent;
+
+    for (size_t i = 0; i < vtx.size(); i++) {
+        const CTransaction& tx = vtx[i];
+        bool fDependsOnPending = setPendingTx.count(tx.GetHash()) > 0;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+            if (setPendingTx.count(txin.prevout.hash) || setPendingSpent.count(txin.prevout))
+                fDependsOnPending = true;
+        }
+        if (fDependsOnPending) {
+            CommitMempoolCandidates(pool, vCandidates, vpos, vState, vfAccepted);
+            vCandidates.clear();
+            vpos.clear();
+            setPendingTx.clear();
+            setPendingSpent.clear();
+        }
+
+        std::unique_ptr<CMempoolCandidate> candidate(new CMempoolCandidate(tx));
+        bool fMissingInputs = false;
+        bool fOk = PreCheckMempoolCandidate(pool, vState[i], *candidate, fLimitFree, &fMissingInputs, 0, candidate->vCoinsToUncache);
+        vfMissingInputs[i] = fMissingInputs;
+        if (fOk) {
+            // Only collect the script checks here when there are threads to
+            // run them; CheckInputs still fails right away on the cheap checks
+            candidate->ptxdata.reset(new PrecomputedTransactionData(tx));
+            fOk = CheckInputs(tx, vState[i], candidate->view, true, STANDARD_SCRIPT_VERIFY_FLAGS, true, *candidate->ptxdata,
+                              nScriptCheckThreads ? &candidate->vChecks : NULL);
+        }
+        if (!fOk) {
+            BOOST_FOREACH(const COutPoint& outpoint, candidate->vCoinsToUncache)
+                pcoinsTip->Uncache(outpoint);
+            continue;
+        }
+
+        setPendingTx.insert(tx.GetHash());
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            setPendingSpent.insert(txin.prevout);
+        vCandidates.push_back(std::move(candidate));
+        vpos.push_back(i);
+    }
+    CommitMempoolCandidates(pool, vCandidates, vpos, vState, vfAccepted);
+}
+
+/** Read the transaction described by a txindex record with its size, in one read */
+static bool ReadTxFromDisk(const CTxIndexEntry& postx, CTransaction& txOut)
+{
+    // Records count the offset from the end of the block header
+    CDiskBlockPos pos(postx.nFile, postx.nPos + 80 + postx.nTxOffset);
+    std::shared_ptr<const CMappedFile> file = blockFileCache.Get(pos.nFile, GetBlockPosFilename(pos, "blk"), (size_t)pos.nPos + postx.nTxSize);
+    std::vector<unsigned char> vchTx;
+    const unsigned char* ptx;
+    if (file) {
+        ptx = file->data() + pos.nPos;
+    } else {
+        CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
+        if (filein.IsNull())
+            return error("%s: OpenBlockFile failed for %s", __func__, pos.ToString());
+        vchTx.resize(postx.nTxSize);
+        try {
+            filein.read((char*)vchTx.data(), vchTx.size());
+        } catch (const std::exception& e) {
+            return error("%s: I/O error - %s at %s", __func__, e.what(), pos.ToString());
+        }
+        ptx = vchTx.data();
+    }
+    try {
+        CByteReader reader(ptx, ptx + postx.nTxSize, SER_DISK, CLIENT_VERSION);
+        reader >> txOut;
+    } catch (const std::exception& e) {
+        return error("%s: Deserialize error - %s at %s", __func__, e.what(), pos.ToString());
+    }
+    return true;
+}
+
 /** Return transaction in txOut, and if it was found inside a block, its hash is placed in hashBlock */
 bool GetTransaction(const uint256 &hash, CTransaction &txOut, const Consensus::Params& consensusParams, uint256 &hashBlock, bool fAllowSlow)
 {
@@ -1663,8 +1874,18 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, const Consensus::P
     }
 
     if (fTxIndex) {
-        CDiskTxPos postx;
-        if (pblocktree->ReadTxIndex(hash, postx)) {
+        CTxIndexEntry postx;
+        if (ptxindexdb->ReadTxIndex(hash, postx)) {
+            // The record knows the block, read nothing but the transaction
+            if (!postx.hashBlock.IsNull()) {
+                if (!ReadTxFromDisk(postx, txOut))
+                    return false;
+                hashBlock = postx.hashBlock;
+                if (txOut.GetHash() != hash)
+                    return error("%s: txid mismatch", __func__);
+                return true;
+            }
+            // Records of older versions need the header for the block hash
             CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
             if (file.IsNull())
                 return error("%s: OpenBlockFile failed", __func__);
@@ -1686,10 +1907,9 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, const Consensus::P
     if (fAllowSlow) { // use coin database to locate block that contains transaction, and scan it
         int nHeight = -1;
         {
-            const CCoinsViewCache& view = *pcoinsTip;
-            const CCoins* coins = view.AccessCoins(hash);
-            if (coins)
-                nHeight = coins->nHeight;
+            const Coin& coin = AccessByTxid(*pcoinsTip, hash);
+            if (!coin.IsSpent())
+                nHeight = coin.nHeight;
         }
         if (nHeight > 0)
             pindexSlow = chainActive[nHeight];
@@ -1742,25 +1962,65 @@ bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHea
     return true;
 }
 
-bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams)
+/**
+ * Locate the serialized block at pos in its mapped block file. Returns the
+ * mapping, which keeps pblock valid, or NULL if the file has to be read.
+ */
+static std::shared_ptr<const CMappedFile> MapBlockFromDisk(const CDiskBlockPos& pos, const unsigned char*& pblock, unsigned int& nSize)
+{
+    std::shared_ptr<const CMappedFile> file;
+    // Blocks are preceded by the network magic and their size
+    if (pos.IsNull() || pos.nPos < 8)
+        return file;
+    file = blockFileCache.Get(pos.nFile, GetBlockPosFilename(pos, "blk"), pos.nPos);
+    if (!file)
+        return file;
+    nSize = ReadLE32(file->data() + pos.nPos - 4);
+    if (memcmp(file->data() + pos.nPos - 8, Params().MessageStart(), MESSAGE_START_SIZE) != 0 ||
+        nSize < 80 || nSize > MAX_BLOCK_SIZE) {
+        file.reset();
+        return file;
+    }
+    if (pos.nPos + nSize > file->size())
+        file = blockFileCache.Get(pos.nFile, GetBlockPosFilename(pos, "blk"), pos.nPos + nSize);
+    if (file)
+        pblock = file->data() + pos.nPos;
+    return file;
+}
+
+static bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams, bool fCheckPOW)
 {
     block.SetNull();
 
-    // Open history file to read
-    CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
-        return error("ReadBlockFromDisk: OpenBlockFile failed for %s", pos.ToString());
+    const unsigned char* pblock;
+    unsigned int nSize;
+    std::shared_ptr<const CMappedFile> file = MapBlockFromDisk(pos, pblock, nSize);
+    if (file) {
+        // Deserialize straight from the mapping
+        try {
+            CByteReader reader(pblock, pblock + nSize, SER_DISK, CLIENT_VERSION);
+            reader >> block;
+        }
+        catch (const std::exception& e) {
+            return error("%s: Deserialize error - %s at %s", __func__, e.what(), pos.ToString());
+        }
+    } else {
+        // Open history file to read
+        CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
+        if (filein.IsNull())
+            return error("ReadBlockFromDisk: OpenBlockFile failed for %s", pos.ToString());
 
-    // Read block
-    try {
-        filein >> block;
-    }
-    catch (const std::exception& e) {
-        return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), pos.ToString());
+        // Read block
+        try {
+            filein >> block;
+        }
+        catch (const std::exception& e) {
+            return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), pos.ToString());
+        }
     }
 
     // Check headers for proof-of-work blocks
-    if (block.GetHash() != consensusParams.hashGenesisBlock && block.IsProofOfWork()) {
+    if (fCheckPOW && block.GetHash() != consensusParams.hashGenesisBlock && block.IsProofOfWork()) {
         if (!CheckProofOfWork(block.GetPoWHash(), block.nBits, consensusParams))
             return error("ReadBlockFromDisk: Errors in block header at %s", pos.ToString());
     }
@@ -1768,16 +2028,113 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus:
     return true;
 }
 
-bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams)
+bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams)
+{
+    return ReadBlockFromDisk(block, pos, consensusParams, true);
+}
+
+/**
+ * Read the block at pos and check it against pindex's header. Only touches the
+ * index entry's immutable header fields, so it can run without cs_main once
+ * the position has been looked up under it.
+ */
+static bool IsIndexHeader(const CBlockHeader& header, const CBlockIndex* pindex)
 {
-    if (!ReadBlockFromDisk(block, pindex->GetBlockPos(), consensusParams))
+    // The index entry's header hashes to its block hash, so comparing the
+    // header fields is equivalent and avoids a scrypt call for legacy blocks.
+    return header.nVersion == pindex->nVersion && header.hashMerkleRoot == pindex->hashMerkleRoot &&
+        header.nTime == pindex->nTime && header.nBits == pindex->nBits && header.nNonce == pindex->nNonce &&
+        header.hashPrevBlock == (pindex->pprev ? pindex->pprev->GetBlockHash() : uint256());
+}
+
+bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const CBlockIndex* pindex, const Consensus::Params& consensusParams)
+{
+    if (!ReadBlockFromDisk(block, pos, consensusParams, false))
         return false;
-    if (block.GetHash() != pindex->GetBlockHash())
+    if (!IsIndexHeader(block, pindex))
         return error("ReadBlockFromDisk(CBlock&, CBlockIndex*): GetHash() doesn't match index for %s at %s",
-                pindex->ToString(), pindex->GetBlockPos().ToString());
+                pindex->ToString(), pos.ToString());
+    return true;
+}
+
+/**
+ * Map the serialized block at pos and check its header against pindex, for
+ * sending it as is. Like ReadBlockFromDisk(), only touches the index entry's
+ * immutable header fields.
+ */
+static std::shared_ptr<const CMappedFile> MapBlockFromDisk(const CDiskBlockPos& pos, const CBlockIndex* pindex, const unsigned char*& pblock, unsigned int& nSize)
+{
+    std::shared_ptr<const CMappedFile> file = MapBlockFromDisk(pos, pblock, nSize);
+    if (!file)
+        return file;
+    CBlockHeader header;
+    try {
+        CByteReader reader(pblock, pblock + nSize, SER_DISK, CLIENT_VERSION);
+        reader >> header;
+    }
+    catch (const std::exception&) {
+        file.reset();
+    }
+    if (file && !IsIndexHeader(header, pindex))
+        file.reset();
+    return file;
+}
+
+bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams)
+{
+    if (!ReadBlockFromDisk(block, pindex->GetBlockPos(), pindex, consensusParams))
+        return false;
+    // Check headers for proof-of-work blocks, using the hash cached in the index if present
+    if (pindex->pprev && block.IsProofOfWork() && !CheckProofOfWork(pindex->GetBlockPoWHash(), block.nBits, consensusParams))
+        return error("ReadBlockFromDisk: Errors in block header at %s", pindex->GetBlockPos().ToString());
+    return true;
+}
+
+/**
+ * Read the serialized block at pos and check its header against pindex, which
+ * is equivalent to checking its hash. Like ReadBlockFromDisk(), only touches
+ * the index entry's immutable header fields.
+ */
+static bool ReadRawBlockFromDisk(std::vector<unsigned char>& vchBlock, const CDiskBlockPos& pos, const CBlockIndex* pindex)
+{
+    const unsigned char* pblock;
+    unsigned int nSize;
+    std::shared_ptr<const CMappedFile> file = MapBlockFromDisk(pos, pindex, pblock, nSize);
+    if (file) {
+        vchBlock.assign(pblock, pblock + nSize);
+        return true;
+    }
+
+    // Blocks are preceded by the network magic and their size
+    if (pos.IsNull() || pos.nPos < 8)
+        return error("%s: invalid position %s", __func__, pos.ToString());
+    CAutoFile filein(OpenBlockFile(CDiskBlockPos(pos.nFile, pos.nPos - 8), true), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return error("%s: OpenBlockFile failed for %s", __func__, pos.ToString());
+    CBlockHeader header;
+    try {
+        CMessageHeader::MessageStartChars messageStart;
+        filein >> FLATDATA(messageStart) >> nSize;
+        if (memcmp(messageStart, Params().MessageStart(), MESSAGE_START_SIZE) != 0 || nSize < 80 || nSize > MAX_BLOCK_SIZE)
+            return error("%s: no block at %s", __func__, pos.ToString());
+        vchBlock.resize(nSize);
+        filein.read((char*)vchBlock.data(), nSize);
+        CByteReader reader(vchBlock.data(), vchBlock.data() + vchBlock.size(), SER_DISK, CLIENT_VERSION);
+        reader >> header;
+    }
+    catch (const std::exception& e) {
+        return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), pos.ToString());
+    }
+    if (!IsIndexHeader(header, pindex))
+        return error("%s: GetHash() doesn't match index for %s at %s", __func__, pindex->ToString(), pos.ToString());
     return true;
 }
 
+bool ReadRawBlockFromDisk(std::vector<unsigned char>& vchBlock, const CBlockIndex* pindex)
+{
+    return ReadRawBlockFromDisk(vchBlock, pindex->GetBlockPos(), pindex);
+}
+
 CAmount GetProofOfWorkSubsidy()
 {
     int nBlockHeight = chainActive.Height() + 1;
@@ -1988,26 +2345,14 @@ void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, CTxUndo &txund
     if (!tx.IsCoinBase()) {
         txundo.vprevout.reserve(tx.vin.size());
         BOOST_FOREACH(const CTxIn &txin, tx.vin) {
-            CCoinsModifier coins = inputs.ModifyCoins(txin.prevout.hash);
-            unsigned nPos = txin.prevout.n;
-
-            if (nPos >= coins->vout.size() || coins->vout[nPos].IsNull())
-                assert(false);
             // mark an outpoint spent, and construct undo information
-            txundo.vprevout.push_back(CTxInUndo(coins->vout[nPos]));
-            coins->Spend(nPos);
-            if (coins->vout.size() == 0) {
-                CTxInUndo& undo = txundo.vprevout.back();
-                undo.nHeight = coins->nHeight;
-                undo.fCoinBase = coins->fCoinBase;
-                undo.fCoinStake = coins->fCoinStake;
-                undo.nVersion = coins->nVersion;
-                undo.nTime = coins->nTime;
-            }
+            txundo.vprevout.push_back(Coin());
+            bool is_spent = inputs.SpendCoin(txin.prevout, &txundo.vprevout.back());
+            assert(is_spent);
         }
     }
     // add outputs
-    inputs.ModifyNewCoins(tx.GetHash(), tx.IsCoinBase())->FromTx(tx, nHeight);
+    AddCoins(inputs, tx, nHeight);
 }
 
 void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, int nHeight)
@@ -2044,26 +2389,26 @@ bool CheckTxInputs(const CTransaction& tx, CValidationState& state, const CCoins
         for (unsigned int i = 0; i < tx.vin.size(); i++)
         {
             const COutPoint &prevout = tx.vin[i].prevout;
-            const CCoins *coins = inputs.AccessCoins(prevout.hash);
-            assert(coins);
+            const Coin& coin = inputs.AccessCoin(prevout);
+            assert(!coin.IsSpent());
 
             // If prev is coinbase or coinstake, check that it's matured
-            if (coins->IsCoinBase() || coins->IsCoinStake()) {
-                     if (nSpendHeight - coins->nHeight < Params().nCoinbaseMaturity)
+            if (coin.IsCoinBase() || coin.IsCoinStake()) {
+                     if (nSpendHeight - coin.nHeight < Params().nCoinbaseMaturity)
                              return state.Invalid(
-                                    error("CheckInputs(): tried to spend %s at depth %d", coins->IsCoinBase() ? "coinbase" : "coinstake", nSpendHeight - coins->nHeight),
+                                    error("CheckInputs(): tried to spend %s at depth %d", coin.IsCoinBase() ? "coinbase" : "coinstake", nSpendHeight - coin.nHeight),
                                     REJECT_INVALID, "bad-txns-premature-spend-of-coinbase");
             }
 
 
             // Check transaction timestamp
-            if (coins->nTime > tx.nTime)
+            if (coin.nTime > tx.nTime)
                     return state.DoS(100, error("CheckInputs() : transaction timestamp earlier than input transaction"),
                                 REJECT_INVALID, "bad-txns-time-earlier-than-input");
 
             // Check for negative or overflow input values
-            nValueIn += coins->vout[prevout.n].nValue;
-            if (!MoneyRange(coins->vout[prevout.n].nValue) || !MoneyRange(nValueIn))
+            nValueIn += coin.out.nValue;
+            if (!MoneyRange(coin.out.nValue) || !MoneyRange(nValueIn))
                 return state.DoS(100, false, REJECT_INVALID, "bad-txns-inputvalues-outofrange");
 
         }
@@ -2112,11 +2457,11 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
         if (fScriptChecks) {
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 const COutPoint &prevout = tx.vin[i].prevout;
-                const CCoins* coins = inputs.AccessCoins(prevout.hash);
-                assert(coins);
+                const Coin& coin = inputs.AccessCoin(prevout);
+                assert(!coin.IsSpent());
 
                 // Verify signature
-                CScriptCheck check(*coins, tx, i, flags, cacheStore, &txdata);
+                CScriptCheck check(coin.out, tx, i, flags, cacheStore, &txdata);
                 if (pvChecks) {
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
@@ -2128,7 +2473,7 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
                         // arguments; if so, don't trigger DoS protection to
                         // avoid splitting the network between upgraded and
                         // non-upgraded nodes.
-                        CScriptCheck check2(*coins, tx, i,
+                        CScriptCheck check2(coin.out, tx, i,
                                 flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore, &txdata);
                         if (check2())
                             return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
@@ -2185,10 +2530,13 @@ bool UndoReadFromDisk(CBlockUndo& blockundo, const CDiskBlockPos& pos, const uin
     if (filein.IsNull())
         return error("%s: OpenUndoFile failed", __func__);
 
-    // Read block
+    // Read block, hashing the bytes as read: serializing the undo data again
+    // does not reproduce records written by older versions
     uint256 hashChecksum;
+    CHashVerifier<CAutoFile> verifier(&filein);
     try {
-        filein >> blockundo;
+        verifier << hashBlock;
+        verifier >> blockundo;
         filein >> hashChecksum;
     }
     catch (const std::exception& e) {
@@ -2196,10 +2544,7 @@ bool UndoReadFromDisk(CBlockUndo& blockundo, const CDiskBlockPos& pos, const uin
     }
 
     // Verify checksum
-    CHashWriter hasher(SER_GETHASH, PROTOCOL_VERSION);
-    hasher << hashBlock;
-    hasher << blockundo;
-    if (hashChecksum != hasher.GetHash())
+    if (hashChecksum != verifier.GetHash())
         return error("%s: Checksum mismatch", __func__);
 
     return true;
@@ -2226,40 +2571,83 @@ bool AbortNode(CValidationState& state, const std::string& strMessage, const std
 } // anon namespace
 
 /**
- * Apply the undo operation of a CTxInUndo to the given chain state.
- * @param undo The undo object.
+ * Restore the coin spent by a transaction input to the given chain state.
+ * @param undo The coin to restore.
  * @param view The coins view to which to apply the changes.
  * @param out The out point that corresponds to the tx input.
  * @return True on success.
  */
-static bool ApplyTxInUndo(const CTxInUndo& undo, CCoinsViewCache& view, const COutPoint& out)
+static bool ApplyTxInUndo(Coin&& undo, CCoinsViewCache& view, const COutPoint& out)
 {
     bool fClean = true;
 
-    CCoinsModifier coins = view.ModifyCoins(out.hash);
-    if (undo.nHeight != 0) {
-        // undo data contains height: this is the last output of the prevout tx being spent
-        if (!coins->IsPruned())
-            fClean = fClean && error("%s: undo data overwriting existing transaction", __func__);
-        coins->Clear();
-        coins->fCoinBase = undo.fCoinBase;
-        coins->fCoinStake = undo.fCoinStake;
-        coins->nHeight = undo.nHeight;
-        coins->nVersion = undo.nVersion;
-        coins->nTime = undo.nTime;
-    } else {
-        if (coins->IsPruned())
-            fClean = fClean && error("%s: undo data adding output to missing transaction", __func__);
-    }
-    if (coins->IsAvailable(out.n))
+    if (view.HaveCoin(out))
         fClean = fClean && error("%s: undo data overwriting existing output", __func__);
-    if (coins->vout.size() < out.n+1)
-        coins->vout.resize(out.n+1);
-    coins->vout[out.n] = undo.txout;
+    if (undo.nHeight == 0) {
+        // Undo data written by older versions only records the metadata with
+        // the last spent output of a transaction. Take it from another output
+        // of the same transaction, which has been restored already.
+        const Coin& alternate = AccessByTxid(view, out.hash);
+        if (alternate.IsSpent())
+            return error("%s: undo data adding output to missing transaction", __func__);
+        undo.nHeight = alternate.nHeight;
+        undo.fCoinBase = alternate.fCoinBase;
+        undo.fCoinStake = alternate.fCoinStake;
+        undo.nTime = alternate.nTime;
+    }
+    view.AddCoin(out, std::move(undo), !fClean);
 
     return fClean;
 }
 
+/** UTXO set statistics of the block written last, which is usually the parent of the next one */
+static std::pair<uint256, CUTXOStats> lastUTXOStats;
+
+static bool ReadUTXOStats(const uint256& hashBlock, CUTXOStats& stats)
+{
+    if (!lastUTXOStats.first.IsNull() && lastUTXOStats.first == hashBlock) {
+        stats = lastUTXOStats.second;
+        return true;
+    }
+    return pblocktree->ReadUTXOStats(hashBlock, stats);
+}
+
+static bool WriteUTXOStats(const uint256& hashBlock, const CUTXOStats& stats)
+{
+    // Statistics only depend on the chain up to the block, so entries of
+    // blocks that get disconnected stay valid and are not erased.
+    if (!pblocktree->WriteUTXOStats(hashBlock, stats))
+        return false;
+    lastUTXOStats = std::make_pair(hashBlock, stats);
+    return true;
+}
+
+bool ReadBlockUTXOStats(const CBlockIndex* pindex, CUTXOStats& stats)
+{
+    AssertLockHeld(cs_main);
+    return ReadUTXOStats(pindex->GetBlockHash(), stats);
+}
+
+/** Update UTXO set statistics with a block's spent coins (from its undo data) and new outputs */
+static void ConnectUTXOStats(CUTXOStats& stats, const CBlock& block, const CBlockUndo& blockundo, int nHeight)
+{
+    for (unsigned int i = 0; i < block.vtx.size(); i++) {
+        const CTransaction& tx = block.vtx[i];
+        if (i > 0) {
+            const CTxUndo& txundo = blockundo.vtxundo[i - 1];
+            for (unsigned int j = 0; j < tx.vin.size(); j++)
+                stats.RemoveCoin(tx.vin[j].prevout, txundo.vprevout[j]);
+        }
+        const uint256& hash = tx.GetHash();
+        for (unsigned int o = 0; o < tx.vout.size(); o++) {
+            if (tx.vout[o].IsUnspendable())
+                stats.nTotalBurned += tx.vout[o].nValue;
+            else
+                stats.AddCoin(COutPoint(hash, o), Coin(tx, o, nHeight));
+        }
+    }
+}
+
 bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean)
 {
     assert(pindex->GetBlockHash() == view.GetBestBlock());
@@ -2279,6 +2667,12 @@ bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockI
     if (blockUndo.vtxundo.size() + 1 != block.vtx.size())
         return error("DisconnectBlock(): block and undo data inconsistent");
 
+    // Derive the statistics of the parent when only this block has them,
+    // e.g. when it is below the height the statistics were started at.
+    CUTXOStats stats;
+    bool fStats = fUTXOStats && !pblocktree->HaveUTXOStats(pindex->pprev->GetBlockHash()) &&
+                  ReadUTXOStats(pindex->GetBlockHash(), stats);
+
     // undo transactions in reverse order
     for (int i = block.vtx.size() - 1; i >= 0; i--) {
         const CTransaction &tx = block.vtx[i];
@@ -2286,33 +2680,34 @@ bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockI
 
         // Check that all outputs are available and match the outputs in the block itself
         // exactly.
-        {
-        CCoinsModifier outs = view.ModifyCoins(hash);
-        outs->ClearUnspendable();
-
-        CCoins outsBlock(tx, pindex->nHeight);
-        // The CCoins serialization does not serialize negative numbers.
-        // No network rules currently depend on the version here, so an inconsistency is harmless
-        // but it must be corrected before txout nversion ever influences a network rule.
-        if (outsBlock.nVersion < 0)
-            outs->nVersion = outsBlock.nVersion;
-        if (*outs != outsBlock)
-            fClean = fClean && error("DisconnectBlock(): added transaction mismatch? database corrupted");
-
-        // remove outputs
-        outs->Clear();
+        for (size_t o = 0; o < tx.vout.size(); o++) {
+            if (!tx.vout[o].IsUnspendable()) {
+                COutPoint out(hash, o);
+                Coin coin;
+                bool is_spent = view.SpendCoin(out, &coin);
+                if (!is_spent || tx.vout[o] != coin.out || pindex->nHeight != (int)coin.nHeight ||
+                    tx.IsCoinBase() != coin.IsCoinBase() || tx.IsCoinStake() != coin.IsCoinStake()) {
+                    fClean = fClean && error("DisconnectBlock(): added transaction mismatch? database corrupted");
+                }
+                if (fStats)
+                    stats.RemoveCoin(out, Coin(tx, o, pindex->nHeight));
+            } else if (fStats) {
+                stats.nTotalBurned -= tx.vout[o].nValue;
+            }
         }
 
         // restore inputs
         if (i > 0) { // not coinbases
-            const CTxUndo &txundo = blockUndo.vtxundo[i-1];
+            CTxUndo &txundo = blockUndo.vtxundo[i-1];
             if (txundo.vprevout.size() != tx.vin.size())
                 return error("DisconnectBlock(): transaction and undo data inconsistent");
             for (unsigned int j = tx.vin.size(); j-- > 0;) {
                 const COutPoint &out = tx.vin[j].prevout;
-                const CTxInUndo &undo = txundo.vprevout[j];
-                if (!ApplyTxInUndo(undo, view, out))
+                if (!ApplyTxInUndo(std::move(txundo.vprevout[j]), view, out))
                     fClean = false;
+                // Take the restored coin from the view, which has its metadata even for old undo data
+                if (fStats)
+                    stats.AddCoin(out, view.AccessCoin(out));
             }
         }
     }
@@ -2320,6 +2715,9 @@ bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockI
     // move best block pointer to prevout block
     view.SetBestBlock(pindex->pprev->GetBlockHash());
 
+    if (fStats && fClean && !WriteUTXOStats(pindex->pprev->GetBlockHash(), stats))
+        return error("DisconnectBlock(): failed to write UTXO stats");
+
     if (pfClean) {
         *pfClean = fClean;
         return true;
@@ -2355,13 +2753,53 @@ void static FlushBlockFile(bool fFinalize = false)
 
 bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigned int nAddSize);
 
-static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
-
 void ThreadScriptCheck() {
     RenameThread("bitcoin-scriptch");
     scriptcheckqueue.Thread();
 }
 
+static CCheckQueue<CHeaderPoWCheck> headerpowcheckqueue(4);
+/** Serializes users of headerpowcheckqueue, which allows one control at a time */
+static boost::mutex cs_headerpowcheck;
+
+void ThreadHeaderPoWCheck() {
+    RenameThread("bitcoin-headerpow");
+    headerpowcheckqueue.Thread();
+}
+
+bool CHeaderPoWCheck::operator()() {
+    char input[80 * SCRYPT_MULTI_MAX_WAYS];
+    for (unsigned int i = 0; i < nCount; i++)
+        memcpy(&input[80 * i], BEGIN(pheaders[i].nVersion), 80);
+    scrypt_1024_1_1_256_multi(input, BEGIN(phashes[0]), nCount);
+    return true;
+}
+
+void ComputeHeadersPoWHash(const std::vector<CBlockHeader>& headers, std::vector<uint256>& vPoWHash)
+{
+    vPoWHash.resize(headers.size());
+    if (headers.empty())
+        return;
+
+    std::vector<CHeaderPoWCheck> vChecks;
+    vChecks.reserve((headers.size() + SCRYPT_MULTI_MAX_WAYS - 1) / SCRYPT_MULTI_MAX_WAYS);
+    for (size_t i = 0; i < headers.size(); i += SCRYPT_MULTI_MAX_WAYS) {
+        unsigned int nCount = std::min<size_t>(SCRYPT_MULTI_MAX_WAYS, headers.size() - i);
+        vChecks.push_back(CHeaderPoWCheck(&headers[i], &vPoWHash[i], nCount));
+    }
+
+    if (nScriptCheckThreads <= 1 || vChecks.size() == 1) {
+        BOOST_FOREACH(CHeaderPoWCheck& check, vChecks)
+            check();
+        return;
+    }
+
+    boost::unique_lock<boost::mutex> lock(cs_headerpowcheck);
+    CCheckQueueControl<CHeaderPoWCheck> control(&headerpowcheckqueue);
+    control.Add(vChecks);
+    control.Wait();
+}
+
 // Protected by cs_main
 VersionBitsCache versionbitscache;
 
@@ -2423,7 +2861,8 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     int64_t nTimeStart = GetTimeMicros();
 
     // Check it again in case a previous version let a bad block in
-    if (!CheckBlock(block, state, chainparams.GetConsensus(), !fJustCheck, !fJustCheck, !fJustCheck))
+    if (!CheckBlock(block, state, chainparams.GetConsensus(), !fJustCheck, !fJustCheck, !fJustCheck,
+                    (pindex->nStatus & BLOCK_HAVE_POW_HASH) ? &pindex->hashPoW : NULL))
         return error("%s: Consensus::CheckBlock: %s", __func__, FormatStateMessage(state));
 
     // verify that the view's current state corresponds to the previous block
@@ -2433,8 +2872,11 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     // Special case for the genesis block, skipping connection of its transactions
     // (its coinbase is unspendable)
     if (block.GetHash() == chainparams.GetConsensus().hashGenesisBlock) {
-        if (!fJustCheck)
+        if (!fJustCheck) {
             view.SetBestBlock(pindex->GetBlockHash());
+            if (fUTXOStats && !WriteUTXOStats(pindex->GetBlockHash(), CUTXOStats()))
+                return AbortNode(state, "Failed to write UTXO stats");
+        }
         return true;
     }
 
@@ -2449,20 +2891,23 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     // Check proof-of-stake
     if (block.IsProofOfStake() && chainparams.GetConsensus().IsProtocolV3(block.GetBlockTime())) {
          const COutPoint &prevout = block.vtx[1].vin[0].prevout;
-         const CCoins *coins = view.AccessCoins(prevout.hash);
-          if (!coins)
+         const Coin& coin = view.AccessCoin(prevout);
+          if (coin.IsSpent())
               return state.DoS(100, error("ConnectBlock(): kernel input unavailable"),
                                 REJECT_INVALID, "bad-cs-kernel");
 
          // Check proof-of-stake min confirmations
-         if (pindex->nHeight - coins->nHeight < chainparams.GetConsensus().nCoinbaseMaturity)
+         if (pindex->nHeight - (int)coin.nHeight < chainparams.GetConsensus().nCoinbaseMaturity)
               return state.DoS(100,
-                  error("ConnectBlock(): tried to stake at depth %d", pindex->nHeight - coins->nHeight),
+                  error("ConnectBlock(): tried to stake at depth %d", pindex->nHeight - (int)coin.nHeight),
                     REJECT_INVALID, "bad-cs-premature");
 
-         if (!CheckStakeKernelHash(pindex->pprev, block.nBits, coins, prevout, block.vtx[1].nTime))
+         if (!CheckStakeKernelHash(pindex->pprev, block.nBits, coin.nTime, coin.out.nValue, prevout, block.vtx[1].nTime))
               return state.DoS(100, error("ConnectBlock(): proof-of-stake hash doesn't match nBits"),
                                  REJECT_INVALID, "bad-cs-proofhash");
+
+         // Keep the input once spent, for blocks competing with this one
+         stakeInputCache.Add(prevout, CStakeInput(coin, pindex->GetAncestor(coin.nHeight)->GetBlockHash()));
     }
 
     bool fScriptChecks = true;
@@ -2503,10 +2948,11 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
     if (fEnforceBIP30) {
         BOOST_FOREACH(const CTransaction& tx, block.vtx) {
-            const CCoins* coins = view.AccessCoins(tx.GetHash());
-            if (coins && !coins->IsPruned())
-                return state.DoS(100, error("ConnectBlock(): tried to overwrite transaction"),
-                                 REJECT_INVALID, "bad-txns-BIP30");
+            for (size_t o = 0; o < tx.vout.size(); o++) {
+                if (view.HaveCoin(COutPoint(tx.GetHash(), o)))
+                    return state.DoS(100, error("ConnectBlock(): tried to overwrite transaction"),
+                                     REJECT_INVALID, "bad-txns-BIP30");
+            }
         }
     }
 
@@ -2550,7 +2996,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     int nInputs = 0;
     int64_t nSigOpsCount = 0;
     CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(block.vtx.size()));
-    std::vector<std::pair<uint256, CDiskTxPos> > vPos;
+    std::vector<std::pair<uint256, CTxIndexEntry> > vPos;
     vPos.reserve(block.vtx.size());
     blockundo.vtxundo.reserve(block.vtx.size() - 1);
     std::vector<PrecomputedTransactionData> txdata;
@@ -2610,8 +3056,9 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         }
         UpdateCoins(tx, view, i == 0 ? undoDummy : blockundo.vtxundo.back(), pindex->nHeight);
 
-        vPos.push_back(std::make_pair(tx.GetHash(), pos));
-        pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
+        unsigned int nTxSize = ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
+        vPos.push_back(std::make_pair(tx.GetHash(), CTxIndexEntry(pos, pindex->GetBlockHash(), nTxSize)));
+        pos.nTxOffset += nTxSize;
     }
     int64_t nTime3 = GetTimeMicros(); nTimeConnect += nTime3 - nTime2;
     LogPrint("bench", "      - Connect %u transactions: %.2fms (%.3fms/tx, %.3fms/txin) [%.2fs]\n", (unsigned)block.vtx.size(), 0.001 * (nTime3 - nTime2), 0.001 * (nTime3 - nTime2) / block.vtx.size(), nInputs <= 1 ? 0 : 0.001 * (nTime3 - nTime2) / (nInputs-1), nTimeConnect * 0.000001);
@@ -2662,9 +3109,20 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     }
 
     if (fTxIndex)
-        if (!pblocktree->WriteTxIndex(vPos))
+        if (!ptxindexdb->WriteTxIndex(vPos))
             return AbortNode(state, "Failed to write transaction index");
 
+    if (fUTXOStats) {
+        CUTXOStats stats;
+        if (ReadUTXOStats(pindex->pprev->GetBlockHash(), stats)) {
+            ConnectUTXOStats(stats, block, blockundo, pindex->nHeight);
+            if (!WriteUTXOStats(pindex->GetBlockHash(), stats))
+                return AbortNode(state, "Failed to write UTXO stats");
+        } else {
+            LogPrint("coindb", "%s: no UTXO stats for %s, not updating them\n", __func__, pindex->pprev->GetBlockHash().ToString());
+        }
+    }
+
     // add this block to the view's block chain
     view.SetBestBlock(pindex->GetBlockHash());
 
@@ -2778,16 +3236,20 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
     }
     // Flush best chain related state. This can only be done if the blocks / block index write was also done.
     if (fDoFullFlush) {
-        // Typical CCoins structures on disk are around 128 bytes in size.
+        // Typical Coin structures on disk are around 48 bytes in size.
         // Pushing a new one to the database can cause it to be written
         // twice (once in the log, and once in the tables). This is already
         // an overestimation, as most will delete an existing entry or
         // overwrite one. Still, use a conservative safety factor of 2.
-        if (!CheckDiskSpace(128 * 2 * 2 * pcoinsTip->GetCacheSize()))
+        if (!CheckDiskSpace(48 * 2 * 2 * pcoinsTip->GetCacheSize()))
             return state.Error("out of disk space");
         // Flush the chainstate (which may refer to block index entries).
+        // With the background writer running this only hands the entries
+        // over; wait for the write when asked to or before pruned files go.
         if (!pcoinsTip->Flush())
             return AbortNode(state, "Failed to write to coin database");
+        if ((mode == FLUSH_STATE_ALWAYS || fFlushForPrune) && !pcoinsdbview->Sync())
+            return AbortNode(state, "Failed to write to coin database");
         nLastFlush = nNow;
     }
     if (fDoFullFlush || ((mode == FLUSH_STATE_ALWAYS || mode == FLUSH_STATE_PERIODIC) && nNow > nLastSetChain + (int64_t)DATABASE_WRITE_INTERVAL * 1000000)) {
@@ -3322,10 +3784,10 @@ bool ResetBlockFailureFlags(CBlockIndex *pindex) {
     return true;
 }
 
-static CBlockIndex* AddToBlockIndex(const CBlockHeader& block)
+static CBlockIndex* AddToBlockIndex(const CBlockHeader& block, const uint256* pPoWHash=NULL)
 {
     // Check for duplicate
-    uint256 hash = block.GetHash();
+    uint256 hash = (pPoWHash && block.nVersion <= 6) ? *pPoWHash : block.GetHash();
     BlockMap::iterator it = mapBlockIndex.find(hash);
     if (it != mapBlockIndex.end())
         return it->second;
@@ -3339,6 +3801,8 @@ static CBlockIndex* AddToBlockIndex(const CBlockHeader& block)
     pindexNew->nSequenceId = 0;
     BlockMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
+    if (pPoWHash)
+        pindexNew->SetBlockPoWHash(*pPoWHash);
     BlockMap::iterator miPrev = mapBlockIndex.find(block.hashPrevBlock);
     if (miPrev != mapBlockIndex.end())
     {
@@ -3346,6 +3810,7 @@ static CBlockIndex* AddToBlockIndex(const CBlockHeader& block)
         pindexNew->nHeight = pindexNew->pprev->nHeight + 1;
         pindexNew->BuildSkip();
     }
+    pindexNew->BuildLastBlockIndex();
     pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + GetBlockProof(*pindexNew);
     pindexNew->RaiseValidity(BLOCK_VALID_TREE);
     if (pindexBestHeader == NULL || pindexBestHeader->nChainWork < pindexNew->nChainWork)
@@ -3380,6 +3845,8 @@ bool ReceivedBlockTransactions(const CBlock &block, CValidationState& state, CBl
             CBlockIndex *pindex = queue.front();
             queue.pop_front();
             pindex->nChainTx = (pindex->pprev ? pindex->pprev->nChainTx : 0) + pindex->nTx;
+            // All predecessors now have their data, so their types are final.
+            pindex->BuildLastBlockIndex();
             {
                 LOCK(cs_nBlockSequenceId);
                 pindex->nSequenceId = nBlockSequenceId++;
@@ -3492,18 +3959,18 @@ bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigne
     return true;
 }
 
-static bool CheckBlockSignature(const CBlock& block)
+bool CheckBlockSignature(const CBlockHeader& header, const std::vector<unsigned char>& vchBlockSig, const CTransaction* ptxCoinStake)
 {
-    if (block.IsProofOfWork())
-        return block.vchBlockSig.empty();
+    if (!ptxCoinStake)
+        return vchBlockSig.empty();
 
-    if (block.vchBlockSig.empty())
+    if (vchBlockSig.empty())
         return false;
 
     vector<vector<unsigned char> > vSolutions;
     txnouttype whichType;
 
-    const CTxOut& txout = block.vtx[1].vout[1];
+    const CTxOut& txout = ptxCoinStake->vout[1];
 
     if (!Solver(txout.scriptPubKey, whichType, vSolutions))
         return false;
@@ -3511,7 +3978,7 @@ static bool CheckBlockSignature(const CBlock& block)
     if (whichType == TX_PUBKEY)
     {
         vector<unsigned char>& vchPubKey = vSolutions[0];
-        return CPubKey(vchPubKey).Verify(block.GetHash(), block.vchBlockSig);
+        return CPubKey(vchPubKey).Verify(header.GetHash(), vchBlockSig);
     }
     else
     {
@@ -3523,7 +3990,7 @@ static bool CheckBlockSignature(const CBlock& block)
         opcodetype opcode;
         vector<unsigned char> vchPushValue;
 
-        uint256 hash = block.GetHash();
+        uint256 hash = header.GetHash();
 
         if (!script.GetOp(pc, opcode, vchPushValue))
             return false;
@@ -3533,26 +4000,31 @@ static bool CheckBlockSignature(const CBlock& block)
             return false;
         if (!IsCompressedOrUncompressedPubKey(vchPushValue))
             return false;
-        return CPubKey(vchPushValue).Verify(hash, block.vchBlockSig);
+        return CPubKey(vchPushValue).Verify(hash, vchBlockSig);
     }
 
     return false;
 }
 
-bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, const Consensus::Params& consensusParams, bool fCheckPOW)
+static bool CheckBlockSignature(const CBlock& block)
+{
+    return CheckBlockSignature(block, block.vchBlockSig, block.IsProofOfStake() ? &block.vtx[1] : NULL);
+}
+
+bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, const Consensus::Params& consensusParams, bool fCheckPOW, const uint256* pPoWHash)
 {
     // Check block version
     if (block.nVersion < 7 && consensusParams.IsProtocolV2(block.GetBlockTime()))
         return state.DoS(100, false, REJECT_OBSOLETE, "bad-version", false, strprintf("rejected nVersion=%d block", block.nVersion));
 
-    // Check proof of work hash
-    if (fCheckPOW && !CheckProofOfWork(block.GetPoWHash(), block.nBits, consensusParams))
+    // Check proof of work hash, reusing the one hashed ahead of time if given
+    if (fCheckPOW && !CheckProofOfWork(pPoWHash ? *pPoWHash : block.GetPoWHash(), block.nBits, consensusParams))
         return state.DoS(50, false, REJECT_INVALID, "high-hash", false, "proof of work failed");
 
     return true;
 }
 
-bool CheckBlock(const CBlock& block, CValidationState& state, const Consensus::Params& consensusParams, bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig)
+bool CheckBlock(const CBlock& block, CValidationState& state, const Consensus::Params& consensusParams, bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig, const uint256* pPoWHash)
 {
     // These are checks that are independent of context.
 
@@ -3561,7 +4033,7 @@ bool CheckBlock(const CBlock& block, CValidationState& state, const Consensus::P
 
     // Check that the header is valid (particularly PoW).  This is mostly
     // redundant with the call in AcceptBlockHeader.
-    if (!CheckBlockHeader(block, state, consensusParams, fCheckPOW && block.IsProofOfWork()))
+    if (!CheckBlockHeader(block, state, consensusParams, fCheckPOW && block.IsProofOfWork(), pPoWHash))
         return false;
 
     // Check the merkle root.
@@ -3661,8 +4133,8 @@ static bool CheckIndexAgainstCheckpoint(const CBlockIndex* pindexPrev, CValidati
 
 bool ContextualCheckBlockHeader(const CBlockHeader& block, CValidationState& state, const Consensus::Params& consensusParams, CBlockIndex * const pindexPrev)
 {
-    uint256 hash = block.GetHash();
-    if (hash == consensusParams.hashGenesisBlock)
+    // Only the genesis block has no previous block; avoid hashing legacy headers again
+    if (pindexPrev == NULL && block.GetHash() == consensusParams.hashGenesisBlock)
            return true;
 
     assert(pindexPrev);
@@ -3742,13 +4214,6 @@ bool CheckStake(CBlock* pblock, CWallet& wallet, const CChainParams& chainparams
         return error("CheckStake() : %s is not a proof-of-stake block", hashBlock.GetHex());
 
     CValidationState state;
-    // verify hash target and signature of coinstake tx
-    if (!CheckProofOfStake(mapBlockIndex[pblock->hashPrevBlock], pblock->vtx[1], pblock->nBits, state))
-        return error("CheckStake() : proof-of-stake checking failed");
-
-    //// debug print
-    LogPrintf("%s\n", pblock->ToString());
-    LogPrintf("out %s\n", FormatMoney(pblock->vtx[1].GetValueOut()));
 
     // Found a solution
     {
@@ -3756,6 +4221,17 @@ bool CheckStake(CBlock* pblock, CWallet& wallet, const CChainParams& chainparams
         if (pblock->hashPrevBlock != chainActive.Tip()->GetBlockHash())
             return error("CheckStake() : generated block is stale");
 
+        // verify hash target and signature of coinstake tx
+        CStakeInput input;
+        if (!GetStakeInput(chainActive.Tip(), pblock->vtx[1].vin[0].prevout, *pcoinsTip, input))
+            return error("CheckStake() : kernel input unavailable");
+        if (!CheckProofOfStake(chainActive.Tip(), pblock->vtx[1], pblock->nBits, input, state))
+            return error("CheckStake() : proof-of-stake checking failed");
+
+        //// debug print
+        LogPrintf("%s\n", pblock->ToString());
+        LogPrintf("out %s\n", FormatMoney(pblock->vtx[1].GetValueOut()));
+
         // Track how many getdata requests this block gets
         {
             LOCK(wallet.cs_wallet);
@@ -3771,7 +4247,7 @@ bool CheckStake(CBlock* pblock, CWallet& wallet, const CChainParams& chainparams
 }
 
 // novacoin: attempt to generate suitable proof-of-stake
-bool SignBlock(CBlock& block, CWallet& wallet, int64_t& nFees)
+bool SignBlock(CBlock& block, CWallet& wallet, int64_t nFees, const COutPoint& prevoutKernel, uint32_t nTimeKernel)
 {
     // if we are trying to sign
     // something except proof-of-stake block template
@@ -3787,52 +4263,46 @@ bool SignBlock(CBlock& block, CWallet& wallet, int64_t& nFees)
         return true;
     }
 
-    static int64_t nLastCoinStakeSearchTime = GetAdjustedTime(); // startup timestamp
-
     CKey key;
     CMutableTransaction txCoinBase(block.vtx[0]);
     CMutableTransaction txCoinStake;
-    txCoinStake.nTime = GetAdjustedTime();
-    txCoinStake.nTime &= ~Params().GetConsensus().nStakeTimestampMask;
+    txCoinStake.nTime = nTimeKernel;
 
-    int64_t nSearchTime = txCoinStake.nTime; // search to current time
+    if (!wallet.CreateCoinStake(wallet, prevoutKernel, nTimeKernel, nFees, txCoinStake, key))
+        return false;
 
-    if (nSearchTime > nLastCoinStakeSearchTime)
-    {
-        if (wallet.CreateCoinStake(wallet, block.nBits, 1, nFees, txCoinStake, key))
-        {
-            if (txCoinStake.nTime >= pindexBestHeader->GetPastTimeLimit()+1)
-            {
-                // make sure coinstake would meet timestamp protocol
-                // as it would be the same as the block timestamp
-                txCoinBase.nTime = block.nTime = txCoinStake.nTime;
-                block.vtx[0] = txCoinBase;
+    // make sure coinstake would meet timestamp protocol
+    // as it would be the same as the block timestamp
+    if (txCoinStake.nTime < pindexBestHeader->GetPastTimeLimit()+1)
+        return false;
 
-                // we have to make sure that we have no future timestamps in
-                // our transactions set
-                for (vector<CTransaction>::iterator it = block.vtx.begin(); it != block.vtx.end();)
-                    if (it->nTime > block.nTime) { it = block.vtx.erase(it); } else { ++it; }
+    txCoinBase.nTime = block.nTime = txCoinStake.nTime;
+    block.vtx[0] = txCoinBase;
 
-                block.vtx.insert(block.vtx.begin() + 1, txCoinStake);
+    // we have to make sure that we have no future timestamps in
+    // our transactions set
+    for (vector<CTransaction>::iterator it = block.vtx.begin(); it != block.vtx.end();)
+        if (it->nTime > block.nTime) { it = block.vtx.erase(it); } else { ++it; }
 
-                block.hashMerkleRoot = BlockMerkleRoot(block);
+    block.vtx.insert(block.vtx.begin() + 1, txCoinStake);
 
-                // append a signature to our block
-                return key.Sign(block.GetHash(), block.vchBlockSig);
-            }
-        }
-        nLastCoinStakeSearchInterval = nSearchTime - nLastCoinStakeSearchTime;
-        nLastCoinStakeSearchTime = nSearchTime;
-    }
+    block.hashMerkleRoot = BlockMerkleRoot(block);
 
-    return false;
+    // append a signature to our block
+    return key.Sign(block.GetHash(), block.vchBlockSig);
 }
 
-static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex=NULL, bool fProofOfStake=true)
+static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex=NULL, bool fProofOfStake=true, const uint256* pPoWHash=NULL)
 {
     AssertLockHeld(cs_main);
+    // Legacy headers are identified by their scrypt hash, which the PoW check reuses
+    uint256 hashPoWLocal;
+    if (!pPoWHash && block.nVersion <= 6) {
+        hashPoWLocal = block.GetPoWHash();
+        pPoWHash = &hashPoWLocal;
+    }
     // Check for duplicate
-    uint256 hash = block.GetHash();
+    uint256 hash = (pPoWHash && block.nVersion <= 6) ? *pPoWHash : block.GetHash();
     BlockMap::iterator miSelf = mapBlockIndex.find(hash);
     CBlockIndex *pindex = NULL;
     if (hash != chainparams.GetConsensus().hashGenesisBlock) {
@@ -3840,6 +4310,10 @@ static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state
         if (miSelf != mapBlockIndex.end()) {
             // Block header is already known.
             pindex = miSelf->second;
+            if (pPoWHash && !(pindex->nStatus & BLOCK_HAVE_POW_HASH)) {
+                pindex->SetBlockPoWHash(*pPoWHash);
+                setDirtyBlockIndex.insert(pindex);
+            }
             if (ppindex)
                 *ppindex = pindex;
             if (pindex->nStatus & BLOCK_FAILED_MASK)
@@ -3847,7 +4321,11 @@ static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state
             return true;
         }
 
-        if (!CheckBlockHeader(block, state, chainparams.GetConsensus(), !fProofOfStake))
+        if (!pPoWHash && !fProofOfStake) {
+            hashPoWLocal = block.GetPoWHash();
+            pPoWHash = &hashPoWLocal;
+        }
+        if (!CheckBlockHeader(block, state, chainparams.GetConsensus(), !fProofOfStake, pPoWHash))
             return error("%s: Consensus::CheckBlockHeader: %s, %s", __func__, hash.ToString(), FormatStateMessage(state));
 
         // Get prev block index
@@ -3867,7 +4345,7 @@ static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state
             return error("%s: Consensus::ContextualCheckBlockHeader: %s, %s", __func__, hash.ToString(), FormatStateMessage(state));
     }
     if (pindex == NULL)
-        pindex = AddToBlockIndex(block);
+        pindex = AddToBlockIndex(block, pPoWHash);
 
     if (pindex->nHeight > chainparams.GetConsensus().nLastPOWBlock)
         pindex->SetProofOfStake();
@@ -3879,7 +4357,7 @@ static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state
 }
 
 /** Store block on disk. If dbp is non-NULL, the file is known to already reside on disk */
-static bool AcceptBlock(const CBlock& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex, bool fRequested, const CDiskBlockPos* dbp, bool* fNewBlock)
+static bool AcceptBlock(const CBlock& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex, bool fRequested, const CDiskBlockPos* dbp, bool* fNewBlock, const uint256* pPoWHash=NULL)
 {
     if (fNewBlock) *fNewBlock = false;
     AssertLockHeld(cs_main);
@@ -3887,7 +4365,7 @@ static bool AcceptBlock(const CBlock& block, CValidationState& state, const CCha
     CBlockIndex *pindexDummy = NULL;
     CBlockIndex *&pindex = ppindex ? *ppindex : pindexDummy;
 
-    if (!AcceptBlockHeader(block, state, chainparams, &pindex, block.IsProofOfStake()))
+    if (!AcceptBlockHeader(block, state, chainparams, &pindex, block.IsProofOfStake(), pPoWHash))
         return false;
 
     // Try to process all requested blocks that we don't have, but only
@@ -3912,7 +4390,21 @@ static bool AcceptBlock(const CBlock& block, CValidationState& state, const CCha
     }
     if (fNewBlock) *fNewBlock = true;
 
-    if ((!CheckBlock(block, state, chainparams.GetConsensus())) || !ContextualCheckBlock(block, state, pindex->pprev)) {
+    if ((!CheckBlock(block, state, chainparams.GetConsensus(), true, true, true, (pindex->nStatus & BLOCK_HAVE_POW_HASH) ? &pindex->hashPoW : NULL)) ||
+        !ContextualCheckBlock(block, state, pindex->pprev)) {
+        if (state.IsInvalid() && !state.CorruptionPossible()) {
+            pindex->nStatus |= BLOCK_FAILED_VALID;
+            setDirtyBlockIndex.insert(pindex);
+        }
+        return error("%s: %s", __func__, FormatStateMessage(state));
+    }
+
+    // Check the coinstake before storing the block, when its kernel input is
+    // known without reading blocks; ConnectBlock checks it in any case
+    CStakeInput stakeInput;
+    if (block.IsProofOfStake() && chainparams.GetConsensus().IsProtocolV3(block.GetBlockTime()) &&
+        GetStakeInput(pindex->pprev, block.vtx[1].vin[0].prevout, *pcoinsTip, stakeInput) &&
+        !CheckProofOfStake(pindex->pprev, block.vtx[1], block.nBits, stakeInput, state)) {
         if (state.IsInvalid() && !state.CorruptionPossible()) {
             pindex->nStatus |= BLOCK_FAILED_VALID;
             setDirtyBlockIndex.insert(pindex);
@@ -4089,6 +4581,8 @@ void UnlinkPrunedFiles(std::set<int>& setFilesToPrune)
 {
     for (set<int>::iterator it = setFilesToPrune.begin(); it != setFilesToPrune.end(); ++it) {
         CDiskBlockPos pos(*it, 0);
+        // Unmap the file so its space is freed
+        blockFileCache.Invalidate(*it);
         boost::filesystem::remove(GetBlockPosFilename(pos, "blk"));
         boost::filesystem::remove(GetBlockPosFilename(pos, "rev"));
         LogPrintf("Prune: %s deleted blk/rev (%05u)\n", __func__, *it);
@@ -4210,13 +4704,276 @@ CBlockIndex * InsertBlockIndex(uint256 hash)
     return pindexNew;
 }
 
-bool static LoadBlockIndexDB()
+/**
+ * Recompute the scrypt hash of every proof-of-work block in the index in
+ * parallel, check it against nBits and the stored copy, and store it for
+ * entries written before the hash was kept in the index.
+ */
+static bool VerifyBlockIndexPoW(const Consensus::Params& consensusParams)
 {
-    const CChainParams& chainparams = Params();
-    if (!pblocktree->LoadBlockIndexGuts(InsertBlockIndex))
-        return false;
-
-    boost::this_thread::interruption_point();
+    int64_t nStart = GetTimeMillis();
+    std::vector<CBlockIndex*> vIndex;
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+    {
+        CBlockIndex* pindex = item.second;
+        if (pindex->pprev && (pindex->nStatus & BLOCK_HAVE_DATA) && pindex->IsProofOfWork())
+            vIndex.push_back(pindex);
+    }
+
+    static const size_t nBatchSize = 16384;
+    std::vector<CBlockHeader> headers;
+    std::vector<uint256> vPoWHash;
+    for (size_t i = 0; i < vIndex.size(); i += nBatchSize) {
+        boost::this_thread::interruption_point();
+        size_t nEnd = std::min(vIndex.size(), i + nBatchSize);
+        headers.clear();
+        for (size_t j = i; j < nEnd; j++)
+            headers.push_back(vIndex[j]->GetBlockHeader());
+        ComputeHeadersPoWHash(headers, vPoWHash);
+        for (size_t j = i; j < nEnd; j++) {
+            CBlockIndex* pindex = vIndex[j];
+            const uint256& hashPoW = vPoWHash[j - i];
+            if ((pindex->nStatus & BLOCK_HAVE_POW_HASH) && pindex->hashPoW != hashPoW)
+                return error("%s: stored PoW hash mismatch: %s", __func__, pindex->ToString());
+            if (pindex->nVersion <= 6 && pindex->GetBlockHash() != hashPoW)
+                return error("%s: block hash mismatch: %s", __func__, pindex->ToString());
+            if (!CheckProofOfWork(hashPoW, pindex->nBits, consensusParams))
+                return error("%s: CheckProofOfWork failed: %s", __func__, pindex->ToString());
+            if (!(pindex->nStatus & BLOCK_HAVE_POW_HASH)) {
+                pindex->SetBlockPoWHash(hashPoW);
+                setDirtyBlockIndex.insert(pindex);
+            }
+        }
+    }
+
+    LogPrintf("%s: verified proof-of-work of %u block index entries in %dms\n", __func__, vIndex.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+/** Apply the effects of a block on the utxo cache, ignoring that it may already have been applied. */
+static bool RollforwardBlock(const CBlockIndex* pindex, CCoinsViewCache& inputs, const CChainParams& params)
+{
+    // TODO: merge with ConnectBlock
+    CBlock block;
+    if (!ReadBlockFromDisk(block, pindex, params.GetConsensus()))
+        return error("%s: failed to read block %s from disk", __func__, pindex->GetBlockHash().ToString());
+
+    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+        if (!tx.IsCoinBase()) {
+            BOOST_FOREACH(const CTxIn &txin, tx.vin) {
+                inputs.SpendCoin(txin.prevout);
+            }
+        }
+        // Pass check = true as every addition may be an overwrite.
+        AddCoins(inputs, tx, pindex->nHeight, true);
+    }
+    return true;
+}
+
+bool ReplayBlocks(const CChainParams& params, CCoinsView* view)
+{
+    LOCK(cs_main);
+
+    CCoinsViewCache cache(view);
+
+    std::vector<uint256> hashHeads = view->GetHeadBlocks();
+    if (hashHeads.empty())
+        return true; // We're already in a consistent state.
+    if (hashHeads.size() != 2)
+        return error("%s: unknown inconsistent state", __func__);
+
+    uiInterface.ShowProgress(_("Replaying blocks..."), 0);
+    LogPrintf("Replaying blocks\n");
+
+    CBlockIndex* pindexOld = NULL;  // Old tip during the interrupted flush.
+    CBlockIndex* pindexNew;         // New tip during the interrupted flush.
+    CBlockIndex* pindexFork = NULL; // Latest block common to both the old and the new tip.
+
+    if (mapBlockIndex.count(hashHeads[0]) == 0)
+        return error("%s: reorganization to unknown block requested", __func__);
+    pindexNew = mapBlockIndex[hashHeads[0]];
+
+    if (!hashHeads[1].IsNull()) { // The old tip is allowed to be 0, indicating it's the first flush.
+        if (mapBlockIndex.count(hashHeads[1]) == 0)
+            return error("%s: reorganization from unknown block requested", __func__);
+        pindexOld = mapBlockIndex[hashHeads[1]];
+        pindexFork = LastCommonAncestor(pindexOld, pindexNew);
+        assert(pindexFork != NULL);
+    }
+
+    // Rollback along the old branch.
+    while (pindexOld != pindexFork) {
+        if (pindexOld->nHeight > 0) { // Never disconnect the genesis block.
+            CBlock block;
+            if (!ReadBlockFromDisk(block, pindexOld, params.GetConsensus()))
+                return error("%s: failed to read block %s from disk", __func__, pindexOld->GetBlockHash().ToString());
+            LogPrintf("Rolling back %s (%i)\n", pindexOld->GetBlockHash().ToString(), pindexOld->nHeight);
+            CValidationState state;
+            bool fClean = true;
+            cache.SetBestBlock(pindexOld->GetBlockHash());
+            if (!DisconnectBlock(block, state, pindexOld, cache, &fClean))
+                return error("%s: failed to disconnect block %s", __func__, pindexOld->GetBlockHash().ToString());
+            // An unclean disconnect means a non-existing coin was deleted or an
+            // existing one overwritten, i.e. the block never had all of its
+            // changes written. As both operations are idempotent, the result
+            // still has the effects of the block undone.
+        }
+        pindexOld = pindexOld->pprev;
+    }
+
+    // Roll forward from the forking point to the new tip.
+    int nForkHeight = pindexFork ? pindexFork->nHeight : 0;
+    for (int nHeight = nForkHeight + 1; nHeight <= pindexNew->nHeight; ++nHeight) {
+        const CBlockIndex* pindex = pindexNew->GetAncestor(nHeight);
+        LogPrintf("Rolling forward %s (%i)\n", pindex->GetBlockHash().ToString(), nHeight);
+        if (!RollforwardBlock(pindex, cache, params))
+            return false;
+    }
+
+    cache.SetBestBlock(pindexNew->GetBlockHash());
+    cache.Flush();
+    uiInterface.ShowProgress("", 100);
+    return true;
+}
+
+bool InitUTXOStats(const CChainParams& chainparams)
+{
+    LOCK(cs_main);
+    CBlockIndex* pindexTip = chainActive.Tip();
+    if (!fUTXOStats || pindexTip == NULL || pblocktree->HaveUTXOStats(pindexTip->GetBlockHash()))
+        return true;
+
+    // Walk the UTXO set once; afterwards every connected block updates the
+    // statistics of its parent.
+    LogPrintf("Computing UTXO set statistics at height %d...\n", pindexTip->nHeight);
+    uiInterface.ShowProgress(_("Computing UTXO set statistics..."), 0);
+    FlushStateToDisk();
+    CUTXOStats stats;
+    boost::scoped_ptr<CCoinsViewCursor> pcursor(pcoinsdbview->Cursor());
+    assert(pcursor->GetBestBlock() == pindexTip->GetBlockHash());
+    uint64_t nCount = 0;
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        if (ShutdownRequested())
+            return false;
+        COutPoint key;
+        Coin coin;
+        if (!pcursor->GetKey(key) || !pcursor->GetValue(coin))
+            return error("%s: unable to read UTXO set", __func__);
+        stats.AddCoin(key, coin);
+        if (++nCount % 100000 == 0) {
+            // Keys are txids, so the first byte gives the progress
+            uiInterface.ShowProgress(_("Computing UTXO set statistics..."), *key.hash.begin() * 50 / 256);
+        }
+        pcursor->Next();
+    }
+
+    // Burnt outputs never enter the set, so add them up from the blocks
+    for (CBlockIndex* pindex = chainActive[1]; pindex != NULL; pindex = chainActive.Next(pindex)) {
+        boost::this_thread::interruption_point();
+        if (ShutdownRequested())
+            return false;
+        CBlock block;
+        if (!(pindex->nStatus & BLOCK_HAVE_DATA) || !ReadBlockFromDisk(block, pindex, chainparams.GetConsensus())) {
+            LogPrintf("%s: block %s is not available, total_burned will leave out pruned blocks\n", __func__, pindex->GetBlockHash().ToString());
+            continue;
+        }
+        BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+            BOOST_FOREACH(const CTxOut& txout, tx.vout) {
+                if (txout.IsUnspendable())
+                    stats.nTotalBurned += txout.nValue;
+            }
+        }
+        if (pindex->nHeight % 1000 == 0)
+            uiInterface.ShowProgress(_("Computing UTXO set statistics..."), 50 + pindex->nHeight * 50 / std::max(pindexTip->nHeight, 1));
+    }
+
+    if (!WriteUTXOStats(pindexTip->GetBlockHash(), stats))
+        return error("%s: failed to write UTXO stats", __func__);
+    uiInterface.ShowProgress("", 100);
+    LogPrintf("%s: %u outputs, total amount %s\n", __func__, stats.nTransactionOutputs, FormatMoney(stats.nTotalAmount));
+    return true;
+}
+
+void ThreadBuildTxIndex()
+{
+    RenameThread("bitcoin-txindex");
+    const CChainParams& chainparams = Params();
+    uint256 hashBuilt;
+    if (!ptxindexdb->ReadBuildPosition(hashBuilt))
+        return;
+    LogPrintf("%s: building the transaction index from %s\n", __func__, hashBuilt.IsNull() ? "the genesis block" : hashBuilt.ToString());
+
+    int64_t nLastLog = GetTime();
+    while (true) {
+        boost::this_thread::interruption_point();
+        if (ShutdownRequested())
+            return;
+
+        // Newly connected blocks are indexed by ConnectBlock; continue after
+        // the last block built, or where its chain forked off the active one
+        CBlockIndex* pindex;
+        {
+            LOCK(cs_main);
+            if (hashBuilt.IsNull()) {
+                pindex = chainActive.Genesis();
+            } else {
+                BlockMap::iterator mi = mapBlockIndex.find(hashBuilt);
+                pindex = mi == mapBlockIndex.end() ? NULL : chainActive.Next(chainActive.FindFork(mi->second));
+            }
+            if (pindex == NULL) {
+                if (!ptxindexdb->FinishBuild()) {
+                    AbortNode("Failed to write transaction index");
+                    return;
+                }
+                LogPrintf("%s: transaction index built\n", __func__);
+                return;
+            }
+        }
+
+        CBlock block;
+        if (!ReadBlockFromDisk(block, pindex, chainparams.GetConsensus())) {
+            AbortNode(strprintf("%s: failed to read block %s", __func__, pindex->GetBlockHash().ToString()));
+            return;
+        }
+        std::vector<std::pair<uint256, CTxIndexEntry> > vPos;
+        vPos.reserve(block.vtx.size());
+        CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(block.vtx.size()));
+        BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+            unsigned int nTxSize = ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
+            vPos.push_back(std::make_pair(tx.GetHash(), CTxIndexEntry(pos, pindex->GetBlockHash(), nTxSize)));
+            pos.nTxOffset += nTxSize;
+        }
+
+        {
+            // Write only while the block is still active, so records of
+            // another block with the same transactions are not overwritten
+            LOCK(cs_main);
+            if (!chainActive.Contains(pindex))
+                continue;
+            if (!ptxindexdb->WriteBuildBlock(vPos, pindex->GetBlockHash())) {
+                AbortNode("Failed to write transaction index");
+                return;
+            }
+            hashBuilt = pindex->GetBlockHash();
+            if (GetTime() - nLastLog >= 30) {
+                LogPrintf("%s: transaction index built up to height %d of %d\n", __func__, pindex->nHeight, chainActive.Height());
+                nLastLog = GetTime();
+            }
+        }
+    }
+}
+
+bool static LoadBlockIndexDB()
+{
+    const CChainParams& chainparams = Params();
+    if (!pblocktree->LoadBlockIndexGuts(InsertBlockIndex))
+        return false;
+
+    boost::this_thread::interruption_point();
+
+    if (GetBoolArg("-verifypowindex", DEFAULT_VERIFY_POW_INDEX) && !VerifyBlockIndexPoW(chainparams.GetConsensus()))
+        return false;
 
     // Calculate nChainWork
     vector<pair<int, CBlockIndex*> > vSortedByHeight;
@@ -4251,6 +5008,7 @@ bool static LoadBlockIndexDB()
             pindexBestInvalid = pindex;
         if (pindex->pprev)
             pindex->BuildSkip();
+        pindex->BuildLastBlockIndex();
         if (pindex->IsValid(BLOCK_VALID_TREE) && (pindexBestHeader == NULL || CBlockIndexWorkComparator()(pindexBestHeader, pindex)))
             pindexBestHeader = pindex;
     }
@@ -4304,6 +5062,10 @@ bool static LoadBlockIndexDB()
     pblocktree->ReadFlag("txindex", fTxIndex);
     LogPrintf("%s: transaction index %s\n", __func__, fTxIndex ? "enabled" : "disabled");
 
+    // Finish a chainstate write that was interrupted, before the tip is taken from it
+    if (!ReplayBlocks(chainparams, pcoinsdbview))
+        return false;
+
     // Load pointer to end of best chain
     BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
     if (it == mapBlockIndex.end())
@@ -4559,20 +5321,138 @@ bool InitBlockIndex(const CChainParams& chainparams)
     return true;
 }
 
-bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskBlockPos *dbp)
+/** A block read from a file being imported, and its hashes once checked */
+struct CImportBlock
 {
-    // Map of disk positions for blocks with unknown parent (only used for reindex)
-    static std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
-    int64_t nStart = GetTimeMillis();
+    CBlock block;
+    //! Position of the block in the file
+    unsigned int nPos;
+    uint256 hash;
+    //! Scrypt hash of proof-of-work and legacy blocks, valid if fHavePoWHash
+    uint256 hashPoW;
+    bool fHavePoWHash;
+
+    CImportBlock() : nPos(0), fHavePoWHash(false) {}
+};
 
-    int nLoaded = 0;
+/**
+ * Closure computing the hashes of a block being imported and running its
+ * context-free checks. CheckBlock marks the block checked when it passes,
+ * so AcceptBlock does not repeat them; a failure is found again, and
+ * handled, by AcceptBlock.
+ */
+class CBlockImportCheck
+{
+private:
+    CImportBlock *pimport;
+    const Consensus::Params *pparams;
+
+public:
+    CBlockImportCheck() : pimport(NULL), pparams(NULL) {}
+    CBlockImportCheck(CImportBlock* pimportIn, const Consensus::Params* pparamsIn) : pimport(pimportIn), pparams(pparamsIn) {}
+
+    bool operator()() {
+        const CBlock& block = pimport->block;
+        // Legacy blocks are identified by their scrypt hash
+        if (block.nVersion <= 6 || block.IsProofOfWork()) {
+            pimport->hashPoW = block.GetPoWHash();
+            pimport->fHavePoWHash = true;
+        }
+        pimport->hash = block.nVersion <= 6 ? pimport->hashPoW : block.GetHash();
+        CValidationState state;
+        CheckBlock(block, state, *pparams, true, true, true, pimport->fHavePoWHash ? &pimport->hashPoW : NULL);
+        return true;
+    }
+
+    void swap(CBlockImportCheck &check) {
+        std::swap(pimport, check.pimport);
+        std::swap(pparams, check.pparams);
+    }
+};
+
+static CCheckQueue<CBlockImportCheck> blockimportcheckqueue(4);
+
+void ThreadBlockImportCheck() {
+    RenameThread("bitcoin-blkcheck");
+    blockimportcheckqueue.Thread();
+}
+
+/**
+ * Reads the blocks of a block file on its own thread, ahead of the checks
+ * and of AcceptBlock, in batches of at most IMPORT_BATCH_SIZE bytes. At most
+ * IMPORT_BATCHES_AHEAD batches wait to be taken.
+ */
+class CBlockFileReader
+{
+private:
+    static const unsigned int IMPORT_BATCH_SIZE = 8 * 1000 * 1000;
+    static const unsigned int IMPORT_BATCHES_AHEAD = 2;
+
+    const CChainParams& chainparams;
+    CBufferedFile blkdat;
+    boost::thread thread;
+
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    std::deque<std::vector<CImportBlock> > queueBatches;
+    bool fDone;
+    std::atomic<bool> fStop;
+    std::string strError;
+
+    void Read();
+
+public:
+    //! Microseconds spent reading, and blocks and bytes read
+    int64_t nReadTime;
+    unsigned int nBlocks;
+    uint64_t nBytes;
+
+    //! Takes over fileIn, like CBufferedFile
+    CBlockFileReader(const CChainParams& chainparamsIn, FILE* fileIn);
+    ~CBlockFileReader();
+
+    //! Wait for the next batch. Returns false once the file is read.
+    bool Next(std::vector<CImportBlock>& vBatch);
+    //! Stop reading and wait for the thread to exit
+    void Stop();
+    //! Error that stopped the reader, if any
+    std::string GetError();
+};
+
+CBlockFileReader::CBlockFileReader(const CChainParams& chainparamsIn, FILE* fileIn) :
+    chainparams(chainparamsIn), blkdat(fileIn, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION),
+    fDone(false), fStop(false), nReadTime(0), nBlocks(0), nBytes(0)
+{
+    thread = boost::thread(boost::bind(&CBlockFileReader::Read, this));
+}
+
+CBlockFileReader::~CBlockFileReader()
+{
+    Stop();
+}
+
+void CBlockFileReader::Stop()
+{
+    // Also called while unwinding from an interruption
+    boost::this_thread::disable_interruption di;
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fStop = true;
+    }
+    cond.notify_all();
+    if (thread.joinable())
+        thread.join();
+}
+
+void CBlockFileReader::Read()
+{
+    RenameThread("bitcoin-blkread");
+    std::vector<CImportBlock> vBatch;
+    unsigned int nBatchSize = 0;
+    int64_t nStart = GetTimeMicros();
     try {
-        // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
-        CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION);
         uint64_t nRewind = blkdat.GetPos();
-        while (!blkdat.eof()) {
-            boost::this_thread::interruption_point();
-
+        while (!blkdat.eof() && !fStop) {
             blkdat.SetPos(nRewind);
             nRewind++; // start one byte further next time, in case of failure
             blkdat.SetLimit(); // remove former limit
@@ -4596,16 +5476,107 @@ bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskB
             try {
                 // read block
                 uint64_t nBlockPos = blkdat.GetPos();
-                if (dbp)
-                    dbp->nPos = nBlockPos;
                 blkdat.SetLimit(nBlockPos + nSize);
                 blkdat.SetPos(nBlockPos);
-                CBlock block;
-                blkdat >> block;
+                vBatch.push_back(CImportBlock());
+                vBatch.back().nPos = nBlockPos;
+                blkdat >> vBatch.back().block;
                 nRewind = blkdat.GetPos();
+                nBatchSize += nSize;
+                nBlocks++;
+                nBytes += nSize;
+            } catch (const std::exception& e) {
+                vBatch.pop_back();
+                LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
+            }
+
+            if (nBatchSize >= IMPORT_BATCH_SIZE) {
+                nReadTime += GetTimeMicros() - nStart;
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (queueBatches.size() >= IMPORT_BATCHES_AHEAD && !fStop)
+                    cond.wait(lock);
+                if (fStop)
+                    return;
+                queueBatches.push_back(std::vector<CImportBlock>());
+                queueBatches.back().swap(vBatch);
+                nBatchSize = 0;
+                cond.notify_all();
+                nStart = GetTimeMicros();
+            }
+        }
+    } catch (const std::runtime_error& e) {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        strError = e.what();
+    }
+    nReadTime += GetTimeMicros() - nStart;
+
+    boost::unique_lock<boost::mutex> lock(mutex);
+    if (!vBatch.empty()) {
+        queueBatches.push_back(std::vector<CImportBlock>());
+        queueBatches.back().swap(vBatch);
+    }
+    fDone = true;
+    cond.notify_all();
+}
 
+bool CBlockFileReader::Next(std::vector<CImportBlock>& vBatch)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (queueBatches.empty() && !fDone)
+        cond.wait(lock);
+    if (queueBatches.empty())
+        return false;
+    vBatch.clear();
+    vBatch.swap(queueBatches.front());
+    queueBatches.pop_front();
+    cond.notify_all();
+    return true;
+}
+
+std::string CBlockFileReader::GetError()
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return strError;
+}
+
+bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskBlockPos *dbp)
+{
+    // Map of disk positions for blocks with unknown parent (only used for reindex)
+    static std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
+    int64_t nStart = GetTimeMillis();
+    int64_t nCheckTime = 0, nAcceptTime = 0;
+
+    int nLoaded = 0;
+    // Blocks are read on a thread of their own, checked in parallel by the
+    // -par threads and accepted in file order here
+    CBlockFileReader reader(chainparams, fileIn);
+    std::vector<CImportBlock> vBatch;
+    bool fAbort = false;
+    while (!fAbort && reader.Next(vBatch)) {
+        int64_t nTime0 = GetTimeMicros();
+        std::vector<CBlockImportCheck> vChecks;
+        vChecks.reserve(vBatch.size());
+        for (size_t i = 0; i < vBatch.size(); i++)
+            vChecks.push_back(CBlockImportCheck(&vBatch[i], &chainparams.GetConsensus()));
+        if (nScriptCheckThreads <= 1) {
+            BOOST_FOREACH(CBlockImportCheck& check, vChecks)
+                check();
+        } else {
+            CCheckQueueControl<CBlockImportCheck> control(&blockimportcheckqueue);
+            control.Add(vChecks);
+            control.Wait();
+        }
+        int64_t nTime1 = GetTimeMicros(); nCheckTime += nTime1 - nTime0;
+
+        BOOST_FOREACH(CImportBlock& import, vBatch) {
+            boost::this_thread::interruption_point();
+
+            CBlock& block = import.block;
+            if (dbp)
+                dbp->nPos = import.nPos;
+            try {
                 // detect out of order blocks, and store them for later
-                uint256 hash = block.GetHash();
+                uint256 hash = import.hash;
                 if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
                     LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
                             block.hashPrevBlock.ToString());
@@ -4618,10 +5589,12 @@ bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskB
                 if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
                     LOCK(cs_main);
                     CValidationState state;
-                    if (AcceptBlock(block, state, chainparams, NULL, true, dbp, NULL))
+                    if (AcceptBlock(block, state, chainparams, NULL, true, dbp, NULL, import.fHavePoWHash ? &import.hashPoW : NULL))
                         nLoaded++;
-                    if (state.IsError())
+                    if (state.IsError()) {
+                        fAbort = true;
                         break;
+                    }
                 } else if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex[hash]->nHeight % 1000 == 0) {
                     LogPrint("reindex", "Block Import: already had block %s at height %d\n", hash.ToString(), mapBlockIndex[hash]->nHeight);
                 }
@@ -4630,6 +5603,7 @@ bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskB
                 if (hash == chainparams.GetConsensus().hashGenesisBlock) {
                     CValidationState state;
                     if (!ActivateBestChain(state, chainparams)) {
+                        fAbort = true;
                         break;
                     }
                 }
@@ -4666,9 +5640,16 @@ bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskB
                 LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
             }
         }
-    } catch (const std::runtime_error& e) {
-        AbortNode(std::string("System error: ") + e.what());
+        nAcceptTime += GetTimeMicros() - nTime1;
     }
+    reader.Stop();
+    std::string strError = reader.GetError();
+    if (!strError.empty())
+        AbortNode(std::string("System error: ") + strError);
+
+    LogPrint("bench", "- Import read: %u blocks, %.2fMB in %.2fms (%.1f blocks/s)\n", reader.nBlocks, reader.nBytes * 0.000001, reader.nReadTime * 0.001, reader.nBlocks * 1000000.0 / std::max(reader.nReadTime, (int64_t)1));
+    LogPrint("bench", "- Import checks: %.2fms (%.1f blocks/s) on %d threads\n", nCheckTime * 0.001, reader.nBlocks * 1000000.0 / std::max(nCheckTime, (int64_t)1), std::max(nScriptCheckThreads, 1));
+    LogPrint("bench", "- Import accept: %.2fms (%.1f blocks/s)\n", nAcceptTime * 0.001, reader.nBlocks * 1000000.0 / std::max(nAcceptTime, (int64_t)1));
     if (nLoaded > 0)
         LogPrintf("Loaded %i blocks from external file in %dms\n", nLoaded, GetTimeMillis() - nStart);
     return nLoaded > 0;
@@ -4930,12 +5911,16 @@ bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
                 recentRejects->reset();
             }
 
-            // Use pcoinsTip->HaveCoinsInCache as a quick approximation to exclude
-            // requesting or processing some txs which have already been included in a block
+            // Use pcoinsTip->HaveCoinInCache as a quick approximation to exclude
+            // requesting or processing some txs which have already been included in a block.
+            // Outputs 0 and 1 are checked, as a first output may well be spent already
+            // (for instance the empty marker output of a coinstake).
             return recentRejects->contains(inv.hash) ||
                    mempool.exists(inv.hash) ||
+                   setTxBatch.count(inv.hash) ||
                    mapOrphanTransactions.count(inv.hash) ||
-                   pcoinsTip->HaveCoinsInCache(inv.hash);
+                   pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 0)) ||
+                   pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 1));
         }
     case MSG_BLOCK:
         return mapBlockIndex.count(inv.hash);
@@ -4950,8 +5935,6 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
 
     vector<CInv> vNotFound;
 
-    LOCK(cs_main);
-
     while (it != pfrom->vRecvGetData.end()) {
         // Don't bother if send buffer is too full to respond anyway
         if (pfrom->nSendSize >= SendBufferSize())
@@ -4962,55 +5945,101 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
             boost::this_thread::interruption_point();
             it++;
 
-            /*
-            // Disable BIP152
             if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
-            */
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
             {
-                bool send = false;
-                BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
-                if (mi != mapBlockIndex.end())
+                // Decide what to send under cs_main, but read and serialize the
+                // block without it so other peers' handlers are not held up.
+                const CBlockIndex* pindexSend = NULL;
+                CDiskBlockPos posSend;
+                uint256 hashContinueTip;
+                bool fSendCompact = false;
                 {
-                    if (chainActive.Contains(mi->second)) {
-                        send = true;
-                    } else {
-                        // To prevent fingerprinting attacks, only send blocks outside of the active
-                        // chain if they are valid, and no more than the max reorganization depth older
-                        // than the best chain we know about.
-                        send = mi->second->IsValid(BLOCK_VALID_SCRIPTS) && (pindexBestHeader != NULL) &&
-                            (chainActive.Height() - mi->second->nHeight < Params().GetConsensus().nMaxReorganizationDepth);
-                        if (!send) {
-                            LogPrintf("%s: ignoring request from peer=%i for old block that isn't in the main chain\n", __func__, pfrom->GetId());
+                    LOCK(cs_main);
+                    bool send = false;
+                    BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+                    if (mi != mapBlockIndex.end())
+                    {
+                        if (chainActive.Contains(mi->second)) {
+                            send = true;
+                        } else {
+                            // To prevent fingerprinting attacks, only send blocks outside of the active
+                            // chain if they are valid, and no more than the max reorganization depth older
+                            // than the best chain we know about.
+                            send = mi->second->IsValid(BLOCK_VALID_SCRIPTS) && (pindexBestHeader != NULL) &&
+                                (chainActive.Height() - mi->second->nHeight < Params().GetConsensus().nMaxReorganizationDepth);
+                            if (!send) {
+                                LogPrintf("%s: ignoring request from peer=%i for old block that isn't in the main chain\n", __func__, pfrom->GetId());
+                            }
                         }
                     }
+                    // disconnect node in case we have reached the outbound limit for serving historical blocks
+                    // never disconnect whitelisted nodes
+                    static const int nOneWeek = 7 * 24 * 60 * 60; // assume > 1 week = historical
+                    if (send && CNode::OutboundTargetReached(true) && ( ((pindexBestHeader != NULL) && (pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() > nOneWeek)) || inv.type == MSG_FILTERED_BLOCK) && !pfrom->fWhitelisted)
+                    {
+                        LogPrint("net", "historical block serving limit reached, disconnect peer=%d\n", pfrom->GetId());
+
+                        //disconnect node
+                        pfrom->fDisconnect = true;
+                        send = false;
+                    }
+                    // Pruned nodes may have deleted the block, so check whether
+                    // it's available before trying to send.
+                    if (send && (mi->second->nStatus & BLOCK_HAVE_DATA))
+                    {
+                        pindexSend = mi->second;
+                        posSend = pindexSend->GetBlockPos();
+                        // If a peer is asking for old blocks, we're almost guaranteed
+                        // they wont have a useful mempool to match against a compact block,
+                        // and we don't feel like constructing the object for them, so
+                        // instead we respond with the full, non-compact block.
+                        fSendCompact = inv.type == MSG_CMPCT_BLOCK && CanDirectFetch(consensusParams) &&
+                            pindexSend->nHeight >= chainActive.Height() - MAX_BLOCKTXN_DEPTH;
+                        // Trigger the peer node to send a getblocks request for the next batch of inventory
+                        if (inv.hash == pfrom->hashContinue)
+                        {
+                            hashContinueTip = chainActive.Tip()->GetBlockHash();
+                            pfrom->hashContinue.SetNull();
+                        }
+                    }
+
+                    // Track requests for our stuff.
+                    GetMainSignals().Inventory(inv.hash);
                 }
-                // disconnect node in case we have reached the outbound limit for serving historical blocks
-                // never disconnect whitelisted nodes
-                static const int nOneWeek = 7 * 24 * 60 * 60; // assume > 1 week = historical
-                if (send && CNode::OutboundTargetReached(true) && ( ((pindexBestHeader != NULL) && (pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() > nOneWeek)) || inv.type == MSG_FILTERED_BLOCK) && !pfrom->fWhitelisted)
-                {
-                    LogPrint("net", "historical block serving limit reached, disconnect peer=%d\n", pfrom->GetId());
 
-                    //disconnect node
-                    pfrom->fDisconnect = true;
-                    send = false;
+                CBlock block;
+                // Full blocks go out as they are serialized on disk, straight
+                // from the mapped file if possible
+                bool fSendFull = inv.type == MSG_BLOCK || (inv.type == MSG_CMPCT_BLOCK && !fSendCompact);
+                std::shared_ptr<const CMappedFile> fileSend;
+                std::vector<unsigned char> vchBlock;
+                const unsigned char* pblockSend = NULL;
+                unsigned int nBlockSize = 0;
+                bool fRead = true;
+                if (pindexSend && fSendFull) {
+                    fileSend = MapBlockFromDisk(posSend, pindexSend, pblockSend, nBlockSize);
+                    if (!fileSend && (fRead = ReadRawBlockFromDisk(vchBlock, posSend, pindexSend))) {
+                        pblockSend = vchBlock.data();
+                        nBlockSize = vchBlock.size();
+                    }
+                } else if (pindexSend) {
+                    fRead = ReadBlockFromDisk(block, posSend, pindexSend, consensusParams);
                 }
-                // Pruned nodes may have deleted the block, so check whether
-                // it's available before trying to send.
-                if (send && (mi->second->nStatus & BLOCK_HAVE_DATA))
+                if (!fRead)
                 {
-                    // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second, consensusParams))
+                    // Only pruning can have removed the block since we looked
+                    LOCK(cs_main);
+                    if (pindexSend->nStatus & BLOCK_HAVE_DATA)
                         assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage(NetMsgType::BLOCK, block);
-                    /*
-                    // Disable BIP152
+                    LogPrint("net", "%s: block %s pruned while serving peer=%d\n", __func__, inv.hash.ToString(), pfrom->GetId());
+                    pindexSend = NULL;
+                }
+                if (pindexSend)
+                {
+                    // Send block from disk
+                    if (fSendFull)
+                        pfrom->PushMessage(NetMsgType::BLOCK, CFlatData((void*)pblockSend, (void*)(pblockSend + nBlockSize)));
                     else if (inv.type == MSG_FILTERED_BLOCK)
-                    */
-                    else // MSG_FILTERED_BLOCK
                     {
                         bool send = false;
                         CMerkleBlock merkleBlock;
@@ -5036,37 +6065,26 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                         // else
                             // no response
                     }
-                    /*
-                    // Disable BIP152
-                    else if (inv.type == MSG_CMPCT_BLOCK)
+                    else // MSG_CMPCT_BLOCK
                     {
-                        // If a peer is asking for old blocks, we're almost guaranteed
-                        // they wont have a useful mempool to match against a compact block,
-                        // and we don't feel like constructing the object for them, so
-                        // instead we respond with the full, non-compact block.
-                        if (CanDirectFetch(consensusParams) && mi->second->nHeight >= chainActive.Height() - MAX_BLOCKTXN_DEPTH) {
-                            CBlockHeaderAndShortTxIDs cmpctblock(block);
-                            pfrom->PushMessage(NetMsgType::CMPCTBLOCK, cmpctblock);
-                        } else
-                            pfrom->PushMessage(NetMsgType::BLOCK, block);
+                        CBlockHeaderAndShortTxIDs cmpctblock(block);
+                        pfrom->PushMessage(NetMsgType::CMPCTBLOCK, cmpctblock);
                     }
-                    */
 
-                    // Trigger the peer node to send a getblocks request for the next batch of inventory
-                    if (inv.hash == pfrom->hashContinue)
+                    if (!hashContinueTip.IsNull())
                     {
                         // Bypass PushInventory, this must send even if redundant,
                         // and we want it right after the last block so they don't
                         // wait for other stuff first.
                         vector<CInv> vInv;
-                        vInv.push_back(CInv(MSG_BLOCK, chainActive.Tip()->GetBlockHash()));
+                        vInv.push_back(CInv(MSG_BLOCK, hashContinueTip));
                         pfrom->PushMessage(NetMsgType::INV, vInv);
-                        pfrom->hashContinue.SetNull();
                     }
                 }
             }
             else if (inv.type == MSG_TX)
             {
+                LOCK(cs_main);
                 // Send stream from relay memory
                 bool push = false;
                 auto mi = mapRelay.find(inv.hash);
@@ -5085,16 +6103,17 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                 if (!push) {
                     vNotFound.push_back(inv);
                 }
-            }
 
-            // Track requests for our stuff.
-            GetMainSignals().Inventory(inv.hash);
+                // Track requests for our stuff.
+                GetMainSignals().Inventory(inv.hash);
+            }
+            else
+            {
+                LOCK(cs_main);
+                GetMainSignals().Inventory(inv.hash);
+            }
 
-            /*
-            // Disable BIP152
             if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
-            */
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
                 break;
         }
     }
@@ -5113,6 +6132,177 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
     }
 }
 
+/** Relay and log the outcome of adding a transaction received from pfrom to the memory pool, and resolve its orphans */
+static void ProcessTxResult(CNode* pfrom, const CTransaction& tx, bool fAccepted, bool fMissingInputs, CValidationState& state)
+{
+    AssertLockHeld(cs_main);
+    deque<COutPoint> vWorkQueue;
+    vector<uint256> vEraseQueue;
+
+    if (fAccepted) {
+        mempool.check(pcoinsTip);
+        RelayTransaction(tx);
+        for (unsigned int i = 0; i < tx.vout.size(); i++) {
+            vWorkQueue.emplace_back(tx.GetHash(), i);
+        }
+
+        pfrom->nLastTXTime = GetTime();
+
+        LogPrint("mempool", "AcceptToMemoryPool: peer=%d: accepted %s (poolsz %u txn, %u kB)\n",
+            pfrom->id,
+            tx.GetHash().ToString(),
+            mempool.size(), mempool.DynamicMemoryUsage() / 1000);
+
+        // Recursively process any orphan transactions that depended on this one
+        set<NodeId> setMisbehaving;
+        while (!vWorkQueue.empty()) {
+            auto itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue.front());
+            vWorkQueue.pop_front();
+            if (itByPrev == mapOrphanTransactionsByPrev.end())
+                continue;
+            for (auto mi = itByPrev->second.begin();
+                 mi != itByPrev->second.end();
+                 ++mi)
+            {
+                const CTransaction& orphanTx = (*mi)->second.tx;
+                const uint256& orphanHash = orphanTx.GetHash();
+                NodeId fromPeer = (*mi)->second.fromPeer;
+                bool fMissingInputs2 = false;
+                // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
+                // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
+                // anyone relaying LegitTxX banned)
+                CValidationState stateDummy;
+
+
+                if (setMisbehaving.count(fromPeer))
+                    continue;
+                if (AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2)) {
+                    LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
+                    RelayTransaction(orphanTx);
+                    for (unsigned int i = 0; i < orphanTx.vout.size(); i++) {
+                        vWorkQueue.emplace_back(orphanHash, i);
+                    }
+                    vEraseQueue.push_back(orphanHash);
+                }
+                else if (!fMissingInputs2)
+                {
+                    int nDos = 0;
+                    if (stateDummy.IsInvalid(nDos) && nDos > 0)
+                    {
+                        // Punish peer that gave us an invalid orphan tx
+                        Misbehaving(fromPeer, nDos);
+                        setMisbehaving.insert(fromPeer);
+                        LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
+                    }
+                    // Has inputs but not accepted to mempool
+                    // Probably non-standard or insufficient fee/priority
+                    LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
+                    vEraseQueue.push_back(orphanHash);
+                    if (!stateDummy.CorruptionPossible()) {
+                        // Do not use rejection cache for transactions as they can have been malleated.
+                        // See https://github.com/bitcoin/bitcoin/issues/8279 for details.
+                        assert(recentRejects);
+                        recentRejects->insert(orphanHash);
+                    }
+                }
+                mempool.check(pcoinsTip);
+            }
+        }
+
+        BOOST_FOREACH(uint256 hash, vEraseQueue)
+            EraseOrphanTx(hash);
+    }
+    else if (fMissingInputs)
+    {
+        bool fRejectedParents = false; // It may be the case that the orphans parents have all been rejected
+        BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+            if (recentRejects->contains(txin.prevout.hash)) {
+                fRejectedParents = true;
+                break;
+            }
+        }
+        if (!fRejectedParents) {
+            BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+                CInv _inv(MSG_TX, txin.prevout.hash);
+                pfrom->AddInventoryKnown(_inv);
+                if (!AlreadyHave(_inv)) pfrom->AskFor(_inv);
+            }
+            AddOrphanTx(tx, pfrom->GetId());
+
+            // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
+            unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
+            unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
+            if (nEvicted > 0)
+                LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
+        } else {
+            LogPrint("mempool", "not keeping orphan with rejected parents %s\n",tx.GetHash().ToString());
+        }
+    } else {
+        if (!state.CorruptionPossible()) {
+            // Do not use rejection cache for transactions, as they can have been malleated.
+            // See https://github.com/bitcoin/bitcoin/issues/8279 for details.
+            assert(recentRejects);
+            recentRejects->insert(tx.GetHash());
+        }
+
+        if (pfrom->fWhitelisted && GetBoolArg("-whitelistforcerelay", DEFAULT_WHITELISTFORCERELAY)) {
+            // Always relay transactions received from whitelisted peers, even
+            // if they were already in the mempool or rejected from it due
+            // to policy, allowing the node to function as a gateway for
+            // nodes hidden behind it.
+            //
+            // Never relay transactions that we would assign a non-zero DoS
+            // score for, as we expect peers to do the same with us in that
+            // case.
+            int nDoS = 0;
+            if (!state.IsInvalid(nDoS) || nDoS == 0) {
+                LogPrintf("Force relaying tx %s from whitelisted peer=%d\n", tx.GetHash().ToString(), pfrom->id);
+                RelayTransaction(tx);
+            } else {
+                LogPrintf("Not relaying invalid transaction %s from whitelisted peer=%d (%s)\n", tx.GetHash().ToString(), pfrom->id, FormatStateMessage(state));
+            }
+        }
+    }
+    int nDoS = 0;
+    if (state.IsInvalid(nDoS))
+    {
+        LogPrint("mempoolrej", "%s from peer=%d was not accepted: %s\n", tx.GetHash().ToString(),
+            pfrom->id,
+            FormatStateMessage(state));
+        if (state.GetRejectCode() < REJECT_INTERNAL) // Never send AcceptToMemoryPool's internal codes over P2P
+            pfrom->PushMessage(NetMsgType::REJECT, string(NetMsgType::TX), (unsigned char)state.GetRejectCode(),
+                               state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), tx.GetHash());
+        if (nDoS > 0) {
+            Misbehaving(pfrom->GetId(), nDoS);
+        }
+    }
+}
+
+/** Add the pending relayed transactions to the memory pool */
+static void ProcessTxBatch()
+{
+    AssertLockHeld(cs_main);
+    if (vTxBatch.empty())
+        return;
+
+    std::vector<CTransaction> vtx;
+    std::vector<CNode*> vFrom;
+    vtx.swap(vTxBatch);
+    vFrom.swap(vTxBatchFrom);
+    setTxBatch.clear();
+
+    std::vector<CValidationState> vState;
+    std::vector<bool> vfAccepted;
+    std::vector<bool> vfMissingInputs;
+    AcceptToMemoryPoolBatch(mempool, vtx, true, vState, vfAccepted, vfMissingInputs);
+    for (size_t i = 0; i < vtx.size(); i++)
+        ProcessTxResult(vFrom[i], vtx[i], vfAccepted[i], vfMissingInputs[i], vState[i]);
+
+    LOCK(cs_vNodes);
+    BOOST_FOREACH(CNode* pnode, vFrom)
+        pnode->Release();
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CChainParams& chainparams)
 {
     LogPrint("net", "received: %s (%u bytes) peer=%d\n", SanitizeString(strCommand), vRecv.size(), pfrom->id);
@@ -5237,6 +6427,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         if (!pfrom->fInbound)
         {
             // Advertise our address
+            LOCK(cs_main); // for vAddrToSend, see the ADDR handler
             if (fListen && !IsInitialBlockDownload())
             {
                 CAddress addr = GetLocalAddress(&pfrom->addr);
@@ -5305,8 +6496,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             // nodes)
             pfrom->PushMessage(NetMsgType::SENDHEADERS);
         }
-        /*
-        // Disable BIP152
         if (pfrom->nVersion >= SHORT_IDS_BLOCKS_VERSION) {
             // Tell our peer we are willing to provide version-1 cmpctblocks
             // However, we do not request new block announcements using
@@ -5317,7 +6506,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             uint64_t nCMPCTBLOCKVersion = 1;
             pfrom->PushMessage(NetMsgType::SENDCMPCT, fAnnounceUsingCMPCTBLOCK, nCMPCTBLOCKVersion);
         }
-        */
     }
 
 
@@ -5340,6 +6528,11 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         vector<CAddress> vAddrOk;
         int64_t nNow = GetAdjustedTime();
         int64_t nSince = nNow - 10 * 60;
+        {
+        // Each peer's addrKnown and vAddrToSend are guarded by cs_main: with
+        // several message handler threads we relay into peers that another
+        // thread may be sending to at the same time.
+        LOCK(cs_main);
         BOOST_FOREACH(CAddress& addr, vAddr)
         {
             boost::this_thread::interruption_point();
@@ -5379,6 +6572,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             if (fReachable)
                 vAddrOk.push_back(addr);
         }
+        }
         addrman.Add(vAddrOk, pfrom->addr, 2 * 60 * 60);
         if (vAddr.size() < 1000)
             pfrom->fGetAddr = false;
@@ -5392,8 +6586,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         State(pfrom->GetId())->fPreferHeaders = true;
     }
 
-    /*
-    // Disable BIP152
     else if (strCommand == NetMsgType::SENDCMPCT)
     {
         bool fAnnounceUsingCMPCTBLOCK = false;
@@ -5413,7 +6605,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             }
         }
     }
-    */
 
 
     else if (strCommand == NetMsgType::INV)
@@ -5461,14 +6652,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                     CNodeState *nodestate = State(pfrom->GetId());
                     if (CanDirectFetch(chainparams.GetConsensus()) &&
                         nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
-                        /*
-                        // Disable BIP152
                         if (nodestate->fProvidesHeaderAndIDs)
                             vToFetch.push_back(CInv(MSG_CMPCT_BLOCK, inv.hash));
                         else
                             vToFetch.push_back(inv);
-                        */
-                        vToFetch.push_back(inv);
                         // Mark block as in flight already, even though the actual "getdata" message only goes out
                         // later (within the same cs_main lock, though).
                         MarkBlockAsInFlight(pfrom->GetId(), inv.hash, chainparams.GetConsensus());
@@ -5565,8 +6752,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
-    /*
-    // Disable BIP152
     else if (strCommand == NetMsgType::GETBLOCKTXN)
     {
         BlockTransactionsRequest req;
@@ -5611,7 +6796,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         }
         pfrom->PushMessage(NetMsgType::BLOCKTXN, resp);
     }
-    */
 
 
     else if (strCommand == NetMsgType::GETHEADERS)
@@ -5673,8 +6857,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             return true;
         }
 
-        deque<COutPoint> vWorkQueue;
-        vector<uint256> vEraseQueue;
         CTransaction tx;
         vRecv >> tx;
 
@@ -5683,154 +6865,26 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
         LOCK(cs_main);
 
-        bool fMissingInputs = false;
-        CValidationState state;
-
         pfrom->setAskFor.erase(inv.hash);
         mapAlreadyAskedFor.erase(inv.hash);
 
-        if (!AlreadyHave(inv) && AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs)) {
-            mempool.check(pcoinsTip);
-            RelayTransaction(tx);
-            for (unsigned int i = 0; i < tx.vout.size(); i++) {
-                vWorkQueue.emplace_back(inv.hash, i);
-            }
-
-            pfrom->nLastTXTime = GetTime();
-
-            LogPrint("mempool", "AcceptToMemoryPool: peer=%d: accepted %s (poolsz %u txn, %u kB)\n",
-                pfrom->id,
-                tx.GetHash().ToString(),
-                mempool.size(), mempool.DynamicMemoryUsage() / 1000);
-
-            // Recursively process any orphan transactions that depended on this one
-            set<NodeId> setMisbehaving;
-            while (!vWorkQueue.empty()) {
-                auto itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue.front());
-                vWorkQueue.pop_front();
-                if (itByPrev == mapOrphanTransactionsByPrev.end())
-                    continue;
-                for (auto mi = itByPrev->second.begin();
-                     mi != itByPrev->second.end();
-                     ++mi)
-                {
-                    const CTransaction& orphanTx = (*mi)->second.tx;
-                    const uint256& orphanHash = orphanTx.GetHash();
-                    NodeId fromPeer = (*mi)->second.fromPeer;
-                    bool fMissingInputs2 = false;
-                    // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
-                    // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
-                    // anyone relaying LegitTxX banned)
-                    CValidationState stateDummy;
-
-
-                    if (setMisbehaving.count(fromPeer))
-                        continue;
-                    if (AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2)) {
-                        LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
-                        RelayTransaction(orphanTx);
-                        for (unsigned int i = 0; i < orphanTx.vout.size(); i++) {
-                            vWorkQueue.emplace_back(orphanHash, i);
-                        }
-                        vEraseQueue.push_back(orphanHash);
-                    }
-                    else if (!fMissingInputs2)
-                    {
-                        int nDos = 0;
-                        if (stateDummy.IsInvalid(nDos) && nDos > 0)
-                        {
-                            // Punish peer that gave us an invalid orphan tx
-                            Misbehaving(fromPeer, nDos);
-                            setMisbehaving.insert(fromPeer);
-                            LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
-                        }
-                        // Has inputs but not accepted to mempool
-                        // Probably non-standard or insufficient fee/priority
-                        LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
-                        vEraseQueue.push_back(orphanHash);
-                        if (!stateDummy.CorruptionPossible()) {
-                            // Do not use rejection cache for transactions as they can have been malleated.
-                            // See https://github.com/bitcoin/bitcoin/issues/8279 for details.
-                            assert(recentRejects);
-                            recentRejects->insert(orphanHash);
-                        }
-                    }
-                    mempool.check(pcoinsTip);
-                }
-            }
-
-            BOOST_FOREACH(uint256 hash, vEraseQueue)
-                EraseOrphanTx(hash);
-        }
-        else if (fMissingInputs)
-        {
-            bool fRejectedParents = false; // It may be the case that the orphans parents have all been rejected
-            BOOST_FOREACH(const CTxIn& txin, tx.vin) {
-                if (recentRejects->contains(txin.prevout.hash)) {
-                    fRejectedParents = true;
-                    break;
-                }
-            }
-            if (!fRejectedParents) {
-                BOOST_FOREACH(const CTxIn& txin, tx.vin) {
-                    CInv _inv(MSG_TX, txin.prevout.hash);
-                    pfrom->AddInventoryKnown(_inv);
-                    if (!AlreadyHave(_inv)) pfrom->AskFor(_inv);
-                }
-                AddOrphanTx(tx, pfrom->GetId());
-
-                // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
-                unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
-                unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
-                if (nEvicted > 0)
-                    LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
-            } else {
-                LogPrint("mempool", "not keeping orphan with rejected parents %s\n",tx.GetHash().ToString());
-            }
+        CValidationState state;
+        if (AlreadyHave(inv)) {
+            ProcessTxResult(pfrom, tx, false, false, state);
         } else {
-            if (!state.CorruptionPossible()) {
-                // Do not use rejection cache for transactions, as they can have been malleated.
-                // See https://github.com/bitcoin/bitcoin/issues/8279 for details.
-                assert(recentRejects);
-                recentRejects->insert(tx.GetHash());
-            }
-
-            if (pfrom->fWhitelisted && GetBoolArg("-whitelistforcerelay", DEFAULT_WHITELISTFORCERELAY)) {
-                // Always relay transactions received from whitelisted peers, even
-                // if they were already in the mempool or rejected from it due
-                // to policy, allowing the node to function as a gateway for
-                // nodes hidden behind it.
-                //
-                // Never relay transactions that we would assign a non-zero DoS
-                // score for, as we expect peers to do the same with us in that
-                // case.
-                int nDoS = 0;
-                if (!state.IsInvalid(nDoS) || nDoS == 0) {
-                    LogPrintf("Force relaying tx %s from whitelisted peer=%d\n", tx.GetHash().ToString(), pfrom->id);
-                    RelayTransaction(tx);
-                } else {
-                    LogPrintf("Not relaying invalid transaction %s from whitelisted peer=%d (%s)\n", tx.GetHash().ToString(), pfrom->id, FormatStateMessage(state));
-                }
-            }
-        }
-        int nDoS = 0;
-        if (state.IsInvalid(nDoS))
-        {
-            LogPrint("mempoolrej", "%s from peer=%d was not accepted: %s\n", tx.GetHash().ToString(),
-                pfrom->id,
-                FormatStateMessage(state));
-            if (state.GetRejectCode() < REJECT_INTERNAL) // Never send AcceptToMemoryPool's internal codes over P2P
-                pfrom->PushMessage(NetMsgType::REJECT, strCommand, (unsigned char)state.GetRejectCode(),
-                                   state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-            if (nDoS > 0) {
-                Misbehaving(pfrom->GetId(), nDoS);
+            vTxBatch.push_back(tx);
+            vTxBatchFrom.push_back(pfrom);
+            setTxBatch.insert(inv.hash);
+            {
+                LOCK(cs_vNodes);
+                pfrom->AddRef();
             }
+            if (vTxBatch.size() >= nMempoolBatchSize)
+                ProcessTxBatch();
         }
         FlushStateToDisk(state, FLUSH_STATE_PERIODIC);
     }
 
-    /*
-    // Disable BIP152
     else if (strCommand == NetMsgType::CMPCTBLOCK && !fImporting && !fReindex) // Ignore blocks received while importing
     {
         CBlockHeaderAndShortTxIDs cmpctblock;
@@ -5840,7 +6894,11 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         // below)
         CBlock block;
         bool fBlockReconstructed = false;
+        bool fProcessBLOCKTXN = false;
+        bool fRevertToHeaderProcessing = false;
+        CBlockIndex *pindex = NULL;
 
+        {
         LOCK(cs_main);
 
         if (mapBlockIndex.find(cmpctblock.header.hashPrevBlock) == mapBlockIndex.end()) {
@@ -5850,9 +6908,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             return true;
         }
 
-        CBlockIndex *pindex = NULL;
         CValidationState state;
-        if (!AcceptBlockHeader(cmpctblock.header, state, chainparams, &pindex)) {
+        if (!AcceptBlockHeader(cmpctblock.header, state, chainparams, &pindex, cmpctblock.GetCoinStake() != NULL)) {
             int nDoS;
             if (state.IsInvalid(nDoS)) {
                 if (nDoS > 0)
@@ -5913,8 +6970,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                     Misbehaving(pfrom->GetId(), 100);
                     LogPrintf("Peer %d sent us invalid compact block\n", pfrom->id);
                     return true;
-                } else if (status == READ_STATUS_FAILED) {
-                    // Duplicate txindexes, the block is now in-flight, so just request it
+                } else if (status == READ_STATUS_FAILED || !CheckCompactBlockStake(cmpctblock, pindex, chainparams.GetConsensus())) {
+                    // Duplicate txindexes, or a coinstake that does not pass
+                    // the kernel check but is not yet known to be part of the
+                    // block; the block is now in-flight, so just request it
                     std::vector<CInv> vInv(1);
                     vInv[0] = CInv(MSG_BLOCK, cmpctblock.header.GetHash());
                     pfrom->PushMessage(NetMsgType::GETDATA, vInv);
@@ -5933,12 +6992,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                         req.indexes.push_back(i);
                 }
                 if (req.indexes.empty()) {
-                    // Dirty hack to jump to BLOCKTXN code (TODO: move message handling into their own functions)
-                    BlockTransactions txn;
-                    txn.blockhash = cmpctblock.header.GetHash();
-                    CDataStream blockTxnMsg(SER_NETWORK, PROTOCOL_VERSION);
-                    blockTxnMsg << txn;
-                    return ProcessMessage(pfrom, NetMsgType::BLOCKTXN, blockTxnMsg, nTimeReceived, chainparams);
+                    // Jump to the BLOCKTXN code below, once cs_main is released
+                    fProcessBLOCKTXN = true;
                 } else {
                     req.blockhash = pindex->GetBlockHash();
                     pfrom->PushMessage(NetMsgType::GETBLOCKTXN, req);
@@ -5951,7 +7006,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 // able to without any round trips.
                 PartiallyDownloadedBlock tempBlock(&mempool);
                 ReadStatus status = tempBlock.InitData(cmpctblock);
-                if (status != READ_STATUS_OK) {
+                if (status != READ_STATUS_OK || !CheckCompactBlockStake(cmpctblock, pindex, chainparams.GetConsensus())) {
                     // TODO: don't ignore failures
                     return true;
                 }
@@ -5971,29 +7026,44 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 return true;
             } else {
                 // If this was an announce-cmpctblock, we want the same treatment as a header message
-                // Dirty hack to process as if it were just a headers message (TODO: move message handling into their own functions)
-                std::vector<CBlock> headers;
-                headers.push_back(cmpctblock.header);
-                CDataStream vHeadersMsg(SER_NETWORK, PROTOCOL_VERSION);
-                vHeadersMsg << headers;
-                return ProcessMessage(pfrom, NetMsgType::HEADERS, vHeadersMsg, nTimeReceived, chainparams);
+                fRevertToHeaderProcessing = true;
             }
         }
 
+        CheckBlockIndex(chainparams.GetConsensus());
+        } // cs_main
+
+        if (fProcessBLOCKTXN) {
+            // Dirty hack to jump to BLOCKTXN code (TODO: move message handling into their own functions)
+            BlockTransactions txn;
+            txn.blockhash = cmpctblock.header.GetHash();
+            CDataStream blockTxnMsg(SER_NETWORK, PROTOCOL_VERSION);
+            blockTxnMsg << txn;
+            return ProcessMessage(pfrom, NetMsgType::BLOCKTXN, blockTxnMsg, nTimeReceived, chainparams);
+        }
+
+        if (fRevertToHeaderProcessing) {
+            // Dirty hack to process as if it were just a headers message (TODO: move message handling into their own functions)
+            std::vector<CBlock> headers;
+            headers.push_back(cmpctblock.header);
+            CDataStream vHeadersMsg(SER_NETWORK, PROTOCOL_VERSION);
+            vHeadersMsg << headers;
+            return ProcessMessage(pfrom, NetMsgType::HEADERS, vHeadersMsg, nTimeReceived, chainparams);
+        }
+
         if (fBlockReconstructed) {
             // If we got here, we were able to optimistically reconstruct a
             // block that is in flight from some other peer.  However, this
-            // cmpctblock may be invalid.  In particular, while we've checked
-            // that the block merkle root commits to the transaction ids, we
-            // haven't yet checked that tx witnesses are properly committed to
-            // in the coinbase witness commitment.
+            // cmpctblock may be invalid: while we've checked that the block
+            // merkle root commits to the transaction ids, the contextual
+            // checks of the block have not been run yet.
             //
             // ProcessNewBlock will call MarkBlockAsReceived(), which will
             // clear any in-flight compact block state that might be present
             // from some other peer.  We don't want a malleated compact block
             // request to interfere with block relay, so we don't want to call
-            // ProcessNewBlock until we've already checked that the witness
-            // commitment is correct.
+            // ProcessNewBlock until we've already checked the block in its
+            // context.
             {
                 LOCK(cs_main);
                 CValidationState dummy;
@@ -6006,8 +7076,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             ProcessNewBlock(state, chainparams, pfrom, &block, true, NULL, false);
             // TODO: could send reject message if block is invalid?
         }
-
-        CheckBlockIndex(chainparams.GetConsensus());
     }
 
     else if (strCommand == NetMsgType::BLOCKTXN && !fImporting && !fReindex) // Ignore blocks received while importing
@@ -6015,6 +7083,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         BlockTransactions resp;
         vRecv >> resp;
 
+        CBlock block;
+        bool fBlockRead = false;
+        {
         LOCK(cs_main);
 
         map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator it = mapBlocksInFlight.find(resp.blockhash);
@@ -6025,7 +7096,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         }
 
         PartiallyDownloadedBlock& partialBlock = *it->second.second->partialBlock;
-        CBlock block;
         ReadStatus status = partialBlock.FillBlock(block, resp.txn);
         if (status == READ_STATUS_INVALID) {
             MarkBlockAsReceived(resp.blockhash); // Reset in-flight state in case of whitelist
@@ -6055,6 +7125,11 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             // though the block was successfully read, and rely on the
             // handling in ProcessNewBlock to ensure the block index is
             // updated, reject messages go out, etc.
+            fBlockRead = true;
+        }
+        } // cs_main
+
+        if (fBlockRead) {
             CValidationState state;
             // BIP 152 permits peers to relay compact blocks after validating
             // the header only; we should not punish peers if the block turns
@@ -6068,7 +7143,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             }
         }
     }
-    */
 
 
     else if (strCommand == NetMsgType::HEADERS && !fImporting && !fReindex) // Ignore headers received while importing
@@ -6089,6 +7163,12 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             ReadCompactSize(vRecv); // ignore block sig; assume it is 0.
         }
 
+        // Scrypt-hash the whole message on the -par threads before taking
+        // cs_main, which is then only held for the contextual checks and the
+        // block index updates.
+        std::vector<uint256> vPoWHash;
+        ComputeHeadersPoWHash(headers, vPoWHash);
+
         {
         LOCK(cs_main);
 
@@ -6135,7 +7215,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
         CBlockIndex *pindexLast = NULL;
 
-        BOOST_FOREACH(const CBlockHeader& header, headers) {
+        for (unsigned int n = 0; n < nCount; n++) {
+            const CBlockHeader& header = headers[n];
             CValidationState state;
             if (pindexLast != NULL && header.hashPrevBlock != pindexLast->GetBlockHash()) {
                 Misbehaving(pfrom->GetId(), 20);
@@ -6144,7 +7225,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 break;
             }
             // ToDo: enable header check for PoW blocks
-            if (!AcceptBlockHeader(header, state, chainparams, &pindexLast)) {
+            if (!AcceptBlockHeader(header, state, chainparams, &pindexLast, true, &vPoWHash[n])) {
                 int nDoS;
                 if (state.IsInvalid(nDoS)) {
                     if (nDoS > 0)
@@ -6242,8 +7323,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                             pindexLast->GetBlockHash().ToString(), pindexLast->nHeight);
                 }
                 if (vGetData.size() > 0) {
-                    /*
-                    // Disable BIP152
                     if (nodestate->fProvidesHeaderAndIDs && vGetData.size() == 1 && mapBlocksInFlight.size() == 1 && pindexLast->pprev->IsValid(BLOCK_VALID_CHAIN)) {
                         // We seem to be rather well-synced, so it appears pfrom was the first to provide us
                         // with this block! Let's get them to announce using compact blocks in the future.
@@ -6251,7 +7330,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                         // In any case, we want to download using a compact block, not a regular one
                         vGetData[0] = CInv(MSG_CMPCT_BLOCK, vGetData[0].hash);
                     }
-                    */
                     pfrom->PushMessage(NetMsgType::GETDATA, vGetData);
                 }
             }
@@ -6311,8 +7389,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         }
         pfrom->fSentAddr = true;
 
-        pfrom->vAddrToSend.clear();
         vector<CAddress> vAddr = addrman.GetAddr();
+        LOCK(cs_main);
+        pfrom->vAddrToSend.clear();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             pfrom->PushAddress(addr);
     }
@@ -6547,6 +7626,7 @@ bool ProcessMessages(CNode* pfrom)
     // this maintains the order of responses
     if (!pfrom->vRecvGetData.empty()) return fOk;
 
+    unsigned int nTxRun = 0;
     std::deque<CNetMessage>::iterator it = pfrom->vRecvMsg.begin();
     while (!pfrom->fDisconnect && it != pfrom->vRecvMsg.end()) {
         // Don't bother if send buffer is too full to respond anyway
@@ -6640,6 +7720,10 @@ bool ProcessMessages(CNode* pfrom)
         if (!fRet)
             LogPrintf("%s(%s, %u bytes) FAILED peer=%d\n", __func__, SanitizeString(strCommand), nMessageSize, pfrom->id);
 
+        // Read on through a run of transactions, so that a burst from one
+        // peer fills the mempool batch instead of taking a pass per message
+        if (strCommand == NetMsgType::TX && ++nTxRun < nMempoolBatchSize)
+            continue;
         break;
     }
 
@@ -6650,6 +7734,12 @@ bool ProcessMessages(CNode* pfrom)
     return fOk;
 }
 
+void FinishProcessMessages()
+{
+    LOCK(cs_main);
+    ProcessTxBatch();
+}
+
 class CompareInvMempoolOrder
 {
     CTxMemPool *mp;
@@ -6809,13 +7899,9 @@ bool SendMessages(CNode* pto)
             // add all to the inv queue.
             LOCK(pto->cs_inventory);
             vector<CBlock> vHeaders;
-            /*
-            // Disable BIP152
             bool fRevertToInv = ((!state.fPreferHeaders &&
                                  (!state.fPreferHeaderAndIDs || pto->vBlockHashesToAnnounce.size() > 1)) ||
                                 pto->vBlockHashesToAnnounce.size() > MAX_BLOCKS_TO_ANNOUNCE);
-            */
-            bool fRevertToInv = (!state.fPreferHeaders || pto->vBlockHashesToAnnounce.size() > MAX_BLOCKS_TO_ANNOUNCE);
             CBlockIndex *pBestIndex = NULL; // last header queued for delivery
             ProcessBlockAvailability(pto->id); // ensure pindexBestKnownBlock is up-to-date
 
@@ -6867,8 +7953,6 @@ bool SendMessages(CNode* pto)
                     }
                 }
             }
-            /*
-            // Disable BIP152
             if (!fRevertToInv && !vHeaders.empty()) {
                 if (vHeaders.size() == 1 && state.fPreferHeaderAndIDs) {
                     // We only send up to 1 block as header-and-ids, as otherwise
@@ -6896,7 +7980,6 @@ bool SendMessages(CNode* pto)
                 } else
                     fRevertToInv = true;
             }
-            */
             if (fRevertToInv) {
                 // If falling back to using an inv, just try to inv the tip.
                 // The last entry in vBlockHashesToAnnounce was our tip at some point
@@ -6922,19 +8005,6 @@ bool SendMessages(CNode* pto)
                             pto->id, hashToAnnounce.ToString());
                     }
                 }
-            // Disable BIP152
-            } else if (!vHeaders.empty()) {
-                if (vHeaders.size() > 1) {
-                    LogPrint("net", "%s: %u headers, range (%s, %s), to peer=%d\n", __func__,
-                            vHeaders.size(),
-                            vHeaders.front().GetHash().ToString(),
-                            vHeaders.back().GetHash().ToString(), pto->id);
-                } else {
-                    LogPrint("net", "%s: sending header %s to peer=%d\n", __func__,
-                            vHeaders.front().GetHash().ToString(), pto->id);
-                }
-                pto->PushMessage(NetMsgType::HEADERS, vHeaders);
-                state.pindexBestHeaderSent = pBestIndex;
             }
             pto->vBlockHashesToAnnounce.clear();
         }
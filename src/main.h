@@ -32,7 +32,10 @@
 
 #include <boost/unordered_map.hpp>
 class CBlockIndex;
+class CBlockFileCache;
 class CBlockTreeDB;
+class CCoinsViewDB;
+class CTxIndexDB;
 class CBloomFilter;
 class CChainParams;
 class CInv;
@@ -59,6 +62,8 @@ static const CAmount DEFAULT_TRANSACTION_MAXFEE = 1 * COIN;
 static const CAmount HIGH_TX_FEE_PER_KB = 0.1 * COIN;
 //! -maxtxfee will warn if called with a higher fee than this amount (in satoshis)
 static const CAmount HIGH_MAX_TX_FEE = 100 * HIGH_TX_FEE_PER_KB; 
+/** Default for -mempoolbatch, maximum number of relayed transactions added to the mempool together */
+static const unsigned int DEFAULT_MEMPOOL_BATCH_SIZE = 64;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
 /** Expiration time for orphan transactions in seconds */
@@ -136,6 +141,9 @@ static const int64_t DEFAULT_MAX_TIP_AGE = 0x7fffffff;
 static const bool DEFAULT_PERMIT_BAREMULTISIG = true;
 static const bool DEFAULT_CHECKPOINTS_ENABLED = true;
 static const bool DEFAULT_TXINDEX = true;
+static const bool DEFAULT_UTXOSTATS = true;
+/** Default for -blockfilecache, the number of block files kept mapped (address space is scarce on 32-bit) */
+static const unsigned int DEFAULT_BLOCK_FILE_CACHE = sizeof(void*) > 4 ? 8 : 0;
 static const unsigned int DEFAULT_BANSCORE_THRESHOLD = 100;
 
 static const bool DEFAULT_TESTSAFEMODE = false;
@@ -175,7 +183,9 @@ extern CConditionVariable cvBlockChange;
 extern bool fImporting;
 extern bool fReindex;
 extern int nScriptCheckThreads;
+extern unsigned int nMempoolBatchSize;
 extern bool fTxIndex;
+extern bool fUTXOStats;
 extern bool fIsBareMultisigStd;
 extern bool fBIP37;
 extern bool fRequireStandard;
@@ -209,6 +219,8 @@ static const unsigned int MIN_BLOCKS_TO_KEEP = 500;
 
 static const signed int DEFAULT_CHECKBLOCKS = 50;
 static const unsigned int DEFAULT_CHECKLEVEL = 3;
+/** Default for -verifypowindex, recomputing every proof-of-work hash in the block index at startup */
+static const bool DEFAULT_VERIFY_POW_INDEX = false;
 
 // Require that user allocate at least 550MB for block & undo files (blk???.dat and rev???.dat)
 // At 1MB per block, 288 blocks = 288MB.
@@ -256,6 +268,8 @@ bool LoadBlockIndex();
 void UnloadBlockIndex();
 /** Process protocol messages received from a given node */
 bool ProcessMessages(CNode* pfrom);
+/** Complete work batched up while processing the messages of all nodes */
+void FinishProcessMessages();
 /**
  * Send queued protocol messages to be sent to a give node.
  *
@@ -264,6 +278,10 @@ bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the header PoW hashing thread */
+void ThreadHeaderPoWCheck();
+/** Run an instance of the thread checking blocks being imported (-reindex, -loadblock) */
+void ThreadBlockImportCheck();
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
 bool IsInitialBlockDownload();
 /** Format a string that describes several potential problems detected by the core.
@@ -318,6 +336,15 @@ void PruneAndFlush();
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
                         bool* pfMissingInputs, bool fOverrideMempoolLimit=false, const CAmount nAbsurdFee=0);
 
+/**
+ * Add a batch of transactions to the memory pool in order, as if by calling
+ * AcceptToMemoryPool on each, except that the pool is trimmed once per group.
+ * The script checks of transactions that do not depend on each other are
+ * spread over the script check threads.
+ */
+void AcceptToMemoryPoolBatch(CTxMemPool& pool, const std::vector<CTransaction>& vtx, bool fLimitFree,
+                             std::vector<CValidationState>& vState, std::vector<bool>& vfAccepted, std::vector<bool>& vfMissingInputs);
+
 /** Convert CValidationState to a human-readable message for logging */
 std::string FormatStateMessage(const CValidationState &state);
 
@@ -429,8 +456,8 @@ private:
 
 public:
     CScriptCheck(): amount(0), ptxTo(0), nIn(0), nFlags(0), cacheStore(false), error(SCRIPT_ERR_UNKNOWN_ERROR) {}
-    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn, PrecomputedTransactionData* txdataIn) :
-        scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey), amount(txFromIn.vout[txToIn.vin[nInIn].prevout.n].nValue),
+    CScriptCheck(const CTxOut& outIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn, PrecomputedTransactionData* txdataIn) :
+        scriptPubKey(outIn.scriptPubKey), amount(outIn.nValue),
         ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), cacheStore(cacheIn), error(SCRIPT_ERR_UNKNOWN_ERROR), txdata(txdataIn) { }
 
     bool operator()();
@@ -449,16 +476,53 @@ public:
     ScriptError GetScriptError() const { return error; }
 };
 
+/**
+ * Closure computing the scrypt PoW hashes of a run of consecutive headers, so
+ * that a whole headers message can be hashed in parallel outside cs_main.
+ */
+class CHeaderPoWCheck
+{
+private:
+    const CBlockHeader *pheaders;
+    uint256 *phashes;
+    unsigned int nCount;
+
+public:
+    CHeaderPoWCheck(): pheaders(NULL), phashes(NULL), nCount(0) {}
+    CHeaderPoWCheck(const CBlockHeader* pheadersIn, uint256* phashesIn, unsigned int nCountIn) :
+        pheaders(pheadersIn), phashes(phashesIn), nCount(nCountIn) { }
+
+    bool operator()();
+
+    void swap(CHeaderPoWCheck &check) {
+        std::swap(pheaders, check.pheaders);
+        std::swap(phashes, check.phashes);
+        std::swap(nCount, check.nCount);
+    }
+};
+
+/**
+ * Compute the scrypt PoW hash of every header, spread over the -par threads.
+ * Does not need cs_main; vPoWHash[i] receives headers[i].GetPoWHash().
+ */
+void ComputeHeadersPoWHash(const std::vector<CBlockHeader>& headers, std::vector<uint256>& vPoWHash);
+
 /** Functions for disk access for blocks */
 bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams);
+/** Read the block of pindex at pos, looked up under cs_main, and check it against the index entry; does not need cs_main */
+bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const CBlockIndex* pindex, const Consensus::Params& consensusParams);
+/** Read the block of pindex as it is serialized on disk (and on the network), without deserializing it */
+bool ReadRawBlockFromDisk(std::vector<unsigned char>& vchBlock, const CBlockIndex* pindex);
 
 /** Functions for validating blocks and updating the block tree */
 
 /** Context-independent validity checks */
-bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, const Consensus::Params& consensusParams, bool fCheckPOW = false);
-bool CheckBlock(const CBlock& block, CValidationState& state, const Consensus::Params& consensusParams, bool fCheckPOW = true, bool fCheckMerkleRoot = true, bool fCheckSig = true);
+bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, const Consensus::Params& consensusParams, bool fCheckPOW = false, const uint256* pPoWHash = NULL);
+bool CheckBlock(const CBlock& block, CValidationState& state, const Consensus::Params& consensusParams, bool fCheckPOW = true, bool fCheckMerkleRoot = true, bool fCheckSig = true, const uint256* pPoWHash = NULL);
+/** Check the signature of a block by the key of its coinstake, which is NULL for proof-of-work blocks (that must not be signed) */
+bool CheckBlockSignature(const CBlockHeader& header, const std::vector<unsigned char>& vchBlockSig, const CTransaction* ptxCoinStake);
 
 /** Context-dependent validity checks.
  *  By "context", we mean only the previous block headers, but not the UTXO
@@ -480,7 +544,7 @@ bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockI
 
 /** Proof-of-stake checks */
 bool CheckStake(CBlock* pblock, CWallet& wallet, const CChainParams& chainparams);
-bool SignBlock(CBlock& block, CWallet& wallet, int64_t& nFees);
+bool SignBlock(CBlock& block, CWallet& wallet, int64_t nFees, const COutPoint& prevoutKernel, uint32_t nTimeKernel);
 
 /** Check a block is completely valid from start to finish (only works on top of our current best block, with cs_main held) */
 bool TestBlockValidity(CValidationState& state, const CChainParams& chainparams, const CBlock& block, CBlockIndex* pindexPrev, bool fCheckPOW = true, bool fCheckMerkleRoot = true, bool fCheckSig = true);
@@ -488,6 +552,16 @@ bool TestBlockValidity(CValidationState& state, const CChainParams& chainparams,
 /** When there are blocks in the active chain with missing data, rewind the chainstate and remove them from the block index */
 bool RewindBlockIndex(const CChainParams& params);
 
+/** Compute the UTXO set statistics at the tip if they are not maintained yet (-utxostats) */
+bool InitUTXOStats(const CChainParams& chainparams);
+/** Build the transaction index from the stored build position up to the tip, in the background */
+void ThreadBuildTxIndex();
+/** Read the UTXO set statistics as of a block of the active chain (requires cs_main) */
+bool ReadBlockUTXOStats(const CBlockIndex* pindex, CUTXOStats& stats);
+
+/** Complete a chainstate write that was interrupted, by replaying the blocks it covered */
+bool ReplayBlocks(const CChainParams& params, CCoinsView* view);
+
 /** RAII wrapper for VerifyDB: Verify consistency of the block and coin databases */
 class CVerifyDB {
 public:
@@ -511,9 +585,18 @@ extern CChain chainActive;
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache *pcoinsTip;
 
+/** Global variable that points to the coins database (protected by cs_main) */
+extern CCoinsViewDB *pcoinsdbview;
+
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB *pblocktree;
 
+/** Mapped block files that blocks are read from */
+extern CBlockFileCache blockFileCache;
+
+/** Global variable that points to the transaction index, if -txindex (protected by cs_main) */
+extern CTxIndexDB *ptxindexdb;
+
 /**
  * Return the spend height, which is one more than the inputs.GetBestBlock().
  * While checking, GetBestBlock() refers to the parent block. (protected by cs_main)
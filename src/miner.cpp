@@ -587,71 +587,189 @@ void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned
     pblock->hashMerkleRoot = BlockMerkleRoot(*pblock);
 }
 
-void ThreadStakeMiner(CWallet *pwallet, const CChainParams& chainparams)
+static CCriticalSection cs_stakeMinerStats;
+static CStakeMinerStats stakeMinerStats;
+
+CStakeMinerStats GetStakeMinerStats()
 {
-    SetThreadPriority(THREAD_PRIORITY_LOWEST);
-    LogPrintf("Staking started\n");
+    LOCK(cs_stakeMinerStats);
+    return stakeMinerStats;
+}
 
-    // Make this thread recognisable as the mining thread
-    RenameThread("cashcore-miner");
+/** Wakes the stake miner as soon as the active chain tip changes */
+class CStakeMinerNotifier : public CValidationInterface
+{
+private:
+    boost::mutex cs;
+    boost::condition_variable cond;
+    uint256 hashTip;
 
+protected:
+    void UpdatedBlockTip(const CBlockIndex *pindex)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(cs);
+            hashTip = pindex->GetBlockHash();
+        }
+        cond.notify_all();
+    }
+
+public:
+    /** Wait up to nMillis for the tip to move away from hashKnown */
+    void WaitForNewTip(const uint256& hashKnown, int64_t nMillis)
+    {
+        boost::system_time const timeout = boost::get_system_time() + boost::posix_time::milliseconds(nMillis);
+        boost::unique_lock<boost::mutex> lock(cs);
+        // Until the first notification the caller's tip is the latest we know of
+        if (hashTip.IsNull())
+            hashTip = hashKnown;
+        while (hashTip == hashKnown) {
+            if (!cond.timed_wait(lock, timeout))
+                break;
+        }
+    }
+};
+
+/**
+ * Assemble and sign a block around a kernel found on top of pindexPrev.
+ * Returns false if no template could be created at all.
+ */
+static bool MineStakeBlock(CWallet *pwallet, CReserveKey& reservekey, const CChainParams& chainparams, const CBlockIndex* pindexPrev, unsigned int nBits, const COutPoint& prevoutKernel, uint32_t nTimeKernel)
+{
+    int64_t nFees = 0;
+    int64_t nTimeStart = GetTimeMicros();
+    std::unique_ptr<CBlockTemplate> pblocktemplate(BlockAssembler(chainparams).CreateNewBlock(reservekey.reserveScript, &nFees, true));
+    int64_t nTimeTemplate = GetTimeMicros();
+    {
+        LOCK(cs_stakeMinerStats);
+        stakeMinerStats.nTemplates++;
+        stakeMinerStats.nTemplateMicros += nTimeTemplate - nTimeStart;
+    }
+    if (!pblocktemplate.get())
+        return false;
+
+    // The kernel is only valid for the tip and target it was found against
+    CBlock *pblock = &pblocktemplate->block;
+    if (pblock->hashPrevBlock != pindexPrev->GetBlockHash() || pblock->nBits != nBits)
+        return true;
+
+    // Trying to sign a block
+    bool fSigned = SignBlock(*pblock, *pwallet, nFees, prevoutKernel, nTimeKernel);
+    {
+        LOCK(cs_stakeMinerStats);
+        stakeMinerStats.nSignMicros += GetTimeMicros() - nTimeTemplate;
+        if (fSigned)
+            stakeMinerStats.nBlocksSigned++;
+    }
+    if (fSigned)
+    {
+        // increase priority
+        SetThreadPriority(THREAD_PRIORITY_ABOVE_NORMAL);
+        // Sign the full block
+        CheckStake(pblock, *pwallet, chainparams);
+        // return back to low priority
+        SetThreadPriority(THREAD_PRIORITY_LOWEST);
+    }
+    return true;
+}
+
+static void StakeMinerLoop(CWallet *pwallet, const CChainParams& chainparams, CStakeMinerNotifier& notifier)
+{
+    const Consensus::Params& consensusParams = chainparams.GetConsensus();
     CReserveKey reservekey(pwallet);
 
     bool fTryToSync = true;
-    bool regtestMode = Params().GetConsensus().fPoSNoRetargeting;
+    bool regtestMode = consensusParams.fPoSNoRetargeting;
     if (regtestMode) {
         nMinerSleep = 30000; //limit regtest to 30s, otherwise it'll create 2 blocks per second
     }
 
+    int64_t nLastSearchTime = GetAdjustedTime(); // startup timestamp
+
     while (true)
     {
+        boost::this_thread::interruption_point();
+
         while (pwallet->IsLocked())
         {
             nLastCoinStakeSearchInterval = 0;
             MilliSleep(10000);
         }
 
+        const CBlockIndex* pindexPrev;
+        unsigned int nBits;
+        {
+            LOCK(cs_main);
+            pindexPrev = chainActive.Tip();
+            nBits = GetNextTargetRequired(pindexPrev, NULL, consensusParams, true);
+        }
+        uint256 hashTip = pindexPrev->GetBlockHash();
+
         if (!regtestMode) {
-            while (vNodes.empty() || IsInitialBlockDownload())
+            if (vNodes.empty() || IsInitialBlockDownload())
             {
                 nLastCoinStakeSearchInterval = 0;
                 fTryToSync = true;
-                MilliSleep(1000);
+                notifier.WaitForNewTip(hashTip, 1000);
+                continue;
             }
             if (fTryToSync)
             {
                 fTryToSync = false;
                 if (vNodes.size() < 3 || pindexBestHeader->GetBlockTime() < GetTime() - 10 * 60)
                 {
-                    MilliSleep(60000);
+                    notifier.WaitForNewTip(hashTip, 60000);
                     continue;
                 }
             }
         }
 
-        //
-        // Create new block
-        //
-        if (pwallet->HaveAvailableCoinsForStaking()) {
-            int64_t nFees = 0;
-            // First just create an empty block. No need to process transactions until we know we can create a block
-            std::unique_ptr<CBlockTemplate> pblocktemplate(BlockAssembler(Params()).CreateNewBlock(reservekey.reserveScript, &nFees, true));
-            if (!pblocktemplate.get())
-                 return;
-
-            CBlock *pblock = &pblocktemplate->block;
-            // Trying to sign a block
-            if (SignBlock(*pblock, *pwallet, nFees))
+        // Search the kernels first, a block is only assembled once one hits.
+        // Kernels can only hit at masked timestamps, so search each of them once.
+        int64_t nSearchTime = GetAdjustedTime() & ~consensusParams.nStakeTimestampMask;
+        if (nSearchTime > nLastSearchTime && pwallet->HaveAvailableCoinsForStaking())
+        {
+            COutPoint prevoutKernel;
+            uint32_t nTimeKernel = 0;
+            int64_t nTimeStart = GetTimeMicros();
+            bool fFound = pwallet->FindStakeKernel(nBits, nSearchTime, nSearchTime - nLastSearchTime, prevoutKernel, nTimeKernel);
+            int64_t nSearchMicros = GetTimeMicros() - nTimeStart;
             {
-                // increase priority
-                SetThreadPriority(THREAD_PRIORITY_ABOVE_NORMAL);
-                 // Sign the full block
-                CheckStake(pblock, *pwallet, chainparams);
-                // return back to low priority
-                SetThreadPriority(THREAD_PRIORITY_LOWEST);
-                MilliSleep(500);
+                LOCK(cs_stakeMinerStats);
+                stakeMinerStats.nSearches++;
+                stakeMinerStats.nSearchMicros += nSearchMicros;
+                stakeMinerStats.nLastSearchMicros = nSearchMicros;
             }
+            nLastCoinStakeSearchInterval = nSearchTime - nLastSearchTime;
+            nLastSearchTime = nSearchTime;
+
+            if (fFound && !MineStakeBlock(pwallet, reservekey, chainparams, pindexPrev, nBits, prevoutKernel, nTimeKernel))
+                return;
         }
-        MilliSleep(nMinerSleep);
+
+        // Sleep until the next stake timestamp or a new tip, whichever comes first
+        int64_t nNextSearchTime = nLastSearchTime + consensusParams.nStakeTimestampMask + 1;
+        int64_t nWait = (nNextSearchTime - GetAdjustedTime()) * 1000 - GetTimeMillis() % 1000;
+        notifier.WaitForNewTip(hashTip, std::max(nWait, (int64_t)nMinerSleep));
+    }
+}
+
+void ThreadStakeMiner(CWallet *pwallet, const CChainParams& chainparams)
+{
+    SetThreadPriority(THREAD_PRIORITY_LOWEST);
+    LogPrintf("Staking started\n");
+
+    // Make this thread recognisable as the mining thread
+    RenameThread("cashcore-miner");
+
+    CStakeMinerNotifier notifier;
+    RegisterValidationInterface(&notifier);
+    try {
+        StakeMinerLoop(pwallet, chainparams, notifier);
+    }
+    catch (...) {
+        UnregisterValidationInterface(&notifier);
+        throw;
     }
+    UnregisterValidationInterface(&notifier);
 }
@@ -205,6 +205,24 @@ private:
 /** Modify the extranonce in a block */
 void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
 int64_t UpdateTime(CBlock* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev);
+
+/** Cumulative stake miner timings, in microseconds */
+struct CStakeMinerStats
+{
+    uint64_t nSearches;
+    int64_t nSearchMicros;
+    int64_t nLastSearchMicros;
+    uint64_t nTemplates;
+    int64_t nTemplateMicros;
+    uint64_t nBlocksSigned;
+    int64_t nSignMicros;
+
+    CStakeMinerStats() : nSearches(0), nSearchMicros(0), nLastSearchMicros(0), nTemplates(0),
+                         nTemplateMicros(0), nBlocksSigned(0), nSignMicros(0) {}
+};
+
+CStakeMinerStats GetStakeMinerStats();
+
 /** Run the miner threads */
 void ThreadStakeMiner(CWallet *pwallet, const CChainParams& chainparams);
 
@@ -46,6 +46,12 @@
 // We add a random period time (0 to 1 seconds) to feeler connections to prevent synchronization.
 #define FEELER_SLEEP_WINDOW 1
 
+// How long the socket handler waits when it can be woken up by other threads
+// (ms); this only bounds how quickly disconnects and timeouts are acted on.
+static const int64_t SOCKET_EVENTS_TIMEOUT_MILLIS = 1000;
+// How long it waits otherwise, which is also how often pending sends are polled
+static const int64_t SOCKET_WAIT_MILLIS = 50;
+
 #if !defined(HAVE_MSG_NOSIGNAL) && !defined(MSG_NOSIGNAL)
 #define MSG_NOSIGNAL 0
 #endif
@@ -94,6 +100,7 @@ uint64_t nLocalHostNonce = 0;
 static std::vector<ListenSocket> vhListenSocket;
 CAddrMan addrman;
 int nMaxConnections = DEFAULT_MAX_PEER_CONNECTIONS;
+SocketEventsMode nSocketEventsMode = DEFAULT_SOCKETEVENTS;
 bool fAddressesInitialized = false;
 std::string strSubVersion;
 
@@ -111,7 +118,10 @@ NodeId nLastNodeId = 0;
 CCriticalSection cs_nLastNodeId;
 
 static CSemaphore *semOutbound = NULL;
-boost::condition_variable messageHandlerCondition;
+int nMessageHandlerThreads = DEFAULT_MESSAGE_HANDLER_THREADS;
+// One per handler thread, so each waits only for its own peers' messages
+boost::condition_variable messageHandlerConditions[MAX_MESSAGE_HANDLER_THREADS];
+static CSocketEvents* pSocketEvents = NULL;
 
 // Signals for message handling
 static CNodeSignals g_signals;
@@ -383,6 +393,19 @@ CNode* FindNode(const NodeId nodeid)
     return NULL;
 }
 
+/** Whether the socket handler is able to wait on this socket */
+static bool IsSupportedSocket(SOCKET hSocket)
+{
+    return pSocketEvents ? pSocketEvents->IsSupported(hSocket) : IsSelectableSocket(hSocket);
+}
+
+/** Make the socket handler re-evaluate which sockets it waits on */
+static void WakeSocketHandler()
+{
+    if (pSocketEvents)
+        pSocketEvents->Wakeup();
+}
+
 CNode* ConnectNode(CAddress addrConnect, const char *pszDest, bool fCountFailure)
 {
     if (pszDest == NULL) {
@@ -409,7 +432,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest, bool fCountFailure
     if (pszDest ? ConnectSocketByName(addrConnect, hSocket, pszDest, Params().GetDefaultPort(), nConnectTimeout, &proxyConnectionFailed) :
                   ConnectSocket(addrConnect, hSocket, nConnectTimeout, &proxyConnectionFailed))
     {
-        if (!IsSelectableSocket(hSocket)) {
+        if (!IsSupportedSocket(hSocket)) {
             LogPrintf("Cannot create connection: non-selectable socket created (fd >= FD_SETSIZE ?)\n");
             CloseSocket(hSocket);
             return NULL;
@@ -445,6 +468,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest, bool fCountFailure
             LOCK(cs_vNodes);
             vNodes.push_back(pnode);
         }
+        WakeSocketHandler();
 
         pnode->nServicesExpected = ServiceFlags(addrConnect.nServices & nRelevantServices);
         pnode->nTimeConnected = GetTime();
@@ -485,6 +509,8 @@ void CNode::CloseSocketDisconnect()
     if (hSocket != INVALID_SOCKET)
     {
         LogPrint("net", "disconnecting peer=%d\n", id);
+        if (pSocketEvents)
+            pSocketEvents->Remove(hSocket);
         CloseSocket(hSocket);
     }
 
@@ -764,7 +790,7 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
             i->second += msg.hdr.nMessageSize + CMessageHeader::HEADER_SIZE;
 
             msg.nTime = GetTimeMicros();
-            messageHandlerCondition.notify_one();
+            messageHandlerConditions[id % nMessageHandlerThreads].notify_one();
         }
     }
 
@@ -1045,7 +1071,7 @@ static void AcceptConnection(const ListenSocket& hListenSocket) {
         return;
     }
 
-    if (!IsSelectableSocket(hSocket))
+    if (!IsSupportedSocket(hSocket))
     {
         LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
         CloseSocket(hSocket);
@@ -1093,6 +1119,16 @@ static void AcceptConnection(const ListenSocket& hListenSocket) {
 void ThreadSocketHandler()
 {
     unsigned int nPrevNodeCount = 0;
+    int64_t nLastInactivityCheck = 0;
+    std::vector<std::pair<SOCKET, int> > vReady;
+
+    // Without a way to be woken, poll for sockets with pending sends
+    int64_t nWaitMillis = pSocketEvents->CanWakeup() ? SOCKET_EVENTS_TIMEOUT_MILLIS : SOCKET_WAIT_MILLIS;
+
+    BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
+        if (!pSocketEvents->Set(hListenSocket.socket, SOCKET_EVENT_RECV))
+            LogPrintf("socket events error %s for listening socket\n", NetworkErrorString(WSAGetLastError()));
+
     while (true)
     {
         //
@@ -1159,45 +1195,23 @@ void ThreadSocketHandler()
         }
 
         //
-        // Find which sockets have data to receive
+        // Update which sockets we wait on
         //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
-
-        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket.socket, &fdsetRecv);
-            hSocketMax = std::max(hSocketMax, hListenSocket.socket);
-            have_fds = true;
-        }
-
         {
             LOCK(cs_vNodes);
             BOOST_FOREACH(CNode* pnode, vNodes)
             {
                 if (pnode->hSocket == INVALID_SOCKET)
                     continue;
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = std::max(hSocketMax, pnode->hSocket);
-                have_fds = true;
 
                 // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
+                // * If there is data to send, wait for sending data. As this only
                 //   happens when optimistic write failed, we choose to first drain the
                 //   write buffer in this case before receiving more. This avoids
                 //   needlessly queueing received data, if the remote peer is not themselves
                 //   receiving data. This means properly utilizing TCP flow control signalling.
                 // * Otherwise, if there is no (complete) message in the receive buffer,
-                //   or there is space left in the buffer, select() for receiving data.
+                //   or there is space left in the buffer, wait for receiving data.
                 // * (if neither of the above applies, there is certainly one message
                 //   in the receiver buffer ready to be processed).
                 // Together, that means that at least one of the following is always possible,
@@ -1205,47 +1219,53 @@ void ThreadSocketHandler()
                 // * We send some data.
                 // * We wait for data to be received (and disconnect after timeout).
                 // * We process a message in the buffer (message handler thread).
+                // A buffer we cannot lock right now keeps its previous interest; the
+                // thread holding it wakes us if that leaves the peer stuck.
+                int nPrevEvents = pnode->nSocketEvents;
+                bool fSend = nPrevEvents & SOCKET_EVENT_SEND;
+                bool fRecv = nPrevEvents & SOCKET_EVENT_RECV;
                 {
                     TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSendMsg.empty()) {
-                        FD_SET(pnode->hSocket, &fdsetSend);
-                        continue;
-                    }
+                    if (lockSend)
+                        fSend = !pnode->vSendMsg.empty();
                 }
+                if (!fSend)
                 {
                     TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (
-                        pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
-                        FD_SET(pnode->hSocket, &fdsetRecv);
+                    if (lockRecv)
+                        fRecv = pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+                                pnode->GetTotalRecvSize() <= ReceiveFloodSize();
+                }
+                int nEvents = SOCKET_EVENT_ERR | (fSend ? SOCKET_EVENT_SEND : fRecv ? SOCKET_EVENT_RECV : 0);
+                if (nEvents == nPrevEvents)
+                    continue;
+                if (!pSocketEvents->Set(pnode->hSocket, nEvents)) {
+                    LogPrintf("socket events error %s, disconnecting peer=%d\n", NetworkErrorString(WSAGetLastError()), pnode->id);
+                    pnode->CloseSocketDisconnect();
+                    continue;
                 }
+                pnode->nSocketEvents = nEvents;
             }
         }
 
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
-        boost::this_thread::interruption_point();
-
-        if (nSelect == SOCKET_ERROR)
+        //
+        // Wait for readiness, or for another thread to wake us
+        //
+        if (!pSocketEvents->Wait(nWaitMillis, vReady))
         {
-            if (have_fds)
-            {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
-            }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec/1000);
+            LogPrintf("socket events wait error %s\n", NetworkErrorString(WSAGetLastError()));
+            MilliSleep(SOCKET_WAIT_MILLIS);
         }
+        boost::this_thread::interruption_point();
+
+        std::map<SOCKET, int> mapReady(vReady.begin(), vReady.end());
 
         //
         // Accept new connections
         //
         BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
         {
-            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
+            if (hListenSocket.socket != INVALID_SOCKET && mapReady.count(hListenSocket.socket))
             {
                 AcceptConnection(hListenSocket);
             }
@@ -1254,6 +1274,9 @@ void ThreadSocketHandler()
         //
         // Service each socket
         //
+        int64_t nTime = GetTime();
+        bool fCheckInactivity = nTime != nLastInactivityCheck;
+        nLastInactivityCheck = nTime;
         std::vector<CNode*> vNodesCopy;
         {
             LOCK(cs_vNodes);
@@ -1265,12 +1288,15 @@ void ThreadSocketHandler()
         {
             boost::this_thread::interruption_point();
 
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+            std::map<SOCKET, int>::const_iterator itReady = mapReady.find(pnode->hSocket);
+            int nReady = itReady == mapReady.end() ? 0 : itReady->second;
+
             //
             // Receive
             //
-            if (pnode->hSocket == INVALID_SOCKET)
-                continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+            if (nReady & (SOCKET_EVENT_RECV | SOCKET_EVENT_ERR))
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv)
@@ -1314,7 +1340,7 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
+            if (nReady & SOCKET_EVENT_SEND)
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend)
@@ -1324,8 +1350,7 @@ void ThreadSocketHandler()
             //
             // Inactivity checking
             //
-            int64_t nTime = GetTime();
-            if (nTime - pnode->nTimeConnected > 60)
+            if (fCheckInactivity && nTime - pnode->nTimeConnected > 60)
             {
                 if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
                 {
@@ -1856,7 +1881,11 @@ bool OpenNetworkConnection(const CAddress& addrConnect, bool fCountFailure, CSem
 }
 
 
-void ThreadMessageHandler()
+/**
+ * Process messages for the peers whose id falls in this thread's shard, so a
+ * peer is always handled by the same thread and its messages stay in order.
+ */
+void ThreadMessageHandler(int nShard)
 {
     boost::mutex condition_mutex;
     boost::unique_lock<boost::mutex> lock(condition_mutex);
@@ -1876,7 +1905,7 @@ void ThreadMessageHandler()
 
         BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
-            if (pnode->fDisconnect)
+            if (pnode->fDisconnect || pnode->id % nMessageHandlerThreads != nShard)
                 continue;
 
             // Receive messages
@@ -1887,6 +1916,10 @@ void ThreadMessageHandler()
                     if (!GetNodeSignals().ProcessMessages(pnode))
                         pnode->CloseSocketDisconnect();
 
+                    // Reading was paused while the receive buffer was full
+                    if (!(pnode->nSocketEvents & (SOCKET_EVENT_RECV | SOCKET_EVENT_SEND)))
+                        WakeSocketHandler();
+
                     if (pnode->nSendSize < SendBufferSize())
                     {
                         if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
@@ -1907,6 +1940,8 @@ void ThreadMessageHandler()
             boost::this_thread::interruption_point();
         }
 
+        GetNodeSignals().FinishProcessMessages();
+
         {
             LOCK(cs_vNodes);
             BOOST_FOREACH(CNode* pnode, vNodesCopy)
@@ -1914,11 +1949,16 @@ void ThreadMessageHandler()
         }
 
         if (fSleep)
-            messageHandlerCondition.timed_wait(lock, boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(100));
+            messageHandlerConditions[nShard].timed_wait(lock, boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(100));
     }
 }
 
 
+static void TraceMessageHandler(int nShard)
+{
+    std::string strName = nShard ? strprintf("msghand.%d", nShard) : "msghand";
+    TraceThread(strName.c_str(), boost::bind(&ThreadMessageHandler, nShard));
+}
 
 
 
@@ -2136,6 +2176,15 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     // Map ports with UPnP
     MapPort(GetBoolArg("-upnp", DEFAULT_UPNP));
 
+    if (!pSocketEvents) {
+        pSocketEvents = CreateSocketEvents(nSocketEventsMode);
+        if (!pSocketEvents) {
+            LogPrintf("Socket events mode %s unavailable, falling back to select\n", GetSocketEventsModeName(nSocketEventsMode));
+            pSocketEvents = CreateSocketEvents(SOCKETEVENTS_SELECT);
+        }
+        LogPrintf("Using %s for socket events\n", GetSocketEventsModeName(pSocketEvents->GetMode()));
+    }
+
     // Send and receive from sockets, accept connections
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "net", &ThreadSocketHandler));
 
@@ -2146,7 +2195,8 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnections));
 
     // Process messages
-    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    for (int i = 0; i < nMessageHandlerThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceMessageHandler, i));
 
     // Dump network addresses
     scheduler.scheduleEvery(&DumpData, DUMP_ADDRESSES_INTERVAL);
@@ -2195,6 +2245,8 @@ public:
         vhListenSocket.clear();
         delete semOutbound;
         semOutbound = NULL;
+        delete pSocketEvents;
+        pSocketEvents = NULL;
         delete pnodeLocalHost;
         pnodeLocalHost = NULL;
 
@@ -2373,6 +2425,7 @@ CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNa
     nServices = NODE_NONE;
     nServicesExpected = NODE_NONE;
     hSocket = hSocketIn;
+    nSocketEvents = 0;
     nRecvVersion = INIT_PROTO_VERSION;
     nLastSend = 0;
     nLastRecv = 0;
@@ -2542,6 +2595,10 @@ void CNode::EndMessage(const char* pszCommand) UNLOCK_FUNCTION(cs_vSend)
     if (it == vSendMsg.begin())
         SocketSendData(this);
 
+    // Anything left over has to wait for the socket to become writable
+    if (!vSendMsg.empty() && !(nSocketEvents & SOCKET_EVENT_SEND))
+        WakeSocketHandler();
+
     LEAVE_CRITICAL_SECTION(cs_vSend);
 }
 
@@ -14,6 +14,7 @@
 #include "netaddress.h"
 #include "protocol.h"
 #include "random.h"
+#include "socketevents.h"
 #include "streams.h"
 #include "sync.h"
 #include "uint256.h"
@@ -74,6 +75,10 @@ static const bool DEFAULT_BLOCKSONLY = false;
 static const bool DEFAULT_FORCEDNSSEED = false;
 static const size_t DEFAULT_MAXRECEIVEBUFFER = 5 * 1000;
 static const size_t DEFAULT_MAXSENDBUFFER    = 1 * 1000;
+/** Default for -msghandlerthreads, the number of threads processing peer messages */
+static const int DEFAULT_MESSAGE_HANDLER_THREADS = 1;
+/** Upper bound for -msghandlerthreads */
+static const int MAX_MESSAGE_HANDLER_THREADS = 16;
 
 static const ServiceFlags REQUIRED_SERVICES = NODE_NETWORK;
 
@@ -120,6 +125,7 @@ struct CNodeSignals
 {
     boost::signals2::signal<int ()> GetHeight;
     boost::signals2::signal<bool (CNode*), CombinerAll> ProcessMessages;
+    boost::signals2::signal<void ()> FinishProcessMessages;
     boost::signals2::signal<bool (CNode*), CombinerAll> SendMessages;
     boost::signals2::signal<void (NodeId, const CNode*)> InitializeNode;
     boost::signals2::signal<void (NodeId)> FinalizeNode;
@@ -166,6 +172,10 @@ extern CAddrMan addrman;
 
 /** Maximum number of connections to simultaneously allow (aka connection slots) */
 extern int nMaxConnections;
+/** Peers are sharded over this many message handler threads by node id */
+extern int nMessageHandlerThreads;
+/** How the socket handler thread waits for peer sockets (-socketevents) */
+extern SocketEventsMode nSocketEventsMode;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
@@ -266,6 +276,8 @@ public:
     ServiceFlags nServices;
     ServiceFlags nServicesExpected;
     SOCKET hSocket;
+    // SOCKET_EVENT_* the socket handler waits for on hSocket, 0 until registered
+    std::atomic<int> nSocketEvents;
     CDataStream ssSend;
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
@@ -10,6 +10,7 @@
 
 #include "chain.h"
 #include "chainparams.h"
+#include "checkqueue.h"
 #include "clientversion.h"
 #include "coins.h"
 #include "hash.h"
@@ -18,6 +19,17 @@
 #include "primitives/transaction.h"
 #include <stdio.h>
 #include "util.h"
+#include "utiltime.h"
+
+#include <boost/thread.hpp>
+
+int nStakeKernelThreads = 0;
+std::atomic<uint64_t> nLastStakeSearchProbes(0);
+std::atomic<int64_t> nLastStakeSearchMicros(0);
+
+static CCheckQueue<CStakeKernelCheck> kernelcheckqueue(16);
+
+CStakeInputCache stakeInputCache(STAKE_INPUT_CACHE_SIZE);
 
 // Stake Modifier (hash modifier of proof-of-stake):
 // The purpose of stake modifier is to prevent a txout (coin) owner from
@@ -69,9 +81,9 @@ bool CheckStakeBlockTimestamp(int64_t nTimeBlock)
 //   quantities so as to generate blocks faster, degrading the system back into
 //   a proof-of-work situation.
 //
-bool CheckStakeKernelHash(const CBlockIndex* pindexPrev, unsigned int nBits, const CCoins* txPrev, const COutPoint& prevout, unsigned int nTimeTx, bool fPrintProofOfStake)
+bool CheckStakeKernelHash(const CBlockIndex* pindexPrev, unsigned int nBits, uint32_t nTimePrev, CAmount nValuePrev, const COutPoint& prevout, unsigned int nTimeTx, bool fPrintProofOfStake)
 {
-    if (nTimeTx < txPrev->nTime)  // Transaction timestamp violation
+    if (nTimeTx < nTimePrev)  // Transaction timestamp violation
         return error("CheckStakeKernelHash() : nTime violation");
 
     // Base target
@@ -79,7 +91,7 @@ bool CheckStakeKernelHash(const CBlockIndex* pindexPrev, unsigned int nBits, con
     bnTarget.SetCompact(nBits);
 
     // Weighted target
-    int64_t nValueIn = txPrev->vout[prevout.n].nValue;
+    int64_t nValueIn = nValuePrev;
     if (nValueIn == 0)
         return error("CheckStakeKernelHash() : nValueIn = 0");
     arith_uint256 bnWeight = arith_uint256(nValueIn);
@@ -90,7 +102,7 @@ bool CheckStakeKernelHash(const CBlockIndex* pindexPrev, unsigned int nBits, con
     // Calculate hash
     CHashWriter ss(SER_GETHASH, 0);
     ss << nStakeModifier;
-    ss << txPrev->nTime << prevout.hash << prevout.n << nTimeTx;
+    ss << nTimePrev << prevout.hash << prevout.n << nTimeTx;
 
     uint256 hashProofOfStake = ss.GetHash();
 
@@ -98,7 +110,7 @@ bool CheckStakeKernelHash(const CBlockIndex* pindexPrev, unsigned int nBits, con
     {
         LogPrintf("CheckStakeKernelHash() : nStakeModifier=%s, txPrev.nTime=%u, txPrev.vout.hash=%s, txPrev.vout.n=%u, nTime=%u, hashProof=%s\n",
             nStakeModifier.GetHex().c_str(),
-            txPrev->nTime, prevout.hash.ToString(), prevout.n, nTimeTx,
+            nTimePrev, prevout.hash.ToString(), prevout.n, nTimeTx,
             hashProofOfStake.ToString());
     }
 
@@ -110,7 +122,7 @@ bool CheckStakeKernelHash(const CBlockIndex* pindexPrev, unsigned int nBits, con
     {
         LogPrintf("CheckStakeKernelHash() : nStakeModifier=%s, txPrev.nTime=%u, txPrev.vout.hash=%s, txPrev.vout.n=%u, nTime=%u, hashProof=%s\n",
             nStakeModifier.GetHex().c_str(),
-            txPrev->nTime, prevout.hash.ToString(), prevout.n, nTimeTx,
+            nTimePrev, prevout.hash.ToString(), prevout.n, nTimeTx,
             hashProofOfStake.ToString());
     }
 
@@ -118,7 +130,7 @@ bool CheckStakeKernelHash(const CBlockIndex* pindexPrev, unsigned int nBits, con
 }
 
 // Check kernel hash target and coinstake signature
-bool CheckProofOfStake(CBlockIndex* pindexPrev, const CTransaction& tx, unsigned int nBits, CValidationState &state)
+bool CheckProofOfStake(const CBlockIndex* pindexPrev, const CTransaction& tx, unsigned int nBits, const CStakeInput& input, CValidationState &state)
 {
     if (!tx.IsCoinStake())
         return error("CheckProofOfStake() : called on non-coinstake %s", tx.GetHash().ToString());
@@ -126,127 +138,183 @@ bool CheckProofOfStake(CBlockIndex* pindexPrev, const CTransaction& tx, unsigned
     // Kernel (input 0) must match the stake hash target per coin age (nBits)
     const CTxIn& txin = tx.vin[0];
 
-    // First try finding the previous transaction in database
-    CTransaction txPrev;
-    uint256 hashBlock = uint256();
-    if (!GetTransaction(txin.prevout.hash, txPrev, Params().GetConsensus(), hashBlock, true))
-       return state.DoS(100, error("CheckProofOfStake() : INFO: read txPrev failed"));  // previous transaction not in main chain, may occur during initial download
-
-    if (mapBlockIndex.count(hashBlock) == 0)
-        return fDebug ? state.DoS(100, error("CheckProofOfStake() : read block failed")) : false; // unable to read block of previous transaction
-
-    // Verify inputs
-    if (txin.prevout.hash != txPrev.GetHash())
-        return state.DoS(100, error("CheckProofOfStake() : coinstake input does not match previous output %s", txin.prevout.hash.GetHex()));
-
     // Verify signature
-    if (!VerifySignature(txPrev, tx, 0, SCRIPT_VERIFY_NONE, 0))
+    if (!VerifyScript(txin.scriptSig, input.scriptPubKey, SCRIPT_VERIFY_NONE, TransactionSignatureChecker(&tx, 0, input.nValue), NULL))
        return state.DoS(100, error("CheckProofOfStake() : VerifySignature failed on coinstake %s", tx.GetHash().ToString()));
 
     // Min age requirement
-    if (pindexPrev->nHeight + 1 - mapBlockIndex[hashBlock]->nHeight < Params().GetConsensus().nCoinbaseMaturity){
-        return state.DoS(100, error("CheckProofOfStake() : stake prevout is not mature, expecting %i and only matured to %i", Params().GetConsensus().nCoinbaseMaturity, pindexPrev->nHeight + 1 - mapBlockIndex[hashBlock]->nHeight));
+    if (pindexPrev->nHeight + 1 - input.nHeight < Params().GetConsensus().nCoinbaseMaturity){
+        return state.DoS(100, error("CheckProofOfStake() : stake prevout is not mature, expecting %i and only matured to %i", Params().GetConsensus().nCoinbaseMaturity, pindexPrev->nHeight + 1 - input.nHeight));
     }
 
-    if (!CheckStakeKernelHash(pindexPrev, nBits, new CCoins(txPrev, pindexPrev->nHeight), txin.prevout, tx.nTime, fDebug))
+    if (!CheckStakeKernelHash(pindexPrev, nBits, input.nTime, input.nValue, txin.prevout, tx.nTime, fDebug))
        return state.DoS(1, error("CheckProofOfStake() : INFO: check kernel failed on coinstake %s", tx.GetHash().ToString())); // may occur during initial download or if behind on block chain sync
 
     return true;
 }
 
-bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType)
+bool CStakeInputCache::Get(const COutPoint& prevout, CStakeInput& inputRet) const
 {
-    assert(nIn < txTo.vin.size());
-    const CTxIn& txin = txTo.vin[nIn];
-    if (txin.prevout.n >= txFrom.vout.size())
+    std::map<COutPoint, CStakeInput>::const_iterator it = mapInputs.find(prevout);
+    if (it == mapInputs.end())
         return false;
-    const CTxOut& txout = txFrom.vout[txin.prevout.n];
+    inputRet = it->second;
+    return true;
+}
 
-    if (txin.prevout.hash != txFrom.GetHash())
-        return false;
+void CStakeInputCache::Add(const COutPoint& prevout, const CStakeInput& input)
+{
+    if (nMaxSize == 0)
+        return;
+    std::pair<std::map<COutPoint, CStakeInput>::iterator, bool> ret = mapInputs.insert(std::make_pair(prevout, input));
+    if (!ret.second) {
+        ret.first->second = input;
+        return;
+    }
+    queueInputs.push_back(prevout);
+    while (queueInputs.size() > nMaxSize) {
+        mapInputs.erase(queueInputs.front());
+        queueInputs.pop_front();
+    }
+}
 
-    return VerifyScript(txin.scriptSig, txout.scriptPubKey, flags, TransactionSignatureChecker(&txTo, nIn, 0),  NULL);
+// A transaction of the same hash may be in another block on other chains
+static bool IsStakeInputInChain(const CBlockIndex* pindexPrev, const CStakeInput& input)
+{
+    const CBlockIndex* pindexFrom = pindexPrev->GetAncestor(input.nHeight);
+    return pindexFrom && pindexFrom->GetBlockHash() == input.hashBlock;
 }
 
-bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, uint32_t nTimeBlock, const COutPoint& prevout){
-    std::map<COutPoint, CStakeCache> tmp;
-    return CheckKernel(pindexPrev, nBits, nTimeBlock, prevout, tmp);
+bool GetStakeInput(const CBlockIndex* pindexPrev, const COutPoint& prevout, const CCoinsViewCache& view, CStakeInput& inputRet)
+{
+    AssertLockHeld(cs_main);
+    if (stakeInputCache.Get(prevout, inputRet) && IsStakeInputInChain(pindexPrev, inputRet))
+        return true;
+
+    const Coin& coin = view.AccessCoin(prevout);
+    if (coin.IsSpent())
+        return false;
+    const CBlockIndex* pindexFrom = chainActive[coin.nHeight];
+    if (!pindexFrom)
+        return false;
+    inputRet = CStakeInput(coin, pindexFrom->GetBlockHash());
+    stakeInputCache.Add(prevout, inputRet);
+    return IsStakeInputInChain(pindexPrev, inputRet);
 }
 
-bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, uint32_t nTime, const COutPoint& prevout, const std::map<COutPoint, CStakeCache>& cache)
+CStakeKernel::CStakeKernel(const CBlockIndex* pindexPrev, unsigned int nBits, const COutPoint& prevoutIn, uint32_t nTimePrevIn, CAmount nValueIn) :
+    ssPrefix(SER_GETHASH, 0), prevout(prevoutIn), nTimePrev(nTimePrevIn)
 {
-    uint256 hashProofOfStake, targetProofOfStake;
-    auto it=cache.find(prevout);
-
-    if(it == cache.end()) {
-        CTransaction txPrev;
-        uint256 hashBlock = uint256();
-        if (!GetTransaction(prevout.hash, txPrev, Params().GetConsensus(), hashBlock, true)){
-            LogPrintf("CheckKernel() : could not find previous transaction %s\n", prevout.hash.ToString());
-            return false;
-        }
+    // Same preimage and weighted target as CheckStakeKernelHash, minus nTimeTx
+    bnTarget.SetCompact(nBits);
+    bnTarget *= arith_uint256(nValueIn);
+    ssPrefix << pindexPrev->nStakeModifier;
+    ssPrefix << nTimePrev << prevout.hash << prevout.n;
+}
 
-        if (mapBlockIndex.count(hashBlock) == 0) {
-            LogPrintf("CheckKernel() : could not find block of previous transaction %s\n", hashBlock.ToString());
-            return false;
-        }
+bool CStakeKernel::CheckHash(uint32_t nTimeTx) const
+{
+    if (nTimeTx < nTimePrev)
+        return false;
+    CHashWriter ss(ssPrefix);
+    ss << nTimeTx;
+    return UintToArith256(ss.GetHash()) <= bnTarget;
+}
 
-        if (pindexPrev->nHeight + 1 - mapBlockIndex[hashBlock]->nHeight < Params().GetConsensus().nCoinbaseMaturity){
-            LogPrintf("CheckKernel() : stake prevout is not mature in block %s\n", hashBlock.ToString());
+bool CStakeKernelCheck::operator()()
+{
+    uint32_t nTime = nTimeBegin;
+    for (unsigned int n = 0; n < nProbes; n++, nTime -= nStep) {
+        if (pkernel->CheckHash(nTime)) {
+            boost::unique_lock<boost::mutex> lock(phit->mutex);
+            if (!phit->fFound) {
+                phit->fFound = true;
+                phit->nIndex = nIndex;
+                phit->nTime = nTime;
+            }
+            nLastStakeSearchProbes += n + 1;
             return false;
         }
+    }
+    nLastStakeSearchProbes += nProbes;
+    return true;
+}
 
-        //CheckStakeKernalHash needs a pointer to coins in order to be used to validate the chain on disk/memort
-        //Using a pointer in this context is not needed, but is required by the function. 
-        //Must ensure coins is deleted to prevent memory leak. 
-        CCoins* coins = new CCoins(txPrev, pindexPrev->nHeight);
-        bool result = CheckStakeKernelHash(pindexPrev, nBits, coins, prevout, nTime);
-        delete coins;
+void ThreadStakeKernelCheck() {
+    RenameThread("cashcore-stakecheck");
+    kernelcheckqueue.Thread();
+}
 
-        return result;
+bool SearchStakeKernels(const std::vector<CStakeKernel>& vKernels, uint32_t nTimeBegin, unsigned int nProbes, unsigned int nStep, size_t& nIndexRet, uint32_t& nTimeRet)
+{
+    int64_t nTimeStart = GetTimeMicros();
+    nLastStakeSearchProbes = 0;
+
+    // Never probe below the epoch
+    if (nStep == 0)
+        nStep = 1;
+    nProbes = std::min(nProbes, nTimeBegin / nStep + 1);
+
+    CStakeKernelHit hit;
+    if (nStakeKernelThreads) {
+        CCheckQueueControl<CStakeKernelCheck> control(&kernelcheckqueue);
+        std::vector<CStakeKernelCheck> vChecks;
+        vChecks.reserve(vKernels.size());
+        for (size_t i = 0; i < vKernels.size(); i++)
+            vChecks.push_back(CStakeKernelCheck(&vKernels[i], i, nTimeBegin, nProbes, nStep, &hit));
+        control.Add(vChecks);
+        control.Wait();
     } else {
-        //found in cache
-        const CStakeCache& stake = it->second;
-        /*
-        if (CheckStakeKernelHash(pindexPrev, nBits, new CCoins(stake.txPrev, pindexPrev->nHeight), prevout, nTime)) {
-            // Cache could potentially cause false positive stakes in the event of deep reorgs, so check without cache also
-            return CheckKernel(pindexPrev, nBits, nTime, prevout);
+        for (size_t i = 0; i < vKernels.size(); i++) {
+            boost::this_thread::interruption_point();
+            CStakeKernelCheck check(&vKernels[i], i, nTimeBegin, nProbes, nStep, &hit);
+            if (!check())
+                break;
         }
-        */
-
-        //CheckStakeKernalHash needs a pointer to coins in order to be used to validate the chain on disk/memort
-        //Using a pointer in this context is not needed, but is required by the function.
-        //Must ensure coins is deleted to prevent memory leak. 
-        CCoins* coins = new CCoins(stake.txPrev, pindexPrev->nHeight);
-        bool result = CheckStakeKernelHash(pindexPrev, nBits, coins, prevout, nTime);
-        delete coins;
-
-        return result;
     }
+
+    nLastStakeSearchMicros = GetTimeMicros() - nTimeStart;
+    if (!hit.fFound)
+        return false;
+    nIndexRet = hit.nIndex;
+    nTimeRet = hit.nTime;
+    return true;
 }
 
-void CacheKernel(std::map<COutPoint, CStakeCache>& cache, const COutPoint& prevout, CBlockIndex* pindexPrev){
-    if(cache.find(prevout) != cache.end()){
-        //already in cache
-        return;
-    }
-    CTransaction txPrev;
-    uint256 hashBlock = uint256();
-    if (!GetTransaction(prevout.hash, txPrev, Params().GetConsensus(), hashBlock, true)){
-        LogPrintf("CacheKernel() : could not find previous transaction %s\n", prevout.hash.ToString());
-        return;
+bool PrepareStakeKernel(const CBlockIndex* pindexPrev, unsigned int nBits, const COutPoint& prevout, const CStakeCandidate& candidate, CStakeKernel& kernelRet)
+{
+    if (candidate.nValue == 0)
+        return false;
+
+    // The block of the prevout may have been reorganized away since the candidate was recorded
+    const CBlockIndex* pindexFrom = pindexPrev->GetAncestor(candidate.nHeight);
+    if (!pindexFrom || pindexFrom->GetBlockHash() != candidate.hashBlock) {
+        LogPrint("coinstake", "PrepareStakeKernel() : block %s of stake prevout is not in the chain\n", candidate.hashBlock.ToString());
+        return false;
     }
 
-    if (mapBlockIndex.count(hashBlock) == 0) {
-        LogPrintf("CacheKernel() : could not find block of previous transaction %s\n", hashBlock.ToString());
-        return;
+    if (pindexPrev->nHeight + 1 - candidate.nHeight < Params().GetConsensus().nCoinbaseMaturity) {
+        LogPrint("coinstake", "PrepareStakeKernel() : stake prevout is not mature in block %s\n", candidate.hashBlock.ToString());
+        return false;
     }
 
-    if (pindexPrev->nHeight + 1 - mapBlockIndex[hashBlock]->nHeight < Params().GetConsensus().nCoinbaseMaturity){
-        LogPrintf("CheckKernel() : stake prevout is not mature in block %s\n", hashBlock.ToString());
-        return;
+    kernelRet = CStakeKernel(pindexPrev, nBits, prevout, candidate.nTime, candidate.nValue);
+    return true;
+}
+
+bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, uint32_t nTime, const COutPoint& prevout)
+{
+    CStakeInput input;
+    {
+        LOCK(cs_main);
+        if (!GetStakeInput(pindexPrev, prevout, *pcoinsTip, input))
+            return false;
     }
+    CStakeCandidate candidate(input.nTime, input.nValue, input.nHeight, input.hashBlock);
+
+    CStakeKernel kernel;
+    if (!PrepareStakeKernel(pindexPrev, nBits, prevout, candidate, kernel))
+        return false;
 
-    CStakeCache c(hashBlock, txPrev);
-    cache.insert({prevout, c});
+    return kernel.CheckHash(nTime);
 }
@@ -20,25 +20,184 @@
 #include "script/sign.h"
 #include <stdint.h>
 
+#include <atomic>
+#include <deque>
+#include <map>
+
+#include <boost/thread/mutex.hpp>
+
 using namespace std;
 
 /** Compute the hash modifier for proof-of-stake */
 uint256 ComputeStakeModifier(const CBlockIndex* pindexPrev, const uint256& kernel);
 
-struct CStakeCache{
-    CStakeCache(uint256 hashBlock_, const CTransaction txPrev_) : hashBlock(hashBlock_), txPrev(txPrev_){
+/** What the stake kernel needs to know about a prevout, without its transaction */
+class CStakeCandidate
+{
+public:
+    uint32_t nTime;
+    CAmount nValue;
+    int nHeight;
+    uint256 hashBlock;
+
+    CStakeCandidate() : nTime(0), nValue(0), nHeight(0) {}
+    CStakeCandidate(uint32_t nTimeIn, CAmount nValueIn, int nHeightIn, const uint256& hashBlockIn) :
+        nTime(nTimeIn), nValue(nValueIn), nHeight(nHeightIn), hashBlock(hashBlockIn) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(nTime);
+        READWRITE(nValue);
+        READWRITE(nHeight);
+        READWRITE(hashBlock);
     }
+};
+
+/**
+ * What checking a coinstake needs to know about its kernel input: the
+ * output and its transaction time, and the block that created it, so the
+ * input can be matched against the chain the coinstake builds on.
+ */
+class CStakeInput
+{
+public:
+    uint32_t nTime;
+    CAmount nValue;
+    int nHeight;
     uint256 hashBlock;
-    const CTransaction txPrev;
+    CScript scriptPubKey;
+
+    CStakeInput() : nTime(0), nValue(0), nHeight(0) {}
+    CStakeInput(const Coin& coin, const uint256& hashBlockIn) :
+        nTime(coin.nTime), nValue(coin.out.nValue), nHeight(coin.nHeight), hashBlock(hashBlockIn), scriptPubKey(coin.out.scriptPubKey) {}
+};
+
+/**
+ * Stake inputs by prevout, kept after the coins view has spent them so
+ * competing blocks staking the same input can still be checked. The
+ * oldest entries are dropped first.
+ */
+class CStakeInputCache
+{
+private:
+    size_t nMaxSize;
+    std::map<COutPoint, CStakeInput> mapInputs;
+    //! Cached prevouts, oldest first
+    std::deque<COutPoint> queueInputs;
+
+public:
+    explicit CStakeInputCache(size_t nMaxSizeIn) : nMaxSize(nMaxSizeIn) {}
+
+    bool Get(const COutPoint& prevout, CStakeInput& inputRet) const;
+    void Add(const COutPoint& prevout, const CStakeInput& input);
+    size_t size() const { return mapInputs.size(); }
+};
+
+/** Number of stake inputs kept by stakeInputCache */
+static const size_t STAKE_INPUT_CACHE_SIZE = 10000;
+/** Kernel inputs of recently checked coinstakes (guarded by cs_main) */
+extern CStakeInputCache stakeInputCache;
+
+/**
+ * Invariant part of a stake kernel: nStakeModifier, txPrev.nTime and prevout are
+ * hashed once per prevout per tip, so a probe only appends the timestamp.
+ */
+class CStakeKernel
+{
+private:
+    CHashWriter ssPrefix;
+    arith_uint256 bnTarget;
+
+public:
+    COutPoint prevout;
+    uint32_t nTimePrev;
+
+    CStakeKernel() : ssPrefix(SER_GETHASH, 0), nTimePrev(0) {}
+    CStakeKernel(const CBlockIndex* pindexPrev, unsigned int nBits, const COutPoint& prevoutIn, uint32_t nTimePrevIn, CAmount nValueIn);
+
+    //! Whether the kernel meets the weighted target at the given timestamp
+    bool CheckHash(uint32_t nTimeTx) const;
+};
+
+/** Result of a stake kernel search, shared between the search workers */
+struct CStakeKernelHit
+{
+    boost::mutex mutex;
+    bool fFound;
+    size_t nIndex;
+    uint32_t nTime;
+
+    CStakeKernelHit() : fFound(false), nIndex(0), nTime(0) {}
+};
+
+/**
+ * Closure representing one kernel scanned over a window of timestamps.
+ * Returns false once a hit is recorded, which makes CCheckQueue skip the
+ * remaining work.
+ */
+class CStakeKernelCheck
+{
+private:
+    const CStakeKernel* pkernel;
+    size_t nIndex;
+    uint32_t nTimeBegin;
+    unsigned int nProbes;
+    unsigned int nStep;
+    CStakeKernelHit* phit;
+
+public:
+    CStakeKernelCheck() : pkernel(NULL), nIndex(0), nTimeBegin(0), nProbes(0), nStep(1), phit(NULL) {}
+    CStakeKernelCheck(const CStakeKernel* pkernelIn, size_t nIndexIn, uint32_t nTimeBeginIn, unsigned int nProbesIn, unsigned int nStepIn, CStakeKernelHit* phitIn) :
+        pkernel(pkernelIn), nIndex(nIndexIn), nTimeBegin(nTimeBeginIn), nProbes(nProbesIn), nStep(nStepIn), phit(phitIn) {}
+
+    bool operator()();
+
+    void swap(CStakeKernelCheck& check) {
+        std::swap(pkernel, check.pkernel);
+        std::swap(nIndex, check.nIndex);
+        std::swap(nTimeBegin, check.nTimeBegin);
+        std::swap(nProbes, check.nProbes);
+        std::swap(nStep, check.nStep);
+        std::swap(phit, check.phit);
+    }
 };
 
+/** -stakethreads default (number of kernel search threads, 0 = auto) */
+static const int DEFAULT_STAKE_THREADS = 0;
+/** Maximum number of kernel search threads */
+static const int MAX_STAKE_THREADS = 16;
+/** Number of kernel search threads, 0 = search on the calling thread */
+extern int nStakeKernelThreads;
+/** Kernel probes done and microseconds spent by the last kernel search */
+extern std::atomic<uint64_t> nLastStakeSearchProbes;
+extern std::atomic<int64_t> nLastStakeSearchMicros;
+
+/** Run instances of this to serve the kernel search queue */
+void ThreadStakeKernelCheck();
+
+/**
+ * Scan vKernels over nProbes timestamps, going backwards from nTimeBegin in
+ * steps of nStep seconds. Stops at the first hit, returning the index of the
+ * kernel and the timestamp that met the target.
+ */
+bool SearchStakeKernels(const std::vector<CStakeKernel>& vKernels, uint32_t nTimeBegin, unsigned int nProbes, unsigned int nStep, size_t& nIndexRet, uint32_t& nTimeRet);
+
+/**
+ * Look the kernel input of a coinstake up in stakeInputCache or in view,
+ * the coins view of the active chain, without reading any block. Returns
+ * false if it is not known or not in the chain of pindexPrev. Requires cs_main.
+ */
+bool GetStakeInput(const CBlockIndex* pindexPrev, const COutPoint& prevout, const CCoinsViewCache& view, CStakeInput& inputRet);
+// Build the kernel of a candidate, checking that it is mature and still in the chain of pindexPrev
+bool PrepareStakeKernel(const CBlockIndex* pindexPrev, unsigned int nBits, const COutPoint& prevout, const CStakeCandidate& candidate, CStakeKernel& kernelRet);
+
 // Check whether the coinstake timestamp meets protocol
 bool CheckCoinStakeTimestamp(int64_t nTimeBlock, int64_t nTimeTx);
 bool CheckStakeBlockTimestamp(int64_t nTimeBlock);
 bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, uint32_t nTime, const COutPoint& prevout);
-bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, uint32_t nTime, const COutPoint& prevout, const std::map<COutPoint, CStakeCache>& cache);
-bool CheckStakeKernelHash(const CBlockIndex* pindexPrev, unsigned int nBits, const CCoins* txPrev, const COutPoint& prevout, unsigned int nTimeTx, bool fPrintProofOfStake = false);
-bool CheckProofOfStake(CBlockIndex* pindexPrev, const CTransaction& tx, unsigned int nBits, CValidationState &state);
-void CacheKernel(std::map<COutPoint, CStakeCache>& cache, const COutPoint& prevout, CBlockIndex* pindexPrev);
-bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
+bool CheckStakeKernelHash(const CBlockIndex* pindexPrev, unsigned int nBits, uint32_t nTimePrev, CAmount nValuePrev, const COutPoint& prevout, unsigned int nTimeTx, bool fPrintProofOfStake = false);
+// Check the kernel of a coinstake and its signature, given its kernel input
+bool CheckProofOfStake(const CBlockIndex* pindexPrev, const CTransaction& tx, unsigned int nBits, const CStakeInput& input, CValidationState &state);
 #endif // CASHCORE_POS_H
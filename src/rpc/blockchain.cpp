@@ -16,6 +16,7 @@
 #include "rpc/server.h"
 #include "streams.h"
 #include "sync.h"
+#include "txdb.h"
 #include "txmempool.h"
 #include "util.h"
 #include "utilstrencodings.h"
@@ -169,6 +170,8 @@ UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool tx
     if (pnext)
         result.push_back(Pair("nextblockhash", pnext->GetBlockHash().GetHex()));
     result.push_back(Pair("flags", blockindex->IsProofOfStake()? "POS" : "POW"));
+    if (blockindex->IsProofOfWork())
+        result.push_back(Pair("powhash", blockindex->GetBlockPoWHash().GetHex()));
     result.push_back(Pair("modifier", blockindex->nStakeModifier.GetHex()));
     if (block.IsProofOfStake())
     	result.push_back(Pair("signature", HexStr(block.vchBlockSig.begin(), block.vchBlockSig.end())));
@@ -621,7 +624,8 @@ UniValue getblock(const UniValue& params, bool fHelp)
             "  \"difficulty\" : x.xxx,  (numeric) The difficulty\n"
             "  \"chainwork\" : \"xxxx\",  (string) Expected number of hashes required to produce the chain up to this block (in hex)\n"
             "  \"previousblockhash\" : \"hash\",  (string) The hash of the previous block\n"
-            "  \"nextblockhash\" : \"hash\"       (string) The hash of the next block\n"
+            "  \"nextblockhash\" : \"hash\",      (string) The hash of the next block\n"
+            "  \"powhash\" : \"hash\"             (string) The scrypt proof-of-work hash, for proof-of-work blocks\n"
             "}\n"
             "\nResult (for verbose=false):\n"
             "\"data\"             (string) A string that is serialized, hex-encoded data for block 'hash'.\n"
@@ -648,17 +652,18 @@ UniValue getblock(const UniValue& params, bool fHelp)
     if (fHavePruned && !(pblockindex->nStatus & BLOCK_HAVE_DATA) && pblockindex->nTx > 0)
         throw JSONRPCError(RPC_INTERNAL_ERROR, "Block not available (pruned data)");
 
-    if(!ReadBlockFromDisk(block, pblockindex, Params().GetConsensus()))
-        throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
-
     if (!fVerbose)
     {
-        CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION | RPCSerializationFlags());
-        ssBlock << block;
-        std::string strHex = HexStr(ssBlock.begin(), ssBlock.end());
-        return strHex;
+        // The serialized block as stored on disk
+        std::vector<unsigned char> vchBlock;
+        if (!ReadRawBlockFromDisk(vchBlock, pblockindex))
+            throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
+        return HexStr(vchBlock.begin(), vchBlock.end());
     }
 
+    if(!ReadBlockFromDisk(block, pblockindex, Params().GetConsensus()))
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
+
     return blockToJSON(block, pblockindex);
 }
 
@@ -667,14 +672,24 @@ struct CCoinsStats
     int nHeight;
     uint256 hashBlock;
     uint64_t nTransactions;
-    uint64_t nTransactionOutputs;
-    uint64_t nSerializedSize;
     uint256 hashSerialized;
-    CAmount nTotalAmount;
+    CUTXOStats utxo;
 
-    CCoinsStats() : nHeight(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), nTotalAmount(0) {}
+    CCoinsStats() : nHeight(0), nTransactions(0) {}
 };
 
+static void ApplyStats(CCoinsStats &stats, CHashWriter& ss, const uint256& hash, const std::map<uint32_t, CTxOut>& outputs)
+{
+    assert(!outputs.empty());
+    stats.nTransactions++;
+    ss << hash;
+    for (std::map<uint32_t, CTxOut>::const_iterator it = outputs.begin(); it != outputs.end(); ++it) {
+        ss << VARINT(it->first + 1);
+        ss << it->second;
+    }
+    ss << VARINT(0);
+}
+
 //! Calculate statistics about the unspent transaction output set
 static bool GetUTXOStats(CCoinsView *view, CCoinsStats &stats)
 {
@@ -687,71 +702,110 @@ static bool GetUTXOStats(CCoinsView *view, CCoinsStats &stats)
         stats.nHeight = mapBlockIndex.find(stats.hashBlock)->second->nHeight;
     }
     ss << stats.hashBlock;
-    CAmount nTotalAmount = 0;
+    // Outputs come sorted by txid; hash them per transaction as before, so
+    // hash_serialized does not depend on how the set is stored.
+    uint256 prevkey;
+    std::map<uint32_t, CTxOut> outputs;
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
-        uint256 key;
-        CCoins coins;
-        if (pcursor->GetKey(key) && pcursor->GetValue(coins)) {
-            stats.nTransactions++;
-            ss << key;
-            for (unsigned int i=0; i<coins.vout.size(); i++) {
-                const CTxOut &out = coins.vout[i];
-                if (!out.IsNull()) {
-                    stats.nTransactionOutputs++;
-                    ss << VARINT(i+1);
-                    ss << out;
-                    nTotalAmount += out.nValue;
-                }
+        COutPoint key;
+        Coin coin;
+        if (pcursor->GetKey(key) && pcursor->GetValue(coin)) {
+            if (!outputs.empty() && key.hash != prevkey) {
+                ApplyStats(stats, ss, prevkey, outputs);
+                outputs.clear();
             }
-            stats.nSerializedSize += 32 + pcursor->GetValueSize();
-            ss << VARINT(0);
+            prevkey = key.hash;
+            outputs[key.n] = coin.out;
+            stats.utxo.AddCoin(key, coin);
         } else {
             return error("%s: unable to read value", __func__);
         }
         pcursor->Next();
     }
+    if (!outputs.empty())
+        ApplyStats(stats, ss, prevkey, outputs);
     stats.hashSerialized = ss.GetHash();
-    stats.nTotalAmount = nTotalAmount;
     return true;
 }
 
 UniValue gettxoutsetinfo(const UniValue& params, bool fHelp)
 {
-    if (fHelp || params.size() != 0)
+    if (fHelp || params.size() > 2)
         throw runtime_error(
-            "gettxoutsetinfo\n"
+            "gettxoutsetinfo ( \"hash_type\" height )\n"
             "\nReturns statistics about the unspent transaction output set.\n"
-            "Note this call may take some time.\n"
+            "With the default hash_type the statistics kept for every block (-utxostats) are returned,\n"
+            "otherwise the whole set is walked, which may take some time.\n"
+            "\nArguments:\n"
+            "1. \"hash_type\"    (string, optional) \"muhash\" to use the statistics kept per block, \"hash_serialized\" to walk the set\n"
+            "                    (default: \"muhash\", or \"hash_serialized\" with -utxostats=0)\n"
+            "2. height         (numeric, optional) The block height to report on, only for \"muhash\" (default: the tip)\n"
             "\nResult:\n"
             "{\n"
             "  \"height\":n,     (numeric) The current block height (index)\n"
             "  \"bestblock\": \"hex\",   (string) the best block hash hex\n"
-            "  \"transactions\": n,      (numeric) The number of transactions\n"
+            "  \"transactions\": n,      (numeric) The number of transactions (hash_serialized only)\n"
             "  \"txouts\": n,            (numeric) The number of output transactions\n"
-            "  \"bytes_serialized\": n,  (numeric) The serialized size\n"
-            "  \"hash_serialized\": \"hash\",   (string) The serialized hash\n"
-            "  \"total_amount\": x.xxx          (numeric) The total amount\n"
+            "  \"bytes_serialized\": n,  (numeric) The serialized size of the outpoints and coins\n"
+            "  \"hash_serialized\": \"hash\",   (string) The serialized hash (hash_serialized only)\n"
+            "  \"muhash\": \"hash\",            (string) The rolling set hash of the outpoints and coins\n"
+            "  \"total_amount\": x.xxx,          (numeric) The total amount\n"
+            "  \"total_burned\": x.xxx           (numeric) The amount sent to unspendable outputs up to this block (muhash only)\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("gettxoutsetinfo", "")
+            + HelpExampleCli("gettxoutsetinfo", "\"muhash\" 1000")
             + HelpExampleRpc("gettxoutsetinfo", "")
         );
 
+    std::string strHashType = fUTXOStats ? "muhash" : "hash_serialized";
+    if (params.size() > 0)
+        strHashType = params[0].get_str();
+
     UniValue ret(UniValue::VOBJ);
 
-    CCoinsStats stats;
-    FlushStateToDisk();
-    if (GetUTXOStats(pcoinsTip, stats)) {
+    if (strHashType == "muhash") {
+        if (!fUTXOStats)
+            throw JSONRPCError(RPC_MISC_ERROR, "UTXO stats are not maintained, restart with -utxostats");
+        CUTXOStats stats;
+        const CBlockIndex* pindex;
+        {
+            LOCK(cs_main);
+            pindex = chainActive.Tip();
+            if (params.size() > 1) {
+                int nHeight = params[1].get_int();
+                if (nHeight < 0 || nHeight > chainActive.Height())
+                    throw JSONRPCError(RPC_INVALID_PARAMETER, "Block height out of range");
+                pindex = chainActive[nHeight];
+            }
+            if (!ReadBlockUTXOStats(pindex, stats))
+                throw JSONRPCError(RPC_MISC_ERROR, "UTXO stats are not available for this block");
+        }
+        ret.push_back(Pair("height", (int64_t)pindex->nHeight));
+        ret.push_back(Pair("bestblock", pindex->GetBlockHash().GetHex()));
+        ret.push_back(Pair("txouts", (int64_t)stats.nTransactionOutputs));
+        ret.push_back(Pair("bytes_serialized", (int64_t)stats.nSerializedSize));
+        ret.push_back(Pair("muhash", stats.GetHash().GetHex()));
+        ret.push_back(Pair("total_amount", ValueFromAmount(stats.nTotalAmount)));
+        ret.push_back(Pair("total_burned", ValueFromAmount(stats.nTotalBurned)));
+    } else if (strHashType == "hash_serialized") {
+        if (params.size() > 1)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "A height can only be given with hash_type muhash");
+        CCoinsStats stats;
+        FlushStateToDisk();
+        if (!GetUTXOStats(pcoinsTip, stats))
+            throw JSONRPCError(RPC_INTERNAL_ERROR, "Unable to read UTXO set");
         ret.push_back(Pair("height", (int64_t)stats.nHeight));
         ret.push_back(Pair("bestblock", stats.hashBlock.GetHex()));
         ret.push_back(Pair("transactions", (int64_t)stats.nTransactions));
-        ret.push_back(Pair("txouts", (int64_t)stats.nTransactionOutputs));
-        ret.push_back(Pair("bytes_serialized", (int64_t)stats.nSerializedSize));
+        ret.push_back(Pair("txouts", (int64_t)stats.utxo.nTransactionOutputs));
+        ret.push_back(Pair("bytes_serialized", (int64_t)stats.utxo.nSerializedSize));
         ret.push_back(Pair("hash_serialized", stats.hashSerialized.GetHex()));
-        ret.push_back(Pair("total_amount", ValueFromAmount(stats.nTotalAmount)));
+        ret.push_back(Pair("muhash", stats.utxo.GetHash().GetHex()));
+        ret.push_back(Pair("total_amount", ValueFromAmount(stats.utxo.nTotalAmount)));
     } else {
-        throw JSONRPCError(RPC_INTERNAL_ERROR, "Unable to read UTXO set");
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Unknown hash_type " + strHashType);
     }
     return ret;
 }
@@ -781,7 +835,6 @@ UniValue gettxout(const UniValue& params, bool fHelp)
             "        ,...\n"
             "     ]\n"
             "  },\n"
-            "  \"version\" : n,            (numeric) The version\n"
             "  \"coinbase\" : true|false   (boolean) Coinbase or not\n"
             "  \"coinstake\" : true|false  (boolean) Coinstake or not\n"
             "}\n"
@@ -806,34 +859,34 @@ UniValue gettxout(const UniValue& params, bool fHelp)
     if (params.size() > 2)
         fMempool = params[2].get_bool();
 
-    CCoins coins;
+    if (n < 0)
+        return NullUniValue;
+    COutPoint out(hash, n);
+
+    Coin coin;
     if (fMempool) {
         LOCK(mempool.cs);
         CCoinsViewMemPool view(pcoinsTip, mempool);
-        if (!view.GetCoins(hash, coins))
+        if (!view.GetCoin(out, coin) || mempool.isSpent(out)) // TODO: filtering spent coins should be done by the CCoinsViewMemPool
             return NullUniValue;
-        mempool.pruneSpent(hash, coins); // TODO: this should be done by the CCoinsViewMemPool
     } else {
-        if (!pcoinsTip->GetCoins(hash, coins))
+        if (!pcoinsTip->GetCoin(out, coin))
             return NullUniValue;
     }
-    if (n<0 || (unsigned int)n>=coins.vout.size() || coins.vout[n].IsNull())
-        return NullUniValue;
 
     BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
     CBlockIndex *pindex = it->second;
     ret.push_back(Pair("bestblock", pindex->GetBlockHash().GetHex()));
-    if ((unsigned int)coins.nHeight == MEMPOOL_HEIGHT)
+    if (coin.nHeight == MEMPOOL_HEIGHT)
         ret.push_back(Pair("confirmations", 0));
     else
-        ret.push_back(Pair("confirmations", pindex->nHeight - coins.nHeight + 1));
-    ret.push_back(Pair("value", ValueFromAmount(coins.vout[n].nValue)));
+        ret.push_back(Pair("confirmations", (int64_t)(pindex->nHeight - coin.nHeight + 1)));
+    ret.push_back(Pair("value", ValueFromAmount(coin.out.nValue)));
     UniValue o(UniValue::VOBJ);
-    ScriptPubKeyToJSON(coins.vout[n].scriptPubKey, o, true);
+    ScriptPubKeyToJSON(coin.out.scriptPubKey, o, true);
     ret.push_back(Pair("scriptPubKey", o));
-    ret.push_back(Pair("version", coins.nVersion));
-    ret.push_back(Pair("coinbase", coins.fCoinBase));
-    ret.push_back(Pair("coinstake", coins.fCoinStake));
+    ret.push_back(Pair("coinbase", (bool)coin.fCoinBase));
+    ret.push_back(Pair("coinstake", (bool)coin.fCoinStake));
 
     return ret;
 }
@@ -946,6 +999,14 @@ UniValue getblockchaininfo(const UniValue& params, bool fHelp)
             "  \"chainwork\": \"xxxx\"     (string) total amount of work in active chain, in hexadecimal\n"
             "  \"pruned\": xx,             (boolean) if the blocks are subject to pruning\n"
             "  \"pruneheight\": xxxxxx,    (numeric) lowest-height complete block stored\n"
+            "  \"chainstateflush\": {      (json object) writes of the UTXO cache to the chainstate database\n"
+            "     \"background\": xx,      (boolean) if writes happen on a background thread (-asyncflush)\n"
+            "     \"inprogress\": xx,      (boolean) if a background write is in progress\n"
+            "     \"flushes\": xxxxxx,     (numeric) number of completed writes\n"
+            "     \"lastduration\": xx.xx, (numeric) duration of the last write in seconds\n"
+            "     \"lastbytes\": xxxxxx,   (numeric) bytes written by the last write\n"
+            "     \"totalbytes\": xxxxxx   (numeric) bytes written since startup\n"
+            "  },\n"
             "  \"softforks\": [            (array) status of softforks in progress\n"
             "     {\n"
             "        \"id\": \"xxxx\",        (string) name of softfork\n"
@@ -990,6 +1051,16 @@ UniValue getblockchaininfo(const UniValue& params, bool fHelp)
     obj.push_back(Pair("chainwork",             chainActive.Tip()->nChainWork.GetHex()));
     obj.push_back(Pair("pruned",                fPruneMode));
 
+    CCoinsFlushStats flushstats = pcoinsdbview->GetFlushStats();
+    UniValue flush(UniValue::VOBJ);
+    flush.push_back(Pair("background",   GetBoolArg("-asyncflush", DEFAULT_ASYNC_FLUSH)));
+    flush.push_back(Pair("inprogress",   flushstats.fInProgress));
+    flush.push_back(Pair("flushes",      flushstats.nFlushes));
+    flush.push_back(Pair("lastduration", flushstats.nLastDuration * 0.000001));
+    flush.push_back(Pair("lastbytes",    flushstats.nLastBytes));
+    flush.push_back(Pair("totalbytes",   flushstats.nTotalBytes));
+    obj.push_back(Pair("chainstateflush", flush));
+
     const Consensus::Params& consensusParams = Params().GetConsensus();
     CBlockIndex* tip = chainActive.Tip();
     UniValue softforks(UniValue::VARR);
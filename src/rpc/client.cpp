@@ -84,6 +84,7 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "fundrawtransaction", 1 },
     { "gettxout", 1 },
     { "gettxout", 2 },
+    { "gettxoutsetinfo", 1 },
     { "gettxoutproof", 0 },
     { "lockunspent", 0 },
     { "lockunspent", 1 },
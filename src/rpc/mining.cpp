@@ -289,11 +289,27 @@ UniValue getstakinginfo(const UniValue& params, bool fHelp)
     obj.push_back(Pair("difficulty", GetDifficulty(GetLastBlockIndex(chainActive.Tip(), true))));
     obj.push_back(Pair("search-interval", (int)nLastCoinStakeSearchInterval));
 
+    uint64_t nProbes = nLastStakeSearchProbes;
+    int64_t nSearchMicros = nLastStakeSearchMicros;
+    obj.push_back(Pair("kernel-probes", nProbes));
+    obj.push_back(Pair("kernel-probes-per-second", nSearchMicros > 0 ? (uint64_t)(nProbes * 1000000 / nSearchMicros) : (uint64_t)0));
+
     obj.push_back(Pair("weight", (uint64_t)nWeight));
     obj.push_back(Pair("netstakeweight", (uint64_t)nNetworkWeight));
 
     obj.push_back(Pair("expectedtime", nExpectedTime));
 
+    CStakeMinerStats stats = GetStakeMinerStats();
+    UniValue timings(UniValue::VOBJ);
+    timings.push_back(Pair("searches", stats.nSearches));
+    timings.push_back(Pair("search-time-ms", stats.nSearchMicros / 1000));
+    timings.push_back(Pair("last-search-time-us", stats.nLastSearchMicros));
+    timings.push_back(Pair("templates", stats.nTemplates));
+    timings.push_back(Pair("template-time-ms", stats.nTemplateMicros / 1000));
+    timings.push_back(Pair("blocks-signed", stats.nBlocksSigned));
+    timings.push_back(Pair("sign-time-ms", stats.nSignMicros / 1000));
+    obj.push_back(Pair("timings", timings));
+
     return obj;
 }
 
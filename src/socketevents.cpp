@@ -0,0 +1,413 @@
+// Copyright (c) 2018 The CashCore Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "socketevents.h"
+
+#include "netbase.h"
+#include "sync.h"
+#include "utiltime.h"
+
+#include <algorithm>
+#include <map>
+#include <set>
+
+#ifndef WIN32
+#include <fcntl.h>
+#endif
+#ifdef USE_POLL
+#include <poll.h>
+#endif
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
+CSocketEvents::CSocketEvents() : hWakeupRead(INVALID_SOCKET), hWakeupWrite(INVALID_SOCKET)
+{
+#ifndef WIN32
+    int fds[2];
+    if (pipe(fds) == 0) {
+        for (int i = 0; i < 2; i++) {
+            fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL, 0) | O_NONBLOCK);
+            fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+        }
+        hWakeupRead = fds[0];
+        hWakeupWrite = fds[1];
+    }
+#endif
+}
+
+CSocketEvents::~CSocketEvents()
+{
+#ifndef WIN32
+    if (hWakeupRead != INVALID_SOCKET) {
+        close(hWakeupRead);
+        close(hWakeupWrite);
+    }
+#endif
+}
+
+void CSocketEvents::Wakeup()
+{
+#ifndef WIN32
+    // A full pipe already guarantees a wakeup, so a failed write is fine
+    char c = 0;
+    if (hWakeupWrite != INVALID_SOCKET && write(hWakeupWrite, &c, 1) != 1) {}
+#endif
+}
+
+void CSocketEvents::DrainWakeup()
+{
+#ifndef WIN32
+    char buf[64];
+    while (read(hWakeupRead, buf, sizeof(buf)) > 0) {}
+#endif
+}
+
+namespace {
+
+/** Portable fallback, limited to FD_SETSIZE descriptors and O(N) per call */
+class CSocketEventsSelect : public CSocketEvents
+{
+private:
+    CCriticalSection cs;
+    std::map<SOCKET, int> mapEvents;
+
+public:
+    SocketEventsMode GetMode() const { return SOCKETEVENTS_SELECT; }
+
+    bool IsSupported(SOCKET hSocket) const
+    {
+#ifdef WIN32
+        return true;
+#else
+        return hSocket < FD_SETSIZE;
+#endif
+    }
+
+    bool Set(SOCKET hSocket, int nEvents)
+    {
+        if (!IsSupported(hSocket))
+            return false;
+        LOCK(cs);
+        mapEvents[hSocket] = nEvents;
+        return true;
+    }
+
+    void Remove(SOCKET hSocket)
+    {
+        LOCK(cs);
+        mapEvents.erase(hSocket);
+    }
+
+    bool Wait(int64_t nTimeout, std::vector<std::pair<SOCKET, int> >& vReady)
+    {
+        vReady.clear();
+
+        fd_set fdsetRecv;
+        fd_set fdsetSend;
+        fd_set fdsetError;
+        FD_ZERO(&fdsetRecv);
+        FD_ZERO(&fdsetSend);
+        FD_ZERO(&fdsetError);
+        SOCKET hSocketMax = 0;
+        bool have_fds = false;
+
+        std::vector<SOCKET> vSockets;
+        {
+            LOCK(cs);
+            vSockets.reserve(mapEvents.size());
+            for (std::map<SOCKET, int>::const_iterator it = mapEvents.begin(); it != mapEvents.end(); ++it) {
+                FD_SET(it->first, &fdsetError);
+                if (it->second & SOCKET_EVENT_RECV)
+                    FD_SET(it->first, &fdsetRecv);
+                if (it->second & SOCKET_EVENT_SEND)
+                    FD_SET(it->first, &fdsetSend);
+                hSocketMax = std::max(hSocketMax, it->first);
+                vSockets.push_back(it->first);
+                have_fds = true;
+            }
+        }
+        if (hWakeupRead != INVALID_SOCKET) {
+            FD_SET(hWakeupRead, &fdsetRecv);
+            hSocketMax = std::max(hSocketMax, hWakeupRead);
+            have_fds = true;
+        }
+
+        if (!have_fds) {
+            // Windows select() fails on empty sets
+            MilliSleep(nTimeout);
+            return true;
+        }
+
+        struct timeval timeout = MillisToTimeval(nTimeout);
+        int nSelect = select(hSocketMax + 1, &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+        if (nSelect == SOCKET_ERROR) {
+            int nErr = WSAGetLastError();
+#ifndef WIN32
+            if (nErr == EBADF) {
+                // A socket was closed without Remove(); forget it and retry on the next call
+                LOCK(cs);
+                for (std::vector<SOCKET>::const_iterator it = vSockets.begin(); it != vSockets.end(); ++it)
+                    if (fcntl(*it, F_GETFD) == -1)
+                        mapEvents.erase(*it);
+                return true;
+            }
+#endif
+            return nErr == WSAEINTR;
+        }
+
+        if (hWakeupRead != INVALID_SOCKET && FD_ISSET(hWakeupRead, &fdsetRecv))
+            DrainWakeup();
+        for (std::vector<SOCKET>::const_iterator it = vSockets.begin(); it != vSockets.end(); ++it) {
+            int nEvents = 0;
+            if (FD_ISSET(*it, &fdsetRecv))
+                nEvents |= SOCKET_EVENT_RECV;
+            if (FD_ISSET(*it, &fdsetSend))
+                nEvents |= SOCKET_EVENT_SEND;
+            if (FD_ISSET(*it, &fdsetError))
+                nEvents |= SOCKET_EVENT_ERR;
+            if (nEvents)
+                vReady.push_back(std::make_pair(*it, nEvents));
+        }
+        return true;
+    }
+};
+
+#ifdef USE_POLL
+/** No descriptor limit, but still hands every socket to the kernel on each call */
+class CSocketEventsPoll : public CSocketEvents
+{
+private:
+    CCriticalSection cs;
+    std::map<SOCKET, int> mapEvents;
+    std::vector<struct pollfd> vPollFds;
+
+public:
+    SocketEventsMode GetMode() const { return SOCKETEVENTS_POLL; }
+
+    bool Set(SOCKET hSocket, int nEvents)
+    {
+        LOCK(cs);
+        mapEvents[hSocket] = nEvents;
+        return true;
+    }
+
+    void Remove(SOCKET hSocket)
+    {
+        LOCK(cs);
+        mapEvents.erase(hSocket);
+    }
+
+    bool Wait(int64_t nTimeout, std::vector<std::pair<SOCKET, int> >& vReady)
+    {
+        vReady.clear();
+        vPollFds.clear();
+        {
+            LOCK(cs);
+            vPollFds.reserve(mapEvents.size() + 1);
+            for (std::map<SOCKET, int>::const_iterator it = mapEvents.begin(); it != mapEvents.end(); ++it) {
+                struct pollfd pfd;
+                pfd.fd = it->first;
+                pfd.events = ((it->second & SOCKET_EVENT_RECV) ? POLLIN : 0) | ((it->second & SOCKET_EVENT_SEND) ? POLLOUT : 0);
+                pfd.revents = 0;
+                vPollFds.push_back(pfd);
+            }
+        }
+        if (hWakeupRead != INVALID_SOCKET) {
+            struct pollfd pfd;
+            pfd.fd = hWakeupRead;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            vPollFds.push_back(pfd);
+        }
+
+        int nReady = poll(vPollFds.empty() ? NULL : &vPollFds[0], vPollFds.size(), nTimeout);
+        if (nReady < 0)
+            return errno == EINTR;
+
+        for (std::vector<struct pollfd>::const_iterator it = vPollFds.begin(); it != vPollFds.end() && nReady > 0; ++it) {
+            if (!it->revents)
+                continue;
+            nReady--;
+            if ((SOCKET)it->fd == hWakeupRead) {
+                DrainWakeup();
+                continue;
+            }
+            if (it->revents & POLLNVAL) {
+                // Closed without Remove(). Set() runs on this thread, so the
+                // descriptor cannot have been reused and registered again yet.
+                LOCK(cs);
+                mapEvents.erase(it->fd);
+                continue;
+            }
+            int nEvents = 0;
+            if (it->revents & POLLIN)
+                nEvents |= SOCKET_EVENT_RECV;
+            if (it->revents & POLLOUT)
+                nEvents |= SOCKET_EVENT_SEND;
+            if (it->revents & (POLLERR | POLLHUP))
+                nEvents |= SOCKET_EVENT_ERR;
+            vReady.push_back(std::make_pair((SOCKET)it->fd, nEvents));
+        }
+        return true;
+    }
+};
+#endif // USE_POLL
+
+#ifdef USE_EPOLL
+/** Kernel-side registration; a wait costs only as much as the number of ready sockets */
+class CSocketEventsEpoll : public CSocketEvents
+{
+private:
+    static const int MAX_EVENTS = 256;
+
+    int hEpoll;
+    CCriticalSection cs;
+    std::set<SOCKET> setRegistered;
+    struct epoll_event events[MAX_EVENTS];
+
+    static uint32_t ToEpoll(int nEvents)
+    {
+        return ((nEvents & SOCKET_EVENT_RECV) ? EPOLLIN : 0) | ((nEvents & SOCKET_EVENT_SEND) ? EPOLLOUT : 0);
+    }
+
+public:
+    CSocketEventsEpoll()
+    {
+        hEpoll = epoll_create1(EPOLL_CLOEXEC);
+        if (hEpoll != -1 && hWakeupRead != INVALID_SOCKET) {
+            struct epoll_event ev;
+            ev.events = EPOLLIN;
+            ev.data.fd = hWakeupRead;
+            epoll_ctl(hEpoll, EPOLL_CTL_ADD, hWakeupRead, &ev);
+        }
+    }
+
+    ~CSocketEventsEpoll()
+    {
+        if (hEpoll != -1)
+            close(hEpoll);
+    }
+
+    bool IsValid() const { return hEpoll != -1; }
+
+    SocketEventsMode GetMode() const { return SOCKETEVENTS_EPOLL; }
+
+    bool Set(SOCKET hSocket, int nEvents)
+    {
+        struct epoll_event ev;
+        ev.events = ToEpoll(nEvents);
+        ev.data.fd = hSocket;
+
+        LOCK(cs);
+        bool fRegistered = setRegistered.count(hSocket);
+        if (epoll_ctl(hEpoll, fRegistered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, hSocket, &ev) != 0) {
+            // Descriptor closed without Remove() and reused, or the other way around
+            if (errno != (fRegistered ? ENOENT : EEXIST))
+                return false;
+            if (epoll_ctl(hEpoll, fRegistered ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, hSocket, &ev) != 0)
+                return false;
+        }
+        setRegistered.insert(hSocket);
+        return true;
+    }
+
+    void Remove(SOCKET hSocket)
+    {
+        LOCK(cs);
+        if (setRegistered.erase(hSocket))
+            epoll_ctl(hEpoll, EPOLL_CTL_DEL, hSocket, NULL);
+    }
+
+    bool Wait(int64_t nTimeout, std::vector<std::pair<SOCKET, int> >& vReady)
+    {
+        vReady.clear();
+        int nReady = epoll_wait(hEpoll, events, MAX_EVENTS, nTimeout);
+        if (nReady < 0)
+            return errno == EINTR;
+
+        for (int i = 0; i < nReady; i++) {
+            SOCKET hSocket = events[i].data.fd;
+            if (hSocket == hWakeupRead) {
+                DrainWakeup();
+                continue;
+            }
+            int nEvents = 0;
+            if (events[i].events & EPOLLIN)
+                nEvents |= SOCKET_EVENT_RECV;
+            if (events[i].events & EPOLLOUT)
+                nEvents |= SOCKET_EVENT_SEND;
+            if (events[i].events & (EPOLLERR | EPOLLHUP))
+                nEvents |= SOCKET_EVENT_ERR;
+            vReady.push_back(std::make_pair(hSocket, nEvents));
+        }
+        return true;
+    }
+};
+#endif // USE_EPOLL
+
+} // namespace
+
+CSocketEvents* CreateSocketEvents(SocketEventsMode mode)
+{
+    switch (mode) {
+    case SOCKETEVENTS_SELECT:
+        return new CSocketEventsSelect();
+#ifdef USE_POLL
+    case SOCKETEVENTS_POLL:
+        return new CSocketEventsPoll();
+#endif
+#ifdef USE_EPOLL
+    case SOCKETEVENTS_EPOLL: {
+        CSocketEventsEpoll* pEvents = new CSocketEventsEpoll();
+        if (!pEvents->IsValid()) {
+            delete pEvents;
+            return NULL;
+        }
+        return pEvents;
+    }
+#endif
+    default:
+        return NULL;
+    }
+}
+
+bool ParseSocketEventsMode(const std::string& strMode, SocketEventsMode& mode)
+{
+    if (strMode == "select")
+        mode = SOCKETEVENTS_SELECT;
+#ifdef USE_POLL
+    else if (strMode == "poll")
+        mode = SOCKETEVENTS_POLL;
+#endif
+#ifdef USE_EPOLL
+    else if (strMode == "epoll")
+        mode = SOCKETEVENTS_EPOLL;
+#endif
+    else
+        return false;
+    return true;
+}
+
+std::string GetSocketEventsModeName(SocketEventsMode mode)
+{
+    switch (mode) {
+    case SOCKETEVENTS_SELECT: return "select";
+    case SOCKETEVENTS_POLL: return "poll";
+    case SOCKETEVENTS_EPOLL: return "epoll";
+    }
+    return "";
+}
+
+std::string GetSupportedSocketEventsModes()
+{
+    std::string strModes = "select";
+#ifdef USE_POLL
+    strModes += ", poll";
+#endif
+#ifdef USE_EPOLL
+    strModes += ", epoll";
+#endif
+    return strModes;
+}
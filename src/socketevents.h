@@ -0,0 +1,93 @@
+// Copyright (c) 2018 The CashCore Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SOCKETEVENTS_H
+#define BITCOIN_SOCKETEVENTS_H
+
+#include "compat.h"
+
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+/** Ways of waiting for socket readiness, selected with -socketevents */
+enum SocketEventsMode
+{
+    SOCKETEVENTS_SELECT,
+    SOCKETEVENTS_POLL,
+    SOCKETEVENTS_EPOLL,
+};
+
+#if defined(USE_EPOLL)
+static const SocketEventsMode DEFAULT_SOCKETEVENTS = SOCKETEVENTS_EPOLL;
+#elif defined(USE_POLL)
+static const SocketEventsMode DEFAULT_SOCKETEVENTS = SOCKETEVENTS_POLL;
+#else
+static const SocketEventsMode DEFAULT_SOCKETEVENTS = SOCKETEVENTS_SELECT;
+#endif
+
+/** Readiness flags, used both for registered interest and reported events */
+enum
+{
+    SOCKET_EVENT_RECV = (1 << 0),
+    SOCKET_EVENT_SEND = (1 << 1),
+    SOCKET_EVENT_ERR  = (1 << 2),
+};
+
+/**
+ * Socket readiness backend. Sockets are registered once and only have their
+ * interest updated when it changes; Wait() then reports just the sockets that
+ * are ready. Errors and hang-ups are always reported, whatever the interest.
+ *
+ * Set() and Wait() belong to the thread servicing the sockets; Remove() and
+ * Wakeup() may be called from any thread.
+ */
+class CSocketEvents
+{
+public:
+    virtual ~CSocketEvents();
+
+    virtual SocketEventsMode GetMode() const = 0;
+
+    /** Whether this backend can watch the socket at all */
+    virtual bool IsSupported(SOCKET hSocket) const { return true; }
+
+    /** Register the socket, or replace its interest if already registered */
+    virtual bool Set(SOCKET hSocket, int nEvents) = 0;
+
+    /** Stop watching the socket. Must be called before closing it. */
+    virtual void Remove(SOCKET hSocket) = 0;
+
+    /**
+     * Wait up to nTimeout milliseconds for registered sockets to become ready
+     * or for Wakeup() to be called. Returns false if waiting failed.
+     */
+    virtual bool Wait(int64_t nTimeout, std::vector<std::pair<SOCKET, int> >& vReady) = 0;
+
+    /** Interrupt a Wait() in progress, or make the next one return at once */
+    void Wakeup();
+
+    /** Whether Wakeup() works on this platform; if not, callers must poll */
+    bool CanWakeup() const { return hWakeupRead != INVALID_SOCKET; }
+
+protected:
+    CSocketEvents();
+
+    /** Consume pending wakeups */
+    void DrainWakeup();
+
+    SOCKET hWakeupRead;
+    SOCKET hWakeupWrite;
+};
+
+/** Create a backend, or NULL if the mode is not available on this platform */
+CSocketEvents* CreateSocketEvents(SocketEventsMode mode);
+
+bool ParseSocketEventsMode(const std::string& strMode, SocketEventsMode& mode);
+std::string GetSocketEventsModeName(SocketEventsMode mode);
+/** Names of the modes available on this platform, for help messages */
+std::string GetSupportedSocketEventsModes();
+
+#endif // BITCOIN_SOCKETEVENTS_H
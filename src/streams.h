@@ -371,6 +371,53 @@ public:
  * If you're returning the file pointer, return file.release().
  * If you need to close the file early, use file.fclose() instead of fclose(file).
  */
+/** Read-only stream over a byte range owned by someone else, e.g. a mapped
+ *  file. Deserializes without copying the range first; it must outlive the
+ *  reader.
+ */
+class CByteReader
+{
+private:
+    int nType;
+    int nVersion;
+    const unsigned char* pcur;
+    const unsigned char* pend;
+
+public:
+    CByteReader(const unsigned char* pbegin, const unsigned char* pendIn, int nTypeIn, int nVersionIn) :
+        nType(nTypeIn), nVersion(nVersionIn), pcur(pbegin), pend(pendIn) {}
+
+    int GetType() const          { return nType; }
+    int GetVersion() const       { return nVersion; }
+    size_t size() const          { return pend - pcur; }
+    bool empty() const           { return pcur == pend; }
+
+    CByteReader& read(char* pch, size_t nSize)
+    {
+        if (nSize > size())
+            throw std::ios_base::failure("CByteReader::read(): end of data");
+        memcpy(pch, pcur, nSize);
+        pcur += nSize;
+        return (*this);
+    }
+
+    CByteReader& ignore(size_t nSize)
+    {
+        if (nSize > size())
+            throw std::ios_base::failure("CByteReader::ignore(): end of data");
+        pcur += nSize;
+        return (*this);
+    }
+
+    template<typename T>
+    CByteReader& operator>>(T& obj)
+    {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
 class CAutoFile
 {
 private:
@@ -2,11 +2,15 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "arith_uint256.h"
 #include "blockencodings.h"
 #include "consensus/merkle.h"
 #include "chainparams.h"
+#include "key.h"
+#include "main.h"
 #include "pow.h"
 #include "random.h"
+#include "script/script.h"
 
 #include "test/test_bitcoin.h"
 
@@ -18,6 +22,8 @@ struct RegtestingSetup : public TestingSetup {
 
 BOOST_FIXTURE_TEST_SUITE(blockencodings_tests, RegtestingSetup)
 
+// The blocks built with proof-of-work are fixed, so that their nonce, found
+// by mining them with scrypt at the easiest target allowed, can be kept here
 static CBlock BuildBlockTestCase() {
     CBlock block;
     CMutableTransaction tx;
@@ -29,16 +35,16 @@ static CBlock BuildBlockTestCase() {
     block.vtx.resize(3);
     block.vtx[0] = tx;
     block.nVersion = 42;
-    block.hashPrevBlock = GetRandHash();
-    block.nBits = 0x207fffff;
+    block.hashPrevBlock = ArithToUint256(arith_uint256(1));
+    block.nBits = UintToArith256(Params().GetConsensus().powLimit).GetCompact();
 
-    tx.vin[0].prevout.hash = GetRandHash();
+    tx.vin[0].prevout.hash = ArithToUint256(arith_uint256(2));
     tx.vin[0].prevout.n = 0;
     block.vtx[1] = tx;
 
     tx.vin.resize(10);
     for (size_t i = 0; i < tx.vin.size(); i++) {
-        tx.vin[i].prevout.hash = GetRandHash();
+        tx.vin[i].prevout.hash = ArithToUint256(arith_uint256(3 + i));
         tx.vin[i].prevout.n = 0;
     }
     block.vtx[2] = tx;
@@ -46,7 +52,8 @@ static CBlock BuildBlockTestCase() {
     bool mutated;
     block.hashMerkleRoot = BlockMerkleRoot(block, &mutated);
     assert(!mutated);
-    while (!CheckProofOfWork(block.GetHash(), block.nBits, Params().GetConsensus())) ++block.nNonce;
+    block.nNonce = 37144;
+    assert(CheckProofOfWork(block.GetPoWHash(), block.nBits, Params().GetConsensus()));
     return block;
 }
 
@@ -107,6 +114,7 @@ class TestHeaderAndShortIDs {
     // Utility to encode custom CBlockHeaderAndShortTxIDs
 public:
     CBlockHeader header;
+    std::vector<unsigned char> vchBlockSig;
     uint64_t nonce;
     std::vector<uint64_t> shorttxids;
     std::vector<PrefilledTransaction> prefilledtxn;
@@ -132,6 +140,7 @@ public:
     template <typename Stream, typename Operation>
     inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
         READWRITE(header);
+        READWRITE(vchBlockSig);
         READWRITE(nonce);
         size_t shorttxids_size = shorttxids.size();
         READWRITE(VARINT(shorttxids_size));
@@ -258,13 +267,14 @@ BOOST_AUTO_TEST_CASE(EmptyBlockRoundTripTest)
     block.vtx.resize(1);
     block.vtx[0] = coinbase;
     block.nVersion = 42;
-    block.hashPrevBlock = GetRandHash();
-    block.nBits = 0x207fffff;
+    block.hashPrevBlock = ArithToUint256(arith_uint256(1));
+    block.nBits = UintToArith256(Params().GetConsensus().powLimit).GetCompact();
 
     bool mutated;
     block.hashMerkleRoot = BlockMerkleRoot(block, &mutated);
     assert(!mutated);
-    while (!CheckProofOfWork(block.GetHash(), block.nBits, Params().GetConsensus())) ++block.nNonce;
+    block.nNonce = 17394;
+    assert(CheckProofOfWork(block.GetPoWHash(), block.nBits, Params().GetConsensus()));
 
     // Test simple header round-trip with only coinbase
     {
@@ -290,6 +300,120 @@ BOOST_AUTO_TEST_CASE(EmptyBlockRoundTripTest)
     }
 }
 
+static CBlock BuildStakeBlockTestCase(const CKey& key) {
+    CBlock block;
+    block.nVersion = 42;
+    block.hashPrevBlock = GetRandHash();
+    block.nBits = 0x207fffff;
+
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].scriptSig.resize(10);
+    coinbase.vout.resize(1);
+    coinbase.vout[0].SetEmpty();
+    block.vtx.push_back(coinbase);
+
+    CMutableTransaction coinstake;
+    coinstake.vin.resize(1);
+    coinstake.vin[0].prevout.hash = GetRandHash();
+    coinstake.vin[0].prevout.n = 0;
+    coinstake.vout.resize(2);
+    coinstake.vout[0].SetEmpty();
+    coinstake.vout[1].nValue = 42;
+    coinstake.vout[1].scriptPubKey = CScript() << ToByteVector(key.GetPubKey()) << OP_CHECKSIG;
+    block.vtx.push_back(coinstake);
+
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.hash = GetRandHash();
+    tx.vin[0].prevout.n = 0;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 42;
+    block.vtx.push_back(tx);
+
+    bool mutated;
+    block.hashMerkleRoot = BlockMerkleRoot(block, &mutated);
+    assert(!mutated);
+    BOOST_REQUIRE(key.Sign(block.GetHash(), block.vchBlockSig));
+    return block;
+}
+
+BOOST_AUTO_TEST_CASE(StakeBlockRoundTripTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+    CKey key;
+    key.MakeNewKey(true);
+    CBlock block(BuildStakeBlockTestCase(key));
+    BOOST_REQUIRE(block.IsProofOfStake());
+
+    pool.addUnchecked(block.vtx[2].GetHash(), entry.FromTx(block.vtx[2]));
+
+    // The coinstake and the block signature travel with the compact block
+    {
+        CBlockHeaderAndShortTxIDs shortIDs(block);
+        BOOST_CHECK_EQUAL(shortIDs.BlockTxCount(), 3U);
+        BOOST_REQUIRE(shortIDs.GetCoinStake());
+        BOOST_CHECK(shortIDs.GetCoinStake()->GetHash() == block.vtx[1].GetHash());
+
+        CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+        stream << shortIDs;
+
+        CBlockHeaderAndShortTxIDs shortIDs2;
+        stream >> shortIDs2;
+        BOOST_CHECK(shortIDs2.vchBlockSig == block.vchBlockSig);
+        BOOST_CHECK(CheckBlockSignature(shortIDs2.header, shortIDs2.vchBlockSig, shortIDs2.GetCoinStake()));
+
+        PartiallyDownloadedBlock partialBlock(&pool);
+        BOOST_CHECK(partialBlock.InitData(shortIDs2) == READ_STATUS_OK);
+        BOOST_CHECK(partialBlock.IsTxAvailable(0));
+        BOOST_CHECK(partialBlock.IsTxAvailable(1));
+        BOOST_CHECK(partialBlock.IsTxAvailable(2));
+
+        CBlock block2;
+        std::vector<CTransaction> vtx_missing;
+        BOOST_CHECK(partialBlock.FillBlock(block2, vtx_missing) == READ_STATUS_OK);
+        BOOST_CHECK_EQUAL(block.GetHash().ToString(), block2.GetHash().ToString());
+        BOOST_CHECK(block2.vchBlockSig == block.vchBlockSig);
+        BOOST_CHECK(block2.IsProofOfStake());
+    }
+
+    // A signature that does not match the coinstake is rejected before
+    // anything is fetched
+    {
+        TestHeaderAndShortIDs shortIDs(block);
+        shortIDs.vchBlockSig[shortIDs.vchBlockSig.size() - 1] ^= 1;
+
+        CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+        stream << shortIDs;
+
+        CBlockHeaderAndShortTxIDs shortIDs2;
+        stream >> shortIDs2;
+
+        PartiallyDownloadedBlock partialBlock(&pool);
+        BOOST_CHECK(partialBlock.InitData(shortIDs2) == READ_STATUS_INVALID);
+    }
+
+    // So is a signed block without its coinstake
+    {
+        TestHeaderAndShortIDs shortIDs(block);
+        shortIDs.prefilledtxn.resize(1);
+        shortIDs.shorttxids.resize(2);
+        shortIDs.shorttxids[0] = shortIDs.GetShortID(block.vtx[1].GetHash());
+        shortIDs.shorttxids[1] = shortIDs.GetShortID(block.vtx[2].GetHash());
+
+        CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+        stream << shortIDs;
+
+        CBlockHeaderAndShortTxIDs shortIDs2;
+        stream >> shortIDs2;
+        BOOST_CHECK(!shortIDs2.GetCoinStake());
+
+        PartiallyDownloadedBlock partialBlock(&pool);
+        BOOST_CHECK(partialBlock.InitData(shortIDs2) == READ_STATUS_INVALID);
+    }
+}
+
 BOOST_AUTO_TEST_CASE(TransactionsRequestSerializationTest) {
     BlockTransactionsRequest req1;
     req1.blockhash = GetRandHash();
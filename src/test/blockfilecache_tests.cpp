@@ -0,0 +1,96 @@
+// Copyright (c) 2018 The CashCore Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilecache.h"
+#include "clientversion.h"
+#include "streams.h"
+#include "test/test_bitcoin.h"
+
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockfilecache_tests, BasicTestingSetup)
+
+static void AppendToFile(const boost::filesystem::path& path, const std::vector<unsigned char>& data)
+{
+    FILE* file = fopen(path.string().c_str(), "ab");
+    BOOST_REQUIRE(file);
+    BOOST_REQUIRE(fwrite(data.data(), 1, data.size(), file) == data.size());
+    fclose(file);
+}
+
+BOOST_AUTO_TEST_CASE(blockfilecache_map)
+{
+#ifndef WIN32
+    boost::filesystem::path dir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+    boost::filesystem::create_directories(dir);
+    boost::filesystem::path path0 = dir / "blk00000.dat";
+    boost::filesystem::path path1 = dir / "blk00001.dat";
+    boost::filesystem::path path2 = dir / "blk00002.dat";
+    AppendToFile(path0, std::vector<unsigned char>(100, 0));
+    AppendToFile(path1, std::vector<unsigned char>(100, 1));
+    AppendToFile(path2, std::vector<unsigned char>(100, 2));
+
+    // Disabled
+    CBlockFileCache cache;
+    BOOST_CHECK(!cache.Get(0, path0, 100));
+
+    cache.SetMaxFiles(2);
+    std::shared_ptr<const CMappedFile> file0 = cache.Get(0, path0, 100);
+    BOOST_REQUIRE(file0);
+    BOOST_CHECK_EQUAL(file0->size(), 100U);
+    BOOST_CHECK_EQUAL(file0->data()[99], 0);
+    BOOST_CHECK(cache.Get(0, path0, 50) == file0);
+    BOOST_CHECK(!cache.Get(0, path0, 101));
+
+    // A grown file is mapped again, the old mapping stays valid for its users
+    AppendToFile(path0, std::vector<unsigned char>(100, 3));
+    std::shared_ptr<const CMappedFile> file0b = cache.Get(0, path0, 200);
+    BOOST_REQUIRE(file0b);
+    BOOST_CHECK(file0b != file0);
+    BOOST_CHECK_EQUAL(file0b->data()[150], 3);
+    BOOST_CHECK_EQUAL(file0->data()[50], 0);
+
+    // The least recently used file is dropped
+    BOOST_CHECK(cache.Get(1, path1, 100));
+    BOOST_CHECK(cache.Get(0, path0, 200) == file0b);
+    BOOST_CHECK(cache.Get(2, path2, 100));
+    BOOST_CHECK(cache.Get(0, path0, 200) == file0b);
+    cache.Invalidate(0);
+    BOOST_CHECK(cache.Get(0, path0, 200) != file0b);
+
+    // Missing files are not mapped
+    BOOST_CHECK(!cache.Get(3, dir / "blk00003.dat", 0));
+
+    cache.Clear();
+    boost::filesystem::remove_all(dir);
+#endif
+}
+
+BOOST_AUTO_TEST_CASE(byte_reader)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << (uint32_t)0x12345678 << std::string("mapped") << (uint8_t)7;
+    std::vector<unsigned char> data(ss.begin(), ss.end());
+
+    CByteReader reader(data.data(), data.data() + data.size(), SER_DISK, CLIENT_VERSION);
+    uint32_t n;
+    std::string str;
+    uint8_t b;
+    reader >> n >> str;
+    BOOST_CHECK_EQUAL(n, 0x12345678U);
+    BOOST_CHECK_EQUAL(str, "mapped");
+    BOOST_CHECK_EQUAL(reader.size(), 1U);
+    reader >> b;
+    BOOST_CHECK_EQUAL(b, 7);
+    BOOST_CHECK(reader.empty());
+    BOOST_CHECK_THROW(reader >> b, std::ios_base::failure);
+
+    CByteReader reader2(data.data(), data.data() + 2, SER_DISK, CLIENT_VERSION);
+    BOOST_CHECK_THROW(reader2 >> n, std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
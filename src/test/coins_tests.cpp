@@ -9,10 +9,15 @@
 #include "utilstrencodings.h"
 #include "test/test_bitcoin.h"
 #include "main.h"
+#include "txdb.h"
+#include "txmempool.h"
+#include "undo.h"
+#include "util.h"
 #include "consensus/validation.h"
 
 #include <vector>
 #include <map>
+#include <set>
 
 #include <boost/test/unit_test.hpp>
 
@@ -21,29 +26,23 @@ namespace
 class CCoinsViewTest : public CCoinsView
 {
     uint256 hashBestBlock_;
-    std::map<uint256, CCoins> map_;
+    std::map<COutPoint, Coin> map_;
 
 public:
-    bool GetCoins(const uint256& txid, CCoins& coins) const
+    bool GetCoin(const COutPoint& outpoint, Coin& coin) const
     {
-        std::map<uint256, CCoins>::const_iterator it = map_.find(txid);
+        std::map<COutPoint, Coin>::const_iterator it = map_.find(outpoint);
         if (it == map_.end()) {
             return false;
         }
-        coins = it->second;
-        if (coins.IsPruned() && insecure_rand() % 2 == 0) {
+        coin = it->second;
+        if (coin.IsSpent() && insecure_rand() % 2 == 0) {
             // Randomly return false in case of an empty entry.
             return false;
         }
         return true;
     }
 
-    bool HaveCoins(const uint256& txid) const
-    {
-        CCoins coins;
-        return GetCoins(txid, coins);
-    }
-
     uint256 GetBestBlock() const { return hashBestBlock_; }
 
     bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
@@ -51,8 +50,8 @@ public:
         for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); ) {
             if (it->second.flags & CCoinsCacheEntry::DIRTY) {
                 // Same optimization used in CCoinsViewDB is to only write dirty entries.
-                map_[it->first] = it->second.coins;
-                if (it->second.coins.IsPruned() && insecure_rand() % 3 == 0) {
+                map_[it->first] = it->second.coin;
+                if (it->second.coin.IsSpent() && insecure_rand() % 3 == 0) {
                     // Randomly delete empty entries on write.
                     map_.erase(it->first);
                 }
@@ -75,7 +74,7 @@ public:
         // Manually recompute the dynamic usage of the whole data, and compare it.
         size_t ret = memusage::DynamicUsage(cacheCoins);
         for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++) {
-            ret += it->second.coins.DynamicMemoryUsage();
+            ret += it->second.coin.DynamicMemoryUsage();
         }
         BOOST_CHECK_EQUAL(DynamicMemoryUsage(), ret);
     }
@@ -91,7 +90,7 @@ static const unsigned int NUM_SIMULATION_ITERATIONS = 40000;
 // This is a large randomized insert/remove simulation test on a variable-size
 // stack of caches on top of CCoinsViewTest.
 //
-// It will randomly create/update/delete CCoins entries to a tip of caches, with
+// It will randomly create/update/delete Coin entries to a tip of caches, with
 // txids picked from a limited list of random 256-bit hashes. Occasionally, a
 // new tip is added to the stack of caches, or the tip is flushed and removed.
 //
@@ -103,13 +102,15 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     bool removed_all_caches = false;
     bool reached_4_caches = false;
     bool added_an_entry = false;
+    bool added_an_unspendable_entry = false;
     bool removed_an_entry = false;
     bool updated_an_entry = false;
     bool found_an_entry = false;
     bool missed_an_entry = false;
+    bool uncached_an_entry = false;
 
     // A simple map to track what we expect the cache stack to represent.
-    std::map<uint256, CCoins> result;
+    std::map<COutPoint, Coin> result;
 
     // The cache stack.
     CCoinsViewTest base; // A CCoinsViewTest at the bottom.
@@ -127,36 +128,71 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
         // Do a random modification.
         {
             uint256 txid = txids[insecure_rand() % txids.size()]; // txid we're going to modify in this iteration.
-            CCoins& coins = result[txid];
-            CCoinsModifier entry = stack.back()->ModifyCoins(txid);
-            BOOST_CHECK(coins == *entry);
-            if (insecure_rand() % 5 == 0 || coins.IsPruned()) {
-                if (coins.IsPruned()) {
-                    added_an_entry = true;
+            COutPoint out(txid, 0);
+            Coin& coin = result[out];
+
+            // HaveCoin and AccessCoin pull entries into the cache, so test
+            // HaveCoin both before and after the access.
+            bool test_havecoin_before = insecure_rand() % 4 == 0;
+            bool test_havecoin_after = insecure_rand() % 4 == 0;
+
+            bool result_havecoin = test_havecoin_before ? stack.back()->HaveCoin(out) : false;
+            const Coin& entry = (insecure_rand() % 500 == 0) ? AccessByTxid(*stack.back(), txid) : stack.back()->AccessCoin(out);
+            BOOST_CHECK(coin == entry);
+            BOOST_CHECK(!test_havecoin_before || result_havecoin == !entry.IsSpent());
+
+            if (test_havecoin_after) {
+                bool ret = stack.back()->HaveCoin(out);
+                BOOST_CHECK(ret == !entry.IsSpent());
+            }
+
+            if (insecure_rand() % 5 == 0 || coin.IsSpent()) {
+                Coin newcoin;
+                newcoin.out.nValue = (CAmount)insecure_rand() + 1; // Empty outputs are unspendable
+                newcoin.nHeight = 1;
+                newcoin.nTime = insecure_rand();
+                if (insecure_rand() % 16 == 0 && coin.IsSpent()) {
+                    newcoin.out.scriptPubKey.assign(1 + (insecure_rand() & 0x3F), OP_RETURN);
+                    BOOST_CHECK(newcoin.out.scriptPubKey.IsUnspendable());
+                    added_an_unspendable_entry = true;
                 } else {
-                    updated_an_entry = true;
+                    // Random sizes so we can test memory usage accounting
+                    newcoin.out.scriptPubKey.assign(insecure_rand() & 0x3F, 0);
+                    if (coin.IsSpent()) {
+                        added_an_entry = true;
+                    } else {
+                        updated_an_entry = true;
+                    }
+                    coin = newcoin;
                 }
-                coins.nVersion = insecure_rand();
-                coins.vout.resize(1);
-                coins.vout[0].nValue = insecure_rand();
-                *entry = coins;
+                stack.back()->AddCoin(out, std::move(newcoin), !coin.IsSpent() || insecure_rand() & 1);
             } else {
-                coins.Clear();
-                entry->Clear();
                 removed_an_entry = true;
+                coin.Clear();
+                stack.back()->SpendCoin(out);
             }
         }
 
+        // Once every 10 iterations, remove a random entry from a cache.
+        if (insecure_rand() % 10 == 0) {
+            COutPoint out(txids[insecure_rand() % txids.size()], 0);
+            int cacheid = insecure_rand() % stack.size();
+            stack[cacheid]->Uncache(out);
+            uncached_an_entry |= !stack[cacheid]->HaveCoinInCache(out);
+        }
+
         // Once every 1000 iterations and at the end, verify the full cache.
         if (insecure_rand() % 1000 == 1 || i == NUM_SIMULATION_ITERATIONS - 1) {
-            for (std::map<uint256, CCoins>::iterator it = result.begin(); it != result.end(); it++) {
-                const CCoins* coins = stack.back()->AccessCoins(it->first);
-                if (coins) {
-                    BOOST_CHECK(*coins == it->second);
-                    found_an_entry = true;
-                } else {
-                    BOOST_CHECK(it->second.IsPruned());
+            for (std::map<COutPoint, Coin>::iterator it = result.begin(); it != result.end(); it++) {
+                bool have = stack.back()->HaveCoin(it->first);
+                const Coin& coin = stack.back()->AccessCoin(it->first);
+                BOOST_CHECK(have == !coin.IsSpent());
+                BOOST_CHECK(coin == it->second);
+                if (coin.IsSpent()) {
                     missed_an_entry = true;
+                } else {
+                    BOOST_CHECK(stack.back()->HaveCoinInCache(it->first));
+                    found_an_entry = true;
                 }
             }
             BOOST_FOREACH(const CCoinsViewCacheTest *test, stack) {
@@ -205,10 +241,12 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     BOOST_CHECK(removed_all_caches);
     BOOST_CHECK(reached_4_caches);
     BOOST_CHECK(added_an_entry);
+    BOOST_CHECK(added_an_unspendable_entry);
     BOOST_CHECK(removed_an_entry);
     BOOST_CHECK(updated_an_entry);
     BOOST_CHECK(found_an_entry);
     BOOST_CHECK(missed_an_entry);
+    BOOST_CHECK(uncached_an_entry);
 }
 
 // This test is similar to the previous test
@@ -220,7 +258,7 @@ BOOST_AUTO_TEST_CASE(updatecoins_simulation_test)
 {
     bool spent_a_duplicate_coinbase = false;
     // A simple map to track what we expect the cache stack to represent.
-    std::map<uint256, CCoins> result;
+    std::map<COutPoint, Coin> result;
 
     // The cache stack.
     CCoinsViewTest base; // A CCoinsViewTest at the bottom.
@@ -238,7 +276,8 @@ BOOST_AUTO_TEST_CASE(updatecoins_simulation_test)
             tx.vin.resize(1);
             tx.vout.resize(1);
             tx.vout[0].nValue = i; //Keep txs unique unless intended to duplicate
-            unsigned int height = insecure_rand();
+            tx.vout[0].scriptPubKey.assign(insecure_rand() & 0x3F, 0); // Random sizes so we can test memory usage accounting
+            unsigned int height = insecure_rand() % 1000000;
 
             // 1/10 times create a coinbase
             if (insecure_rand() % 10 == 0 || coinbaseids.size() < 10) {
@@ -250,10 +289,12 @@ BOOST_AUTO_TEST_CASE(updatecoins_simulation_test)
                     }
                     //Use same random value to have same hash and be a true duplicate
                     tx.vout[0].nValue = coinbaseIt->second;
+                    tx.vout[0].scriptPubKey.assign(1, OP_TRUE); // Same script for duplicates
                     assert(tx.GetHash() == coinbaseIt->first);
                     duplicateids.insert(coinbaseIt->first);
                 }
                 else {
+                    tx.vout[0].scriptPubKey.assign(1, OP_TRUE); // Same script for duplicates
                     coinbaseids[tx.GetHash()] = tx.vout[0].nValue;
                 }
                 assert(CTransaction(tx).IsCoinBase());
@@ -273,8 +314,7 @@ BOOST_AUTO_TEST_CASE(updatecoins_simulation_test)
                 tx.vin[0].prevout.n = 0;
 
                 // Update the expected result of prevouthash to know these coins are spent
-                CCoins& oldcoins = result[prevouthash];
-                oldcoins.Clear();
+                result[tx.vin[0].prevout].Clear();
 
                 // It is of particular importance here that once we spend a coinbase tx hash
                 // it is no longer available to be duplicated (or spent again)
@@ -294,21 +334,18 @@ BOOST_AUTO_TEST_CASE(updatecoins_simulation_test)
             alltxids.insert(tx.GetHash());
 
             // Update the expected result to know about the new output coins
-            CCoins &coins = result[tx.GetHash()];
-            coins.FromTx(tx, height);
+            result[COutPoint(tx.GetHash(), 0)] = Coin(tx, 0, height);
 
             UpdateCoins(tx, *(stack.back()), height);
         }
 
         // Once every 1000 iterations and at the end, verify the full cache.
         if (insecure_rand() % 1000 == 1 || i == NUM_SIMULATION_ITERATIONS - 1) {
-            for (std::map<uint256, CCoins>::iterator it = result.begin(); it != result.end(); it++) {
-                const CCoins* coins = stack.back()->AccessCoins(it->first);
-                if (coins) {
-                    BOOST_CHECK(*coins == it->second);
-                 } else {
-                    BOOST_CHECK(it->second.IsPruned());
-                 }
+            for (std::map<COutPoint, Coin>::iterator it = result.begin(); it != result.end(); it++) {
+                bool have = stack.back()->HaveCoin(it->first);
+                const Coin& coin = stack.back()->AccessCoin(it->first);
+                BOOST_CHECK(have == !coin.IsSpent());
+                BOOST_CHECK(coin == it->second);
             }
         }
 
@@ -346,57 +383,46 @@ BOOST_AUTO_TEST_CASE(updatecoins_simulation_test)
     BOOST_CHECK(spent_a_duplicate_coinbase);
 }
 
-BOOST_AUTO_TEST_CASE(ccoins_serialization)
+BOOST_AUTO_TEST_CASE(coin_serialization)
 {
-    // Good example
-    CDataStream ss1(ParseHex("0104835800816115944e077fe7c803cfa57f29b36bf87c1d358bb85e"), SER_DISK, CLIENT_VERSION);
-    CCoins cc1;
-    ss1 >> cc1;
-    BOOST_CHECK_EQUAL(cc1.nVersion, 1);
-    BOOST_CHECK_EQUAL(cc1.fCoinBase, false);
-    BOOST_CHECK_EQUAL(cc1.nHeight, 203998);
-    BOOST_CHECK_EQUAL(cc1.vout.size(), 2);
-    BOOST_CHECK_EQUAL(cc1.IsAvailable(0), false);
-    BOOST_CHECK_EQUAL(cc1.IsAvailable(1), true);
-    BOOST_CHECK_EQUAL(cc1.vout[1].nValue, 60000000000ULL);
-    BOOST_CHECK_EQUAL(HexStr(cc1.vout[1].scriptPubKey), HexStr(GetScriptForDestination(CKeyID(uint160(ParseHex("816115944e077fe7c803cfa57f29b36bf87c1d35"))))));
-
-    // Good example
-    CDataStream ss2(ParseHex("0109044086ef97d5790061b01caab50f1b8e9c50a5057eb43c2d9563a4eebbd123008c988f1a4a4de2161e0f50aac7f17e7f9555caa486af3b"), SER_DISK, CLIENT_VERSION);
-    CCoins cc2;
-    ss2 >> cc2;
-    BOOST_CHECK_EQUAL(cc2.nVersion, 1);
-    BOOST_CHECK_EQUAL(cc2.fCoinBase, true);
-    BOOST_CHECK_EQUAL(cc2.nHeight, 120891);
-    BOOST_CHECK_EQUAL(cc2.vout.size(), 17);
-    for (int i = 0; i < 17; i++) {
-        BOOST_CHECK_EQUAL(cc2.IsAvailable(i), i == 4 || i == 16);
-    }
-    BOOST_CHECK_EQUAL(cc2.vout[4].nValue, 234925952);
-    BOOST_CHECK_EQUAL(HexStr(cc2.vout[4].scriptPubKey), HexStr(GetScriptForDestination(CKeyID(uint160(ParseHex("61b01caab50f1b8e9c50a5057eb43c2d9563a4ee"))))));
-    BOOST_CHECK_EQUAL(cc2.vout[16].nValue, 110397);
-    BOOST_CHECK_EQUAL(HexStr(cc2.vout[16].scriptPubKey), HexStr(GetScriptForDestination(CKeyID(uint160(ParseHex("8c988f1a4a4de2161e0f50aac7f17e7f9555caa4"))))));
-
-    // Smallest possible example
-    CDataStream ssx(SER_DISK, CLIENT_VERSION);
-    BOOST_CHECK_EQUAL(HexStr(ssx.begin(), ssx.end()), "");
-
-    CDataStream ss3(ParseHex("0002000600"), SER_DISK, CLIENT_VERSION);
-    CCoins cc3;
-    ss3 >> cc3;
-    BOOST_CHECK_EQUAL(cc3.nVersion, 0);
-    BOOST_CHECK_EQUAL(cc3.fCoinBase, false);
-    BOOST_CHECK_EQUAL(cc3.nHeight, 0);
-    BOOST_CHECK_EQUAL(cc3.vout.size(), 1);
-    BOOST_CHECK_EQUAL(cc3.IsAvailable(0), true);
-    BOOST_CHECK_EQUAL(cc3.vout[0].nValue, 0);
-    BOOST_CHECK_EQUAL(cc3.vout[0].scriptPubKey.size(), 0);
+    CTxOut txout(60000000000ULL, GetScriptForDestination(CKeyID(uint160(ParseHex("816115944e077fe7c803cfa57f29b36bf87c1d35")))));
+
+    // Layout: VARINT(height * 4 + coinstake * 2 + coinbase), nTime, compressed txout
+    CDataStream ssExpected(SER_DISK, CLIENT_VERSION);
+    uint32_t nCode = 203998 * 4 + 2;
+    ssExpected << VARINT(nCode) << (uint32_t)1500000000 << CTxOutCompressor(txout);
+
+    Coin coin(txout, 203998, false, true, 1500000000);
+    CDataStream ss1(SER_DISK, CLIENT_VERSION);
+    ss1 << coin;
+    BOOST_CHECK_EQUAL(HexStr(ss1.begin(), ss1.end()), HexStr(ssExpected.begin(), ssExpected.end()));
+    BOOST_CHECK_EQUAL(ss1.size(), ::GetSerializeSize(coin, SER_DISK, CLIENT_VERSION));
+
+    Coin coin1;
+    ss1 >> coin1;
+    BOOST_CHECK(coin1 == coin);
+    BOOST_CHECK_EQUAL(coin1.IsCoinBase(), false);
+    BOOST_CHECK_EQUAL(coin1.IsCoinStake(), true);
+    BOOST_CHECK_EQUAL((uint32_t)coin1.nHeight, 203998);
+    BOOST_CHECK_EQUAL(coin1.nTime, 1500000000);
+    BOOST_CHECK_EQUAL(coin1.out.nValue, 60000000000ULL);
+    BOOST_CHECK_EQUAL(HexStr(coin1.out.scriptPubKey), HexStr(txout.scriptPubKey));
+
+    // Largest height that fits, as used for mempool coins
+    Coin coin2(txout, MEMPOOL_HEIGHT, true, false, 0);
+    CDataStream ss2(SER_DISK, CLIENT_VERSION);
+    ss2 << coin2;
+    Coin coin3;
+    ss2 >> coin3;
+    BOOST_CHECK_EQUAL((uint32_t)coin3.nHeight, MEMPOOL_HEIGHT);
+    BOOST_CHECK_EQUAL(coin3.IsCoinBase(), true);
+    BOOST_CHECK_EQUAL(coin3.IsCoinStake(), false);
 
     // scriptPubKey that ends beyond the end of the stream
-    CDataStream ss4(ParseHex("0002000800"), SER_DISK, CLIENT_VERSION);
+    CDataStream ss4(ParseHex("000000000000"), SER_DISK, CLIENT_VERSION);
     try {
-        CCoins cc4;
-        ss4 >> cc4;
+        Coin coin4;
+        ss4 >> coin4;
         BOOST_CHECK_MESSAGE(false, "We should have thrown");
     } catch (const std::ios_base::failure& e) {
     }
@@ -406,13 +432,169 @@ BOOST_AUTO_TEST_CASE(ccoins_serialization)
     uint64_t x = 3000000000ULL;
     tmp << VARINT(x);
     BOOST_CHECK_EQUAL(HexStr(tmp.begin(), tmp.end()), "8a95c0bb00");
-    CDataStream ss5(ParseHex("0002008a95c0bb0000"), SER_DISK, CLIENT_VERSION);
+    CDataStream ss5(ParseHex("0000000000008a95c0bb0000"), SER_DISK, CLIENT_VERSION);
     try {
-        CCoins cc5;
-        ss5 >> cc5;
+        Coin coin5;
+        ss5 >> coin5;
         BOOST_CHECK_MESSAGE(false, "We should have thrown");
     } catch (const std::ios_base::failure& e) {
     }
 }
 
+// Undo data is written per spent output now, but must stay readable by and
+// from older versions, which stored the transaction version with the last
+// spent output of a transaction and nothing for the others.
+BOOST_AUTO_TEST_CASE(txinundo_compatibility)
+{
+    CTxOut txout(234925952, GetScriptForDestination(CKeyID(uint160(ParseHex("61b01caab50f1b8e9c50a5057eb43c2d9563a4ee")))));
+
+    // Last spent output, as written by older versions
+    CDataStream ssLast(SER_DISK, CLIENT_VERSION);
+    ssLast << VARINT(120891 * 4 + 1) << VARINT(1) << (uint32_t)1400000000 << CTxOutCompressor(txout);
+    Coin coin;
+    TxInUndoDeserializer deserializer(&coin);
+    ssLast >> deserializer;
+    BOOST_CHECK(ssLast.empty());
+    BOOST_CHECK(coin == Coin(txout, 120891, true, false, 1400000000));
+
+    // Written back it reads the same, with a zero version
+    CDataStream ssNew(SER_DISK, CLIENT_VERSION);
+    ssNew << TxInUndoSerializer(&coin);
+    BOOST_CHECK_EQUAL(ssNew.size(), TxInUndoSerializer(&coin).GetSerializeSize(SER_DISK, CLIENT_VERSION));
+    Coin coin2;
+    TxInUndoDeserializer deserializer2(&coin2);
+    ssNew >> deserializer2;
+    BOOST_CHECK(coin2 == coin);
+
+    // Earlier spent output, as written by older versions: no metadata
+    CDataStream ssOther(SER_DISK, CLIENT_VERSION);
+    ssOther << VARINT(0) << (uint32_t)0 << CTxOutCompressor(txout);
+    Coin coin3;
+    TxInUndoDeserializer deserializer3(&coin3);
+    ssOther >> deserializer3;
+    BOOST_CHECK(ssOther.empty());
+    BOOST_CHECK_EQUAL((uint32_t)coin3.nHeight, 0);
+    BOOST_CHECK(coin3.out == txout);
+}
+
+BOOST_AUTO_TEST_CASE(utxo_stats)
+{
+    std::vector<std::pair<COutPoint, Coin> > coins;
+    for (int i = 0; i < 40; i++) {
+        Coin coin;
+        coin.out.nValue = insecure_rand() % 100000000 + 1;
+        coin.out.scriptPubKey.assign(insecure_rand() % 40 + 1, 0x51);
+        coin.nHeight = insecure_rand() % 1000 + 1;
+        coin.fCoinBase = i % 5 == 0;
+        coin.fCoinStake = i % 7 == 0;
+        coin.nTime = insecure_rand();
+        coins.push_back(std::make_pair(COutPoint(GetRandHash(), i), coin));
+    }
+
+    // The first half directly, versus everything and then removing the second half backwards
+    CUTXOStats direct, updated;
+    CAmount nAmount = 0;
+    for (size_t i = 0; i < coins.size() / 2; i++) {
+        direct.AddCoin(coins[i].first, coins[i].second);
+        nAmount += coins[i].second.out.nValue;
+    }
+    for (size_t i = 0; i < coins.size(); i++)
+        updated.AddCoin(coins[i].first, coins[i].second);
+    for (size_t i = coins.size(); i-- > coins.size() / 2;)
+        updated.RemoveCoin(coins[i].first, coins[i].second);
+
+    BOOST_CHECK_EQUAL(direct.nTransactionOutputs, coins.size() / 2);
+    BOOST_CHECK_EQUAL(updated.nTransactionOutputs, direct.nTransactionOutputs);
+    BOOST_CHECK_EQUAL(updated.nSerializedSize, direct.nSerializedSize);
+    BOOST_CHECK_EQUAL(updated.nTotalAmount, nAmount);
+    BOOST_CHECK(updated.GetHash() == direct.GetHash());
+
+    // Metadata is part of the hash
+    CUTXOStats changed;
+    for (size_t i = 0; i < coins.size() / 2; i++) {
+        Coin coin = coins[i].second;
+        if (i == 3)
+            coin.nTime++;
+        changed.AddCoin(coins[i].first, coin);
+    }
+    BOOST_CHECK(changed.GetHash() != direct.GetHash());
+
+    CDataStream ss(SER_DISK, PROTOCOL_VERSION);
+    updated.nTotalBurned = 12345;
+    ss << updated;
+    CUTXOStats restored;
+    ss >> restored;
+    BOOST_CHECK_EQUAL(restored.nTransactionOutputs, updated.nTransactionOutputs);
+    BOOST_CHECK_EQUAL(restored.nSerializedSize, updated.nSerializedSize);
+    BOOST_CHECK_EQUAL(restored.nTotalAmount, updated.nTotalAmount);
+    BOOST_CHECK_EQUAL(restored.nTotalBurned, 12345);
+    BOOST_CHECK(restored.GetHash() == direct.GetHash());
+}
+
+// Flush a few generations of coins through the background writer, in
+// partial batches, and check they are visible before and after the write.
+BOOST_FIXTURE_TEST_CASE(ccoins_db_background_write, TestingSetup)
+{
+    mapArgs["-dbbatchsize"] = "1024";
+    CCoinsViewDB db(1 << 20, true);
+    db.StartBackgroundWriter();
+
+    std::map<COutPoint, Coin> result;
+    std::vector<COutPoint> outpoints;
+    for (int round = 0; round < 4; round++) {
+        CCoinsViewCache cache(&db);
+        for (int i = 0; i < 200; i++) {
+            COutPoint outpoint(GetRandHash(), i % 3);
+            Coin coin;
+            coin.out.nValue = (CAmount)insecure_rand() + 1;
+            coin.out.scriptPubKey.assign(1 + (insecure_rand() & 0x3F), 0);
+            coin.nHeight = round + 1;
+            cache.AddCoin(outpoint, std::move(coin), false);
+            result[outpoint] = cache.AccessCoin(outpoint);
+            outpoints.push_back(outpoint);
+        }
+        // Spend some coins written by earlier rounds
+        for (size_t i = 0; i < outpoints.size() - 200; i += 3) {
+            if (result.count(outpoints[i]) && cache.SpendCoin(outpoints[i]))
+                result.erase(outpoints[i]);
+        }
+        uint256 hashBlock = GetRandHash();
+        cache.SetBestBlock(hashBlock);
+        BOOST_CHECK(cache.Flush());
+
+        // Visible right away, whether the write is done or not
+        BOOST_CHECK(db.GetBestBlock() == hashBlock);
+        BOOST_FOREACH(const COutPoint& outpoint, outpoints) {
+            Coin coin;
+            std::map<COutPoint, Coin>::const_iterator it = result.find(outpoint);
+            BOOST_CHECK_EQUAL(db.GetCoin(outpoint, coin), it != result.end());
+            BOOST_CHECK_EQUAL(db.HaveCoin(outpoint), it != result.end());
+            if (it != result.end())
+                BOOST_CHECK(coin.out == it->second.out);
+        }
+    }
+
+    BOOST_CHECK(db.Sync());
+    db.StopBackgroundWriter();
+    BOOST_CHECK(db.GetHeadBlocks().empty());
+    CCoinsFlushStats stats = db.GetFlushStats();
+    BOOST_CHECK_EQUAL(stats.nFlushes, 4U);
+    BOOST_CHECK(!stats.fInProgress);
+    BOOST_CHECK(stats.nLastBytes > 0 && stats.nTotalBytes > stats.nLastBytes);
+
+    // Everything ended up in the database
+    size_t nFound = 0;
+    boost::scoped_ptr<CCoinsViewCursor> pcursor(db.Cursor());
+    while (pcursor->Valid()) {
+        COutPoint key;
+        Coin coin;
+        BOOST_CHECK(pcursor->GetKey(key) && pcursor->GetValue(coin));
+        BOOST_CHECK(result.count(key) && result[key].out == coin.out);
+        nFound++;
+        pcursor->Next();
+    }
+    BOOST_CHECK_EQUAL(nFound, result.size());
+    mapArgs.erase("-dbbatchsize");
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -3,6 +3,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "crypto/aes.h"
+#include "crypto/muhash.h"
 #include "crypto/ripemd160.h"
 #include "crypto/sha1.h"
 #include "crypto/sha256.h"
@@ -10,6 +11,7 @@
 #include "crypto/hmac_sha256.h"
 #include "crypto/hmac_sha512.h"
 #include "random.h"
+#include "streams.h"
 #include "utilstrencodings.h"
 #include "test/test_bitcoin.h"
 
@@ -439,4 +441,61 @@ BOOST_AUTO_TEST_CASE(aes_cbc_testvectors) {
                   "b2eb05e2c39be9fcda6c19078c6a9d1b3f461796d6b0d6b2e0c2a72b4d80e644");
 }
 
+static uint256 FinalizeMuHash(MuHash3072 acc)
+{
+    uint256 out;
+    acc.Finalize(out);
+    return out;
+}
+
+BOOST_AUTO_TEST_CASE(muhash_tests)
+{
+    const unsigned char a[1] = {0}, b[1] = {1}, c[1] = {2};
+
+    BOOST_CHECK_EQUAL(FinalizeMuHash(MuHash3072()).GetHex(), "dd5ad2a105c2d29495f577245c357409002329b9f4d6182c0af3dc2f462555c8");
+
+    MuHash3072 ab;
+    ab.Insert(a, 1).Insert(b, 1);
+    uint256 hashAB = FinalizeMuHash(ab);
+    BOOST_CHECK_EQUAL(hashAB.GetHex(), "4792949aa7179db16e23f5449ce736809d78ce70245d591160d4e86d92d35627");
+
+    // Independent of the order of insertions and removals
+    MuHash3072 acc;
+    acc.Insert(c, 1).Insert(b, 1).Remove(c, 1).Insert(a, 1);
+    BOOST_CHECK(FinalizeMuHash(acc) == hashAB);
+    acc.Remove(a, 1).Remove(b, 1);
+    BOOST_CHECK(FinalizeMuHash(acc) == FinalizeMuHash(MuHash3072()));
+
+    // Combining sets
+    MuHash3072 onlyA, onlyB, onlyC, abc;
+    onlyA.Insert(a, 1);
+    onlyB.Insert(b, 1);
+    onlyC.Insert(c, 1);
+    abc.Insert(a, 1).Insert(b, 1).Insert(c, 1);
+    onlyA *= onlyB;
+    BOOST_CHECK(FinalizeMuHash(onlyA) == hashAB);
+    abc /= onlyC;
+    BOOST_CHECK(FinalizeMuHash(abc) == hashAB);
+
+    // Serialization keeps pending removals
+    MuHash3072 pending;
+    pending.Insert(a, 1).Insert(b, 1).Insert(c, 1).Remove(c, 1);
+    CDataStream ss(SER_DISK, 0);
+    ss << pending;
+    BOOST_CHECK_EQUAL(ss.size(), 2 * Num3072::BYTE_SIZE);
+    MuHash3072 restored;
+    ss >> restored;
+    BOOST_CHECK(FinalizeMuHash(restored) == hashAB);
+
+    // Inputs at or above the modulus are reduced
+    unsigned char max[Num3072::BYTE_SIZE];
+    memset(max, 0xff, sizeof(max));
+    Num3072 num(max), one;
+    unsigned char out[Num3072::BYTE_SIZE];
+    num.Divide(num);
+    num.ToBytes(out);
+    one.ToBytes(max);
+    BOOST_CHECK(memcmp(out, max, sizeof(out)) == 0);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
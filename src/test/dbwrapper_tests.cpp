@@ -2,7 +2,9 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "arith_uint256.h"
 #include "dbwrapper.h"
+#include "txdb.h"
 #include "uint256.h"
 #include "random.h"
 #include "test/test_bitcoin.h"
@@ -322,6 +324,120 @@ BOOST_AUTO_TEST_CASE(iterator_string_ordering)
     }
 }
 
+BOOST_AUTO_TEST_CASE(dbwrapper_profiles)
+{
+    DBProfile profile;
+    BOOST_CHECK(ParseDBProfile("default", profile) && profile == DB_PROFILE_DEFAULT);
+    BOOST_CHECK(ParseDBProfile("ssd", profile) && profile == DB_PROFILE_SSD);
+    BOOST_CHECK(ParseDBProfile("hdd", profile) && profile == DB_PROFILE_HDD);
+    BOOST_CHECK(ParseDBProfile("lowmem", profile) && profile == DB_PROFILE_LOWMEM);
+    BOOST_CHECK(!ParseDBProfile("SSD", profile));
+    BOOST_CHECK(!ParseDBProfile("", profile));
+
+    // The default profile keeps the historical tuning
+    CDBOptions def(DB_PROFILE_DEFAULT);
+    BOOST_CHECK_EQUAL(def.nMaxOpenFiles, 64);
+    BOOST_CHECK_EQUAL(def.nBlockSize, 4096U);
+    BOOST_CHECK_EQUAL(def.nWriteBufferPercent, 25);
+    BOOST_CHECK_EQUAL(def.nBloomBits, 10);
+    BOOST_CHECK(!def.fCompression);
+
+    // Every profile, with and without compression and bloom filters, must hold the same data
+    const DBProfile profiles[] = {DB_PROFILE_DEFAULT, DB_PROFILE_SSD, DB_PROFILE_HDD, DB_PROFILE_LOWMEM};
+    for (unsigned int i = 0; i < sizeof(profiles) / sizeof(profiles[0]); i++) {
+        CDBOptions dbopts(profiles[i]);
+        dbopts.fCompression = i % 2;
+        dbopts.nBloomBits = i == 3 ? 0 : dbopts.nBloomBits;
+        path ph = temp_directory_path() / unique_path();
+        {
+            CDBWrapper dbw(ph, (1 << 20), false, false, true, dbopts);
+            CDBBatch batch(dbw);
+            for (uint32_t n = 0; n < 1000; n++)
+                batch.Write(make_pair('t', ArithToUint256(arith_uint256(n))), n);
+            BOOST_CHECK(dbw.WriteBatch(batch, true));
+        }
+        CDBWrapper dbw(ph, (1 << 20), false, false, true, dbopts);
+        uint32_t value;
+        BOOST_CHECK(dbw.Read(make_pair('t', ArithToUint256(arith_uint256(999))), value) && value == 999);
+        BOOST_CHECK(!dbw.Exists(make_pair('t', ArithToUint256(arith_uint256(1000)))));
+        boost::scoped_ptr<CDBIterator> it(dbw.NewIterator());
+        uint32_t count = 0;
+        for (it->Seek(make_pair('t', uint256())); it->Valid(); it->Next()) {
+            BOOST_CHECK(it->GetValue(value));
+            count++;
+        }
+        BOOST_CHECK_EQUAL(count, 1000U);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(txindex_migration)
+{
+    CBlockTreeDB blocktree(1 << 20, true);
+    CTxIndexDB txindex(1 << 20, true);
+
+    // Older versions wrote the txindex next to the block tree records
+    std::vector<std::pair<uint256, CDiskTxPos> > vPos;
+    for (unsigned int n = 0; n < 300; n++) {
+        vPos.push_back(std::make_pair(GetRandHash(), CDiskTxPos(CDiskBlockPos(n / 100, n), 81 + n)));
+        BOOST_CHECK(blocktree.Write(std::make_pair('t', vPos.back().first), vPos.back().second));
+    }
+    BOOST_CHECK(blocktree.WriteFlag("txindex", true));
+
+    mapArgs["-dbbatchsize"] = "1024";
+    BOOST_CHECK(txindex.MigrateData(blocktree));
+    mapArgs.erase("-dbbatchsize");
+
+    for (unsigned int n = 0; n < vPos.size(); n++) {
+        CTxIndexEntry pos;
+        BOOST_CHECK(txindex.ReadTxIndex(vPos[n].first, pos));
+        BOOST_CHECK(pos.hashBlock.IsNull());
+        BOOST_CHECK(pos.nFile == vPos[n].second.nFile && pos.nPos == vPos[n].second.nPos && pos.nTxOffset == vPos[n].second.nTxOffset);
+        BOOST_CHECK(!blocktree.Exists(std::make_pair('t', vPos[n].first)));
+    }
+    // Other block tree records stay, and a second pass finds nothing to do
+    bool fTxIndex = false;
+    BOOST_CHECK(blocktree.ReadFlag("txindex", fTxIndex) && fTxIndex);
+    BOOST_CHECK(txindex.MigrateData(blocktree));
+}
+
+BOOST_AUTO_TEST_CASE(txindex_build)
+{
+    CTxIndexDB txindex(1 << 20, true);
 
+    std::vector<std::pair<uint256, CDiskTxPos> > vLegacy;
+    for (unsigned int n = 0; n < 20; n++) {
+        vLegacy.push_back(std::make_pair(GetRandHash(), CDiskTxPos(CDiskBlockPos(0, n), 1 + n)));
+        BOOST_CHECK(txindex.Write(std::make_pair('t', vLegacy.back().first), vLegacy.back().second));
+    }
+    BOOST_CHECK(txindex.HaveLegacyRecords());
+
+    uint256 hashBuilt;
+    BOOST_CHECK(!txindex.ReadBuildPosition(hashBuilt));
+    BOOST_CHECK(txindex.WriteBuildPosition(uint256()));
+    BOOST_CHECK(txindex.ReadBuildPosition(hashBuilt) && hashBuilt.IsNull());
+
+    // A built block replaces the records of older versions
+    uint256 hashBlock = GetRandHash();
+    std::vector<std::pair<uint256, CTxIndexEntry> > vPos;
+    for (unsigned int n = 0; n < 10; n++)
+        vPos.push_back(std::make_pair(vLegacy[n].first, CTxIndexEntry(vLegacy[n].second, hashBlock, 100 + n)));
+    BOOST_CHECK(txindex.WriteBuildBlock(vPos, hashBlock));
+    BOOST_CHECK(txindex.ReadBuildPosition(hashBuilt) && hashBuilt == hashBlock);
+    for (unsigned int n = 0; n < 20; n++) {
+        CTxIndexEntry entry;
+        BOOST_CHECK(txindex.ReadTxIndex(vLegacy[n].first, entry));
+        BOOST_CHECK_EQUAL(entry.nTxOffset, vLegacy[n].second.nTxOffset);
+        BOOST_CHECK(entry.hashBlock == (n < 10 ? hashBlock : uint256()));
+        BOOST_CHECK_EQUAL(entry.nTxSize, n < 10 ? 100 + n : 0);
+    }
+
+    // Finishing drops the position and the records it did not replace
+    BOOST_CHECK(txindex.FinishBuild());
+    BOOST_CHECK(!txindex.ReadBuildPosition(hashBuilt));
+    BOOST_CHECK(!txindex.HaveLegacyRecords());
+    CTxIndexEntry entry;
+    BOOST_CHECK(txindex.ReadTxIndex(vLegacy[0].first, entry));
+    BOOST_CHECK(!txindex.ReadTxIndex(vLegacy[10].first, entry));
+}
 
 BOOST_AUTO_TEST_SUITE_END()
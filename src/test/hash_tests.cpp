@@ -3,6 +3,8 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "hash.h"
+#include "crypto/common.h"
+#include "random.h"
 #include "utilstrencodings.h"
 #include "test/test_bitcoin.h"
 
@@ -126,6 +128,22 @@ BOOST_AUTO_TEST_CASE(siphash)
     CHashWriter ss(SER_DISK, CLIENT_VERSION);
     ss << CTransaction();
     BOOST_CHECK_EQUAL(SipHashUint256(1, 2, ss.GetHash()), 0x79751e980c2a0a35ULL);
+
+    // The specialized outpoint hash must match hashing the same bytes
+    for (int i = 0; i < 16; ++i) {
+        uint64_t k0 = GetRand(std::numeric_limits<uint64_t>::max());
+        uint64_t k1 = GetRand(std::numeric_limits<uint64_t>::max());
+        uint256 x = GetRandHash();
+        uint32_t n = insecure_rand();
+        unsigned char nb[4];
+        WriteLE32(nb, n);
+        CSipHasher sip256(k0, k1);
+        sip256.Write(x.begin(), 32);
+        CSipHasher sip288 = sip256;
+        sip288.Write(nb, 4);
+        BOOST_CHECK_EQUAL(SipHashUint256(k0, k1, x), sip256.Finalize());
+        BOOST_CHECK_EQUAL(SipHashUint256Extra(k0, k1, x, n), sip288.Finalize());
+    }
 }
 
 BOOST_AUTO_TEST_SUITE_END()
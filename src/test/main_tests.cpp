@@ -2,8 +2,17 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "chain.h"
 #include "chainparams.h"
+#include "coins.h"
+#include "consensus/validation.h"
+#include "crypto/scrypt.h"
+#include "key.h"
 #include "main.h"
+#include "script/interpreter.h"
+#include "streams.h"
+#include "timedata.h"
+#include "txmempool.h"
 
 #include "test/test_bitcoin.h"
 
@@ -33,4 +42,139 @@ BOOST_AUTO_TEST_CASE(test_combiner_all)
     Test.disconnect(&ReturnTrue);
     BOOST_CHECK(Test());
 }
+
+BOOST_AUTO_TEST_CASE(headers_pow_hash_batch)
+{
+    // A headers message is hashed in parallel chunks; every entry must match
+    // the hash computed one header at a time.
+    std::vector<CBlockHeader> headers(2 * SCRYPT_MULTI_MAX_WAYS + 5);
+    for (size_t i = 0; i < headers.size(); i++) {
+        headers[i].nVersion = i % 2 ? 6 : 7;
+        headers[i].hashPrevBlock = i ? headers[i - 1].GetHash() : uint256();
+        headers[i].nTime = 1500000000 + i * 64;
+        headers[i].nBits = 0x1e0fffff;
+        headers[i].nNonce = i;
+    }
+
+    std::vector<uint256> vPoWHash;
+    ComputeHeadersPoWHash(headers, vPoWHash);
+    BOOST_CHECK_EQUAL(vPoWHash.size(), headers.size());
+    for (size_t i = 0; i < headers.size(); i++)
+        BOOST_CHECK(vPoWHash[i] == headers[i].GetPoWHash());
+
+    ComputeHeadersPoWHash(std::vector<CBlockHeader>(), vPoWHash);
+    BOOST_CHECK(vPoWHash.empty());
+}
+
+BOOST_AUTO_TEST_CASE(block_index_pow_hash)
+{
+    CBlockHeader header;
+    header.nVersion = 7;
+    header.nTime = 1500000000;
+    header.nBits = 0x1e0fffff;
+    header.nNonce = 42;
+    uint256 hash = header.GetHash();
+    uint256 hashPoW = header.GetPoWHash();
+
+    CBlockIndex index(header);
+    index.phashBlock = &hash;
+    BOOST_CHECK(!(index.nStatus & BLOCK_HAVE_POW_HASH));
+    BOOST_CHECK(index.GetBlockPoWHash() == hashPoW);
+
+    // Entries without the cached hash keep the old on-disk format
+    CDataStream ssOld(SER_DISK, CLIENT_VERSION);
+    ssOld << CDiskBlockIndex(&index);
+    size_t nSizeOld = ssOld.size();
+    CDiskBlockIndex diskOld;
+    ssOld >> diskOld;
+    BOOST_CHECK(ssOld.empty());
+    BOOST_CHECK(!(diskOld.nStatus & BLOCK_HAVE_POW_HASH));
+
+    index.SetBlockPoWHash(hashPoW);
+    CDataStream ssNew(SER_DISK, CLIENT_VERSION);
+    ssNew << CDiskBlockIndex(&index);
+    // The hash plus one more byte for the VARINT of nStatus
+    BOOST_CHECK_EQUAL(ssNew.size(), nSizeOld + 32 + 1);
+    CDiskBlockIndex diskNew;
+    ssNew >> diskNew;
+    BOOST_CHECK(diskNew.nStatus & BLOCK_HAVE_POW_HASH);
+    BOOST_CHECK(diskNew.hashPoW == hashPoW);
+    BOOST_CHECK(diskNew.GetBlockHash() == hash);
+
+    // The cached copy is returned without recomputing
+    index.hashPoW = uint256S("0x1234");
+    BOOST_CHECK(index.GetBlockPoWHash() == uint256S("0x1234"));
+}
+
+static CTransaction SpendForBatch(const COutPoint& prevout, CAmount nValue, const CScript& scriptPubKey, const CKey& key)
+{
+    CMutableTransaction tx;
+    tx.nTime = GetAdjustedTime();
+    tx.vin.resize(1);
+    tx.vin[0].prevout = prevout;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = nValue;
+    tx.vout[0].scriptPubKey = scriptPubKey;
+
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(scriptPubKey, tx, 0, SIGHASH_ALL, 0);
+    BOOST_CHECK(key.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    tx.vin[0].scriptSig << vchSig;
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(mempool_batch)
+{
+    CKey key, keyOther;
+    key.MakeNewKey(true);
+    keyOther.MakeNewKey(true);
+    CScript scriptPubKey = CScript() << ToByteVector(key.GetPubKey()) << OP_CHECKSIG;
+
+    // Fund a few confirmed outputs without building a chain
+    CMutableTransaction txFund;
+    txFund.nTime = GetAdjustedTime() - 1000;
+    txFund.vin.resize(1);
+    txFund.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    txFund.vout.resize(3, CTxOut(100 * COIN, scriptPubKey));
+    CTransaction txFunding(txFund);
+
+    LOCK(cs_main);
+    AddCoins(*pcoinsTip, txFunding, 0);
+
+    std::vector<CTransaction> vtx;
+    vtx.push_back(SpendForBatch(COutPoint(txFunding.GetHash(), 0), 99 * COIN, scriptPubKey, key));
+    // Bad signature, must not affect its neighbours
+    vtx.push_back(SpendForBatch(COutPoint(txFunding.GetHash(), 1), 99 * COIN, scriptPubKey, keyOther));
+    // Spends the first one, which has to be in the pool before it is checked
+    vtx.push_back(SpendForBatch(COutPoint(vtx[0].GetHash(), 0), 98 * COIN, scriptPubKey, key));
+    // Double spend of the first one
+    vtx.push_back(SpendForBatch(COutPoint(txFunding.GetHash(), 0), 97 * COIN, scriptPubKey, key));
+    vtx.push_back(SpendForBatch(COutPoint(txFunding.GetHash(), 2), 99 * COIN, scriptPubKey, key));
+    // Unknown input
+    vtx.push_back(SpendForBatch(COutPoint(GetRandHash(), 0), 99 * COIN, scriptPubKey, key));
+
+    std::vector<CValidationState> vState;
+    std::vector<bool> vfAccepted;
+    std::vector<bool> vfMissingInputs;
+    AcceptToMemoryPoolBatch(mempool, vtx, false, vState, vfAccepted, vfMissingInputs);
+    BOOST_CHECK_EQUAL(vState.size(), vtx.size());
+
+    BOOST_CHECK(vfAccepted[0]);
+    BOOST_CHECK(!vfAccepted[1]);
+    int nDoS = 0;
+    BOOST_CHECK(vState[1].IsInvalid(nDoS) && nDoS == 100);
+    BOOST_CHECK(vfAccepted[2]);
+    BOOST_CHECK(!vfAccepted[3]);
+    BOOST_CHECK_EQUAL(vState[3].GetRejectReason(), "txn-mempool-conflict");
+    BOOST_CHECK(vfAccepted[4]);
+    BOOST_CHECK(!vfAccepted[5] && vfMissingInputs[5] && vState[5].IsValid());
+
+    BOOST_CHECK_EQUAL(mempool.size(), 3U);
+    BOOST_CHECK(mempool.exists(vtx[0].GetHash()));
+    BOOST_CHECK(mempool.exists(vtx[2].GetHash()));
+    BOOST_CHECK(mempool.exists(vtx[4].GetHash()));
+    mempool.clear();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -10,7 +10,9 @@
 #include "net.h"
 #include "netbase.h"
 #include "serialize.h"
+#include "socketevents.h"
 #include "streams.h"
+#include "utiltime.h"
 
 using namespace std;
 
@@ -172,4 +174,68 @@ BOOST_AUTO_TEST_CASE(cnode_simple_test)
     BOOST_CHECK(pnode2->fFeeler == false);
 }
 
+#ifndef WIN32
+BOOST_AUTO_TEST_CASE(socket_events)
+{
+    const SocketEventsMode modes[] = {SOCKETEVENTS_SELECT, SOCKETEVENTS_POLL, SOCKETEVENTS_EPOLL};
+    BOOST_FOREACH(SocketEventsMode mode, modes) {
+        SocketEventsMode parsed;
+        if (!ParseSocketEventsMode(GetSocketEventsModeName(mode), parsed))
+            continue;
+        BOOST_CHECK(parsed == mode);
+        CSocketEvents* pEvents = CreateSocketEvents(mode);
+        BOOST_REQUIRE(pEvents);
+        BOOST_CHECK(pEvents->GetMode() == mode);
+
+        int fds[2];
+        BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+        SOCKET hLocal = fds[0], hPeer = fds[1];
+        std::vector<std::pair<SOCKET, int> > vReady;
+
+        // Nothing to read yet
+        BOOST_CHECK(pEvents->Set(hLocal, SOCKET_EVENT_RECV));
+        BOOST_CHECK(pEvents->Wait(0, vReady));
+        BOOST_CHECK(vReady.empty());
+
+        char c = 'x';
+        BOOST_CHECK(send(hPeer, &c, 1, 0) == 1);
+        BOOST_CHECK(pEvents->Wait(1000, vReady));
+        BOOST_REQUIRE_EQUAL(vReady.size(), 1U);
+        BOOST_CHECK(vReady[0].first == hLocal);
+        BOOST_CHECK(vReady[0].second & SOCKET_EVENT_RECV);
+
+        // Switching interest to sending reports writability instead
+        BOOST_CHECK(pEvents->Set(hLocal, SOCKET_EVENT_SEND));
+        BOOST_CHECK(pEvents->Wait(1000, vReady));
+        BOOST_REQUIRE_EQUAL(vReady.size(), 1U);
+        BOOST_CHECK(vReady[0].second == SOCKET_EVENT_SEND);
+
+        // A wakeup ends the wait early and is consumed
+        BOOST_CHECK(pEvents->Set(hLocal, 0));
+        if (pEvents->CanWakeup()) {
+            pEvents->Wakeup();
+            int64_t nStart = GetTimeMillis();
+            BOOST_CHECK(pEvents->Wait(60000, vReady));
+            BOOST_CHECK(vReady.empty());
+            BOOST_CHECK(GetTimeMillis() - nStart < 30000);
+            BOOST_CHECK(pEvents->Wait(0, vReady));
+            BOOST_CHECK(vReady.empty());
+        }
+
+        // A hang-up wakes the reader
+        BOOST_CHECK(pEvents->Set(hLocal, SOCKET_EVENT_RECV));
+        CloseSocket(hPeer);
+        BOOST_CHECK(pEvents->Wait(1000, vReady));
+        BOOST_REQUIRE_EQUAL(vReady.size(), 1U);
+        BOOST_CHECK(vReady[0].second & (SOCKET_EVENT_RECV | SOCKET_EVENT_ERR));
+
+        pEvents->Remove(hLocal);
+        CloseSocket(hLocal);
+        BOOST_CHECK(pEvents->Wait(0, vReady));
+        BOOST_CHECK(vReady.empty());
+        delete pEvents;
+    }
+}
+#endif
+
 BOOST_AUTO_TEST_SUITE_END()
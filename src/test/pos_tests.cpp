@@ -0,0 +1,187 @@
+// Copyright (c) 2014-2018 The CashCore Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chain.h"
+#include "chainparams.h"
+#include "coins.h"
+#include "consensus/validation.h"
+#include "key.h"
+#include "keystore.h"
+#include "pos.h"
+#include "random.h"
+#include "script/sign.h"
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(pos_tests, BasicTestingSetup)
+
+static CTransaction MakeStakePrev(uint32_t nTime, CAmount nValue)
+{
+    CMutableTransaction tx;
+    tx.nTime = nTime;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.hash = GetRandHash();
+    tx.vout.resize(1);
+    tx.vout[0].nValue = nValue;
+    return CTransaction(tx);
+}
+
+/* The precomputed kernel must agree with the reference kernel hash check */
+BOOST_AUTO_TEST_CASE(stake_kernel_matches_reference)
+{
+    CBlockIndex indexPrev;
+    indexPrev.nHeight = 1000;
+    indexPrev.nStakeModifier = GetRandHash();
+    // Easy enough target that both outcomes show up over the probed window
+    unsigned int nBits = 0x2000ffff;
+
+    for (int i = 0; i < 20; i++) {
+        CTransaction txPrev = MakeStakePrev(1500000000, 1 + insecure_rand() % 100);
+        COutPoint prevout(txPrev.GetHash(), 0);
+        CStakeKernel kernel(&indexPrev, nBits, prevout, txPrev.nTime, txPrev.vout[0].nValue);
+        for (uint32_t nTime = txPrev.nTime; nTime < txPrev.nTime + 64; nTime += 16)
+            BOOST_CHECK_EQUAL(kernel.CheckHash(nTime), CheckStakeKernelHash(&indexPrev, nBits, txPrev.nTime, txPrev.vout[0].nValue, prevout, nTime));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(stake_kernel_search)
+{
+    CBlockIndex indexPrev;
+    indexPrev.nHeight = 1000;
+    indexPrev.nStakeModifier = GetRandHash();
+    unsigned int nBits = 0x2000ffff;
+    uint32_t nTimeBegin = 1500001600;
+
+    std::vector<CStakeKernel> vKernels;
+    for (int i = 0; i < 50; i++) {
+        CTransaction txPrev = MakeStakePrev(1500000000, 1);
+        vKernels.push_back(CStakeKernel(&indexPrev, nBits, COutPoint(txPrev.GetHash(), 0), txPrev.nTime, 1));
+    }
+
+    size_t nIndex;
+    uint32_t nTime;
+    if (SearchStakeKernels(vKernels, nTimeBegin, 4, 16, nIndex, nTime)) {
+        BOOST_CHECK(nIndex < vKernels.size());
+        BOOST_CHECK(nTime <= nTimeBegin && nTime > nTimeBegin - 64 && (nTimeBegin - nTime) % 16 == 0);
+        BOOST_CHECK(vKernels[nIndex].CheckHash(nTime));
+    } else {
+        for (size_t i = 0; i < vKernels.size(); i++)
+            for (uint32_t n = 0; n < 4; n++)
+                BOOST_CHECK(!vKernels[i].CheckHash(nTimeBegin - 16 * n));
+    }
+
+    // A timestamp before txPrev.nTime can never meet the target
+    BOOST_CHECK(!vKernels[0].CheckHash(1499999999));
+    BOOST_CHECK(!SearchStakeKernels(std::vector<CStakeKernel>(), nTimeBegin, 4, 16, nIndex, nTime));
+}
+
+/* Candidates must be mature and still in the chain the kernel is built on */
+BOOST_AUTO_TEST_CASE(stake_candidate_prepare)
+{
+    const int nMaturity = Params().GetConsensus().nCoinbaseMaturity;
+    std::vector<uint256> vHashes(nMaturity + 10);
+    std::vector<CBlockIndex> vIndex(vHashes.size());
+    for (size_t i = 0; i < vIndex.size(); i++) {
+        vHashes[i] = GetRandHash();
+        vIndex[i].nHeight = i;
+        vIndex[i].pprev = i ? &vIndex[i - 1] : NULL;
+        vIndex[i].phashBlock = &vHashes[i];
+        vIndex[i].BuildSkip();
+    }
+    CBlockIndex* pindexTip = &vIndex.back();
+    COutPoint prevout(GetRandHash(), 0);
+    CStakeKernel kernel;
+
+    CStakeCandidate candidate(1500000000, 100, 5, vHashes[5]);
+    BOOST_CHECK(PrepareStakeKernel(pindexTip, 0x2000ffff, prevout, candidate, kernel));
+    BOOST_CHECK(kernel.prevout == prevout && kernel.nTimePrev == candidate.nTime);
+
+    // Reorganized away
+    candidate.hashBlock = GetRandHash();
+    BOOST_CHECK(!PrepareStakeKernel(pindexTip, 0x2000ffff, prevout, candidate, kernel));
+
+    // Not mature yet
+    int nHeight = pindexTip->nHeight + 2 - nMaturity;
+    CStakeCandidate immature(1500000000, 100, nHeight, vHashes[nHeight]);
+    BOOST_CHECK(!PrepareStakeKernel(pindexTip, 0x2000ffff, prevout, immature, kernel));
+}
+
+BOOST_AUTO_TEST_CASE(stake_input_cache)
+{
+    CStakeInputCache cache(3);
+    std::vector<COutPoint> vPrevouts;
+    for (int i = 0; i < 4; i++) {
+        vPrevouts.push_back(COutPoint(GetRandHash(), i));
+        Coin coin(CTxOut(100 + i, CScript() << OP_TRUE), 10 + i, false, true, 1500000000 + i);
+        cache.Add(vPrevouts.back(), CStakeInput(coin, GetRandHash()));
+    }
+    BOOST_CHECK_EQUAL(cache.size(), 3U);
+
+    // The oldest input was dropped
+    CStakeInput input;
+    BOOST_CHECK(!cache.Get(vPrevouts[0], input));
+    BOOST_CHECK(cache.Get(vPrevouts[3], input));
+    BOOST_CHECK(input.nTime == 1500000003 && input.nValue == 103 && input.nHeight == 13);
+    BOOST_CHECK(input.scriptPubKey == CScript() << OP_TRUE);
+
+    // Adding again replaces the entry
+    input.nHeight = 20;
+    cache.Add(vPrevouts[3], input);
+    BOOST_CHECK_EQUAL(cache.size(), 3U);
+    BOOST_CHECK(cache.Get(vPrevouts[3], input) && input.nHeight == 20);
+
+    CStakeInputCache disabled(0);
+    disabled.Add(vPrevouts[0], input);
+    BOOST_CHECK(!disabled.Get(vPrevouts[0], input));
+}
+
+/* The coinstake is checked from its kernel input alone, without the previous transaction */
+BOOST_AUTO_TEST_CASE(check_proof_of_stake)
+{
+    const int nMaturity = Params().GetConsensus().nCoinbaseMaturity;
+    CBlockIndex indexPrev;
+    indexPrev.nHeight = nMaturity + 100;
+    indexPrev.nStakeModifier = GetRandHash();
+    unsigned int nBits = 0x2000ffff;
+
+    CKey key;
+    key.MakeNewKey(true);
+    CBasicKeyStore keystore;
+    keystore.AddKey(key);
+    CScript scriptPubKey = CScript() << ToByteVector(key.GetPubKey()) << OP_CHECKSIG;
+    Coin coin(CTxOut(1000, scriptPubKey), 50, false, false, 1500000000);
+    CStakeInput input(coin, GetRandHash());
+
+    CMutableTransaction tx;
+    tx.nTime = 1500000016;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), 1);
+    tx.vout.resize(2);
+    tx.vout[0].SetEmpty();
+    tx.vout[1] = CTxOut(1000, scriptPubKey);
+    BOOST_CHECK(SignSignature(keystore, scriptPubKey, tx, 0, input.nValue, SIGHASH_ALL));
+
+    CValidationState state;
+    bool fKernel = CheckStakeKernelHash(&indexPrev, nBits, input.nTime, input.nValue, tx.vin[0].prevout, tx.nTime);
+    BOOST_CHECK_EQUAL(CheckProofOfStake(&indexPrev, CTransaction(tx), nBits, input, state), fKernel);
+    int nDoS = 0;
+    BOOST_CHECK_EQUAL(state.IsInvalid(nDoS), !fKernel);
+
+    // Immature input
+    CStakeInput immature(input);
+    immature.nHeight = indexPrev.nHeight + 2 - nMaturity;
+    state = CValidationState();
+    BOOST_CHECK(!CheckProofOfStake(&indexPrev, CTransaction(tx), nBits, immature, state));
+    BOOST_CHECK(state.IsInvalid(nDoS) && nDoS == 100);
+
+    // Signed for another output
+    CStakeInput other(input);
+    other.scriptPubKey = CScript() << OP_FALSE;
+    state = CValidationState();
+    BOOST_CHECK(!CheckProofOfStake(&indexPrev, CTransaction(tx), nBits, other, state));
+    BOOST_CHECK(state.IsInvalid(nDoS) && nDoS == 100);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -32,4 +32,36 @@ BOOST_AUTO_TEST_CASE(scrypt_hashtest)
     }
 }
 
+BOOST_AUTO_TEST_CASE(scrypt_multi_hashtest)
+{
+    // Batches that exercise every lane width plus a scalar tail must match the single hash path
+    const char* inputhex[] = { "020000004c1271c211717198227392b029a64a7971931d351b387bb80db027f270411e398a07046f7d4a08dd815412a8712f874a7ebf0507e3878bd24e20a3b73fd750a667d2f451eac7471b00de6659", "0200000011503ee6a855e900c00cfdd98f5f55fffeaee9b6bf55bea9b852d9de2ce35828e204eef76acfd36949ae56d1fbe81c1ac9c0209e6331ad56414f9072506a77f8c6faf551eac7471b00389d01", "02000000a72c8a177f523946f42f22c3e86b8023221b4105e8007e59e81f6beb013e29aaf635295cb9ac966213fb56e046dc71df5b3f7f67ceaeab24038e743f883aff1aaafaf551eac7471b0166249b" };
+    const char* expected[] = { "00000000002bef4107f882f6115e0b01f348d21195dacd3582aa2dabd7985806" , "00000000003a0d11bdd5eb634e08b7feddcfbbf228ed35d250daf19f1c88fc94", "00000000000b40f895f288e13244728a6c2d9d59d8aff29c65f8dd5114a8ca81" };
+    scrypt_detect_multi();
+    BOOST_CHECK(scrypt_multi_ways() >= 1 && scrypt_multi_ways() <= SCRYPT_MULTI_MAX_WAYS);
+
+    const size_t count = 16 + 8 + 4 + 3;
+    std::vector<char> input(80 * count), output(32 * count);
+    for (size_t i = 0; i < count; i++) {
+        std::vector<unsigned char> inputbytes = ParseHex(inputhex[i % 3]);
+        memcpy(&input[80 * i], &inputbytes[0], 80);
+    }
+    scrypt_1024_1_1_256_multi(&input[0], &output[0], count);
+    for (size_t i = 0; i < count; i++) {
+        uint256 scrypthash;
+        memcpy(scrypthash.begin(), &output[32 * i], 32);
+        BOOST_CHECK_EQUAL(scrypthash.ToString().c_str(), expected[i % 3]);
+    }
+
+    // Lanes must stay independent when the inputs only differ in the nonce
+    for (size_t i = 0; i < count; i++)
+        input[80 * i + 79] = (char)i;
+    scrypt_1024_1_1_256_multi(&input[0], &output[0], count);
+    for (size_t i = 0; i < count; i++) {
+        char single[32];
+        scrypt_1024_1_1_256(&input[80 * i], single);
+        BOOST_CHECK(memcmp(single, &output[32 * i], 32) == 0);
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
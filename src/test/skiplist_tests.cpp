@@ -100,4 +100,53 @@ BOOST_AUTO_TEST_CASE(getlocator_test)
     }
 }
 
+static const CBlockIndex* GetLastBlockIndexLinear(const CBlockIndex* pindex, bool fProofOfStake)
+{
+    while (pindex && pindex->pprev && (pindex->IsProofOfStake() != fProofOfStake))
+        pindex = pindex->pprev;
+    return pindex;
+}
+
+BOOST_AUTO_TEST_CASE(getlastblockindex_test)
+{
+    // A chain that starts with a run of PoW blocks and then mixes both types.
+    std::vector<CBlockIndex> vIndex(10000);
+    for (unsigned int i=0; i<vIndex.size(); i++) {
+        vIndex[i].nHeight = i;
+        vIndex[i].pprev = i ? &vIndex[i - 1] : NULL;
+        vIndex[i].nTx = 1;
+        if (i > 100 && (insecure_rand() % 3))
+            vIndex[i].SetProofOfStake();
+        vIndex[i].BuildSkip();
+        vIndex[i].BuildLastBlockIndex();
+        BOOST_CHECK(vIndex[i].fPrevTypeFinal);
+    }
+    BOOST_CHECK(GetLastBlockIndex(&vIndex[50], true) == &vIndex[0]);
+    for (unsigned int i=0; i<vIndex.size(); i++) {
+        BOOST_CHECK(GetLastBlockIndex(&vIndex[i], true) == GetLastBlockIndexLinear(&vIndex[i], true));
+        BOOST_CHECK(GetLastBlockIndex(&vIndex[i], false) == GetLastBlockIndexLinear(&vIndex[i], false));
+    }
+
+    // Headers without block data may still change type, so entries above
+    // them must not rely on the cached pointers.
+    std::vector<CBlockIndex> vHeaders(100);
+    for (unsigned int i=0; i<vHeaders.size(); i++) {
+        vHeaders[i].nHeight = vIndex.size() + i;
+        vHeaders[i].pprev = i ? &vHeaders[i - 1] : &vIndex.back();
+        vHeaders[i].BuildSkip();
+        vHeaders[i].BuildLastBlockIndex();
+        BOOST_CHECK_EQUAL(vHeaders[i].fPrevTypeFinal, i == 0);
+    }
+    for (unsigned int i=0; i<vHeaders.size(); i++) {
+        if (insecure_rand() % 2) {
+            vHeaders[i].SetProofOfStake();
+            vHeaders[i].nTx = 1;
+        }
+    }
+    for (unsigned int i=0; i<vHeaders.size(); i++) {
+        BOOST_CHECK(GetLastBlockIndex(&vHeaders[i], true) == GetLastBlockIndexLinear(&vHeaders[i], true));
+        BOOST_CHECK(GetLastBlockIndex(&vHeaders[i], false) == GetLastBlockIndexLinear(&vHeaders[i], false));
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -67,8 +67,11 @@ TestingSetup::TestingSetup(const std::string& chainName) : BasicTestingSetup(cha
             BOOST_CHECK(ok);
         }
         nScriptCheckThreads = 3;
-        for (int i=0; i < nScriptCheckThreads-1; i++)
+        for (int i=0; i < nScriptCheckThreads-1; i++) {
             threadGroup.create_thread(&ThreadScriptCheck);
+            threadGroup.create_thread(&ThreadHeaderPoWCheck);
+            threadGroup.create_thread(&ThreadBlockImportCheck);
+        }
         RegisterNodeSignals(GetNodeSignals());
 }
 
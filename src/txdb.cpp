@@ -7,69 +7,404 @@
 
 #include "chainparams.h"
 #include "hash.h"
+#include "init.h"
 #include "pow.h"
+#include "random.h"
+#include "ui_interface.h"
 #include "uint256.h"
+#include "util.h"
+#include "utiltime.h"
 
 #include <stdint.h>
+#include <stdlib.h>
 
 #include <boost/thread.hpp>
 
 using namespace std;
 
+static const char DB_COIN = 'C';
 static const char DB_COINS = 'c';
 static const char DB_BLOCK_FILES = 'f';
 static const char DB_TXINDEX = 't';
+static const char DB_TXINDEX_ENTRY = 'T';
+static const char DB_TXINDEX_BUILD = 'P';
 static const char DB_BLOCK_INDEX = 'b';
+static const char DB_UTXO_STATS = 's';
 
 static const char DB_BEST_BLOCK = 'B';
+static const char DB_HEAD_BLOCKS = 'H';
 static const char DB_FLAG = 'F';
 static const char DB_REINDEX_FLAG = 'R';
 static const char DB_LAST_BLOCK = 'l';
 
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, true)
+namespace {
+
+/** Chainstate key of a single unspent output */
+struct CoinEntry {
+    COutPoint* outpoint;
+    char key;
+    CoinEntry(const COutPoint* ptr) : outpoint(const_cast<COutPoint*>(ptr)), key(DB_COIN) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(key);
+        READWRITE(outpoint->hash);
+        READWRITE(VARINT(outpoint->n));
+    }
+};
+
+/**
+ * Per-transaction chainstate record as written by earlier versions, kept only
+ * so Upgrade() can read it:
+ * - VARINT(nVersion)
+ * - VARINT(nCode): bit 0 coinbase, bit 3 coinstake, bits 1 and 2 whether
+ *   vout[0] and vout[1] are unspent, higher bits the number of non-zero bytes
+ *   of the following bitvector (minus one if neither bit 1 nor bit 2 is set)
+ * - unspentness bitvector for vout[2] and further
+ * - the unspent CTxOuts (via CTxOutCompressor)
+ * - VARINT(nHeight)
+ * - nTime
+ */
+struct CLegacyCoins
 {
+    bool fCoinBase;
+    bool fCoinStake;
+    std::vector<CTxOut> vout;
+    int nHeight;
+    uint32_t nTime;
+
+    CLegacyCoins() : fCoinBase(false), fCoinStake(false), nHeight(0), nTime(0) {}
+
+    template<typename Stream>
+    void Unserialize(Stream &s, int nType, int nVersion) {
+        unsigned int nCode = 0;
+        int nTxVersion = 0;
+        ::Unserialize(s, VARINT(nTxVersion), nType, nVersion);
+        ::Unserialize(s, VARINT(nCode), nType, nVersion);
+        fCoinBase = nCode & 1;
+        fCoinStake = nCode & 8;
+        std::vector<bool> vAvail(2, false);
+        vAvail[0] = (nCode & 2) != 0;
+        vAvail[1] = (nCode & 4) != 0;
+        unsigned int nMaskCode = (nCode / 16) + ((nCode & 6) != 0 ? 0 : 1);
+        while (nMaskCode > 0) {
+            unsigned char chAvail = 0;
+            ::Unserialize(s, chAvail, nType, nVersion);
+            for (unsigned int p = 0; p < 8; p++)
+                vAvail.push_back((chAvail & (1 << p)) != 0);
+            if (chAvail != 0)
+                nMaskCode--;
+        }
+        vout.assign(vAvail.size(), CTxOut());
+        for (unsigned int i = 0; i < vAvail.size(); i++) {
+            if (vAvail[i])
+                ::Unserialize(s, REF(CTxOutCompressor(vout[i])), nType, nVersion);
+        }
+        ::Unserialize(s, VARINT(nHeight), nType, nVersion);
+        ::Unserialize(s, nTime, nType, nVersion);
+    }
+};
+
 }
 
-bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) const {
-    return db.Read(make_pair(DB_COINS, txid), coins);
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe, const CDBOptions& dbopts) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, true, dbopts),
+    fPending(false), fWriterFailed(false), fStopWriter(false)
+{
+}
+
+CCoinsViewDB::~CCoinsViewDB()
+{
+    StopBackgroundWriter();
+}
+
+bool CCoinsViewDB::GetCoin(const COutPoint &outpoint, Coin &coin) const {
+    {
+        boost::unique_lock<boost::mutex> lock(cs_writer);
+        if (fPending) {
+            CCoinsMap::const_iterator it = mapPending.find(outpoint);
+            if (it != mapPending.end() && (it->second.flags & CCoinsCacheEntry::DIRTY)) {
+                if (it->second.coin.IsSpent())
+                    return false;
+                coin = it->second.coin;
+                return true;
+            }
+        }
+    }
+    return db.Read(CoinEntry(&outpoint), coin);
 }
 
-bool CCoinsViewDB::HaveCoins(const uint256 &txid) const {
-    return db.Exists(make_pair(DB_COINS, txid));
+bool CCoinsViewDB::HaveCoin(const COutPoint &outpoint) const {
+    {
+        boost::unique_lock<boost::mutex> lock(cs_writer);
+        if (fPending) {
+            CCoinsMap::const_iterator it = mapPending.find(outpoint);
+            if (it != mapPending.end() && (it->second.flags & CCoinsCacheEntry::DIRTY))
+                return !it->second.coin.IsSpent();
+        }
+    }
+    return db.Exists(CoinEntry(&outpoint));
 }
 
 uint256 CCoinsViewDB::GetBestBlock() const {
+    {
+        boost::unique_lock<boost::mutex> lock(cs_writer);
+        if (fPending)
+            return hashPendingBlock;
+    }
     uint256 hashBestChain;
     if (!db.Read(DB_BEST_BLOCK, hashBestChain))
         return uint256();
     return hashBestChain;
 }
 
-bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
+std::vector<uint256> CCoinsViewDB::GetHeadBlocks() const {
+    {
+        boost::unique_lock<boost::mutex> lock(cs_writer);
+        if (fPending)
+            return std::vector<uint256>();
+    }
+    std::vector<uint256> vhashHeadBlocks;
+    if (!db.Read(DB_HEAD_BLOCKS, vhashHeadBlocks))
+        return std::vector<uint256>();
+    return vhashHeadBlocks;
+}
+
+bool CCoinsViewDB::WriteCoins(const CCoinsMap &mapCoins, const uint256 &hashBlock) {
+    int64_t nTimeStart = GetTimeMicros();
     CDBBatch batch(db);
     size_t count = 0;
     size_t changed = 0;
-    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
+    size_t nBytes = 0;
+    size_t nBatchSize = (size_t)GetArg("-dbbatchsize", nDefaultDbBatchSize);
+    int nCrashRatio = GetArg("-dbcrashratio", 0);
+
+    if (!hashBlock.IsNull()) {
+        uint256 hashOldTip;
+        if (!db.Read(DB_BEST_BLOCK, hashOldTip)) {
+            // We may be in the middle of replaying.
+            std::vector<uint256> vhashOldHeads;
+            if (db.Read(DB_HEAD_BLOCKS, vhashOldHeads) && vhashOldHeads.size() == 2) {
+                assert(vhashOldHeads[0] == hashBlock);
+                hashOldTip = vhashOldHeads[1];
+            }
+        }
+        // In the first batch, mark the database as being in the middle of a
+        // transition from hashOldTip to hashBlock.
+        std::vector<uint256> vhashHeadBlocks;
+        vhashHeadBlocks.push_back(hashBlock);
+        vhashHeadBlocks.push_back(hashOldTip);
+        batch.Erase(DB_BEST_BLOCK);
+        batch.Write(DB_HEAD_BLOCKS, vhashHeadBlocks);
+    }
+
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) {
-            if (it->second.coins.IsPruned())
-                batch.Erase(make_pair(DB_COINS, it->first));
+            CoinEntry entry(&it->first);
+            if (it->second.coin.IsSpent())
+                batch.Erase(entry);
             else
-                batch.Write(make_pair(DB_COINS, it->first), it->second.coins);
+                batch.Write(entry, it->second.coin);
             changed++;
         }
         count++;
-        CCoinsMap::iterator itOld = it++;
-        mapCoins.erase(itOld);
+        if (batch.SizeEstimate() > nBatchSize) {
+            LogPrint("coindb", "Writing partial batch of %.2f MiB\n", batch.SizeEstimate() * (1.0 / 1048576.0));
+            nBytes += batch.SizeEstimate();
+            db.WriteBatch(batch);
+            batch.Clear();
+            if (nCrashRatio) {
+                static FastRandomContext rng;
+                if (rng.rand32() % nCrashRatio == 0) {
+                    LogPrintf("Simulating a crash. Goodbye.\n");
+                    _Exit(0);
+                }
+            }
+        }
     }
-    if (!hashBlock.IsNull())
+
+    // In the last batch, mark the database as consistent with hashBlock again.
+    if (!hashBlock.IsNull()) {
+        batch.Erase(DB_HEAD_BLOCKS);
         batch.Write(DB_BEST_BLOCK, hashBlock);
+    }
+
+    LogPrint("coindb", "Writing final batch of %.2f MiB\n", batch.SizeEstimate() * (1.0 / 1048576.0));
+    nBytes += batch.SizeEstimate();
+    bool ret = db.WriteBatch(batch);
+    int64_t nDuration = GetTimeMicros() - nTimeStart;
+    LogPrint("coindb", "Committed %u changed coins (out of %u) to coin database: %.2f MiB in %.2fms\n",
+        (unsigned int)changed, (unsigned int)count, nBytes * (1.0 / 1048576.0), nDuration * 0.001);
+    if (ret) {
+        boost::unique_lock<boost::mutex> lock(cs_writer);
+        stats.nFlushes++;
+        stats.nLastDuration = nDuration;
+        stats.nLastBytes = nBytes;
+        stats.nTotalBytes += nBytes;
+    }
+    return ret;
+}
+
+bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
+    {
+        boost::unique_lock<boost::mutex> lock(cs_writer);
+        while (fPending && !fWriterFailed)
+            condWriter.wait(lock);
+        if (fWriterFailed)
+            return false;
+        if (threadWriter) {
+            // The entries are only swapped, so this is cheap regardless of their number
+            mapPending.swap(mapCoins);
+            hashPendingBlock = hashBlock;
+            fPending = true;
+            condWriter.notify_all();
+            return true;
+        }
+    }
+    bool ret = WriteCoins(mapCoins, hashBlock);
+    mapCoins.clear();
+    return ret;
+}
+
+void CCoinsViewDB::ThreadWriter() {
+    RenameThread("cashcore-coinsdb");
+    while (true) {
+        uint256 hashBlock;
+        {
+            boost::unique_lock<boost::mutex> lock(cs_writer);
+            while (!fPending && !fStopWriter)
+                condWriter.wait(lock);
+            if (!fPending)
+                return;
+            hashBlock = hashPendingBlock;
+        }
+        // mapPending is not modified while fPending is set, so it can be
+        // read here without the lock while lookups go on concurrently.
+        bool ret = false;
+        try {
+            ret = WriteCoins(mapPending, hashBlock);
+        } catch (const std::exception& e) {
+            LogPrintf("%s: %s\n", __func__, e.what());
+        }
+        CCoinsMap mapDone;
+        {
+            boost::unique_lock<boost::mutex> lock(cs_writer);
+            if (ret) {
+                mapDone.swap(mapPending);
+                fPending = false;
+            } else {
+                // Keep serving the entries; the next flush reports the failure.
+                LogPrintf("%s: failed to write to coin database\n", __func__);
+                fWriterFailed = true;
+            }
+            condWriter.notify_all();
+        }
+        if (!ret)
+            return;
+    }
+}
+
+void CCoinsViewDB::StartBackgroundWriter() {
+    boost::unique_lock<boost::mutex> lock(cs_writer);
+    if (threadWriter)
+        return;
+    fStopWriter = false;
+    threadWriter.reset(new boost::thread(boost::bind(&CCoinsViewDB::ThreadWriter, this)));
+}
+
+void CCoinsViewDB::StopBackgroundWriter() {
+    {
+        boost::unique_lock<boost::mutex> lock(cs_writer);
+        if (!threadWriter)
+            return;
+        fStopWriter = true;
+        condWriter.notify_all();
+    }
+    // The writer drains the pending write before it exits
+    threadWriter->join();
+    boost::unique_lock<boost::mutex> lock(cs_writer);
+    threadWriter.reset();
+}
 
-    LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
-    return db.WriteBatch(batch);
+bool CCoinsViewDB::Sync() {
+    boost::unique_lock<boost::mutex> lock(cs_writer);
+    while (fPending && !fWriterFailed)
+        condWriter.wait(lock);
+    return !fWriterFailed;
 }
 
-CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe, false) {
+CCoinsFlushStats CCoinsViewDB::GetFlushStats() const {
+    boost::unique_lock<boost::mutex> lock(cs_writer);
+    CCoinsFlushStats ret = stats;
+    ret.fInProgress = fPending;
+    return ret;
+}
+
+bool CCoinsViewDB::Upgrade() {
+    boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator());
+    pcursor->Seek(make_pair(DB_COINS, uint256()));
+    if (!pcursor->Valid())
+        return true;
+
+    int64_t count = 0;
+    LogPrintf("Upgrading UTXO database to per-output records...\n");
+    LogPrintf("[0%%]...");
+    uiInterface.ShowProgress(_("Upgrading UTXO database"), 0);
+    // Write in chunks so memory stays bounded, and compact what was rewritten
+    size_t nBatchSize = (size_t)GetArg("-dbbatchsize", nDefaultDbBatchSize);
+    CDBBatch batch(db);
+    int nReportDone = 0;
+    std::pair<char, uint256> key;
+    std::pair<char, uint256> prevKey(DB_COINS, uint256());
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        if (ShutdownRequested())
+            break;
+        if (!pcursor->GetKey(key) || key.first != DB_COINS)
+            break;
+        if (count++ % 256 == 0) {
+            // Keys are txids, so the first two bytes give the progress
+            uint32_t nHigh = 0x100 * *key.second.begin() + *(key.second.begin() + 1);
+            int nPercentageDone = (int)(nHigh * 100.0 / 65536.0 + 0.5);
+            uiInterface.ShowProgress(_("Upgrading UTXO database"), nPercentageDone);
+            if (nReportDone < nPercentageDone / 10) {
+                // report max. every 10% step
+                LogPrintf("[%d%%]...", nPercentageDone);
+                nReportDone = nPercentageDone / 10;
+            }
+        }
+        CLegacyCoins oldCoins;
+        if (!pcursor->GetValue(oldCoins))
+            return error("%s: cannot parse CCoins record", __func__);
+        COutPoint outpoint(key.second, 0);
+        for (size_t i = 0; i < oldCoins.vout.size(); ++i) {
+            if (!oldCoins.vout[i].IsNull() && !oldCoins.vout[i].IsUnspendable()) {
+                Coin newCoin(oldCoins.vout[i], oldCoins.nHeight, oldCoins.fCoinBase, oldCoins.fCoinStake, oldCoins.nTime);
+                outpoint.n = i;
+                batch.Write(CoinEntry(&outpoint), newCoin);
+            }
+        }
+        batch.Erase(key);
+        if (batch.SizeEstimate() > nBatchSize) {
+            if (!db.WriteBatch(batch))
+                return error("%s: failed to write batch", __func__);
+            batch.Clear();
+            db.CompactRange(prevKey, key);
+            prevKey = key;
+        }
+        pcursor->Next();
+    }
+    if (!db.WriteBatch(batch))
+        return error("%s: failed to write batch", __func__);
+    db.CompactRange(make_pair(DB_COINS, uint256()), key);
+    uiInterface.ShowProgress("", 100);
+    LogPrintf("[%s].\n", ShutdownRequested() ? "CANCELLED" : "DONE");
+    return !ShutdownRequested();
+}
+
+CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe, const CDBOptions& dbopts) : CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe, false, dbopts) {
 }
 
 bool CBlockTreeDB::ReadBlockFileInfo(int nFile, CBlockFileInfo &info) {
@@ -94,29 +429,37 @@ bool CBlockTreeDB::ReadLastBlockFile(int &nFile) {
 
 CCoinsViewCursor *CCoinsViewDB::Cursor() const
 {
+    // Iterate over the database only once the pending write is in it
+    const_cast<CCoinsViewDB*>(this)->Sync();
     CCoinsViewDBCursor *i = new CCoinsViewDBCursor(const_cast<CDBWrapper*>(&db)->NewIterator(), GetBestBlock());
     /* It seems that there are no "const iterators" for LevelDB.  Since we
        only need read operations on it, use a const-cast to get around
        that restriction.  */
-    i->pcursor->Seek(DB_COINS);
+    i->pcursor->Seek(DB_COIN);
     // Cache key of first record
-    i->pcursor->GetKey(i->keyTmp);
+    if (i->pcursor->Valid()) {
+        CoinEntry entry(&i->keyTmp.second);
+        i->pcursor->GetKey(entry);
+        i->keyTmp.first = entry.key;
+    } else {
+        i->keyTmp.first = 0; // Make sure Valid() and GetKey() return false
+    }
     return i;
 }
 
-bool CCoinsViewDBCursor::GetKey(uint256 &key) const
+bool CCoinsViewDBCursor::GetKey(COutPoint &key) const
 {
     // Return cached key
-    if (keyTmp.first == DB_COINS) {
+    if (keyTmp.first == DB_COIN) {
         key = keyTmp.second;
         return true;
     }
     return false;
 }
 
-bool CCoinsViewDBCursor::GetValue(CCoins &coins) const
+bool CCoinsViewDBCursor::GetValue(Coin &coin) const
 {
-    return pcursor->GetValue(coins);
+    return pcursor->GetValue(coin);
 }
 
 unsigned int CCoinsViewDBCursor::GetValueSize() const
@@ -126,14 +469,18 @@ unsigned int CCoinsViewDBCursor::GetValueSize() const
 
 bool CCoinsViewDBCursor::Valid() const
 {
-    return keyTmp.first == DB_COINS;
+    return keyTmp.first == DB_COIN;
 }
 
 void CCoinsViewDBCursor::Next()
 {
     pcursor->Next();
-    if (!pcursor->Valid() || !pcursor->GetKey(keyTmp))
+    CoinEntry entry(&keyTmp.second);
+    if (!pcursor->Valid() || !pcursor->GetKey(entry)) {
         keyTmp.first = 0; // Invalidate cached key after last record so that Valid() and GetKey() return false
+    } else {
+        keyTmp.first = entry.key;
+    }
 }
 
 bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo) {
@@ -148,15 +495,16 @@ bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockF
     return WriteBatch(batch, true);
 }
 
-bool CBlockTreeDB::ReadTxIndex(const uint256 &txid, CDiskTxPos &pos) {
-    return Read(make_pair(DB_TXINDEX, txid), pos);
+bool CBlockTreeDB::ReadUTXOStats(const uint256 &hashBlock, CUTXOStats &stats) {
+    return Read(make_pair(DB_UTXO_STATS, hashBlock), stats);
 }
 
-bool CBlockTreeDB::WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> >&vect) {
-    CDBBatch batch(*this);
-    for (std::vector<std::pair<uint256,CDiskTxPos> >::const_iterator it=vect.begin(); it!=vect.end(); it++)
-        batch.Write(make_pair(DB_TXINDEX, it->first), it->second);
-    return WriteBatch(batch);
+bool CBlockTreeDB::WriteUTXOStats(const uint256 &hashBlock, const CUTXOStats &stats) {
+    return Write(make_pair(DB_UTXO_STATS, hashBlock), stats);
+}
+
+bool CBlockTreeDB::HaveUTXOStats(const uint256 &hashBlock) {
+    return Exists(make_pair(DB_UTXO_STATS, hashBlock));
 }
 
 bool CBlockTreeDB::WriteFlag(const std::string &name, bool fValue) {
@@ -200,14 +548,15 @@ bool CBlockTreeDB::LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256
                 pindexNew->nStakeModifier = diskindex.nStakeModifier;
                 pindexNew->nTx            = diskindex.nTx;
 
-                // Litecoin: Disable PoW Sanity check while loading block index from disk.
-                                // We use the sha256 hash for the block index for performance reasons, which is recorded for later use.
-                                // CheckProofOfWork() uses the scrypt hash which is discarded after a block is accepted.
-                                // While it is technically feasible to verify the PoW, doing so takes several minutes as it
-                                // requires recomputing every PoW hash during every Litecoin startup.
-                                // We opt instead to simply trust the data that is on your local disk.
-                                //if (!CheckProofOfWork(pindexNew->GetBlockPoWHash(), pindexNew->nBits, Params().GetConsensus()))
-                //    return error("LoadBlockIndex(): CheckProofOfWork failed: %s", pindexNew->ToString());
+                pindexNew->hashPoW        = diskindex.hashPoW;
+
+                // The scrypt hash is stored with the entry, so the PoW sanity check no longer
+                // needs to recompute it. Entries written before it was stored are checked by
+                // -verifypowindex, which recomputes the hashes in parallel.
+                if ((pindexNew->nStatus & BLOCK_HAVE_POW_HASH) && (pindexNew->nStatus & BLOCK_HAVE_DATA) && pindexNew->IsProofOfWork() &&
+                    diskindex.GetBlockHash() != Params().GetConsensus().hashGenesisBlock &&
+                    !CheckProofOfWork(pindexNew->hashPoW, pindexNew->nBits, Params().GetConsensus()))
+                    return error("LoadBlockIndex(): CheckProofOfWork failed: %s", pindexNew->ToString());
 
                 pcursor->Next();
             } else {
@@ -220,3 +569,119 @@ bool CBlockTreeDB::LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256
 
     return true;
 }
+
+CTxIndexDB::CTxIndexDB(size_t nCacheSize, bool fMemory, bool fWipe, const CDBOptions& dbopts) : CDBWrapper(GetDataDir() / "indexes" / "txindex", nCacheSize, fMemory, fWipe, false, dbopts) {
+}
+
+bool CTxIndexDB::ReadTxIndex(const uint256 &txid, CTxIndexEntry &entry) {
+    if (Read(make_pair(DB_TXINDEX_ENTRY, txid), entry))
+        return true;
+    CDiskTxPos pos;
+    if (!Read(make_pair(DB_TXINDEX, txid), pos))
+        return false;
+    entry = CTxIndexEntry(pos, uint256(), 0);
+    return true;
+}
+
+bool CTxIndexDB::WriteTxIndex(const std::vector<std::pair<uint256, CTxIndexEntry> >&vect) {
+    CDBBatch batch(*this);
+    for (std::vector<std::pair<uint256,CTxIndexEntry> >::const_iterator it=vect.begin(); it!=vect.end(); it++)
+        batch.Write(make_pair(DB_TXINDEX_ENTRY, it->first), it->second);
+    return WriteBatch(batch);
+}
+
+bool CTxIndexDB::HaveLegacyRecords() {
+    boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
+    std::pair<char, uint256> key;
+    pcursor->Seek(make_pair(DB_TXINDEX, uint256()));
+    return pcursor->Valid() && pcursor->GetKey(key) && key.first == DB_TXINDEX;
+}
+
+bool CTxIndexDB::ReadBuildPosition(uint256 &hashBlock) {
+    return Read(DB_TXINDEX_BUILD, hashBlock);
+}
+
+bool CTxIndexDB::WriteBuildPosition(const uint256 &hashBlock) {
+    return Write(DB_TXINDEX_BUILD, hashBlock, true);
+}
+
+bool CTxIndexDB::FinishBuild() {
+    // Records of older versions left are of blocks no longer in the active chain
+    boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
+    CDBBatch batch(*this);
+    pcursor->Seek(make_pair(DB_TXINDEX, uint256()));
+    std::pair<char, uint256> key;
+    while (pcursor->Valid() && pcursor->GetKey(key) && key.first == DB_TXINDEX) {
+        batch.Erase(key);
+        pcursor->Next();
+    }
+    batch.Erase(DB_TXINDEX_BUILD);
+    return WriteBatch(batch, true);
+}
+
+bool CTxIndexDB::WriteBuildBlock(const std::vector<std::pair<uint256, CTxIndexEntry> >&vect, const uint256 &hashBlock) {
+    CDBBatch batch(*this);
+    for (std::vector<std::pair<uint256,CTxIndexEntry> >::const_iterator it=vect.begin(); it!=vect.end(); it++) {
+        batch.Write(make_pair(DB_TXINDEX_ENTRY, it->first), it->second);
+        batch.Erase(make_pair(DB_TXINDEX, it->first));
+    }
+    batch.Write(DB_TXINDEX_BUILD, hashBlock);
+    return WriteBatch(batch);
+}
+
+bool CTxIndexDB::MigrateData(CBlockTreeDB &blocktree) {
+    boost::scoped_ptr<CDBIterator> pcursor(blocktree.NewIterator());
+    std::pair<char, uint256> key;
+    pcursor->Seek(make_pair(DB_TXINDEX, uint256()));
+    if (!pcursor->Valid() || !pcursor->GetKey(key) || key.first != DB_TXINDEX)
+        return true;
+
+    int64_t count = 0;
+    LogPrintf("Moving transaction index to its own database...\n");
+    LogPrintf("[0%%]...");
+    uiInterface.ShowProgress(_("Moving transaction index"), 0);
+    size_t nBatchSize = (size_t)GetArg("-dbbatchsize", nDefaultDbBatchSize);
+    CDBBatch batch(*this);
+    CDBBatch batchErase(blocktree);
+    int nReportDone = 0;
+    std::pair<char, uint256> prevKey(DB_TXINDEX, uint256());
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        if (ShutdownRequested())
+            break;
+        if (!pcursor->GetKey(key) || key.first != DB_TXINDEX)
+            break;
+        if (count++ % 256 == 0) {
+            // Keys are txids, so the first two bytes give the progress
+            uint32_t nHigh = 0x100 * *key.second.begin() + *(key.second.begin() + 1);
+            int nPercentageDone = (int)(nHigh * 100.0 / 65536.0 + 0.5);
+            uiInterface.ShowProgress(_("Moving transaction index"), nPercentageDone);
+            if (nReportDone < nPercentageDone / 10) {
+                // report max. every 10% step
+                LogPrintf("[%d%%]...", nPercentageDone);
+                nReportDone = nPercentageDone / 10;
+            }
+        }
+        CDiskTxPos pos;
+        if (!pcursor->GetValue(pos))
+            return error("%s: cannot parse txindex record", __func__);
+        batch.Write(key, pos);
+        batchErase.Erase(key);
+        if (batch.SizeEstimate() > nBatchSize) {
+            // The copies must be on disk before the originals go, an interrupted move is resumed on the next start
+            if (!WriteBatch(batch, true) || !blocktree.WriteBatch(batchErase))
+                return error("%s: failed to write batch", __func__);
+            batch.Clear();
+            batchErase.Clear();
+            blocktree.CompactRange(prevKey, key);
+            prevKey = key;
+        }
+        pcursor->Next();
+    }
+    if (!WriteBatch(batch, true) || !blocktree.WriteBatch(batchErase))
+        return error("%s: failed to write batch", __func__);
+    blocktree.CompactRange(prevKey, key);
+    uiInterface.ShowProgress("", 100);
+    LogPrintf("[%s].\n", ShutdownRequested() ? "CANCELLED" : "DONE");
+    return !ShutdownRequested();
+}
@@ -16,6 +16,10 @@
 #include <vector>
 
 #include <boost/function.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
 
 class CBlockIndex;
 class CCoinsViewDBCursor;
@@ -27,14 +31,22 @@ static const int64_t nDefaultDbCache = 450;
 static const int64_t nMaxDbCache = sizeof(void*) > 4 ? 16384 : 1024;
 //! min. -dbcache (MiB)
 static const int64_t nMinDbCache = 4;
-//! Max memory allocated to block tree DB specific cache, if no -txindex (MiB)
+//! Max memory allocated to block tree DB specific cache (MiB)
 static const int64_t nMaxBlockDBCache = 2;
-//! Max memory allocated to block tree DB specific cache, if -txindex (MiB)
+//! Max memory allocated to txindex DB specific cache, if -txindex (MiB)
 // Unlike for the UTXO database, for the txindex scenario the leveldb cache make
 // a meaningful difference: https://github.com/bitcoin/bitcoin/pull/8273#issuecomment-229601991
-static const int64_t nMaxBlockDBAndTxIndexCache = 1024;
+static const int64_t nMaxTxIndexCache = 1024;
 //! Max memory allocated to coin DB specific cache (MiB)
 static const int64_t nMaxCoinsDBCache = 8;
+//! -dbbatchsize default (bytes)
+static const int64_t nDefaultDbBatchSize = 16 << 20;
+//! -dbprofile default
+static const char* const DEFAULT_DB_PROFILE = "default";
+//! -txindexcompression default
+static const bool DEFAULT_TXINDEX_COMPRESSION = true;
+//! -asyncflush default
+static const bool DEFAULT_ASYNC_FLUSH = true;
 
 struct CDiskTxPos : public CDiskBlockPos
 {
@@ -61,19 +73,101 @@ struct CDiskTxPos : public CDiskBlockPos
     }
 };
 
-/** CCoinsView backed by the coin database (chainstate/) */
+/** Where a transaction is stored, and in which block */
+struct CTxIndexEntry : public CDiskTxPos
+{
+    //! Hash of the block, null for records written by older versions
+    uint256 hashBlock;
+    //! Serialized size of the transaction
+    unsigned int nTxSize;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(*(CDiskTxPos*)this);
+        READWRITE(hashBlock);
+        READWRITE(VARINT(nTxSize));
+    }
+
+    CTxIndexEntry(const CDiskTxPos &posIn, const uint256 &hashBlockIn, unsigned int nTxSizeIn) : CDiskTxPos(posIn), hashBlock(hashBlockIn), nTxSize(nTxSizeIn) {
+    }
+
+    CTxIndexEntry() : nTxSize(0) {
+    }
+};
+
+/** Statistics about chainstate writes, as reported by getblockchaininfo */
+struct CCoinsFlushStats
+{
+    //! Number of completed writes
+    uint64_t nFlushes;
+    //! Duration of the last completed write (microseconds)
+    int64_t nLastDuration;
+    //! Serialized size of the last completed write
+    uint64_t nLastBytes;
+    //! Serialized size of all completed writes
+    uint64_t nTotalBytes;
+    //! Whether a background write is in progress
+    bool fInProgress;
+
+    CCoinsFlushStats() : nFlushes(0), nLastDuration(0), nLastBytes(0), nTotalBytes(0), fInProgress(false) {}
+};
+
+/**
+ * CCoinsView backed by the coin database (chainstate/)
+ *
+ * Writes are split into batches of -dbbatchsize bytes. While they are in
+ * progress the database holds the new and old best block under a "head
+ * blocks" record instead of the best block, so an interrupted write can be
+ * completed at startup by replaying blocks (see ReplayBlocks()).
+ *
+ * Once StartBackgroundWriter() was called, BatchWrite() only takes over the
+ * passed entries and returns; a dedicated thread writes them while lookups
+ * are answered from the taken-over entries first. At most one write is in
+ * flight, a further BatchWrite() waits for it.
+ */
 class CCoinsViewDB : public CCoinsView
 {
 protected:
     CDBWrapper db;
 public:
-    CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false, const CDBOptions& dbopts = CDBOptions());
+    ~CCoinsViewDB();
 
-    bool GetCoins(const uint256 &txid, CCoins &coins) const;
-    bool HaveCoins(const uint256 &txid) const;
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const;
+    bool HaveCoin(const COutPoint &outpoint) const;
     uint256 GetBestBlock() const;
+    std::vector<uint256> GetHeadBlocks() const;
     bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
     CCoinsViewCursor *Cursor() const;
+
+    //! Convert per-transaction records from older versions to per-output ones. Returns false on failure or shutdown.
+    bool Upgrade();
+
+    //! Hand further writes to a background thread.
+    void StartBackgroundWriter();
+    //! Finish the pending write and go back to synchronous writes.
+    void StopBackgroundWriter();
+    //! Wait until the pending write, if any, is on disk. Returns false if a background write failed.
+    bool Sync();
+    CCoinsFlushStats GetFlushStats() const;
+
+private:
+    //! Write the dirty entries of mapCoins and the best block in one or more batches
+    bool WriteCoins(const CCoinsMap &mapCoins, const uint256 &hashBlock);
+    void ThreadWriter();
+
+    mutable boost::mutex cs_writer;
+    boost::condition_variable condWriter;
+    boost::scoped_ptr<boost::thread> threadWriter;
+    //! Entries taken over by the writer thread, they shadow the database until written
+    CCoinsMap mapPending;
+    uint256 hashPendingBlock;
+    bool fPending;
+    bool fWriterFailed;
+    bool fStopWriter;
+    CCoinsFlushStats stats;
 };
 
 /** Specialization of CCoinsViewCursor to iterate over a CCoinsViewDB */
@@ -82,8 +176,8 @@ class CCoinsViewDBCursor: public CCoinsViewCursor
 public:
     ~CCoinsViewDBCursor() {}
 
-    bool GetKey(uint256 &key) const;
-    bool GetValue(CCoins &coins) const;
+    bool GetKey(COutPoint &key) const;
+    bool GetValue(Coin &coin) const;
     unsigned int GetValueSize() const;
 
     bool Valid() const;
@@ -93,7 +187,7 @@ private:
     CCoinsViewDBCursor(CDBIterator* pcursorIn, const uint256 &hashBlockIn):
         CCoinsViewCursor(hashBlockIn), pcursor(pcursorIn) {}
     boost::scoped_ptr<CDBIterator> pcursor;
-    std::pair<char, uint256> keyTmp;
+    std::pair<char, COutPoint> keyTmp;
 
     friend class CCoinsViewDB;
 };
@@ -102,7 +196,7 @@ private:
 class CBlockTreeDB : public CDBWrapper
 {
 public:
-    CBlockTreeDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    CBlockTreeDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false, const CDBOptions& dbopts = CDBOptions());
 private:
     CBlockTreeDB(const CBlockTreeDB&);
     void operator=(const CBlockTreeDB&);
@@ -112,11 +206,50 @@ public:
     bool ReadLastBlockFile(int &nFile);
     bool WriteReindexing(bool fReindex);
     bool ReadReindexing(bool &fReindex);
-    bool ReadTxIndex(const uint256 &txid, CDiskTxPos &pos);
-    bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &list);
+    bool ReadUTXOStats(const uint256 &hashBlock, CUTXOStats &stats);
+    bool WriteUTXOStats(const uint256 &hashBlock, const CUTXOStats &stats);
+    bool HaveUTXOStats(const uint256 &hashBlock);
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
     bool LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256&)> insertBlockIndex);
 };
 
+/**
+ * Access to the transaction index database (indexes/txindex/)
+ *
+ * The txindex outgrows everything else kept about blocks, and is written
+ * once and read rarely, so it lives in a database of its own with its own
+ * cache budget and tuning.
+ */
+class CTxIndexDB : public CDBWrapper
+{
+public:
+    CTxIndexDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false, const CDBOptions& dbopts = CDBOptions());
+private:
+    CTxIndexDB(const CTxIndexDB&);
+    void operator=(const CTxIndexDB&);
+public:
+    //! Look up a transaction, in the records of older versions too
+    bool ReadTxIndex(const uint256 &txid, CTxIndexEntry &entry);
+    bool WriteTxIndex(const std::vector<std::pair<uint256, CTxIndexEntry> > &list);
+
+    //! Move the txindex records older versions kept in the block tree database. Returns false on failure or shutdown.
+    bool MigrateData(CBlockTreeDB &blocktree);
+
+    //! Whether there are records of older versions, which lack the block hash and size
+    bool HaveLegacyRecords();
+
+    /**
+     * A build of the index is in progress while a build position is stored;
+     * it is the last block whose transactions were written, null before the
+     * first one.
+     */
+    bool ReadBuildPosition(uint256 &hashBlock);
+    bool WriteBuildPosition(const uint256 &hashBlock);
+    //! End the build, removing the records of older versions it did not replace
+    bool FinishBuild();
+    //! Write the records of a block for the build, replacing those of older versions, and advance its position
+    bool WriteBuildBlock(const std::vector<std::pair<uint256, CTxIndexEntry> > &list, const uint256 &hashBlock);
+};
+
 #endif // BITCOIN_TXDB_H
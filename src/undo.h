@@ -6,70 +6,108 @@
 #ifndef BITCOIN_UNDO_H
 #define BITCOIN_UNDO_H
 
-#include "compressor.h" 
+#include "coins.h"
+#include "compressor.h"
+#include "consensus/consensus.h"
 #include "primitives/transaction.h"
 #include "serialize.h"
+#include "version.h"
 
-/** Undo information for a CTxIn
+/** Undo information for a CTxIn: the Coin it spent
  *
- *  Contains the prevout's CTxOut being spent, and if this was the
- *  last output of the affected transaction, its metadata as well
- *  (coinbase or not, height, transaction version, time)
+ *  Serialized as the spent CTxOut and the metadata of its transaction
+ *  (coinbase or coinstake, height, time). Undo data written by earlier
+ *  versions only carries the metadata with the last spent output of a
+ *  transaction; for the others nHeight is 0 and the metadata is taken from
+ *  another output of the same transaction when the block is disconnected.
  */
-class CTxInUndo
+class TxInUndoSerializer
 {
+    const Coin* txout;
+
 public:
-    CTxOut txout;         // the txout data before being spent
-    bool fCoinBase;       // if the outpoint was the last unspent: whether it belonged to a coinbase
-    bool fCoinStake;	  // if the outpoint was the last unspent: whether it belonged to a coinstake
-    unsigned int nHeight; // if the outpoint was the last unspent: its height
-    int nVersion;         // if the outpoint was the last unspent: its version
-    unsigned int nTime; // if the outpoint was the last unspent: its time
-
-    CTxInUndo() : txout(), fCoinBase(false), fCoinStake(false), nHeight(0), nVersion(0), nTime(0) {}
-    CTxInUndo(const CTxOut &txoutIn, bool fCoinBaseIn = false, bool fCoinStakeIn = false, unsigned int nHeightIn = 0, int nVersionIn = 0, unsigned int nTimeIn = 0) : txout(txoutIn), fCoinBase(fCoinBaseIn), fCoinStake(fCoinStakeIn), nHeight(nHeightIn), nVersion(nVersionIn), nTime(nTimeIn) { }
     unsigned int GetSerializeSize(int nType, int nVersion) const {
-    	return ::GetSerializeSize(VARINT(nHeight*4+(fCoinBase ? 1 : 0)+(fCoinStake ? 2 : 0)), nType, nVersion) +
-               (nHeight > 0 ? ::GetSerializeSize(VARINT(this->nVersion), nType, nVersion) : 0) +
-			   ::GetSerializeSize(this->nTime, nType, nVersion) +
-               ::GetSerializeSize(CTxOutCompressor(REF(txout)), nType, nVersion);
+        return ::GetSerializeSize(VARINT(txout->nHeight * 4 + (txout->fCoinBase ? 1 : 0) + (txout->fCoinStake ? 2 : 0)), nType, nVersion) +
+               (txout->nHeight > 0 ? ::GetSerializeSize(VARINT(0), nType, nVersion) : 0) +
+               ::GetSerializeSize(txout->nTime, nType, nVersion) +
+               ::GetSerializeSize(CTxOutCompressor(REF(txout->out)), nType, nVersion);
     }
 
     template<typename Stream>
     void Serialize(Stream &s, int nType, int nVersion) const {
-    	::Serialize(s, VARINT(nHeight*4+(fCoinBase ? 1 : 0)+(fCoinStake ? 2 : 0)), nType, nVersion);
-        if (nHeight > 0)
-            ::Serialize(s, VARINT(this->nVersion), nType, nVersion);
-        ::Serialize(s, this->nTime, nType, nVersion);
-        ::Serialize(s, CTxOutCompressor(REF(txout)), nType, nVersion);
+        ::Serialize(s, VARINT(txout->nHeight * 4 + (txout->fCoinBase ? 1 : 0) + (txout->fCoinStake ? 2 : 0)), nType, nVersion);
+        if (txout->nHeight > 0) {
+            // Required to maintain compatibility with older undo format.
+            ::Serialize(s, (unsigned char)0, nType, nVersion);
+        }
+        ::Serialize(s, txout->nTime, nType, nVersion);
+        ::Serialize(s, CTxOutCompressor(REF(txout->out)), nType, nVersion);
     }
 
+    TxInUndoSerializer(const Coin* coin) : txout(coin) {}
+};
+
+class TxInUndoDeserializer
+{
+    Coin* txout;
+
+public:
     template<typename Stream>
     void Unserialize(Stream &s, int nType, int nVersion) {
         unsigned int nCode = 0;
         ::Unserialize(s, VARINT(nCode), nType, nVersion);
-        nHeight = nCode / 4;
-        fCoinBase = nCode & 1;
-        fCoinStake = nCode & 2;
-        if (nHeight > 0)
-            ::Unserialize(s, VARINT(this->nVersion), nType, nVersion);
-        ::Unserialize(s, this->nTime, nType, nVersion);
-        ::Unserialize(s, REF(CTxOutCompressor(REF(txout))), nType, nVersion);
+        txout->nHeight = nCode / 4;
+        txout->fCoinBase = nCode & 1;
+        txout->fCoinStake = (nCode & 2) != 0;
+        if (txout->nHeight > 0) {
+            // Old versions stored the version number for the last spend of
+            // a transaction's outputs. Non-final spends were indicated with
+            // height = 0.
+            int nVersionDummy;
+            ::Unserialize(s, VARINT(nVersionDummy), nType, nVersion);
+        }
+        ::Unserialize(s, txout->nTime, nType, nVersion);
+        ::Unserialize(s, REF(CTxOutCompressor(REF(txout->out))), nType, nVersion);
     }
+
+    TxInUndoDeserializer(Coin* coin) : txout(coin) {}
 };
 
+static const size_t MIN_TRANSACTION_INPUT_WEIGHT = ::GetSerializeSize(CTxIn(), SER_NETWORK, PROTOCOL_VERSION);
+static const size_t MAX_INPUTS_PER_BLOCK = MAX_BLOCK_SIZE / MIN_TRANSACTION_INPUT_WEIGHT;
+
 /** Undo information for a CTransaction */
 class CTxUndo
 {
 public:
     // undo information for all txins
-    std::vector<CTxInUndo> vprevout;
+    std::vector<Coin> vprevout;
 
-    ADD_SERIALIZE_METHODS;
+    unsigned int GetSerializeSize(int nType, int nVersion) const {
+        unsigned int nSize = GetSizeOfCompactSize(vprevout.size());
+        for (size_t i = 0; i < vprevout.size(); i++)
+            nSize += TxInUndoSerializer(&vprevout[i]).GetSerializeSize(nType, nVersion);
+        return nSize;
+    }
 
-    template <typename Stream, typename Operation>
-    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
-        READWRITE(vprevout);
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const {
+        WriteCompactSize(s, vprevout.size());
+        for (size_t i = 0; i < vprevout.size(); i++)
+            ::Serialize(s, TxInUndoSerializer(&vprevout[i]), nType, nVersion);
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion) {
+        // TODO: avoid reimplementing vector deserializer
+        uint64_t count = ReadCompactSize(s);
+        if (count > MAX_INPUTS_PER_BLOCK)
+            throw std::ios_base::failure("Too many input undo records");
+        vprevout.resize(count);
+        for (size_t i = 0; i < vprevout.size(); i++) {
+            TxInUndoDeserializer deserializer(&vprevout[i]);
+            ::Unserialize(s, deserializer, nType, nVersion);
+        }
     }
 };
 
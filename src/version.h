@@ -9,7 +9,7 @@
  * network protocol versioning
  */
 
-static const int PROTOCOL_VERSION = 70025;
+static const int PROTOCOL_VERSION = 70026;
 
 //! initial proto version, to be increased after version/verack negotiation
 static const int INIT_PROTO_VERSION = 209;
@@ -43,13 +43,11 @@ static const int SENDHEADERS_VERSION = 70012;
 //! "feefilter" tells peers to filter invs to you by fee starts with this version
 static const int FEEFILTER_VERSION = 70013;
 
-/*
-// Disable BIP152
-//! shord-id-based block download starts with this version
-static const int SHORT_IDS_BLOCKS_VERSION = 70014;
+//! short-id-based block download, with the block signature and coinstake
+//! of proof-of-stake blocks, starts with this version
+static const int SHORT_IDS_BLOCKS_VERSION = 70026;
 
 //! not banning for invalid compact blocks starts with this version
-static const int INVALID_CB_NO_BAN_VERSION = 70015;
-*/
+static const int INVALID_CB_NO_BAN_VERSION = 70026;
 
 #endif // BITCOIN_VERSION_H
@@ -18,6 +18,7 @@
 #endif
 
 #include <boost/filesystem.hpp>
+#include <boost/foreach.hpp>
 #include <boost/thread.hpp>
 #include <boost/version.hpp>
 
@@ -26,6 +27,11 @@ using namespace std;
 
 unsigned int nWalletDBUpdated;
 
+/** Location of a database file, which is relative to the data directory unless absolute */
+static boost::filesystem::path GetDbPath(const std::string& strFile)
+{
+    return boost::filesystem::absolute(strFile, GetDataDir());
+}
 
 //
 // CDB
@@ -46,6 +52,14 @@ void CDBEnv::EnvShutdown()
         DbEnv((u_int32_t)0).remove(strPath.c_str(), 0);
 }
 
+void CDBEnv::CloseLogDbs()
+{
+    LOCK(cs_db);
+    for (map<string, CLogDB*>::iterator it = mapLogDb.begin(); it != mapLogDb.end(); ++it)
+        delete it->second;
+    mapLogDb.clear();
+}
+
 void CDBEnv::Reset()
 {
     delete dbenv;
@@ -61,6 +75,7 @@ CDBEnv::CDBEnv() : dbenv(NULL)
 
 CDBEnv::~CDBEnv()
 {
+    CloseLogDbs();
     EnvShutdown();
     delete dbenv;
     dbenv = NULL;
@@ -68,6 +83,7 @@ CDBEnv::~CDBEnv()
 
 void CDBEnv::Close()
 {
+    CloseLogDbs();
     EnvShutdown();
 }
 
@@ -153,6 +169,10 @@ CDBEnv::VerifyResult CDBEnv::Verify(const std::string& strFile, bool (*recoverFu
     LOCK(cs_db);
     assert(mapFileUseCount.count(strFile) == 0);
 
+    // Log-structured files check each batch as they are loaded
+    if (IsLogDb(strFile))
+        return VERIFY_OK;
+
     Db db(dbenv, 0);
     int result = db.verify(strFile.c_str(), NULL, NULL, 0);
     if (result == 0)
@@ -234,13 +254,45 @@ bool CDBEnv::Salvage(const std::string& strFile, bool fAggressive, std::vector<C
 void CDBEnv::CheckpointLSN(const std::string& strFile)
 {
     dbenv->txn_checkpoint(0, 0, 0);
-    if (fMockDb)
+    if (fMockDb || IsLogDb(strFile))
         return;
     dbenv->lsn_reset(strFile.c_str(), 0);
 }
 
 
-CDB::CDB(const std::string& strFilename, const char* pszMode, bool fFlushOnCloseIn) : pdb(NULL), activeTxn(NULL)
+bool CDBEnv::IsLogDb(const std::string& strFile)
+{
+    LOCK(cs_db);
+    return mapLogDb.count(strFile) || CLogDB::IsLogFile(GetDbPath(strFile));
+}
+
+CLogDB* CDBEnv::OpenLogDb(const std::string& strFile, bool fCreate)
+{
+    LOCK(cs_db);
+    map<string, CLogDB*>::iterator it = mapLogDb.find(strFile);
+    if (it != mapLogDb.end())
+        return it->second;
+
+    boost::filesystem::path path = GetDbPath(strFile);
+    if (!CLogDB::IsLogFile(path)) {
+        if (!fCreate || boost::filesystem::exists(path) || GetArg("-walletbackend", DEFAULT_WALLET_BACKEND) != WALLET_BACKEND_LOG)
+            return NULL;
+        LogPrintf("CDBEnv::OpenLogDb: Creating log-structured database %s\n", strFile);
+    }
+
+    int64_t nStart = GetTimeMillis();
+    CLogDB* plog = new CLogDB(path);
+    if (!plog->Open(fCreate)) {
+        delete plog;
+        throw runtime_error(strprintf("CDB: Error, can't open database %s", strFile));
+    }
+    LogPrint("db", "CDBEnv::OpenLogDb: Loaded %s (%u records) in %dms\n", strFile, plog->GetRecordCount(), GetTimeMillis() - nStart);
+    mapLogDb[strFile] = plog;
+    return plog;
+}
+
+
+CDB::CDB(const std::string& strFilename, const char* pszMode, bool fFlushOnCloseIn) : pdb(NULL), plog(NULL), activeTxn(NULL), plogTxn(NULL)
 {
     int ret;
     fReadOnly = (!strchr(pszMode, '+') && !strchr(pszMode, 'w'));
@@ -262,6 +314,15 @@ CDB::CDB(const std::string& strFilename, const char* pszMode, bool fFlushOnClose
         ++bitdb.mapFileUseCount[strFile];
         pdb = bitdb.mapDb[strFile];
         if (pdb == NULL) {
+            try {
+                plog = bitdb.OpenLogDb(strFile, fCreate);
+            } catch (const std::exception&) {
+                --bitdb.mapFileUseCount[strFile];
+                strFile = "";
+                throw;
+            }
+        }
+        if (pdb == NULL && plog == NULL) {
             pdb = new Db(bitdb.dbenv, 0);
 
             bool fMockDb = bitdb.IsMock();
@@ -287,23 +348,110 @@ CDB::CDB(const std::string& strFilename, const char* pszMode, bool fFlushOnClose
                 throw runtime_error(strprintf("CDB: Error %d, can't open database %s", ret, strFilename));
             }
 
-            if (fCreate && !Exists(string("version"))) {
-                bool fTmp = fReadOnly;
-                fReadOnly = false;
-                WriteVersion(CLIENT_VERSION);
-                fReadOnly = fTmp;
-            }
-
             bitdb.mapDb[strFile] = pdb;
         }
+
+        if (fCreate && !Exists(string("version"))) {
+            bool fTmp = fReadOnly;
+            fReadOnly = false;
+            WriteVersion(CLIENT_VERSION);
+            fReadOnly = fTmp;
+        }
+    }
+}
+
+bool CDB::ReadLog(const CDataStream& ssKey, CDataStream& ssValue)
+{
+    CLogDBData vchKey(ssKey.begin(), ssKey.end());
+    CLogDBData vchValue;
+    const CLogDBRecord* precord = plogTxn ? plogTxn->Find(vchKey) : NULL;
+    if (precord) {
+        if (precord->nType == CLogDBRecord::ERASE)
+            return false;
+        vchValue = precord->vchValue;
+    } else if (!plog->Read(vchKey, vchValue)) {
+        return false;
+    }
+    ssValue.write((const char*)vchValue.data(), vchValue.size());
+    return true;
+}
+
+bool CDB::WriteLog(const CDataStream& ssKey, const CDataStream& ssValue, bool fOverwrite)
+{
+    if (!fOverwrite && ExistsLog(ssKey))
+        return false;
+
+    CLogDBData vchKey(ssKey.begin(), ssKey.end());
+    CLogDBData vchValue(ssValue.begin(), ssValue.end());
+    if (plogTxn) {
+        plogTxn->Write(vchKey, vchValue);
+        return true;
+    }
+    CLogDBBatch batch;
+    batch.Write(vchKey, vchValue);
+    return plog->Write(batch);
+}
+
+bool CDB::EraseLog(const CDataStream& ssKey)
+{
+    CLogDBData vchKey(ssKey.begin(), ssKey.end());
+    if (plogTxn) {
+        plogTxn->Erase(vchKey);
+        return true;
     }
+    if (!plog->Exists(vchKey))
+        return true;
+    CLogDBBatch batch;
+    batch.Erase(vchKey);
+    return plog->Write(batch);
+}
+
+bool CDB::ExistsLog(const CDataStream& ssKey)
+{
+    CLogDBData vchKey(ssKey.begin(), ssKey.end());
+    const CLogDBRecord* precord = plogTxn ? plogTxn->Find(vchKey) : NULL;
+    if (precord)
+        return precord->nType == CLogDBRecord::PUT;
+    return plog->Exists(vchKey);
+}
+
+int CDB::ReadAtLogCursor(CDBCursor* pcursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags)
+{
+    CLogDBData vchKey, vchValue;
+    bool fFound;
+    if (fFlags == DB_SET_RANGE)
+        fFound = pcursor->plog->Seek(CLogDBData(ssKey.begin(), ssKey.end()), true, vchKey, vchValue);
+    else if (fFlags == DB_NEXT)
+        fFound = pcursor->plog->Seek(pcursor->vchKey, !pcursor->fStarted, vchKey, vchValue);
+    else
+        return EINVAL;
+    if (!fFound)
+        return DB_NOTFOUND;
+    pcursor->vchKey = vchKey;
+    pcursor->fStarted = true;
+
+    // Convert to streams
+    ssKey.SetType(SER_DISK);
+    ssKey.clear();
+    ssKey.write((const char*)vchKey.data(), vchKey.size());
+    ssValue.SetType(SER_DISK);
+    ssValue.clear();
+    ssValue.write((const char*)vchValue.data(), vchValue.size());
+    return 0;
 }
 
 void CDB::Flush()
 {
-    if (activeTxn)
+    if (activeTxn || plogTxn)
         return;
 
+    if (plog) {
+        // Appended batches are already with the OS; commit them to disk
+        if (!fReadOnly)
+            plog->Flush();
+        return;
+    }
+
     // Flush database activity from memory pool to disk log
     unsigned int nMinutes = 0;
     if (fReadOnly)
@@ -314,11 +462,13 @@ void CDB::Flush()
 
 void CDB::Close()
 {
-    if (!pdb)
+    if (!pdb && !plog)
         return;
     if (activeTxn)
         activeTxn->abort();
     activeTxn = NULL;
+    delete plogTxn;
+    plogTxn = NULL;
     pdb = NULL;
 
     if (fFlushOnClose)
@@ -334,6 +484,11 @@ void CDBEnv::CloseDb(const string& strFile)
 {
     {
         LOCK(cs_db);
+        // A log-structured file is self-contained once committed, and keeping
+        // it open saves replaying the log into its index on the next use
+        map<string, CLogDB*>::iterator it = mapLogDb.find(strFile);
+        if (it != mapLogDb.end())
+            it->second->Flush();
         if (mapDb[strFile] != NULL) {
             // Close the database handle
             Db* pdb = mapDb[strFile];
@@ -346,6 +501,20 @@ void CDBEnv::CloseDb(const string& strFile)
 
 bool CDBEnv::RemoveDb(const string& strFile)
 {
+    if (IsLogDb(strFile)) {
+        LOCK(cs_db);
+        map<string, CLogDB*>::iterator it = mapLogDb.find(strFile);
+        if (it != mapLogDb.end()) {
+            delete it->second;
+            mapLogDb.erase(it);
+        }
+        try {
+            return boost::filesystem::remove(GetDbPath(strFile));
+        } catch (const boost::filesystem::filesystem_error&) {
+            return false;
+        }
+    }
+
     this->CloseDb(strFile);
 
     LOCK(cs_db);
@@ -364,6 +533,12 @@ bool CDB::Rewrite(const string& strFile, const char* pszSkip)
                 bitdb.CheckpointLSN(strFile);
                 bitdb.mapFileUseCount.erase(strFile);
 
+                if (bitdb.IsLogDb(strFile)) {
+                    LogPrintf("CDB::Rewrite: Compacting %s...\n", strFile);
+                    CDB db(strFile.c_str(), "r+");
+                    return db.WriteVersion(CLIENT_VERSION) && db.plog->Compact(pszSkip);
+                }
+
                 bool fSuccess = true;
                 LogPrintf("CDB::Rewrite: Rewriting %s...\n", strFile);
                 string strFileRes = strFile + ".rewrite";
@@ -382,7 +557,7 @@ bool CDB::Rewrite(const string& strFile, const char* pszSkip)
                         fSuccess = false;
                     }
 
-                    Dbc* pcursor = db.GetCursor();
+                    CDBCursor* pcursor = db.GetCursor();
                     if (pcursor)
                         while (fSuccess) {
                             CDataStream ssKey(SER_DISK, CLIENT_VERSION);
@@ -436,6 +611,113 @@ bool CDB::Rewrite(const string& strFile, const char* pszSkip)
     return false;
 }
 
+bool CDB::Convert(const string& strFile, const string& strBackend)
+{
+    bool fToLog = (strBackend == WALLET_BACKEND_LOG);
+    while (true) {
+        {
+            LOCK(bitdb.cs_db);
+            if (!bitdb.mapFileUseCount.count(strFile) || bitdb.mapFileUseCount[strFile] == 0) {
+                // Flush log data to the dat file
+                bitdb.CloseDb(strFile);
+                bitdb.CheckpointLSN(strFile);
+                bitdb.mapFileUseCount.erase(strFile);
+
+                if (bitdb.IsLogDb(strFile) == fToLog)
+                    return true;
+
+                int64_t nStart = GetTimeMillis();
+                LogPrintf("CDB::Convert: Converting %s to the %s backend...\n", strFile, strBackend);
+                CLogDBBatch records;
+                bool fSuccess = true;
+                { // surround usage of db with extra {}
+                    CDB db(strFile.c_str(), "r");
+                    CDBCursor* pcursor = db.GetCursor();
+                    if (!pcursor)
+                        fSuccess = false;
+                    while (fSuccess) {
+                        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+                        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+                        int ret = db.ReadAtCursor(pcursor, ssKey, ssValue, DB_NEXT);
+                        if (ret == DB_NOTFOUND)
+                            break;
+                        else if (ret != 0)
+                            fSuccess = false;
+                        else
+                            records.Write(CLogDBData(ssKey.begin(), ssKey.end()), CLogDBData(ssValue.begin(), ssValue.end()));
+                    }
+                    if (pcursor)
+                        pcursor->close();
+                }
+                bitdb.CloseDb(strFile);
+
+                string strFileRes = strFile + ".convert";
+                boost::filesystem::path pathRes = GetDbPath(strFileRes);
+                boost::filesystem::remove(pathRes);
+                if (fSuccess && fToLog) {
+                    CLogDB logdb(pathRes);
+                    fSuccess = logdb.Open(true);
+                    CLogDBBatch batch;
+                    unsigned int nBatchSize = 0;
+                    for (unsigned int i = 0; fSuccess && i < records.vRecords.size(); i++) {
+                        const CLogDBRecord& record = records.vRecords[i];
+                        batch.vRecords.push_back(record);
+                        nBatchSize += record.vchKey.size() + record.vchValue.size();
+                        if (nBatchSize >= LOGDB_BATCH_SIZE || i + 1 == records.vRecords.size()) {
+                            fSuccess = logdb.Write(batch);
+                            batch.Clear();
+                            nBatchSize = 0;
+                        }
+                    }
+                    logdb.Close();
+                } else if (fSuccess) {
+                    Db* pdbCopy = new Db(bitdb.dbenv, 0);
+                    int ret = pdbCopy->open(NULL,               // Txn pointer
+                                            strFileRes.c_str(), // Filename
+                                            "main",             // Logical db name
+                                            DB_BTREE,           // Database type
+                                            DB_CREATE,          // Flags
+                                            0);
+                    if (ret > 0) {
+                        LogPrintf("CDB::Convert: Can't create database file %s\n", strFileRes);
+                        fSuccess = false;
+                    }
+                    BOOST_FOREACH(CLogDBRecord& record, records.vRecords) {
+                        if (!fSuccess)
+                            break;
+                        Dbt datKey(record.vchKey.data(), record.vchKey.size());
+                        Dbt datValue(record.vchValue.data(), record.vchValue.size());
+                        if (pdbCopy->put(NULL, &datKey, &datValue, DB_NOOVERWRITE) > 0)
+                            fSuccess = false;
+                    }
+                    if (pdbCopy->close(0))
+                        fSuccess = false;
+                    delete pdbCopy;
+                }
+
+                if (fSuccess) {
+                    if (!bitdb.RemoveDb(strFile))
+                        fSuccess = false;
+                    else if (fToLog)
+                        fSuccess = RenameOver(pathRes, GetDbPath(strFile));
+                    else {
+                        Db dbB(bitdb.dbenv, 0);
+                        if (dbB.rename(strFileRes.c_str(), NULL, strFile.c_str(), 0))
+                            fSuccess = false;
+                    }
+                }
+                if (!fSuccess)
+                    LogPrintf("CDB::Convert: Failed to convert database file %s\n", strFile);
+                else
+                    LogPrintf("CDB::Convert: Converted %u records of %s in %dms\n", records.vRecords.size(), strFile, GetTimeMillis() - nStart);
+                return fSuccess;
+            }
+        }
+        MilliSleep(100);
+    }
+    return false;
+}
+
 
 void CDBEnv::Flush(bool fShutdown)
 {
@@ -457,7 +739,7 @@ void CDBEnv::Flush(bool fShutdown)
                 LogPrint("db", "CDBEnv::Flush: %s checkpoint\n", strFile);
                 dbenv->txn_checkpoint(0, 0, 0);
                 LogPrint("db", "CDBEnv::Flush: %s detach\n", strFile);
-                if (!fMockDb)
+                if (!fMockDb && !IsLogDb(strFile))
                     dbenv->lsn_reset(strFile.c_str(), 0);
                 LogPrint("db", "CDBEnv::Flush: %s closed\n", strFile);
                 mapFileUseCount.erase(mi++);
@@ -11,6 +11,7 @@
 #include "streams.h"
 #include "sync.h"
 #include "version.h"
+#include "wallet/logdb.h"
 
 #include <map>
 #include <string>
@@ -35,12 +36,14 @@ private:
     std::string strPath;
 
     void EnvShutdown();
+    void CloseLogDbs();
 
 public:
     mutable CCriticalSection cs_db;
     DbEnv *dbenv;
     std::map<std::string, int> mapFileUseCount;
     std::map<std::string, Db*> mapDb;
+    std::map<std::string, CLogDB*> mapLogDb;
 
     CDBEnv();
     ~CDBEnv();
@@ -77,6 +80,15 @@ public:
     void CloseDb(const std::string& strFile);
     bool RemoveDb(const std::string& strFile);
 
+    /** Whether strFile is a log-structured database rather than a Berkeley one */
+    bool IsLogDb(const std::string& strFile);
+    /**
+     * Open the log-structured database strFile, creating it if fCreate is set,
+     * it does not exist yet and -walletbackend selects the log backend.
+     * Returns NULL if strFile is, or is to be created as, a Berkeley database.
+     */
+    CLogDB* OpenLogDb(const std::string& strFile, bool fCreate);
+
     DbTxn* TxnBegin(int flags = DB_TXN_WRITE_NOSYNC)
     {
         DbTxn* ptxn = NULL;
@@ -90,13 +102,36 @@ public:
 extern CDBEnv bitdb;
 
 
-/** RAII class that provides access to a Berkeley database */
+/** Cursor over a Berkeley or log-structured database; like Dbc, close() releases it */
+class CDBCursor
+{
+public:
+    Dbc* pcursor;
+    CLogDB* plog;
+    //! Key the log cursor was last positioned on
+    CLogDBData vchKey;
+    bool fStarted;
+
+    explicit CDBCursor(Dbc* pcursorIn) : pcursor(pcursorIn), plog(NULL), fStarted(false) {}
+    explicit CDBCursor(CLogDB* plogIn) : pcursor(NULL), plog(plogIn), fStarted(false) {}
+
+    void close()
+    {
+        if (pcursor)
+            pcursor->close();
+        delete this;
+    }
+};
+
+/** RAII class that provides access to a Berkeley or log-structured database */
 class CDB
 {
 protected:
     Db* pdb;
+    CLogDB* plog;
     std::string strFile;
     DbTxn* activeTxn;
+    CLogDBBatch* plogTxn;
     bool fReadOnly;
     bool fFlushOnClose;
 
@@ -111,17 +146,35 @@ private:
     CDB(const CDB&);
     void operator=(const CDB&);
 
+    bool ReadLog(const CDataStream& ssKey, CDataStream& ssValue);
+    bool WriteLog(const CDataStream& ssKey, const CDataStream& ssValue, bool fOverwrite);
+    bool EraseLog(const CDataStream& ssKey);
+    bool ExistsLog(const CDataStream& ssKey);
+    int ReadAtLogCursor(CDBCursor* pcursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags);
+
 protected:
     template <typename K, typename T>
     bool Read(const K& key, T& value)
     {
-        if (!pdb)
+        if (!pdb && !plog)
             return false;
 
         // Key
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
+
+        if (plog) {
+            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+            if (!ReadLog(ssKey, ssValue))
+                return false;
+            try {
+                ssValue >> value;
+            } catch (const std::exception&) {
+                return false;
+            }
+            return true;
+        }
         Dbt datKey(&ssKey[0], ssKey.size());
 
         // Read
@@ -149,7 +202,7 @@ protected:
     template <typename K, typename T>
     bool Write(const K& key, const T& value, bool fOverwrite = true)
     {
-        if (!pdb)
+        if (!pdb && !plog)
             return false;
         if (fReadOnly)
             assert(!"Write called on database in read-only mode");
@@ -164,6 +217,8 @@ protected:
         CDataStream ssValue(SER_DISK, CLIENT_VERSION);
         ssValue.reserve(10000);
         ssValue << value;
+        if (plog)
+            return WriteLog(ssKey, ssValue, fOverwrite);
         Dbt datValue(&ssValue[0], ssValue.size());
 
         // Write
@@ -178,7 +233,7 @@ protected:
     template <typename K>
     bool Erase(const K& key)
     {
-        if (!pdb)
+        if (!pdb && !plog)
             return false;
         if (fReadOnly)
             assert(!"Erase called on database in read-only mode");
@@ -187,6 +242,8 @@ protected:
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
+        if (plog)
+            return EraseLog(ssKey);
         Dbt datKey(&ssKey[0], ssKey.size());
 
         // Erase
@@ -200,13 +257,15 @@ protected:
     template <typename K>
     bool Exists(const K& key)
     {
-        if (!pdb)
+        if (!pdb && !plog)
             return false;
 
         // Key
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
+        if (plog)
+            return ExistsLog(ssKey);
         Dbt datKey(&ssKey[0], ssKey.size());
 
         // Exists
@@ -217,19 +276,24 @@ protected:
         return (ret == 0);
     }
 
-    Dbc* GetCursor()
+    CDBCursor* GetCursor()
     {
+        if (plog)
+            return new CDBCursor(plog);
         if (!pdb)
             return NULL;
         Dbc* pcursor = NULL;
         int ret = pdb->cursor(NULL, &pcursor, 0);
         if (ret != 0)
             return NULL;
-        return pcursor;
+        return new CDBCursor(pcursor);
     }
 
-    int ReadAtCursor(Dbc* pcursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags = DB_NEXT)
+    int ReadAtCursor(CDBCursor* pcursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags = DB_NEXT)
     {
+        if (pcursor->plog)
+            return ReadAtLogCursor(pcursor, ssKey, ssValue, fFlags);
+
         // Read at cursor
         Dbt datKey;
         if (fFlags == DB_SET || fFlags == DB_SET_RANGE || fFlags == DB_GET_BOTH || fFlags == DB_GET_BOTH_RANGE) {
@@ -243,7 +307,7 @@ protected:
         }
         datKey.set_flags(DB_DBT_MALLOC);
         datValue.set_flags(DB_DBT_MALLOC);
-        int ret = pcursor->get(&datKey, &datValue, fFlags);
+        int ret = pcursor->pcursor->get(&datKey, &datValue, fFlags);
         if (ret != 0)
             return ret;
         else if (datKey.get_data() == NULL || datValue.get_data() == NULL)
@@ -268,6 +332,12 @@ protected:
 public:
     bool TxnBegin()
     {
+        if (plog) {
+            if (plogTxn)
+                return false;
+            plogTxn = new CLogDBBatch();
+            return true;
+        }
         if (!pdb || activeTxn)
             return false;
         DbTxn* ptxn = bitdb.TxnBegin();
@@ -279,6 +349,14 @@ public:
 
     bool TxnCommit()
     {
+        if (plog) {
+            if (!plogTxn)
+                return false;
+            bool ret = plog->Write(*plogTxn);
+            delete plogTxn;
+            plogTxn = NULL;
+            return ret;
+        }
         if (!pdb || !activeTxn)
             return false;
         int ret = activeTxn->commit(0);
@@ -288,6 +366,13 @@ public:
 
     bool TxnAbort()
     {
+        if (plog) {
+            if (!plogTxn)
+                return false;
+            delete plogTxn;
+            plogTxn = NULL;
+            return true;
+        }
         if (!pdb || !activeTxn)
             return false;
         int ret = activeTxn->abort();
@@ -307,6 +392,8 @@ public:
     }
 
     bool static Rewrite(const std::string& strFile, const char* pszSkip = NULL);
+    /** Copy every record of strFile into a new file of the given -walletbackend type and swap it in */
+    bool static Convert(const std::string& strFile, const std::string& strBackend);
 };
 
 #endif // BITCOIN_WALLET_DB_H
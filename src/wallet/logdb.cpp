@@ -0,0 +1,365 @@
+// Copyright (c) 2018 The CashCore Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "wallet/logdb.h"
+
+#include "clientversion.h"
+#include "crypto/common.h"
+#include "hash.h"
+#include "streams.h"
+#include "util.h"
+
+#include <string.h>
+
+#include <boost/foreach.hpp>
+
+static const unsigned char LOGDB_MAGIC[8] = {'C', 'C', 'W', 'L', 'O', 'G', 0x00, 0x01};
+
+static uint64_t GetRecordSize(const CLogDBRecord& record)
+{
+    return ::GetSerializeSize(record, SER_DISK, CLIENT_VERSION);
+}
+
+/** Write a batch as <size><records><checksum>, returning the number of bytes written or 0 on failure */
+static uint64_t WriteBatch(FILE* file, const CLogDBBatch& batch)
+{
+    CDataStream ssRecords(SER_DISK, CLIENT_VERSION);
+    ssRecords << batch.vRecords;
+
+    unsigned char header[4];
+    WriteLE32(header, ssRecords.size());
+    unsigned char checksum[4];
+    WriteLE32(checksum, ReadLE32(Hash(ssRecords.begin(), ssRecords.end()).begin()));
+
+    if (fwrite(header, 1, sizeof(header), file) != sizeof(header) ||
+        fwrite(&ssRecords[0], 1, ssRecords.size(), file) != ssRecords.size() ||
+        fwrite(checksum, 1, sizeof(checksum), file) != sizeof(checksum) ||
+        fflush(file) != 0)
+        return 0;
+    return sizeof(header) + ssRecords.size() + sizeof(checksum);
+}
+
+const CLogDBRecord* CLogDBBatch::Find(const CLogDBData& vchKey) const
+{
+    for (std::vector<CLogDBRecord>::const_reverse_iterator it = vRecords.rbegin(); it != vRecords.rend(); ++it)
+        if (it->vchKey == vchKey)
+            return &*it;
+    return NULL;
+}
+
+CLogDB::CLogDB(const fs::path& pathIn) : path(pathIn), file(NULL), nFileSize(0), nLiveSize(0), fDirty(false)
+{
+}
+
+CLogDB::~CLogDB()
+{
+    Close();
+}
+
+bool CLogDB::IsLogFile(const fs::path& pathIn)
+{
+    FILE* f = fopen(pathIn.string().c_str(), "rb");
+    if (!f)
+        return false;
+    unsigned char magic[sizeof(LOGDB_MAGIC)];
+    bool fLog = fread(magic, 1, sizeof(magic), f) == sizeof(magic) && memcmp(magic, LOGDB_MAGIC, sizeof(magic)) == 0;
+    fclose(f);
+    return fLog;
+}
+
+bool CLogDB::Open(bool fCreate)
+{
+    LOCK(cs_logdb);
+    if (file)
+        return true;
+
+    if (fs::exists(path)) {
+        file = fopen(path.string().c_str(), "rb+");
+        if (!file)
+            return error("CLogDB::Open: Unable to open %s", path.string());
+        if (!Replay()) {
+            fclose(file);
+            file = NULL;
+            mapRecords.clear();
+            return false;
+        }
+        return true;
+    }
+
+    if (!fCreate)
+        return false;
+    file = fopen(path.string().c_str(), "wb+");
+    if (!file)
+        return error("CLogDB::Open: Unable to create %s", path.string());
+    if (fwrite(LOGDB_MAGIC, 1, sizeof(LOGDB_MAGIC), file) != sizeof(LOGDB_MAGIC)) {
+        fclose(file);
+        file = NULL;
+        return error("CLogDB::Open: Unable to write header to %s", path.string());
+    }
+    FileCommit(file);
+    nFileSize = sizeof(LOGDB_MAGIC);
+    nLiveSize = 0;
+    fDirty = false;
+    return true;
+}
+
+bool CLogDB::Replay()
+{
+    AssertLockHeld(cs_logdb);
+
+    unsigned char magic[sizeof(LOGDB_MAGIC)];
+    if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) || memcmp(magic, LOGDB_MAGIC, sizeof(magic)) != 0)
+        return error("CLogDB::Replay: %s is not a log-structured database", path.string());
+
+    mapRecords.clear();
+    nFileSize = sizeof(LOGDB_MAGIC);
+    nLiveSize = 0;
+    unsigned int nBatches = 0;
+    bool fTorn = false;
+    while (true) {
+        unsigned char header[4];
+        size_t nRead = fread(header, 1, sizeof(header), file);
+        if (nRead == 0 && feof(file))
+            break;
+        unsigned int nSize = ReadLE32(header);
+        if (nRead != sizeof(header) || nSize > LOGDB_MAX_BATCH_SIZE) {
+            fTorn = true;
+            break;
+        }
+
+        CDataStream ssRecords(SER_DISK, CLIENT_VERSION);
+        ssRecords.resize(nSize);
+        unsigned char checksum[4];
+        if (fread(&ssRecords[0], 1, nSize, file) != nSize ||
+            fread(checksum, 1, sizeof(checksum), file) != sizeof(checksum) ||
+            ReadLE32(checksum) != ReadLE32(Hash(ssRecords.begin(), ssRecords.end()).begin())) {
+            fTorn = true;
+            break;
+        }
+
+        std::vector<CLogDBRecord> vRecords;
+        try {
+            ssRecords >> vRecords;
+        } catch (const std::exception&) {
+            fTorn = true;
+            break;
+        }
+        BOOST_FOREACH(const CLogDBRecord& record, vRecords)
+            Apply(record);
+        nFileSize += sizeof(header) + nSize + sizeof(checksum);
+        nBatches++;
+    }
+
+    if (fTorn) {
+        // Everything up to the last complete batch is intact; drop the rest
+        LogPrintf("CLogDB::Replay: Discarding incomplete batch at offset %u of %s\n", nFileSize, path.string());
+        if (!TruncateFile(file, nFileSize))
+            return error("CLogDB::Replay: Unable to truncate %s", path.string());
+        FileCommit(file);
+    }
+    if (fseek(file, nFileSize, SEEK_SET) != 0)
+        return error("CLogDB::Replay: Unable to seek in %s", path.string());
+    fDirty = false;
+
+    LogPrint("db", "CLogDB::Replay: Loaded %u records from %u batches in %s\n", mapRecords.size(), nBatches, path.string());
+    return true;
+}
+
+void CLogDB::Close()
+{
+    LOCK(cs_logdb);
+    if (file) {
+        FileCommit(file);
+        fclose(file);
+        file = NULL;
+    }
+    mapRecords.clear();
+    nFileSize = 0;
+    nLiveSize = 0;
+    fDirty = false;
+}
+
+void CLogDB::Apply(const CLogDBRecord& record)
+{
+    AssertLockHeld(cs_logdb);
+
+    RecordMap::iterator it = mapRecords.find(record.vchKey);
+    if (it != mapRecords.end()) {
+        nLiveSize -= GetRecordSize(CLogDBRecord(CLogDBRecord::PUT, it->first, it->second));
+        if (record.nType == CLogDBRecord::ERASE) {
+            mapRecords.erase(it);
+            return;
+        }
+        it->second = record.vchValue;
+    } else {
+        if (record.nType == CLogDBRecord::ERASE)
+            return;
+        mapRecords.insert(std::make_pair(record.vchKey, record.vchValue));
+    }
+    nLiveSize += GetRecordSize(record);
+}
+
+bool CLogDB::Append(const CLogDBBatch& batch)
+{
+    AssertLockHeld(cs_logdb);
+
+    uint64_t nWritten = WriteBatch(file, batch);
+    if (nWritten == 0) {
+        // Cut off whatever part of the batch made it to the file, so later
+        // batches are not appended after a torn one
+        TruncateFile(file, nFileSize);
+        fseek(file, nFileSize, SEEK_SET);
+        return error("CLogDB::Append: Unable to append to %s", path.string());
+    }
+    nFileSize += nWritten;
+    fDirty = true;
+    return true;
+}
+
+bool CLogDB::Read(const CLogDBData& vchKey, CLogDBData& vchValue) const
+{
+    LOCK(cs_logdb);
+    RecordMap::const_iterator it = mapRecords.find(vchKey);
+    if (it == mapRecords.end())
+        return false;
+    vchValue = it->second;
+    return true;
+}
+
+bool CLogDB::Exists(const CLogDBData& vchKey) const
+{
+    LOCK(cs_logdb);
+    return mapRecords.count(vchKey) != 0;
+}
+
+bool CLogDB::Write(const CLogDBBatch& batch)
+{
+    LOCK(cs_logdb);
+    if (!file)
+        return false;
+    if (batch.IsEmpty())
+        return true;
+    if (!Append(batch))
+        return false;
+    BOOST_FOREACH(const CLogDBRecord& record, batch.vRecords)
+        Apply(record);
+
+    if (nFileSize >= LOGDB_COMPACT_MIN_SIZE && nFileSize - nLiveSize > nLiveSize)
+        CompactLocked(NULL);
+    return true;
+}
+
+bool CLogDB::Flush()
+{
+    LOCK(cs_logdb);
+    if (!file)
+        return false;
+    if (fDirty) {
+        FileCommit(file);
+        fDirty = false;
+    }
+    return true;
+}
+
+bool CLogDB::Compact(const char* pszSkip)
+{
+    LOCK(cs_logdb);
+    return CompactLocked(pszSkip);
+}
+
+bool CLogDB::CompactLocked(const char* pszSkip)
+{
+    AssertLockHeld(cs_logdb);
+    if (!file)
+        return false;
+
+    int64_t nStart = GetTimeMillis();
+    fs::path pathCompact = path.string() + ".compact";
+    FILE* fileCompact = fopen(pathCompact.string().c_str(), "wb");
+    if (!fileCompact)
+        return error("CLogDB::Compact: Unable to create %s", pathCompact.string());
+
+    size_t nSkip = pszSkip ? strlen(pszSkip) : 0;
+    std::vector<RecordMap::iterator> vSkipped;
+    bool fSuccess = fwrite(LOGDB_MAGIC, 1, sizeof(LOGDB_MAGIC), fileCompact) == sizeof(LOGDB_MAGIC);
+    uint64_t nCompactSize = sizeof(LOGDB_MAGIC);
+    CLogDBBatch batch;
+    uint64_t nBatchSize = 0;
+    for (RecordMap::iterator it = mapRecords.begin(); fSuccess && it != mapRecords.end(); ++it) {
+        if (nSkip && it->first.size() >= nSkip && memcmp(&it->first[0], pszSkip, nSkip) == 0) {
+            vSkipped.push_back(it);
+            continue;
+        }
+        batch.Write(it->first, it->second);
+        nBatchSize += GetRecordSize(batch.vRecords.back());
+        if (nBatchSize >= LOGDB_BATCH_SIZE) {
+            uint64_t nWritten = WriteBatch(fileCompact, batch);
+            fSuccess = nWritten != 0;
+            nCompactSize += nWritten;
+            batch.Clear();
+            nBatchSize = 0;
+        }
+    }
+    if (fSuccess && !batch.IsEmpty()) {
+        uint64_t nWritten = WriteBatch(fileCompact, batch);
+        fSuccess = nWritten != 0;
+        nCompactSize += nWritten;
+    }
+    if (fSuccess)
+        FileCommit(fileCompact);
+    fclose(fileCompact);
+    if (!fSuccess) {
+        fs::remove(pathCompact);
+        return error("CLogDB::Compact: Unable to write %s", pathCompact.string());
+    }
+
+    // The compacted file is complete on disk; swap it in for the log
+    fclose(file);
+    bool fRenamed = RenameOver(pathCompact, path);
+    if (!fRenamed) {
+        fs::remove(pathCompact);
+        LogPrintf("CLogDB::Compact: Unable to rename %s to %s\n", pathCompact.string(), path.string());
+    }
+    file = fopen(path.string().c_str(), "rb+");
+    if (!file)
+        return error("CLogDB::Compact: Unable to reopen %s", path.string());
+    if (!fRenamed) {
+        fseek(file, nFileSize, SEEK_SET);
+        return false;
+    }
+    BOOST_FOREACH(const RecordMap::iterator& it, vSkipped) {
+        nLiveSize -= GetRecordSize(CLogDBRecord(CLogDBRecord::PUT, it->first, it->second));
+        mapRecords.erase(it);
+    }
+    nFileSize = nCompactSize;
+    fDirty = false;
+    if (fseek(file, nFileSize, SEEK_SET) != 0)
+        return error("CLogDB::Compact: Unable to seek in %s", path.string());
+
+    LogPrint("db", "CLogDB::Compact: Compacted %s to %u bytes (%u records) in %dms\n", path.string(), nCompactSize, mapRecords.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+bool CLogDB::Seek(const CLogDBData& vchKey, bool fInclusive, CLogDBData& vchKeyOut, CLogDBData& vchValueOut) const
+{
+    LOCK(cs_logdb);
+    RecordMap::const_iterator it = fInclusive ? mapRecords.lower_bound(vchKey) : mapRecords.upper_bound(vchKey);
+    if (it == mapRecords.end())
+        return false;
+    vchKeyOut = it->first;
+    vchValueOut = it->second;
+    return true;
+}
+
+size_t CLogDB::GetRecordCount() const
+{
+    LOCK(cs_logdb);
+    return mapRecords.size();
+}
+
+uint64_t CLogDB::GetFileSize() const
+{
+    LOCK(cs_logdb);
+    return nFileSize;
+}
@@ -0,0 +1,150 @@
+// Copyright (c) 2018 The CashCore Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_WALLET_LOGDB_H
+#define BITCOIN_WALLET_LOGDB_H
+
+#include "fs.h"
+#include "serialize.h"
+#include "support/allocators/zeroafterfree.h"
+#include "sync.h"
+
+#include <map>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/** Storage backends a wallet file can be created with (-walletbackend) */
+static const char* const WALLET_BACKEND_BDB = "bdb";
+static const char* const WALLET_BACKEND_LOG = "log";
+static const char* const DEFAULT_WALLET_BACKEND = WALLET_BACKEND_BDB;
+
+/** A log is compacted once its superseded records outweigh the live ones and it is at least this large */
+static const uint64_t LOGDB_COMPACT_MIN_SIZE = 1 << 20;
+/** Records are rewritten in batches of about this size when compacting or converting */
+static const unsigned int LOGDB_BATCH_SIZE = 1 << 20;
+/** Largest batch accepted when loading; anything larger is treated as a torn write */
+static const unsigned int LOGDB_MAX_BATCH_SIZE = 0x10000000;
+
+/** Serialized key or value, wiped when freed as it may hold a private key */
+typedef std::vector<unsigned char, zero_after_free_allocator<unsigned char> > CLogDBData;
+
+/** A single put or erase of a key */
+class CLogDBRecord
+{
+public:
+    enum Type {
+        PUT = 'p',
+        ERASE = 'e',
+    };
+
+    unsigned char nType;
+    CLogDBData vchKey;
+    CLogDBData vchValue;
+
+    CLogDBRecord() : nType(PUT) {}
+    CLogDBRecord(unsigned char nTypeIn, const CLogDBData& vchKeyIn, const CLogDBData& vchValueIn = CLogDBData()) :
+        nType(nTypeIn), vchKey(vchKeyIn), vchValue(vchValueIn) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType_, int nVersion) {
+        READWRITE(nType);
+        READWRITE(vchKey);
+        if (nType == PUT)
+            READWRITE(vchValue);
+    }
+};
+
+/** Records that are appended to the log together, or not at all */
+class CLogDBBatch
+{
+public:
+    std::vector<CLogDBRecord> vRecords;
+
+    void Write(const CLogDBData& vchKey, const CLogDBData& vchValue)
+    {
+        vRecords.push_back(CLogDBRecord(CLogDBRecord::PUT, vchKey, vchValue));
+    }
+
+    void Erase(const CLogDBData& vchKey)
+    {
+        vRecords.push_back(CLogDBRecord(CLogDBRecord::ERASE, vchKey));
+    }
+
+    /** Latest record for vchKey in this batch, or NULL if the batch does not touch it */
+    const CLogDBRecord* Find(const CLogDBData& vchKey) const;
+
+    bool IsEmpty() const { return vRecords.empty(); }
+    void Clear() { vRecords.clear(); }
+};
+
+/**
+ * Log-structured, append-only key/value file used as an alternative wallet
+ * storage backend.
+ *
+ * The file starts with a magic header followed by batches, each stored as
+ * <size><records><checksum>. Every write appends a batch; the file is never
+ * modified in place. On open the whole log is replayed into an in-memory
+ * index, and a batch that is incomplete or fails its checksum (a write torn
+ * by a crash) is cut off together with anything after it. Once superseded
+ * records make up more than half of the log it is compacted by writing the
+ * live records to a new file and renaming it over the old one.
+ *
+ * Keys are ordered as unsigned bytes, like the default BerkeleyDB btree
+ * comparison, so cursors behave the same on both backends.
+ */
+class CLogDB
+{
+private:
+    typedef std::map<CLogDBData, CLogDBData> RecordMap;
+
+    mutable CCriticalSection cs_logdb;
+    fs::path path;
+    FILE* file;
+    RecordMap mapRecords;
+    //! Bytes in the log file, including the header
+    uint64_t nFileSize;
+    //! Bytes the live records take up when serialized
+    uint64_t nLiveSize;
+    //! Whether batches were appended since the file was last committed to disk
+    bool fDirty;
+
+    bool Append(const CLogDBBatch& batch);
+    void Apply(const CLogDBRecord& record);
+    bool Replay();
+    bool CompactLocked(const char* pszSkip);
+
+    CLogDB(const CLogDB&);
+    void operator=(const CLogDB&);
+
+public:
+    explicit CLogDB(const fs::path& pathIn);
+    ~CLogDB();
+
+    /** Whether the file at pathIn is a log-structured database */
+    static bool IsLogFile(const fs::path& pathIn);
+
+    /** Open the file and load its index, creating an empty log if fCreate is set and it does not exist */
+    bool Open(bool fCreate);
+    void Close();
+
+    bool Read(const CLogDBData& vchKey, CLogDBData& vchValue) const;
+    bool Exists(const CLogDBData& vchKey) const;
+    /** Append a batch and apply it to the index */
+    bool Write(const CLogDBBatch& batch);
+    /** Commit appended batches to disk */
+    bool Flush();
+    /** Rewrite the log with only its live records, dropping keys starting with pszSkip */
+    bool Compact(const char* pszSkip = NULL);
+
+    /** First key not before (fInclusive) or after vchKey, in key order */
+    bool Seek(const CLogDBData& vchKey, bool fInclusive, CLogDBData& vchKeyOut, CLogDBData& vchValueOut) const;
+
+    size_t GetRecordCount() const;
+    uint64_t GetFileSize() const;
+};
+
+#endif // BITCOIN_WALLET_LOGDB_H
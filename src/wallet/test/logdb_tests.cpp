@@ -0,0 +1,221 @@
+// Copyright (c) 2018 The CashCore Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "test/test_bitcoin.h"
+
+#include "fs.h"
+#include "util.h"
+#include "wallet/db.h"
+#include "wallet/logdb.h"
+#include "wallet/wallet.h"
+#include "wallet/walletdb.h"
+
+#include <boost/test/unit_test.hpp>
+
+namespace {
+struct LogDBTestingSetup : public TestingSetup
+{
+    // Unlike the other wallet tests, use a real database environment so
+    // wallets can be converted between backends on disk
+    LogDBTestingSetup()
+    {
+        mapArgs["-walletbackend"] = WALLET_BACKEND_LOG;
+    }
+
+    ~LogDBTestingSetup()
+    {
+        mapArgs.erase("-walletbackend");
+        bitdb.Flush(true);
+        bitdb.Reset();
+    }
+};
+
+static CLogDBData Data(const std::string& str)
+{
+    return CLogDBData(str.begin(), str.end());
+}
+
+static std::string ReadString(const CLogDB& logdb, const std::string& strKey)
+{
+    CLogDBData vchValue;
+    if (!logdb.Read(Data(strKey), vchValue))
+        return "";
+    return std::string(vchValue.begin(), vchValue.end());
+}
+}
+
+BOOST_FIXTURE_TEST_SUITE(logdb_tests, LogDBTestingSetup)
+
+BOOST_AUTO_TEST_CASE(logdb_replay)
+{
+    fs::path path = pathTemp / "replay.dat";
+    uint64_t nFileSize;
+    {
+        CLogDB logdb(path);
+        BOOST_CHECK(!logdb.Open(false));
+        BOOST_CHECK(logdb.Open(true));
+
+        CLogDBBatch batch;
+        batch.Write(Data("a"), Data("1"));
+        batch.Write(Data("b"), Data("2"));
+        batch.Write(Data("c"), Data("3"));
+        BOOST_CHECK(logdb.Write(batch));
+        batch.Clear();
+        batch.Erase(Data("b"));
+        batch.Write(Data("c"), Data("4"));
+        BOOST_CHECK(logdb.Write(batch));
+        nFileSize = logdb.GetFileSize();
+    }
+    BOOST_CHECK(CLogDB::IsLogFile(path));
+    BOOST_CHECK_EQUAL(fs::file_size(path), nFileSize);
+
+    // Simulate a crash in the middle of appending a batch
+    FILE* file = fopen(path.string().c_str(), "ab");
+    const unsigned char torn[] = {0x40, 0x00, 0x00, 0x00, 0x01, 'p', 0x01, 'd'};
+    fwrite(torn, 1, sizeof(torn), file);
+    fclose(file);
+
+    {
+        CLogDB logdb(path);
+        BOOST_CHECK(logdb.Open(false));
+        BOOST_CHECK_EQUAL(logdb.GetRecordCount(), 2U);
+        BOOST_CHECK_EQUAL(logdb.GetFileSize(), nFileSize);
+        BOOST_CHECK_EQUAL(ReadString(logdb, "a"), "1");
+        BOOST_CHECK(!logdb.Exists(Data("b")));
+        BOOST_CHECK_EQUAL(ReadString(logdb, "c"), "4");
+
+        CLogDBData vchKey, vchValue;
+        BOOST_CHECK(logdb.Seek(Data("b"), true, vchKey, vchValue));
+        BOOST_CHECK(vchKey == Data("c"));
+        BOOST_CHECK(!logdb.Seek(Data("c"), false, vchKey, vchValue));
+
+        // Batches appended after the torn one are kept
+        CLogDBBatch batch;
+        batch.Write(Data("d"), Data("5"));
+        BOOST_CHECK(logdb.Write(batch));
+    }
+    BOOST_CHECK_EQUAL(fs::file_size(path), nFileSize + 14);
+    {
+        CLogDB logdb(path);
+        BOOST_CHECK(logdb.Open(false));
+        BOOST_CHECK_EQUAL(logdb.GetRecordCount(), 3U);
+        BOOST_CHECK_EQUAL(ReadString(logdb, "d"), "5");
+    }
+}
+
+BOOST_AUTO_TEST_CASE(logdb_compact)
+{
+    fs::path path = pathTemp / "compact.dat";
+    CLogDB logdb(path);
+    BOOST_CHECK(logdb.Open(true));
+
+    CLogDBBatch batch;
+    batch.Write(Data("\x04pool1"), Data("key"));
+    batch.Write(Data("\x04pool2"), Data("key"));
+    BOOST_CHECK(logdb.Write(batch));
+
+    // Rewriting the same record leaves superseded copies behind until the
+    // log has grown enough to be compacted
+    std::string strValue(1000, 'x');
+    uint64_t nMaxFileSize = 0;
+    for (int i = 0; i < 3000; i++) {
+        batch.Clear();
+        batch.Write(Data("tx"), Data(strValue + itostr(i)));
+        BOOST_CHECK(logdb.Write(batch));
+        nMaxFileSize = std::max(nMaxFileSize, logdb.GetFileSize());
+    }
+    BOOST_CHECK(nMaxFileSize < 2 * LOGDB_COMPACT_MIN_SIZE);
+    BOOST_CHECK(logdb.GetFileSize() < LOGDB_COMPACT_MIN_SIZE);
+    BOOST_CHECK_EQUAL(ReadString(logdb, "tx"), strValue + "2999");
+
+    BOOST_CHECK(logdb.Compact("\x04pool"));
+    BOOST_CHECK_EQUAL(logdb.GetRecordCount(), 1U);
+    BOOST_CHECK(!fs::exists(path.string() + ".compact"));
+    uint64_t nFileSize = logdb.GetFileSize();
+    BOOST_CHECK_EQUAL(fs::file_size(path), nFileSize);
+
+    logdb.Close();
+    BOOST_CHECK(logdb.Open(false));
+    BOOST_CHECK_EQUAL(logdb.GetRecordCount(), 1U);
+    BOOST_CHECK_EQUAL(ReadString(logdb, "tx"), strValue + "2999");
+    BOOST_CHECK(!logdb.Exists(Data("\x04pool1")));
+}
+
+static void CheckWallet(const std::string& strFile, const CKey& key, const CTxDestination& dest, size_t nAccountingEntries)
+{
+    CWallet wallet(strFile);
+    bool fFirstRun;
+    BOOST_CHECK(wallet.LoadWallet(fFirstRun) == DB_LOAD_OK);
+    BOOST_CHECK(wallet.HaveKey(key.GetPubKey().GetID()));
+    BOOST_CHECK_EQUAL(wallet.mapAddressBook[dest].name, "name");
+
+    CWalletDB walletdb(strFile);
+    CKeyPool keypool;
+    BOOST_CHECK(!walletdb.ReadPool(1, keypool));
+    BOOST_CHECK(walletdb.ReadPool(2, keypool));
+    std::list<CAccountingEntry> entries;
+    walletdb.ListAccountCreditDebit("account", entries);
+    BOOST_CHECK_EQUAL(entries.size(), nAccountingEntries);
+}
+
+BOOST_AUTO_TEST_CASE(logdb_wallet)
+{
+    const std::string strFile = "wallet_log.dat";
+    CKey key;
+    key.MakeNewKey(true);
+    CTxDestination dest = key.GetPubKey().GetID();
+    {
+        CWallet wallet(strFile);
+        bool fFirstRun;
+        BOOST_CHECK(wallet.LoadWallet(fFirstRun) == DB_LOAD_OK);
+        BOOST_CHECK(fFirstRun);
+        BOOST_CHECK(wallet.AddKeyPubKey(key, key.GetPubKey()));
+        BOOST_CHECK(wallet.SetAddressBook(dest, "name", "receive"));
+    }
+    BOOST_CHECK(bitdb.IsLogDb(strFile));
+
+    {
+        CWalletDB walletdb(strFile);
+        CKeyPool keypool(key.GetPubKey());
+        CKeyPool keypoolRead;
+
+        // Records written in a transaction are visible to it, and only
+        // reach the log when it commits
+        BOOST_CHECK(walletdb.TxnBegin());
+        BOOST_CHECK(walletdb.WritePool(1, keypool));
+        BOOST_CHECK(walletdb.ReadPool(1, keypoolRead));
+        BOOST_CHECK(walletdb.TxnAbort());
+        BOOST_CHECK(!walletdb.ReadPool(1, keypoolRead));
+
+        BOOST_CHECK(walletdb.TxnBegin());
+        BOOST_CHECK(walletdb.WritePool(2, keypool));
+        BOOST_CHECK(walletdb.WritePool(3, keypool));
+        BOOST_CHECK(walletdb.ErasePool(3));
+        BOOST_CHECK(walletdb.TxnCommit());
+        BOOST_CHECK(walletdb.ReadPool(2, keypoolRead));
+        BOOST_CHECK(!walletdb.ReadPool(3, keypoolRead));
+
+        // Accounting entries are listed through a ranged cursor
+        CAccountingEntry acentry;
+        acentry.strAccount = "account";
+        acentry.nCreditDebit = COIN;
+        for (uint64_t i = 0; i < 3; i++)
+            BOOST_CHECK(walletdb.WriteAccountingEntry(i, acentry));
+        acentry.strAccount = "other";
+        BOOST_CHECK(walletdb.WriteAccountingEntry(3, acentry));
+    }
+    CheckWallet(strFile, key, dest, 3);
+
+    // Convert to BerkeleyDB and back without losing any records
+    BOOST_CHECK(CDB::Convert(strFile, WALLET_BACKEND_BDB));
+    BOOST_CHECK(!bitdb.IsLogDb(strFile));
+    CheckWallet(strFile, key, dest, 3);
+
+    BOOST_CHECK(CDB::Convert(strFile, WALLET_BACKEND_LOG));
+    BOOST_CHECK(bitdb.IsLogDb(strFile));
+    BOOST_CHECK(!fs::exists(GetDataDir() / (strFile + ".convert")));
+    CheckWallet(strFile, key, dest, 3);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -4,6 +4,13 @@
 
 #include "wallet/wallet.h"
 
+#include "chain.h"
+#include "chainparams.h"
+#include "consensus/merkle.h"
+#include "main.h"
+#include "random.h"
+#include "script/standard.h"
+
 #include <set>
 #include <stdint.h>
 #include <utility>
@@ -353,4 +360,114 @@ BOOST_AUTO_TEST_CASE(ApproximateBestSubset)
     BOOST_CHECK_EQUAL(setCoinsRet.size(), 2U);
 }
 
+// Append a block spending nothing to a block file of its own and to the active chain
+static CBlockIndex* AddRescanBlock(const std::vector<CMutableTransaction>& vtx, unsigned int& nOffset)
+{
+    CBlockIndex* pindexPrev = chainActive.Tip();
+    CBlock block;
+    block.nVersion = 7;
+    block.hashPrevBlock = pindexPrev->GetBlockHash();
+    block.nTime = pindexPrev->nTime + 64;
+    block.nBits = pindexPrev->nBits;
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].scriptSig = CScript() << (pindexPrev->nHeight + 1) << OP_0;
+    coinbase.vout.resize(1);
+    coinbase.vout[0].SetEmpty();
+    block.vtx.push_back(coinbase);
+    BOOST_FOREACH(const CMutableTransaction& tx, vtx)
+        block.vtx.push_back(tx);
+    block.hashMerkleRoot = BlockMerkleRoot(block);
+
+    CDiskBlockPos pos(1, nOffset);
+    BOOST_REQUIRE(WriteBlockToDisk(block, pos, Params().MessageStart()));
+    nOffset = pos.nPos + ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
+
+    CBlockIndex* pindex = new CBlockIndex(block);
+    pindex->phashBlock = &mapBlockIndex.insert(std::make_pair(block.GetHash(), pindex)).first->first;
+    pindex->pprev = pindexPrev;
+    pindex->nHeight = pindexPrev->nHeight + 1;
+    pindex->nFile = pos.nFile;
+    pindex->nDataPos = pos.nPos;
+    pindex->nStatus |= BLOCK_HAVE_DATA;
+    pindex->nTx = block.vtx.size();
+    pindex->BuildSkip();
+    chainActive.SetTip(pindex);
+    return pindex;
+}
+
+BOOST_AUTO_TEST_CASE(rescan)
+{
+    CKey key, keyOther;
+    key.MakeNewKey(true);
+    keyOther.MakeNewKey(true);
+    CScript scriptOther = GetScriptForDestination(keyOther.GetPubKey().GetID());
+    {
+        LOCK(pwalletMain->cs_wallet);
+        BOOST_CHECK(pwalletMain->AddKeyPubKey(key, key.GetPubKey()));
+        pwalletMain->nTimeFirstKey = 1;
+    }
+
+    // Blocks paying to the key, to a bare multisig of it, and spending
+    // from the wallet, among blocks of other transactions, over several chunks
+    CMutableTransaction txReceive, txMultisig, txSpend;
+    unsigned int nOffset = 0;
+    {
+        LOCK(cs_main);
+        for (unsigned int i = 1; i <= 2 * RESCAN_CHUNK_BLOCKS + 50; i++) {
+            std::vector<CMutableTransaction> vtx(1);
+            vtx[0].vin.push_back(CTxIn(COutPoint(GetRandHash(), 0)));
+            vtx[0].vout.push_back(CTxOut(COIN, scriptOther));
+            if (i == 10) {
+                txReceive = vtx[0];
+                txReceive.vout.push_back(CTxOut(COIN, GetScriptForDestination(key.GetPubKey().GetID())));
+                vtx.push_back(txReceive);
+            } else if (i == RESCAN_CHUNK_BLOCKS + 10) {
+                txMultisig = vtx[0];
+                txMultisig.vout[0].scriptPubKey = GetScriptForMultisig(1, std::vector<CPubKey>(1, key.GetPubKey()));
+                vtx.push_back(txMultisig);
+            } else if (i == 2 * RESCAN_CHUNK_BLOCKS + 10) {
+                txSpend.vin.push_back(CTxIn(COutPoint(txReceive.GetHash(), 1)));
+                txSpend.vout.push_back(CTxOut(COIN, scriptOther));
+                vtx.push_back(txSpend);
+            }
+            AddRescanBlock(vtx, nOffset);
+        }
+    }
+
+    BOOST_CHECK_EQUAL(pwalletMain->GetBalance(), 0);
+
+    // An unfinished rescan is resumed from its last committed block
+    CBlockIndex* pindexTip;
+    {
+        LOCK(cs_main);
+        pindexTip = chainActive.Tip();
+        CWalletDB(pwalletMain->strWalletFile).WriteRescanProgress(chainActive.GetLocator(chainActive[5]));
+    }
+    BOOST_CHECK_EQUAL(pwalletMain->ScanForWalletTransactions(pindexTip, true), 3);
+    {
+        LOCK(pwalletMain->cs_wallet);
+        BOOST_CHECK(pwalletMain->mapWallet.count(txReceive.GetHash()));
+        BOOST_CHECK(pwalletMain->mapWallet.count(txMultisig.GetHash()));
+        BOOST_CHECK(pwalletMain->mapWallet.count(txSpend.GetHash()));
+        BOOST_CHECK_EQUAL(pwalletMain->mapWallet.size(), 3U);
+    }
+
+    // Of the outputs found, only the multisig one is left unspent
+    BOOST_CHECK_EQUAL(pwalletMain->GetBalance(), COIN);
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), 0);
+    std::vector<COutput> vAvailable;
+    pwalletMain->AvailableCoins(vAvailable);
+    BOOST_REQUIRE_EQUAL(vAvailable.size(), 1U);
+    BOOST_CHECK(vAvailable[0].tx->GetHash() == txMultisig.GetHash());
+    CBlockLocator locator;
+    BOOST_CHECK(!CWalletDB(pwalletMain->strWalletFile).ReadRescanProgress(locator));
+
+    // A finished rescan leaves nothing to resume
+    BOOST_CHECK_EQUAL(pwalletMain->ScanForWalletTransactions(pindexTip, true), 0);
+
+    LOCK(cs_main);
+    chainActive.SetTip(chainActive.Genesis());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -30,6 +30,8 @@
 #include "utilmoneystr.h"
 
 #include <assert.h>
+#include <deque>
+#include <memory>
 
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
@@ -160,8 +162,11 @@ CPubKey CWallet::GenerateNewKey()
     if (!nTimeFirstKey || nCreationTime < nTimeFirstKey)
         nTimeFirstKey = nCreationTime;
 
+    // No transaction of the wallet pays to a key it did not have yet
+    bool fWalletUTXOWasStale = fWalletUTXOStale;
     if (!AddKeyPubKey(secret, pubkey))
         throw std::runtime_error(std::string(__func__) + ": AddKey failed");
+    fWalletUTXOStale = fWalletUTXOWasStale;
     return pubkey;
 }
 
@@ -170,6 +175,9 @@ bool CWallet::AddKeyPubKey(const CKey& secret, const CPubKey &pubkey)
     AssertLockHeld(cs_wallet); // mapKeyMetadata
     if (!CCryptoKeyStore::AddKeyPubKey(secret, pubkey))
         return false;
+    // Outputs of our transactions may now be ours
+    fWalletUTXOStale = true;
+    nWalletTxUpdated++;
 
     // check if we need to remove from watch-only
     CScript script;
@@ -230,6 +238,8 @@ bool CWallet::AddCScript(const CScript& redeemScript)
 {
     if (!CCryptoKeyStore::AddCScript(redeemScript))
         return false;
+    fWalletUTXOStale = true;
+    nWalletTxUpdated++;
     if (!fFileBacked)
         return true;
     return CWalletDB(strWalletFile).WriteCScript(Hash160(redeemScript), redeemScript);
@@ -258,6 +268,8 @@ bool CWallet::AddWatchOnly(const CScript &dest)
 {
     if (!CCryptoKeyStore::AddWatchOnly(dest))
         return false;
+    fWalletUTXOStale = true;
+    nWalletTxUpdated++;
     nTimeFirstKey = 1; // No birthday information for watch-only keys.
     NotifyWatchonlyChanged(true);
     if (!fFileBacked)
@@ -270,6 +282,7 @@ bool CWallet::RemoveWatchOnly(const CScript &dest)
     AssertLockHeld(cs_wallet);
     if (!CCryptoKeyStore::RemoveWatchOnly(dest))
         return false;
+    nWalletTxUpdated++;
     if (!HaveWatchOnly())
         NotifyWatchonlyChanged(false);
     if (fFileBacked)
@@ -435,6 +448,10 @@ bool CWallet::Verify()
     if (walletFile != boost::filesystem::basename(walletFile) + boost::filesystem::extension(walletFile))
         return InitError(strprintf(_("Wallet %s resides outside data directory %s"), walletFile, GetDataDir().string()));
 
+    std::string strBackend = GetArg("-walletbackend", DEFAULT_WALLET_BACKEND);
+    if (strBackend != WALLET_BACKEND_BDB && strBackend != WALLET_BACKEND_LOG)
+        return InitError(strprintf(_("Unknown wallet backend requested: %s"), strBackend));
+
     if (!bitdb.Open(GetDataDir()))
     {
         // try moving the database env out of the way
@@ -456,8 +473,12 @@ bool CWallet::Verify()
     
     if (GetBoolArg("-salvagewallet", false))
     {
+        // Log-structured wallets drop incomplete batches as they are loaded,
+        // there is nothing for BerkeleyDB's salvage to recover
+        if (bitdb.IsLogDb(walletFile))
+            LogPrintf("Not salvaging %s: it is a log-structured wallet\n", walletFile);
         // Recover readable keypairs:
-        if (!CWalletDB::Recover(bitdb, walletFile, true))
+        else if (!CWalletDB::Recover(bitdb, walletFile, true))
             return false;
     }
     
@@ -474,6 +495,13 @@ bool CWallet::Verify()
         }
         if (r == CDBEnv::RECOVER_FAIL)
             return InitError(strprintf(_("%s corrupt, salvage failed"), walletFile));
+
+        if (GetBoolArg("-convertwallet", false))
+        {
+            uiInterface.InitMessage(_("Converting wallet..."));
+            if (!CDB::Convert(walletFile, strBackend))
+                return InitError(strprintf(_("Error converting %s to the %s backend"), walletFile, strBackend));
+        }
     }
     
     return true;
@@ -562,6 +590,8 @@ void CWallet::RemoveFromSpends(const COutPoint& outpoint, const uint256& wtxid)
             break;
         }
     }
+    AddToWalletUTXO(outpoint);
+    nWalletTxUpdated++;
     range = mapTxSpends.equal_range(outpoint);
     SyncMetaData(range);
 }
@@ -588,16 +618,62 @@ void CWallet::RemoveFromSpends(const uint256& wtxid)
         RemoveFromSpends(txin.prevout, wtxid);
 }
 
+void CWallet::AddToWalletUTXO(const COutPoint& outpoint)
+{
+    std::map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(outpoint.hash);
+    if (mi != mapWallet.end() && outpoint.n < mi->second.vout.size() && IsMine(mi->second.vout[outpoint.n]) != ISMINE_NO)
+        setWalletUTXO.insert(outpoint);
+}
+
+void CWallet::AddToWalletUTXO(const CWalletTx& wtx)
+{
+    const uint256& hash = wtx.GetHash();
+    for (unsigned int i = 0; i < wtx.vout.size(); i++) {
+        if (IsMine(wtx.vout[i]) != ISMINE_NO)
+            setWalletUTXO.insert(COutPoint(hash, i));
+    }
+}
+
+void CWallet::GetWalletUTXOTransactions(std::vector<const CWalletTx*>& vpwtx) const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    if (fWalletUTXOStale) {
+        setWalletUTXO.clear();
+        for (std::map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            const_cast<CWallet*>(this)->AddToWalletUTXO(it->second);
+        fWalletUTXOStale = false;
+    }
+
+    vpwtx.clear();
+    std::map<uint256, CWalletTx>::const_iterator mi = mapWallet.end();
+    std::set<COutPoint>::iterator it = setWalletUTXO.begin();
+    while (it != setWalletUTXO.end()) {
+        if (mi == mapWallet.end() || mi->first != it->hash)
+            mi = mapWallet.find(it->hash);
+        // Immature outputs stay, they count towards the immature balances
+        if (mi == mapWallet.end() || (IsSpent(it->hash, it->n) && mi->second.GetBlocksToMaturity() == 0)) {
+            setWalletUTXO.erase(it++);
+            continue;
+        }
+        if (vpwtx.empty() || vpwtx.back() != &mi->second)
+            vpwtx.push_back(&mi->second);
+        ++it;
+    }
+}
+
 void CWallet::AvailableCoinsForStaking(std::vector<COutput>& vCoins) const
 {
     vCoins.clear();
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        std::vector<const CWalletTx*> vpwtx;
+        GetWalletUTXOTransactions(vpwtx);
+        BOOST_FOREACH(const CWalletTx* pcoin, vpwtx)
         {
-            const uint256& wtxid = it->first;
-            const CWalletTx* pcoin = &(*it).second;
+            const uint256& wtxid = pcoin->GetHash();
             int nDepth = pcoin->GetDepthInMainChain();
 
             if (nDepth < 1)
@@ -612,7 +688,7 @@ void CWallet::AvailableCoinsForStaking(std::vector<COutput>& vCoins) const
             for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
                 isminetype mine = IsMine(pcoin->vout[i]);
                 if (!(IsSpent(wtxid, i)) && mine != ISMINE_NO &&
-                    !IsLockedCoin((*it).first, i) && (pcoin->vout[i].nValue > 0))
+                    !IsLockedCoin(wtxid, i) && (pcoin->vout[i].nValue > 0))
                     vCoins.push_back(COutput(pcoin, i, nDepth,
                                              ((mine & ISMINE_SPENDABLE) != ISMINE_NO) ||
                                              (mine & ISMINE_WATCH_SOLVABLE) != ISMINE_NO,
@@ -669,20 +745,75 @@ bool CWallet::SelectCoinsForStaking(CAmount& nTargetValue, std::set<std::pair<co
     return true;
 }
 
-bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int64_t nSearchInterval, CAmount& nFees, CMutableTransaction& tx, CKey& key)
+bool CWallet::FindStakeCandidate(const CWalletTx* pcoin, unsigned int n, CStakeCandidate& candidateRet)
 {
-    CBlockIndex* pindexPrev = pindexBestHeader;
-    arith_uint256 bnTargetPerCoinDay;
-    bnTargetPerCoinDay.SetCompact(nBits);
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
 
-    struct CMutableTransaction txNew(tx);
-    txNew.vin.clear();
-    txNew.vout.clear();
+    COutPoint prevout(pcoin->GetHash(), n);
+    map<COutPoint, CStakeCandidate>::const_iterator it = mapStakeCandidates.find(prevout);
+    if (it != mapStakeCandidates.end()) {
+        candidateRet = it->second;
+        return true;
+    }
 
-    // Mark coin stake transaction
-    CScript scriptEmpty;
-    scriptEmpty.clear();
-    txNew.vout.push_back(CTxOut(0, scriptEmpty));
+    // Not indexed yet (older wallet file, or a spend that was reorganized
+    // away): the wallet transaction has everything the kernel needs
+    BlockMap::const_iterator mi = mapBlockIndex.find(pcoin->hashBlock);
+    if (mi == mapBlockIndex.end() || n >= pcoin->vout.size())
+        return false;
+
+    candidateRet = CStakeCandidate(pcoin->nTime, pcoin->vout[n].nValue, mi->second->nHeight, pcoin->hashBlock);
+    mapStakeCandidates[prevout] = candidateRet;
+    if (fFileBacked)
+        CWalletDB(strWalletFile, "r+", false).WriteStakeCandidate(prevout, candidateRet);
+    return true;
+}
+
+void CWallet::UpdateStakeCandidates(const CTransaction& tx, const CBlockIndex* pindex, const CBlock* pblock)
+{
+    AssertLockHeld(cs_wallet);
+
+    const uint256& hash = tx.GetHash();
+    vector<COutPoint> vErase;
+    vector<pair<COutPoint, CStakeCandidate> > vWrite;
+
+    if (pblock && pindex) {
+        // Confirmed spends retire the candidates they consume
+        if (!tx.IsCoinBase()) {
+            BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+                if (mapStakeCandidates.erase(txin.prevout))
+                    vErase.push_back(txin.prevout);
+            }
+        }
+        for (unsigned int i = 0; i < tx.vout.size(); i++) {
+            if (tx.vout[i].nValue <= 0 || IsMine(tx.vout[i]) == ISMINE_NO)
+                continue;
+            CStakeCandidate candidate(tx.nTime, tx.vout[i].nValue, pindex->nHeight, pindex->GetBlockHash());
+            mapStakeCandidates[COutPoint(hash, i)] = candidate;
+            vWrite.push_back(make_pair(COutPoint(hash, i), candidate));
+        }
+    } else {
+        // Disconnected or unconfirmed, its outputs cannot stake
+        for (unsigned int i = 0; i < tx.vout.size(); i++) {
+            if (mapStakeCandidates.erase(COutPoint(hash, i)))
+                vErase.push_back(COutPoint(hash, i));
+        }
+    }
+
+    if (!fFileBacked || (vErase.empty() && vWrite.empty()))
+        return;
+
+    CWalletDB walletdb(strWalletFile, "r+", false);
+    BOOST_FOREACH(const COutPoint& prevout, vErase)
+        walletdb.EraseStakeCandidate(prevout);
+    for (unsigned int i = 0; i < vWrite.size(); i++)
+        walletdb.WriteStakeCandidate(vWrite[i].first, vWrite[i].second);
+}
+
+bool CWallet::FindStakeKernel(unsigned int nBits, uint32_t nTime, int64_t nSearchInterval, COutPoint& prevoutKernel, uint32_t& nTimeKernel)
+{
+    CBlockIndex* pindexPrev = pindexBestHeader;
 
     // Choose coins to use
     CAmount nBalance = GetBalance();
@@ -690,8 +821,6 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
     if (nBalance <= nReserveBalance)
         return false;
 
-    vector<const CWalletTx*> vwtxPrev;
-
     set<pair<const CWalletTx*,unsigned int> > setCoins;
     CAmount nValueIn = 0;
 
@@ -703,96 +832,141 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
     if (setCoins.empty())
         return false;
 
-    if (stakeCache.size() > setCoins.size() + 100){
-        //Determining if the cache is still valid is harder than just clearing it when it gets too big, so instead just clear it
-        //when it has more than 100 entries more than the actual setCoins.
-        stakeCache.clear();
+    // Kernels only depend on the tip and the target, rebuild them when either changes
+    if (hashStakeKernelTip != pindexPrev->GetBlockHash() || nStakeKernelBits != nBits) {
+        mapStakeKernels.clear();
+        hashStakeKernelTip = pindexPrev->GetBlockHash();
+        nStakeKernelBits = nBits;
     }
 
-    if (GetBoolArg("-stakecache", DEFAULT_STAKE_CACHE)) {
+    vector<CStakeKernel> vKernels;
+    vector<COutPoint> vKernelPrevouts;
+    vKernels.reserve(setCoins.size());
+    vKernelPrevouts.reserve(setCoins.size());
+    {
+        LOCK2(cs_main, cs_wallet);
         BOOST_FOREACH(const PAIRTYPE(const CWalletTx*, unsigned int)& pcoin, setCoins)
         {
             boost::this_thread::interruption_point();
             COutPoint prevoutStake = COutPoint(pcoin.first->GetHash(), pcoin.second);
-            CacheKernel(stakeCache, prevoutStake, pindexPrev); //this will do a 2 disk loads per op
+            map<COutPoint, CStakeKernel>::const_iterator mi = mapStakeKernels.find(prevoutStake);
+            if (mi == mapStakeKernels.end()) {
+                CStakeCandidate candidate;
+                CStakeKernel kernel;
+                if (!FindStakeCandidate(pcoin.first, pcoin.second, candidate) ||
+                    !PrepareStakeKernel(pindexPrev, nBits, prevoutStake, candidate, kernel))
+                    continue;
+                mi = mapStakeKernels.insert(make_pair(prevoutStake, kernel)).first;
+            }
+            vKernels.push_back(mi->second);
+            vKernelPrevouts.push_back(prevoutStake);
         }
-
     }
 
+    // Search backward in time from nTime, nSearchInterval seconds back up to
+    // nMaxStakeSearchInterval, only probing valid timestamps
+    static const int64_t nMaxStakeSearchInterval = 60;
+    unsigned int nStep = 1;
+    if (Params().GetConsensus().IsProtocolV2(nTime))
+        nStep = Params().GetConsensus().nStakeTimestampMask + 1;
+    unsigned int nProbes = std::max((int64_t)1, (min(nSearchInterval, nMaxStakeSearchInterval) + nStep - 1) / nStep);
+
+    size_t nKernel = 0;
+    if (pindexPrev != pindexBestHeader || !SearchStakeKernels(vKernels, nTime, nProbes, nStep, nKernel, nTimeKernel))
+        return false;
+
+    LogPrint("coinstake", "FindStakeKernel : kernel found\n");
+    prevoutKernel = vKernelPrevouts[nKernel];
+    return true;
+}
+
+bool CWallet::CreateCoinStake(const CKeyStore& keystore, const COutPoint& prevoutKernel, uint32_t nTimeKernel, CAmount& nFees, CMutableTransaction& tx, CKey& key)
+{
+    struct CMutableTransaction txNew(tx);
+    txNew.vin.clear();
+    txNew.vout.clear();
+
+    // Mark coin stake transaction
+    CScript scriptEmpty;
+    scriptEmpty.clear();
+    txNew.vout.push_back(CTxOut(0, scriptEmpty));
+
+    // Choose coins to use
+    CAmount nBalance = GetBalance();
+
+    if (nBalance <= nReserveBalance)
+        return false;
+
+    vector<const CWalletTx*> vwtxPrev;
+
+    set<pair<const CWalletTx*,unsigned int> > setCoins;
+    CAmount nValueIn = 0;
+
+    // Select coins with suitable depth
+    CAmount nTargetValue = nBalance - nReserveBalance;
+    if (!SelectCoinsForStaking(nTargetValue, setCoins, nValueIn))
+        return false;
+
     int64_t nCredit = 0;
     CScript scriptPubKeyKernel;
     BOOST_FOREACH(const PAIRTYPE(const CWalletTx*, unsigned int)& pcoin, setCoins)
     {
-        static int nMaxStakeSearchInterval = 60;
-        bool fKernelFound = false;
-        for (unsigned int n=0; n<min(nSearchInterval,(int64_t)nMaxStakeSearchInterval) && !fKernelFound && pindexPrev == pindexBestHeader; n++)
+        // Locate the kernel among the coins still available, it may have been spent since it was found
+        if (pcoin.first->GetHash() != prevoutKernel.hash || pcoin.second != prevoutKernel.n)
+            continue;
+
+        vector<vector<unsigned char> > vSolutions;
+        txnouttype whichType;
+        CScript scriptPubKeyOut;
+        scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
+        if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
         {
-            boost::this_thread::interruption_point();
-            // Search backward in time from the given txNew timestamp
-            // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
-            COutPoint prevoutStake = COutPoint(pcoin.first->GetHash(), pcoin.second);
-            if (CheckKernel(pindexPrev, nBits, txNew.nTime - n, prevoutStake, stakeCache))
+            LogPrint("coinstake", "CreateCoinStake : failed to parse kernel\n");
+            return false;
+        }
+        LogPrint("coinstake", "CreateCoinStake : parsed kernel type=%d\n", whichType);
+        if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
+        {
+            LogPrint("coinstake", "CreateCoinStake : no support for kernel type=%d\n", whichType);
+            return false;  // only support pay to public key and pay to address
+        }
+        if (whichType == TX_PUBKEYHASH) // pay to address type
+        {
+            // convert to pay to public key type
+            if (!keystore.GetKey(uint160(vSolutions[0]), key))
             {
-                // Found a kernel
-                LogPrint("coinstake", "CreateCoinStake : kernel found\n");
-                vector<vector<unsigned char> > vSolutions;
-                txnouttype whichType;
-                CScript scriptPubKeyOut;
-                scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
-                if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
-                {
-                    LogPrint("coinstake", "CreateCoinStake : failed to parse kernel\n");
-                    break;
-                }
-                LogPrint("coinstake", "CreateCoinStake : parsed kernel type=%d\n", whichType);
-                if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
-                {
-                    LogPrint("coinstake", "CreateCoinStake : no support for kernel type=%d\n", whichType);
-                    break;  // only support pay to public key and pay to address
-                }
-                if (whichType == TX_PUBKEYHASH) // pay to address type
-                {
-                    // convert to pay to public key type
-                    if (!keystore.GetKey(uint160(vSolutions[0]), key))
-                    {
-                        LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                        break;  // unable to find corresponding public key
-                    }
-
-                    scriptPubKeyOut << key.GetPubKey().getvch() << OP_CHECKSIG;
-                }
-                if (whichType == TX_PUBKEY)
-                {
-
-                    if (!keystore.GetKey(Hash160(vSolutions[0]), key))
-                    {
-                        LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                        break;  // unable to find corresponding public key
-                    }
-
-                    if (key.GetPubKey() != vSolutions[0])
-                    {
-                        LogPrint("coinstake", "CreateCoinStake : invalid key for kernel type=%d\n", whichType);
-                        break; // keys mismatch
-                    }
+                LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+                return false;  // unable to find corresponding public key
+            }
 
-                    scriptPubKeyOut = scriptPubKeyKernel;
-                }
+            scriptPubKeyOut << key.GetPubKey().getvch() << OP_CHECKSIG;
+        }
+        if (whichType == TX_PUBKEY)
+        {
 
-                txNew.nTime -= n;
-                txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
-                nCredit += pcoin.first->vout[pcoin.second].nValue;
-                vwtxPrev.push_back(pcoin.first);
-                txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
+            if (!keystore.GetKey(Hash160(vSolutions[0]), key))
+            {
+                LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+                return false;  // unable to find corresponding public key
+            }
 
-                LogPrint("coinstake", "CreateCoinStake : added kernel type=%d\n", whichType);
-                fKernelFound = true;
-                break;
+            if (key.GetPubKey() != vSolutions[0])
+            {
+                LogPrint("coinstake", "CreateCoinStake : invalid key for kernel type=%d\n", whichType);
+                return false; // keys mismatch
             }
+
+            scriptPubKeyOut = scriptPubKeyKernel;
         }
 
-        if (fKernelFound)
-            break; // if kernel is found stop searching
+        txNew.nTime = nTimeKernel;
+        txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
+        nCredit += pcoin.first->vout[pcoin.second].nValue;
+        vwtxPrev.push_back(pcoin.first);
+        txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
+
+        LogPrint("coinstake", "CreateCoinStake : added kernel type=%d\n", whichType);
+        break;
     }
 
     if (nCredit == 0 || nCredit > nBalance - nReserveBalance)
@@ -1050,6 +1224,7 @@ void CWallet::MarkDirty()
         LOCK(cs_wallet);
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
+        nWalletTxUpdated++;
     }
 }
 
@@ -1171,6 +1346,9 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletD
 
         // Break debit/credit balance caches:
         wtx.MarkDirty();
+        if (fInsertedNew)
+            AddToWalletUTXO(wtx);
+        nWalletTxUpdated++;
 
         // Notify UI of new or updated transaction
         NotifyTransactionChanged(this, hash, fInsertedNew ? CT_NEW : CT_UPDATED);
@@ -1282,7 +1460,9 @@ bool CWallet::AbandonTransaction(const uint256& hashTx)
             {
                 if (mapWallet.count(txin.prevout.hash))
                     mapWallet[txin.prevout.hash].MarkDirty();
+                AddToWalletUTXO(txin.prevout);
             }
+            nWalletTxUpdated++;
         }
     }
 
@@ -1343,7 +1523,9 @@ void CWallet::MarkConflicted(const uint256& hashBlock, const uint256& hashTx)
             {
                 if (mapWallet.count(txin.prevout.hash))
                     mapWallet[txin.prevout.hash].MarkDirty();
+                AddToWalletUTXO(txin.prevout);
             }
+            nWalletTxUpdated++;
         }
     }
 }
@@ -1356,6 +1538,7 @@ void CWallet::SyncTransaction(const CTransaction& tx, const CBlockIndex *pindex,
         // wallets need to refund inputs when disconnecting coinstake
         if (tx.IsCoinStake()) {
             if (IsFromMe(tx)) {
+                UpdateStakeCandidates(tx, pindex, pblock);
                 DisableTransaction(tx);
                 return;
             }
@@ -1365,6 +1548,8 @@ void CWallet::SyncTransaction(const CTransaction& tx, const CBlockIndex *pindex,
     if (!AddToWalletIfInvolvingMe(tx, pblock, true))
         return; // Not one of ours
 
+    UpdateStakeCandidates(tx, pindex, pblock);
+
     // If a transaction changes 'conflicted' state, that changes the balance
     // available of the outputs it spends. So force those to be
     // recomputed, also:
@@ -1699,10 +1884,181 @@ void CWalletTx::GetAccountAmounts(const string& strAccount, CAmount& nReceived,
     }
 }
 
+void CWallet::GetScriptPubKeys(std::set<CScript>& setScripts) const
+{
+    LOCK(cs_KeyStore);
+    std::set<CKeyID> setKeys;
+    GetKeys(setKeys);
+    BOOST_FOREACH(const CKeyID& keyID, setKeys) {
+        setScripts.insert(GetScriptForDestination(keyID));
+        CPubKey pubkey;
+        if (GetPubKey(keyID, pubkey))
+            setScripts.insert(GetScriptForRawPubKey(pubkey));
+    }
+    BOOST_FOREACH(const PAIRTYPE(CScriptID, CScript)& item, mapScripts)
+        setScripts.insert(GetScriptForDestination(item.first));
+    BOOST_FOREACH(const CScript& script, setWatchOnly)
+        setScripts.insert(script);
+}
+
+/** A block being rescanned, and which of its transactions pay to the wallet */
+struct CRescanBlock
+{
+    CBlockIndex* pindex;
+    CDiskBlockPos pos;
+    CBlock block;
+    bool fRead;
+    //! Transactions with an output to one of the wallet's scripts
+    std::vector<bool> vMatch;
+    bool fDone;
+
+    CRescanBlock(CBlockIndex* pindexIn, const CDiskBlockPos& posIn) : pindex(pindexIn), pos(posIn), fRead(false), fDone(false) {}
+};
+
+/**
+ * Reads the blocks of a rescan on a few threads, in chain order but ahead of
+ * the wallet, and matches their outputs against the wallet's scripts. Only
+ * the matching transactions, and those spending from the wallet, are then
+ * looked at under cs_wallet.
+ */
+class CWalletRescanReader
+{
+private:
+    const CWallet* pwallet;
+    std::set<CScript> setScripts;
+    const Consensus::Params& consensusParams;
+    boost::thread_group threads;
+
+    boost::mutex mutex;
+    boost::condition_variable condWork;
+    boost::condition_variable condDone;
+    //! Blocks queued in chain order; the first nTaken of them were taken by a thread
+    std::deque<std::shared_ptr<CRescanBlock> > queueBlocks;
+    size_t nTaken;
+    bool fStop;
+
+    void Match(CRescanBlock& rescan) const;
+    void Thread();
+
+public:
+    CWalletRescanReader(const CWallet* pwalletIn, const Consensus::Params& consensusParamsIn);
+    ~CWalletRescanReader();
+
+    //! Queue a block, whose position was looked up under cs_main
+    void Push(CBlockIndex* pindex, const CDiskBlockPos& pos);
+    //! Wait for the first queued block to be read and matched, and take it
+    std::shared_ptr<CRescanBlock> Pop();
+    //! Drop the queued blocks, after a reorganization
+    void Clear();
+    size_t Size();
+};
+
+CWalletRescanReader::CWalletRescanReader(const CWallet* pwalletIn, const Consensus::Params& consensusParamsIn) :
+    pwallet(pwalletIn), consensusParams(consensusParamsIn), nTaken(0), fStop(false)
+{
+    pwallet->GetScriptPubKeys(setScripts);
+    int nThreads = std::max(1, std::min(GetNumCores(), MAX_RESCAN_THREADS));
+    for (int i = 0; i < nThreads; i++)
+        threads.create_thread(boost::bind(&CWalletRescanReader::Thread, this));
+}
+
+CWalletRescanReader::~CWalletRescanReader()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fStop = true;
+    }
+    condWork.notify_all();
+    threads.join_all();
+}
+
+void CWalletRescanReader::Match(CRescanBlock& rescan) const
+{
+    rescan.vMatch.assign(rescan.block.vtx.size(), false);
+    for (unsigned int i = 0; i < rescan.block.vtx.size(); i++) {
+        BOOST_FOREACH(const CTxOut& txout, rescan.block.vtx[i].vout) {
+            // Bare multisig outputs are ours only if all of their keys are
+            const CScript& script = txout.scriptPubKey;
+            if (setScripts.count(script) ||
+                (!script.empty() && script.back() == OP_CHECKMULTISIG && ::IsMine(*pwallet, script) != ISMINE_NO)) {
+                rescan.vMatch[i] = true;
+                break;
+            }
+        }
+    }
+}
+
+void CWalletRescanReader::Thread()
+{
+    RenameThread("bitcoin-rescan");
+    while (true) {
+        std::shared_ptr<CRescanBlock> prescan;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (!fStop && nTaken == queueBlocks.size())
+                condWork.wait(lock);
+            if (fStop)
+                return;
+            prescan = queueBlocks[nTaken++];
+        }
+
+        prescan->fRead = ReadBlockFromDisk(prescan->block, prescan->pos, prescan->pindex, consensusParams);
+        if (prescan->fRead)
+            Match(*prescan);
+
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            prescan->fDone = true;
+        }
+        condDone.notify_all();
+    }
+}
+
+void CWalletRescanReader::Push(CBlockIndex* pindex, const CDiskBlockPos& pos)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        queueBlocks.push_back(std::make_shared<CRescanBlock>(pindex, pos));
+    }
+    condWork.notify_one();
+}
+
+std::shared_ptr<CRescanBlock> CWalletRescanReader::Pop()
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    assert(!queueBlocks.empty());
+    while (!queueBlocks.front()->fDone)
+        condDone.wait(lock);
+    std::shared_ptr<CRescanBlock> prescan = queueBlocks.front();
+    queueBlocks.pop_front();
+    nTaken--;
+    return prescan;
+}
+
+void CWalletRescanReader::Clear()
+{
+    // Blocks being read are dropped by their thread once done
+    boost::unique_lock<boost::mutex> lock(mutex);
+    queueBlocks.clear();
+    nTaken = 0;
+}
+
+size_t CWalletRescanReader::Size()
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return queueBlocks.size();
+}
+
 /**
  * Scan the block chain (starting in pindexStart) for transactions
  * from or to us. If fUpdate is true, found transactions that already
  * exist in the wallet will be updated.
+ *
+ * Blocks are read ahead by a CWalletRescanReader, and cs_main and cs_wallet
+ * are only taken to commit them in chunks of RESCAN_CHUNK_BLOCKS, so callers
+ * should not hold them. The last committed block is saved in the wallet
+ * until the scan completes; a scan aborted or interrupted by a crash resumes
+ * from it, on the next scan or when the wallet is next loaded.
  */
 int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 {
@@ -1710,45 +2066,103 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
     int64_t nNow = GetTime();
     const CChainParams& chainParams = Params();
 
+    LOCK(cs_rescan);
+    fAbortRescan = false;
+    fScanningWallet = true;
+
     CBlockIndex* pindex = pindexStart;
+    double dProgressStart, dProgressTip;
     {
-        LOCK2(cs_main, cs_wallet);
-        fAbortRescan = false;
-        fScanningWallet = true;
+        LOCK(cs_main);
+
+        CBlockLocator locator;
+        if (fFileBacked && CWalletDB(strWalletFile).ReadRescanProgress(locator)) {
+            CBlockIndex* pindexResume = FindForkInGlobalIndex(chainActive, locator);
+            if (pindexResume && (!pindex || pindexResume->nHeight < pindex->nHeight)) {
+                LogPrintf("Resuming unfinished rescan from block %d\n", pindexResume->nHeight);
+                pindex = pindexResume;
+            }
+        }
 
         // no need to read and scan block, if block was created before
         // our wallet birthday (as adjusted for block time variability)
         while (pindex && nTimeFirstKey && (pindex->GetBlockTime() < (nTimeFirstKey - 7200)))
             pindex = chainActive.Next(pindex);
 
-        ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
-        double dProgressStart = Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex, false);
-        double dProgressTip = Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), chainActive.Tip(), false);
-        while (pindex && !fAbortRescan)
+        dProgressStart = Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex, false);
+        dProgressTip = Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), chainActive.Tip(), false);
+    }
+    ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
+
+    CWalletRescanReader reader(this, chainParams.GetConsensus());
+    // Next block to queue, and last block committed
+    CBlockIndex* pindexQueue = pindex;
+    CBlockIndex* pindexLast = NULL;
+    while (!fAbortRescan)
+    {
         {
-            if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
-                ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
+            LOCK(cs_main);
+            for (size_t nQueued = reader.Size(); pindexQueue && nQueued < RESCAN_BLOCKS_AHEAD; nQueued++) {
+                reader.Push(pindexQueue, pindexQueue->GetBlockPos());
+                pindexQueue = chainActive.Next(pindexQueue);
+            }
+        }
+        if (reader.Size() == 0)
+            break;
+
+        std::vector<std::shared_ptr<CRescanBlock> > vChunk;
+        while (vChunk.size() < RESCAN_CHUNK_BLOCKS && reader.Size() > 0)
+            vChunk.push_back(reader.Pop());
 
-            CBlock block;
-            ReadBlockFromDisk(block, pindex, Params().GetConsensus());
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
+        LOCK2(cs_main, cs_wallet);
+        BOOST_FOREACH(const std::shared_ptr<CRescanBlock>& prescan, vChunk)
+        {
+            if (!chainActive.Contains(prescan->pindex)) {
+                // Continue on the new chain, from the fork
+                reader.Clear();
+                pindexQueue = chainActive[chainActive.FindFork(prescan->pindex)->nHeight];
+                break;
+            }
+            pindexLast = prescan->pindex;
+            if (!prescan->fRead) {
+                LogPrintf("%s: could not read block %s\n", __func__, prescan->pindex->GetBlockHash().ToString());
+                continue;
+            }
+
+            for (unsigned int i = 0; i < prescan->block.vtx.size(); i++)
             {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
+                const CTransaction& tx = prescan->block.vtx[i];
+                // Other transactions are neither ours, nor spend from or conflict with ours
+                bool fCandidate = prescan->vMatch[i] || mapWallet.count(tx.GetHash());
+                for (unsigned int j = 0; j < tx.vin.size() && !fCandidate; j++)
+                    fCandidate = mapWallet.count(tx.vin[j].prevout.hash) || mapTxSpends.count(tx.vin[j].prevout);
+                if (fCandidate && AddToWalletIfInvolvingMe(tx, &prescan->block, fUpdate))
                     ret++;
             }
-            pindex = chainActive.Next(pindex);
+        }
+
+        if (pindexLast) {
+            if (fFileBacked)
+                CWalletDB(strWalletFile).WriteRescanProgress(chainActive.GetLocator(pindexLast));
+            if (dProgressTip - dProgressStart > 0.0)
+                ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindexLast, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
             if (GetTime() >= nNow + 60) {
                 nNow = GetTime();
-                LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindex->nHeight, Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex));
+                LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindexLast->nHeight, Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindexLast));
             }
         }
-        if (pindex && fAbortRescan) {
-            LogPrintf("Rescan aborted at block %d. Progress=%f\n", pindex->nHeight, Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex));
-        }
-        ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
-
-        fScanningWallet = false;
     }
+    if (fAbortRescan) {
+        LOCK(cs_main);
+        CBlockIndex* pindexNext = pindexLast ? chainActive.Next(pindexLast) : pindex;
+        if (pindexNext)
+            LogPrintf("Rescan aborted at block %d. Progress=%f\n", pindexNext->nHeight, Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindexNext));
+    } else if (fFileBacked) {
+        CWalletDB(strWalletFile).EraseRescanProgress();
+    }
+    ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
+
+    fScanningWallet = false;
     return ret;
 }
 
@@ -2094,108 +2508,75 @@ void CWallet::ResendWalletTransactions(int64_t nBestBlockTime)
  */
 
 
-CAmount CWallet::GetBalance() const
+CWalletBalances CWallet::GetBalances() const
 {
-    CAmount nTotal = 0;
+    LOCK2(cs_main, cs_wallet);
+    if (fBalancesCached && pindexBalances == chainActive.Tip() &&
+        nBalancesMempoolUpdated == mempool.GetTransactionsUpdated() && nBalancesWalletTxUpdated == nWalletTxUpdated)
+        return cachedBalances;
+
+    CWalletBalances balances;
+    std::vector<const CWalletTx*> vpwtx;
+    GetWalletUTXOTransactions(vpwtx);
+    BOOST_FOREACH(const CWalletTx* pcoin, vpwtx)
     {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableCredit();
+        if (pcoin->IsTrusted()) {
+            balances.nTrusted += pcoin->GetAvailableCredit();
+            balances.nWatchOnlyTrusted += pcoin->GetAvailableWatchOnlyCredit();
+        } else if (pcoin->GetDepthInMainChain() == 0 && pcoin->InMempool()) {
+            balances.nPending += pcoin->GetAvailableCredit();
+            balances.nWatchOnlyPending += pcoin->GetAvailableWatchOnlyCredit();
+        }
+        balances.nImmature += pcoin->GetImmatureCredit();
+        balances.nWatchOnlyImmature += pcoin->GetImmatureWatchOnlyCredit();
+        // ppcoin: total coins staked (non-spendable until maturity)
+        if (pcoin->IsCoinStake() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0) {
+            balances.nStake += CWallet::GetCredit(*pcoin, ISMINE_SPENDABLE);
+            balances.nWatchOnlyStake += CWallet::GetCredit(*pcoin, ISMINE_WATCH_ONLY);
         }
     }
 
-    return nTotal;
+    cachedBalances = balances;
+    fBalancesCached = true;
+    pindexBalances = chainActive.Tip();
+    nBalancesMempoolUpdated = mempool.GetTransactionsUpdated();
+    nBalancesWalletTxUpdated = nWalletTxUpdated;
+    return balances;
+}
+
+CAmount CWallet::GetBalance() const
+{
+    return GetBalances().nTrusted;
 }
 
 CAmount CWallet::GetUnconfirmedBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0 && pcoin->InMempool())
-                nTotal += pcoin->GetAvailableCredit();
-        }
-    }
-    return nTotal;
+    return GetBalances().nPending;
 }
 
 CAmount CWallet::GetImmatureBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureCredit();
-        }
-    }
-    return nTotal;
+    return GetBalances().nImmature;
 }
 
-// ppcoin: total coins staked (non-spendable until maturity)
 CAmount CWallet::GetStake() const
 {
-    CAmount nTotal = 0;
-    LOCK2(cs_main, cs_wallet);
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-    {
-        const CWalletTx* pcoin = &(*it).second;
-        if (pcoin->IsCoinStake() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
-            nTotal += CWallet::GetCredit(*pcoin, ISMINE_SPENDABLE);
-    }
-    return nTotal;
+    return GetBalances().nStake;
 }
 
 CAmount CWallet::GetWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
-        }
-    }
-
-    return nTotal;
+    return GetBalances().nWatchOnlyTrusted;
 }
 
 CAmount CWallet::GetUnconfirmedWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0 && pcoin->InMempool())
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
-        }
-    }
-    return nTotal;
+    return GetBalances().nWatchOnlyPending;
 }
 
 CAmount CWallet::GetImmatureWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureWatchOnlyCredit();
-        }
-    }
-    return nTotal;
+    return GetBalances().nWatchOnlyImmature;
 }
 
 void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const CCoinControl *coinControl, bool fIncludeZeroValue) const
@@ -2204,10 +2585,11 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        std::vector<const CWalletTx*> vpwtx;
+        GetWalletUTXOTransactions(vpwtx);
+        BOOST_FOREACH(const CWalletTx* pcoin, vpwtx)
         {
-            const uint256& wtxid = it->first;
-            const CWalletTx* pcoin = &(*it).second;
+            const uint256& wtxid = pcoin->GetHash();
 
             if (!CheckFinalTx(*pcoin))
                 continue;
@@ -2230,8 +2612,8 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
             for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
                 isminetype mine = IsMine(pcoin->vout[i]);
                 if (!(IsSpent(wtxid, i)) && mine != ISMINE_NO &&
-                    !IsLockedCoin((*it).first, i) && (pcoin->vout[i].nValue > 0 || fIncludeZeroValue) &&
-                    (!coinControl || !coinControl->HasSelected() || coinControl->fAllowOtherInputs || coinControl->IsSelected(COutPoint((*it).first, i))))
+                    !IsLockedCoin(wtxid, i) && (pcoin->vout[i].nValue > 0 || fIncludeZeroValue) &&
+                    (!coinControl || !coinControl->HasSelected() || coinControl->fAllowOtherInputs || coinControl->IsSelected(COutPoint(wtxid, i))))
                         vCoins.push_back(COutput(pcoin, i, nDepth,
                                                  ((mine & ISMINE_SPENDABLE) != ISMINE_NO) ||
                                                   (coinControl && coinControl->fAllowWatchOnly && (mine & ISMINE_WATCH_SOLVABLE) != ISMINE_NO),
@@ -2952,6 +3334,13 @@ DBErrors CWallet::LoadWallet(bool& fFirstRunRet)
         return nLoadWalletRet;
     fFirstRunRet = !vchDefaultKey.IsValid();
 
+    {
+        // Keys and transactions are loaded in any order, index outputs once all are
+        LOCK(cs_wallet);
+        fWalletUTXOStale = true;
+        nWalletTxUpdated++;
+    }
+
     uiInterface.LoadWallet(this);
 
     return DB_LOAD_OK;
@@ -2977,6 +3366,10 @@ DBErrors CWallet::ZapSelectTx(vector<uint256>& vHashIn, vector<uint256>& vHashOu
     if (nZapSelectTxRet != DB_LOAD_OK)
         return nZapSelectTxRet;
 
+    {
+        LOCK(cs_wallet);
+        fWalletUTXOStale = true;
+    }
     MarkDirty();
 
     return DB_LOAD_OK;
@@ -3525,15 +3918,7 @@ void CWallet::ListLockedCoins(std::vector<COutPoint>& vOutpts)
 
 CAmount CWallet::GetWatchOnlyStake() const
 {
-    CAmount nTotal = 0;
-    LOCK2(cs_main, cs_wallet);
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-    {
-        const CWalletTx* pcoin = &(*it).second;
-        if (pcoin->IsCoinStake() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
-            nTotal += CWallet::GetCredit(*pcoin, ISMINE_WATCH_ONLY);
-    }
-    return nTotal;
+    return GetBalances().nWatchOnlyStake;
 }
 
 uint64_t CWallet::GetStakeWeight() const
@@ -3701,6 +4086,7 @@ bool CWallet::GetDestData(const CTxDestination &dest, const std::string &key, st
 std::string CWallet::GetWalletHelpString(bool showDebug)
 {
     std::string strUsage = HelpMessageGroup(_("Wallet options:"));
+    strUsage += HelpMessageOpt("-convertwallet", _("Convert the wallet to the storage backend selected by -walletbackend on startup"));
     strUsage += HelpMessageOpt("-disablewallet", _("Do not load the wallet and disable wallet RPC calls"));
     strUsage += HelpMessageOpt("-keypool=<n>", strprintf(_("Set key pool size to <n> (default: %u)"), DEFAULT_KEYPOOL_SIZE));
     strUsage += HelpMessageOpt("-fallbackfee=<amt>", strprintf(_("A fee rate (in %s/kB) that will be used when fee estimation has insufficient data (default: %s)"),
@@ -3718,6 +4104,8 @@ std::string CWallet::GetWalletHelpString(bool showDebug)
     strUsage += HelpMessageOpt("-usehd", _("Use hierarchical deterministic key generation (HD) after BIP32. Only has effect during wallet creation/first start") + " " + strprintf(_("(default: %u)"), DEFAULT_USE_HD_WALLET));
     strUsage += HelpMessageOpt("-upgradewallet", _("Upgrade wallet to latest format on startup"));
     strUsage += HelpMessageOpt("-wallet=<file>", _("Specify wallet file (within data directory)") + " " + strprintf(_("(default: %s)"), DEFAULT_WALLET_DAT));
+    strUsage += HelpMessageOpt("-walletbackend=<backend>", strprintf(_("Storage backend for newly created wallets: %s (BerkeleyDB) or %s (append-only log) (default: %s)"),
+                                                                     WALLET_BACKEND_BDB, WALLET_BACKEND_LOG, DEFAULT_WALLET_BACKEND));
     strUsage += HelpMessageOpt("-walletbroadcast", _("Make the wallet broadcast transactions") + " " + strprintf(_("(default: %u)"), DEFAULT_WALLETBROADCAST));
     strUsage += HelpMessageOpt("-walletnotify=<cmd>", _("Execute command when a wallet transaction changes (%s in cmd is replaced by TxID)"));
     strUsage += HelpMessageOpt("-zapwallettxes=<mode>", _("Delete all wallet transactions and only recover those parts of the blockchain through -rescan on startup") +
@@ -3843,6 +4231,16 @@ bool CWallet::InitLoadWallet()
         else
             pindexRescan = chainActive.Genesis();
     }
+    {
+        // Finish a rescan that was aborted or interrupted
+        CWalletDB walletdb(walletFile);
+        CBlockLocator locator;
+        if (walletdb.ReadRescanProgress(locator)) {
+            CBlockIndex* pindexResume = FindForkInGlobalIndex(chainActive, locator);
+            if (pindexResume && pindexRescan && pindexResume->nHeight < pindexRescan->nHeight)
+                pindexRescan = pindexResume;
+        }
+    }
     if (chainActive.Tip() && chainActive.Tip() != pindexRescan)
     {
         //We can't rescan beyond non-pruned blocks, stop and throw an error
@@ -65,6 +65,13 @@ static const bool DEFAULT_WALLETBROADCAST = true;
 //! if set, all keys will be derived by using BIP32
 static const bool DEFAULT_USE_HD_WALLET = true;
 
+//! Maximum number of threads reading and matching blocks during a rescan
+static const int MAX_RESCAN_THREADS = 8;
+//! Blocks of a rescan committed to the wallet for each take of cs_main and cs_wallet
+static const unsigned int RESCAN_CHUNK_BLOCKS = 100;
+//! Blocks of a rescan read ahead of the ones being committed
+static const unsigned int RESCAN_BLOCKS_AHEAD = 4 * RESCAN_CHUNK_BLOCKS;
+
 extern const char * DEFAULT_WALLET_DAT;
 
 class CBlockIndex;
@@ -547,6 +554,26 @@ private:
 };
 
 
+/** The balances of a wallet, in the buckets reported by CWallet::GetBalance() and the like */
+struct CWalletBalances
+{
+    //! Available credit of trusted transactions
+    CAmount nTrusted;
+    //! Available credit of untrusted transactions in the mempool
+    CAmount nPending;
+    //! Credit of immature coinbases
+    CAmount nImmature;
+    //! Credit of immature coinstakes
+    CAmount nStake;
+    CAmount nWatchOnlyTrusted;
+    CAmount nWatchOnlyPending;
+    CAmount nWatchOnlyImmature;
+    CAmount nWatchOnlyStake;
+
+    CWalletBalances() : nTrusted(0), nPending(0), nImmature(0), nStake(0),
+        nWatchOnlyTrusted(0), nWatchOnlyPending(0), nWatchOnlyImmature(0), nWatchOnlyStake(0) {}
+};
+
 /** 
  * A CWallet is an extension of a keystore, which also maintains a set of transactions and balances,
  * and provides the ability to create new transactions.
@@ -556,6 +583,8 @@ class CWallet : public CCryptoKeyStore, public CValidationInterface
 private:
     std::atomic<bool> fAbortRescan;
     std::atomic<bool> fScanningWallet;
+    //! Held for the whole of a rescan, which only takes cs_main and cs_wallet in chunks
+    CCriticalSection cs_rescan;
 
     /**
      * Select a set of coins such that nValueRet >= nTargetValue and at least
@@ -576,7 +605,13 @@ private:
     int64_t nLastResend;
     bool fBroadcastTransactions;
 
-    std::map<COutPoint, CStakeCache> stakeCache;
+    //! Kernel inputs of our confirmed outputs, kept in the wallet file so staking never reads blocks
+    std::map<COutPoint, CStakeCandidate> mapStakeCandidates;
+
+    //! Precomputed stake kernels, valid for the tip and target they were built against
+    std::map<COutPoint, CStakeKernel> mapStakeKernels;
+    uint256 hashStakeKernelTip;
+    unsigned int nStakeKernelBits;
 
     /**
      * Used to keep track of spent outpoints, and
@@ -599,6 +634,29 @@ private:
     /* the HD chain data model (external chain counters) */
     CHDChain hdChain;
 
+    /**
+     * Outputs of ours which may be unspent, so that balances and available
+     * coins only look at the transactions holding them. Every unspent output
+     * is in the set; spent ones are dropped by the next walk of it, once no
+     * longer immature, and put back if their spend gets conflicted or
+     * abandoned. Rebuilt from mapWallet when keys or scripts are added.
+     */
+    mutable std::set<COutPoint> setWalletUTXO;
+    mutable bool fWalletUTXOStale;
+    void AddToWalletUTXO(const COutPoint& outpoint);
+    void AddToWalletUTXO(const CWalletTx& wtx);
+    //! Transactions with outputs in setWalletUTXO, in the order of mapWallet
+    void GetWalletUTXOTransactions(std::vector<const CWalletTx*>& vpwtx) const;
+
+    //! Counts changes to the wallet's transactions and keys that balances depend on
+    uint64_t nWalletTxUpdated;
+    //! Balances, valid for the tip, mempool and wallet state they were computed at
+    mutable CWalletBalances cachedBalances;
+    mutable bool fBalancesCached;
+    mutable const CBlockIndex* pindexBalances;
+    mutable unsigned int nBalancesMempoolUpdated;
+    mutable uint64_t nBalancesWalletTxUpdated;
+
 public:
     /*
      * Main wallet lock.
@@ -654,9 +712,16 @@ public:
         nTimeFirstKey = 0;
         fBroadcastTransactions = false;
         nConflictsReceived = 0;
+        nStakeKernelBits = 0;
 
         fAbortRescan = false;
         fScanningWallet = false;
+        fWalletUTXOStale = true;
+        nWalletTxUpdated = 0;
+        fBalancesCached = false;
+        pindexBalances = NULL;
+        nBalancesMempoolUpdated = 0;
+        nBalancesWalletTxUpdated = 0;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
@@ -709,6 +774,8 @@ public:
     void AbortRescan() { fAbortRescan = true; }
     bool IsAbortingRescan() { return fAbortRescan; }
     bool IsScanning() { return fScanningWallet; }
+    //! Scripts paid to by the outputs of our transactions, other than bare multisig ones
+    void GetScriptPubKeys(std::set<CScript>& setScripts) const;
 
     /**
      * keystore implementation
@@ -768,6 +835,8 @@ public:
     void ReacceptWalletTransactions();
     void ResendWalletTransactions(int64_t nBestBlockTime);
     std::vector<uint256> ResendWalletTransactionsBefore(int64_t nTime);
+    //! All balances at once; computed from the wallet's unspent outputs when anything changed
+    CWalletBalances GetBalances() const;
     CAmount GetBalance() const;
     CAmount GetUnconfirmedBalance() const;
     CAmount GetImmatureBalance() const;
@@ -924,11 +993,20 @@ public:
     bool AbandonTransaction(const uint256& hashTx);
 
     /* Staking */
-    bool CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int64_t nSearchInterval, CAmount& nFees, CMutableTransaction& tx, CKey& key);
+    //! Searches the staking coins for a kernel meeting nBits at or up to nSearchInterval seconds before nTime
+    bool FindStakeKernel(unsigned int nBits, uint32_t nTime, int64_t nSearchInterval, COutPoint& prevoutKernel, uint32_t& nTimeKernel);
+    //! Builds and signs the coinstake spending a kernel found by FindStakeKernel
+    bool CreateCoinStake(const CKeyStore& keystore, const COutPoint& prevoutKernel, uint32_t nTimeKernel, CAmount& nFees, CMutableTransaction& tx, CKey& key);
     bool SelectCoinsForStaking(CAmount& nTargetValue, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const;
     void AvailableCoinsForStaking(std::vector<COutput>& vCoins) const;
     bool HaveAvailableCoinsForStaking() const;
     uint64_t GetStakeWeight() const;
+    //! Adds a stake candidate to the index, without saving it to disk (used by LoadWallet)
+    void LoadStakeCandidate(const COutPoint& prevout, const CStakeCandidate& candidate) { mapStakeCandidates[prevout] = candidate; }
+    //! Looks a staking output up in the index, deriving and storing it from the wallet transaction when missing
+    bool FindStakeCandidate(const CWalletTx* pcoin, unsigned int n, CStakeCandidate& candidateRet);
+    //! Keeps the stake candidate index in step with transactions entering or leaving the chain
+    void UpdateStakeCandidates(const CTransaction& tx, const CBlockIndex* pindex, const CBlock* pblock);
 
     /* Returns the wallets help message */
     static std::string GetWalletHelpString(bool showDebug);
@@ -954,7 +1032,6 @@ public:
     /* Set the current HD master key (will reset the chain child index counters) */
     bool SetHDMasterKey(const CPubKey& key);
 
-    static const bool DEFAULT_STAKE_CACHE = false;
 };
 
 /** A key allocated from the key pool. */
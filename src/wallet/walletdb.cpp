@@ -10,6 +10,7 @@
 #include "base58.h"
 #include "consensus/validation.h"
 #include "main.h" // For CheckTransaction
+#include "pos.h"
 #include "dstencode.h"
 #include "protocol.h"
 #include "serialize.h"
@@ -146,6 +147,18 @@ bool CWalletDB::EraseWatchOnly(const CScript &dest)
     return Erase(std::make_pair(std::string("watchs"), *(const CScriptBase*)(&dest)));
 }
 
+bool CWalletDB::WriteStakeCandidate(const COutPoint& prevout, const CStakeCandidate& candidate)
+{
+    nWalletDBUpdated++;
+    return Write(std::make_pair(std::string("stakecandidate"), prevout), candidate);
+}
+
+bool CWalletDB::EraseStakeCandidate(const COutPoint& prevout)
+{
+    nWalletDBUpdated++;
+    return Erase(std::make_pair(std::string("stakecandidate"), prevout));
+}
+
 bool CWalletDB::WriteBestBlock(const CBlockLocator& locator)
 {
     nWalletDBUpdated++;
@@ -159,6 +172,23 @@ bool CWalletDB::ReadBestBlock(CBlockLocator& locator)
     return Read(std::string("bestblock_nomerkle"), locator);
 }
 
+bool CWalletDB::WriteRescanProgress(const CBlockLocator& locator)
+{
+    nWalletDBUpdated++;
+    return Write(std::string("rescanprogress"), locator);
+}
+
+bool CWalletDB::ReadRescanProgress(CBlockLocator& locator)
+{
+    return Read(std::string("rescanprogress"), locator) && !locator.vHave.empty();
+}
+
+bool CWalletDB::EraseRescanProgress()
+{
+    nWalletDBUpdated++;
+    return Erase(std::string("rescanprogress"));
+}
+
 bool CWalletDB::WriteOrderPosNext(int64_t nOrderPosNext)
 {
     nWalletDBUpdated++;
@@ -230,7 +260,7 @@ void CWalletDB::ListAccountCreditDebit(const string& strAccount, list<CAccountin
 {
     bool fAllAccounts = (strAccount == "*");
 
-    Dbc* pcursor = GetCursor();
+    CDBCursor* pcursor = GetCursor();
     if (!pcursor)
         throw runtime_error(std::string(__func__) + ": cannot create DB cursor");
     unsigned int fFlags = DB_SET_RANGE;
@@ -614,6 +644,14 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
                 return false;
             }
         }
+        else if (strType == "stakecandidate")
+        {
+            COutPoint prevout;
+            CStakeCandidate candidate;
+            ssKey >> prevout;
+            ssValue >> candidate;
+            pwallet->LoadStakeCandidate(prevout, candidate);
+        }
         else if (strType == "hdchain")
         {
             CHDChain chain;
@@ -655,7 +693,7 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
         }
 
         // Get cursor
-        Dbc* pcursor = GetCursor();
+        CDBCursor* pcursor = GetCursor();
         if (!pcursor)
         {
             LogPrintf("Error getting wallet database cursor\n");
@@ -761,7 +799,7 @@ DBErrors CWalletDB::FindWalletTx(CWallet* pwallet, vector<uint256>& vTxHash, vec
         }
 
         // Get cursor
-        Dbc* pcursor = GetCursor();
+        CDBCursor* pcursor = GetCursor();
         if (!pcursor)
         {
             LogPrintf("Error getting wallet database cursor\n");
@@ -29,6 +29,7 @@ struct CBlockLocator;
 class CKeyPool;
 class CMasterKey;
 class CScript;
+class CStakeCandidate;
 class CWallet;
 class CWalletTx;
 class uint160;
@@ -147,6 +148,11 @@ public:
     bool WriteBestBlock(const CBlockLocator& locator);
     bool ReadBestBlock(CBlockLocator& locator);
 
+    //! Last block of an unfinished rescan committed to the wallet
+    bool WriteRescanProgress(const CBlockLocator& locator);
+    bool ReadRescanProgress(CBlockLocator& locator);
+    bool EraseRescanProgress();
+
     bool WriteOrderPosNext(int64_t nOrderPosNext);
 
     bool WriteDefaultKey(const CPubKey& vchPubKey);
@@ -157,6 +163,9 @@ public:
 
     bool WriteMinVersion(int nVersion);
 
+    bool WriteStakeCandidate(const COutPoint& prevout, const CStakeCandidate& candidate);
+    bool EraseStakeCandidate(const COutPoint& prevout);
+
     /// This writes directly to the database, and will not update the CWallet's cached accounting entries!
     /// Use wallet.AddAccountingEntry instead, to write *and* update its caches.
     bool WriteAccountingEntry(const uint64_t nAccEntryNum, const CAccountingEntry &acentry);